@@ -0,0 +1,312 @@
+#include "admit.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "outq.h"
+#include "lockstat.h"
+
+/**
+ * @brief Admission control: which new connections the server takes on.
+ *
+ * Connections are counted from the moment they are admitted, handshake included,
+ * until they are closed; queued bytes and CPU are read when a connection knocks.
+ */
+struct admit {
+	struct admit_limits limits; 						/**< The limits */
+	struct lockstat *mutex;								/**< Protects everything below */
+	unsigned connections; 								/**< Connections open */
+	unsigned handshakes; 								/**< Handshakes in progress */
+	unsigned peak; 										/**< Most connections open at once */
+	unsigned long long admitted; 						/**< Connections admitted */
+	unsigned long long refused[ADMIT_REASONS]; 			/**< Connections refused, by reason */
+	long ncpu; 											/**< CPUs online */
+	uint64_t sample_ms; 								/**< When the CPU was last sampled */
+	uint64_t sample_cpu_us; 							/**< CPU time the server had used by then */
+	unsigned cpu; 										/**< Percent of all the CPUs used between the last two samples */
+};
+
+/** @brief What admit_print() calls each reason. */
+static const char *ADMIT_REASON_NAMES[ADMIT_REASONS] = {
+	"admitted", "connections", "handshakes", "queued", "cpu", "no thread"
+};
+
+/**
+ * @brief Read the @c CLOCK_MONOTONIC time in milliseconds.
+ */
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Read the CPU time used by the whole server, in microseconds.
+ */
+static uint64_t cpu_used_us(void)
+{
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		return 0;
+
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000
+		+ ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/**
+ * @brief Fill in the defaults.
+ *
+ * @param[out] l The limits.
+ */
+void admit_default_limits(struct admit_limits *l)
+{
+	l->connections 	= 10000;
+	l->handshakes 	= 128;
+	l->queued 		= 1000000000;
+	l->cpu 			= 90;
+}
+
+/**
+ * @brief Change limits from a spec such as <tt>conns=20k,queued=2g</tt>.
+ *
+ * The keys are given with struct admit_limits; values may end with @c k, @c m or
+ * @c g, for thousands, millions and billions. A limit of @c 0 is no limit.
+ *
+ * @param[in] spec Comma separated @c key=value pairs.
+ * @param[in,out] l The limits, changed as the spec says.
+ *
+ * @return @c 0 in case of success, @c -1 if the spec is wrong.
+ */
+int admit_parse_limits(const char *spec, struct admit_limits *l)
+{
+	char *copy = strdup(spec);
+	if (!copy)
+		return -1;
+
+	int rv = 0;
+	char *save;
+	for (char *tok = strtok_r(copy, ",", &save); tok && rv == 0; tok = strtok_r(NULL, ",", &save)) {
+		char *value = strchr(tok, '=');
+		if (!value || value[1] == '-') {
+			rv = -1;
+			break;
+		}
+		*value++ = '\0';
+
+		char *end;
+		errno = 0;
+		unsigned long long v = strtoull(value, &end, 10);
+		if (*end == 'k') {
+			v *= 1000;
+			end++;
+		} else if (*end == 'm') {
+			v *= 1000000;
+			end++;
+		} else if (*end == 'g') {
+			v *= 1000000000;
+			end++;
+		}
+		if (errno || end == value || *end != '\0') {
+			rv = -1;
+		} else if (strcmp(tok, "conns") == 0 && v <= UINT32_MAX) {
+			l->connections = v;
+		} else if (strcmp(tok, "handshakes") == 0 && v <= UINT32_MAX) {
+			l->handshakes = v;
+		} else if (strcmp(tok, "queued") == 0) {
+			l->queued = v;
+		} else if (strcmp(tok, "cpu") == 0 && v <= 100) {
+			l->cpu = v;
+		} else {
+			rv = -1;
+		}
+	}
+
+	free(copy);
+
+	return rv;
+}
+
+/**
+ * @brief Create an admission control.
+ *
+ * @param[in] l The limits, copied.
+ *
+ * @return A pointer to the admission control in case of success, NULL otherwise.
+ * It must be freed, using admit_destroy().
+ */
+struct admit *admit_create(const struct admit_limits *l)
+{
+	struct admit *a = calloc(1, sizeof(struct admit));
+	if (a) {
+		if (!(a->mutex = lockstat_create("admit"))) {
+			free(a);
+			return NULL;
+		}
+		a->limits 			= *l;
+		a->ncpu 			= sysconf(_SC_NPROCESSORS_ONLN);
+		a->sample_ms 		= now_ms();
+		a->sample_cpu_us 	= cpu_used_us();
+		if (a->ncpu < 1)
+			a->ncpu = 1;
+	}
+
+	return a;
+}
+
+/**
+ * @brief Destroys an admission control.
+ *
+ * @param[in] a The admission control.
+ */
+void admit_destroy(struct admit *a)
+{
+	if (a) {
+		lockstat_destroy(a->mutex);
+		free(a);
+	}
+}
+
+/**
+ * @brief Sample the CPU the server uses, if the last sample is old enough.
+ *
+ * @warning The mutex must be held.
+ */
+static void sample_cpu(struct admit *a)
+{
+	uint64_t now = now_ms();
+	if (now - a->sample_ms < ADMIT_CPU_SAMPLE_MS)
+		return;
+
+	uint64_t used = cpu_used_us();
+	a->cpu = (used - a->sample_cpu_us) / 10 / (now - a->sample_ms) / a->ncpu;
+	a->sample_ms 		= now;
+	a->sample_cpu_us 	= used;
+}
+
+/**
+ * @brief Decide whether to take a new connection on.
+ *
+ * An admitted connection counts against the limits until admit_leave(), and its
+ * handshake until admit_handshake_done().
+ *
+ * @param[in] a The admission control.
+ *
+ * @return @c ADMIT_OK if the connection is admitted, why it is refused otherwise.
+ */
+enum admit_reason admit_enter(struct admit *a)
+{
+	enum admit_reason why = ADMIT_OK;
+
+	lockstat_lock(a->mutex);
+	sample_cpu(a);
+
+	if (a->limits.connections && a->connections >= a->limits.connections)
+		why = ADMIT_CONNECTIONS;
+	else if (a->limits.handshakes && a->handshakes >= a->limits.handshakes)
+		why = ADMIT_HANDSHAKES;
+	else if (a->limits.queued && outq_get_total_bytes() >= a->limits.queued)
+		why = ADMIT_QUEUED;
+	else if (a->limits.cpu && a->cpu >= a->limits.cpu)
+		why = ADMIT_CPU;
+
+	if (why == ADMIT_OK) {
+		a->connections++;
+		a->handshakes++;
+		a->admitted++;
+		if (a->connections > a->peak)
+			a->peak = a->connections;
+	} else {
+		a->refused[why]++;
+	}
+	lockstat_unlock(a->mutex);
+
+	return why;
+}
+
+/**
+ * @brief The handshake of an admitted connection is over, whatever came of it.
+ *
+ * @param[in] a The admission control.
+ */
+void admit_handshake_done(struct admit *a)
+{
+	lockstat_lock(a->mutex);
+	a->handshakes--;
+	lockstat_unlock(a->mutex);
+}
+
+/**
+ * @brief An admitted connection was closed.
+ *
+ * @param[in] a The admission control.
+ */
+void admit_leave(struct admit *a)
+{
+	lockstat_lock(a->mutex);
+	a->connections--;
+	lockstat_unlock(a->mutex);
+}
+
+/**
+ * @brief Take back the admission of a connection that cannot be served, before its handshake.
+ *
+ * @param[in] a The admission control.
+ * @param[in] why Why it cannot be served.
+ */
+void admit_refuse(struct admit *a, enum admit_reason why)
+{
+	lockstat_lock(a->mutex);
+	a->connections--;
+	a->handshakes--;
+	a->admitted--;
+	a->refused[why]++;
+	lockstat_unlock(a->mutex);
+}
+
+/**
+ * @brief Get how long a refused client should wait before trying again.
+ *
+ * Clients refused together are spread over a few seconds, so they do not all
+ * come back at once.
+ *
+ * @param[in] a The admission control.
+ * @param[in] why Why it was refused.
+ *
+ * @return The number of seconds.
+ */
+unsigned admit_retry_after(struct admit *a, enum admit_reason why)
+{
+	unsigned base = why == ADMIT_HANDSHAKES ? ADMIT_RETRY_SHORT : ADMIT_RETRY_LONG;
+
+	lockstat_lock(a->mutex);
+	unsigned spread = a->refused[why] % (base + 1);
+	lockstat_unlock(a->mutex);
+
+	return base + spread;
+}
+
+/**
+ * @brief Print the load against the limits, and what was refused.
+ *
+ * @param[in] a The admission control.
+ * @param[in] f Where to print.
+ */
+void admit_print(struct admit *a, FILE *f)
+{
+	lockstat_lock(a->mutex);
+	sample_cpu(a);
+	fprintf(f, "admission: %u/%u connections (peak %u), %u/%u handshakes, %zu/%llu bytes queued, cpu %u%%/%u%%\n",
+			a->connections, a->limits.connections, a->peak, a->handshakes, a->limits.handshakes,
+			outq_get_total_bytes(), (unsigned long long)a->limits.queued, a->cpu, a->limits.cpu);
+	fprintf(f, "  %llu admitted, refused:", a->admitted);
+	for (int i = ADMIT_OK + 1; i < ADMIT_REASONS; i++)
+		fprintf(f, " %s %llu%s", ADMIT_REASON_NAMES[i], a->refused[i], i + 1 < ADMIT_REASONS ? "," : "\n");
+	lockstat_unlock(a->mutex);
+}
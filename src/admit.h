@@ -0,0 +1,53 @@
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/** @brief Milliseconds between two samples of the CPU the server uses. */
+#define ADMIT_CPU_SAMPLE_MS 1000
+
+/** @brief Seconds a client refused while handshakes pile up is told to wait, at least. */
+#define ADMIT_RETRY_SHORT 1
+
+/** @brief Seconds a client refused for any other reason is told to wait, at least. */
+#define ADMIT_RETRY_LONG 5
+
+/**
+ * @brief Why a connection was refused, or @c ADMIT_OK.
+ */
+enum admit_reason {
+	ADMIT_OK, 			/**< Admitted */
+	ADMIT_CONNECTIONS, 	/**< Too many connections open */
+	ADMIT_HANDSHAKES, 	/**< Too many handshakes in progress */
+	ADMIT_QUEUED, 		/**< Too many bytes waiting for the clients */
+	ADMIT_CPU, 			/**< The server uses too much CPU */
+	ADMIT_NO_THREAD, 	/**< The connection could not be given a thread */
+	ADMIT_REASONS 		/**< Number of reasons */
+};
+
+/**
+ * @brief What the server takes on before refusing new connections, see admit_parse_limits().
+ */
+struct admit_limits {
+	unsigned connections; 	/**< Connections open, handshakes included, @c conns */
+	unsigned handshakes; 	/**< Handshakes in progress, @c handshakes */
+	uint64_t queued; 		/**< Bytes waiting in every outbound queue, @c queued */
+	unsigned cpu; 			/**< Percent of all the CPUs the server uses, @c cpu */
+};
+
+struct admit;
+
+void admit_default_limits(struct admit_limits *l);
+int admit_parse_limits(const char *spec, struct admit_limits *l);
+struct admit *admit_create(const struct admit_limits *l);
+void admit_destroy(struct admit *a);
+enum admit_reason admit_enter(struct admit *a);
+void admit_handshake_done(struct admit *a);
+void admit_leave(struct admit *a);
+void admit_refuse(struct admit *a, enum admit_reason why);
+unsigned admit_retry_after(struct admit *a, enum admit_reason why);
+void admit_print(struct admit *a, FILE *f);
+
+#endif
@@ -0,0 +1,440 @@
+#define _GNU_SOURCE
+#include "affinity.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "lockstat.h"
+
+/** @brief Where the kernel lists the NUMA nodes. */
+#define AFFINITY_SYSFS "/sys/devices/system/node"
+
+/**
+ * @brief Which CPUs the server threads run on, and on which NUMA node every connection is served.
+ *
+ * The topology is read once, from sysfs. A role without CPUs given keeps the CPUs
+ * the server was started with; nothing is pinned at all unless a role has CPUs.
+ *
+ * A connection is placed on the node of the CPU its packets arrive on, so the
+ * threads serving it run next to the NIC queue, and its state is allocated there
+ * by those threads. Connections that tell nothing go to the node serving the fewest.
+ */
+struct affinity {
+	int nodes; 												/**< NUMA nodes with CPUs */
+	short cpu_node[CPU_SETSIZE]; 							/**< Node of every CPU, @c -1 if not online */
+	cpu_set_t node_cpus[AFFINITY_MAX_NODES]; 				/**< CPUs of every node */
+	cpu_set_t role_cpus[AFFINITY_ROLES]; 					/**< CPUs of every role */
+	bool pinned[AFFINITY_ROLES]; 							/**< Whether the role was given CPUs */
+	bool any_pinned; 										/**< Whether any role was given CPUs */
+	bool io_node[AFFINITY_MAX_NODES]; 						/**< Whether the node has @c io CPUs */
+	bool steer; 											/**< Whether connections go to the node of their packets */
+	struct lockstat *mutex;									/**< Protects the counters below */
+	unsigned connections[AFFINITY_MAX_NODES]; 				/**< Connections open, by node */
+	unsigned long long steered[AFFINITY_MAX_NODES]; 		/**< Connections placed by their incoming CPU, by node */
+	unsigned long long spread[AFFINITY_MAX_NODES]; 			/**< Connections placed on the least served node, by node */
+	unsigned long long pin_failures; 						/**< Threads that could not be moved to their node */
+};
+
+/** @brief What affinity_print() calls each role. */
+static const char *AFFINITY_ROLE_NAMES[AFFINITY_ROLES] = { "accept", "io", "workers" };
+
+/**
+ * @brief Parse a CPU list such as <tt>0-3,8-11</tt>.
+ *
+ * @param[in] s The list.
+ * @param[in] sep What separates the ranges.
+ * @param[out] set The CPUs listed.
+ *
+ * @return @c 0 in case of success, @c -1 if the list is wrong.
+ */
+static int parse_cpu_list(const char *s, char sep, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+
+	while (*s && *s != '\n') {
+		char *end;
+		unsigned long first = strtoul(s, &end, 10);
+		unsigned long last 	= first;
+		if (end == s)
+			return -1;
+		if (*end == '-') {
+			s 		= end + 1;
+			last 	= strtoul(s, &end, 10);
+			if (end == s || last < first)
+				return -1;
+		}
+		if (last >= CPU_SETSIZE)
+			return -1;
+		for (unsigned long cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, set);
+
+		if (*end == sep)
+			end++;
+		else if (*end && *end != '\n')
+			return -1;
+		s = end;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Write a CPU list such as <tt>0-3+8-11</tt>, the way the @c -A option takes it.
+ *
+ * @param[in] set The CPUs.
+ * @param[out] buf Where to write.
+ * @param[in] size The size of @p buf.
+ *
+ * @return @p buf.
+ */
+static char *format_cpu_list(const cpu_set_t *set, char *buf, size_t size)
+{
+	size_t len = 0;
+	buf[0] = '\0';
+
+	for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+		if (!CPU_ISSET(cpu, set))
+			continue;
+		int last = cpu;
+		while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+			last++;
+		len += snprintf(buf + len, size - len, last == cpu ? "%s%d" : "%s%d-%d", len ? "+" : "", cpu, last);
+		cpu = last;
+	}
+
+	return buf;
+}
+
+/**
+ * @brief Read a file of sysfs, such as a CPU list.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+static int read_sysfs(const char *path, char *buf, size_t size)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	bool ok = fgets(buf, size, f) != NULL;
+	fclose(f);
+
+	return ok ? 0 : -1;
+}
+
+/**
+ * @brief Find out which CPUs each NUMA node has.
+ *
+ * Without sysfs, every CPU is taken to be on a single node.
+ */
+static void read_topology(struct affinity *a)
+{
+	char buf[4096];
+	cpu_set_t online;
+
+	memset(a->cpu_node, -1, sizeof(a->cpu_node));
+
+	if (read_sysfs(AFFINITY_SYSFS "/online", buf, sizeof(buf)) == 0 && parse_cpu_list(buf, ',', &online) == 0) {
+		for (int id = 0; id < CPU_SETSIZE; id++) {
+			char path[64];
+			cpu_set_t cpus;
+			snprintf(path, sizeof(path), AFFINITY_SYSFS "/node%d/cpulist", id);
+			if (!CPU_ISSET(id, &online) || read_sysfs(path, buf, sizeof(buf)) == -1
+					|| parse_cpu_list(buf, ',', &cpus) == -1 || CPU_COUNT(&cpus) == 0)
+				continue;
+
+			/* Nodes past the last one told apart are merged into it */
+			int node = a->nodes < AFFINITY_MAX_NODES ? a->nodes++ : AFFINITY_MAX_NODES - 1;
+			CPU_OR(&a->node_cpus[node], &a->node_cpus[node], &cpus);
+		}
+	}
+
+	if (a->nodes == 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+		a->nodes = 1;
+		CPU_ZERO(&a->node_cpus[0]);
+		for (long cpu = 0; cpu < ncpu && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, &a->node_cpus[0]);
+	}
+
+	for (int node = 0; node < a->nodes; node++) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &a->node_cpus[node]))
+				a->cpu_node[cpu] = node;
+		}
+	}
+}
+
+/**
+ * @brief Change the roles from a spec such as <tt>accept=0,io=2-7+10-15,workers=1+9</tt>.
+ *
+ * Roles take CPU lists, their ranges separated by @c +; @c steer=0 places every
+ * connection on the node serving the fewest instead of the node of its packets.
+ *
+ * @return @c 0 in case of success, @c -1 if the spec is wrong.
+ */
+static int parse_spec(struct affinity *a, const char *spec)
+{
+	char *copy = strdup(spec);
+	if (!copy)
+		return -1;
+
+	int rv = 0;
+	char *save;
+	for (char *tok = strtok_r(copy, ",", &save); tok && rv == 0; tok = strtok_r(NULL, ",", &save)) {
+		char *value = strchr(tok, '=');
+		if (!value) {
+			rv = -1;
+			break;
+		}
+		*value++ = '\0';
+
+		if (strcmp(tok, "steer") == 0 && (strcmp(value, "0") == 0 || strcmp(value, "1") == 0)) {
+			a->steer = value[0] == '1';
+			continue;
+		}
+
+		rv = -1;
+		for (int role = 0; role < AFFINITY_ROLES; role++) {
+			cpu_set_t cpus;
+			if (strcmp(tok, AFFINITY_ROLE_NAMES[role]) != 0 || parse_cpu_list(value, '+', &cpus) == -1
+					|| CPU_COUNT(&cpus) == 0)
+				continue;
+
+			rv = 0;
+			for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+				if (CPU_ISSET(cpu, &cpus) && a->cpu_node[cpu] == -1)
+					rv = -1;
+			}
+			a->role_cpus[role] 	= cpus;
+			a->pinned[role] 	= true;
+			a->any_pinned 		= true;
+		}
+	}
+
+	free(copy);
+
+	return rv;
+}
+
+/**
+ * @brief Create the placement of the server threads.
+ *
+ * @param[in] spec Which CPUs each role gets, see parse_spec(); NULL to pin nothing.
+ *
+ * @return A pointer to the placement in case of success, NULL if the spec is
+ * wrong or memory is short. It must be freed, using affinity_destroy().
+ */
+struct affinity *affinity_create(const char *spec)
+{
+	struct affinity *a = calloc(1, sizeof(struct affinity));
+	if (!a)
+		return NULL;
+
+	read_topology(a);
+	a->steer = true;
+
+	/* The roles not given CPUs keep those the server was started with */
+	cpu_set_t started;
+	if (sched_getaffinity(0, sizeof(started), &started) == -1) {
+		CPU_ZERO(&started);
+		for (int node = 0; node < a->nodes; node++)
+			CPU_OR(&started, &started, &a->node_cpus[node]);
+	}
+	for (int role = 0; role < AFFINITY_ROLES; role++)
+		a->role_cpus[role] = started;
+
+	if (spec && parse_spec(a, spec) == -1) {
+		free(a);
+		return NULL;
+	}
+
+	for (int node = 0; node < a->nodes; node++) {
+		cpu_set_t io;
+		CPU_AND(&io, &a->node_cpus[node], &a->role_cpus[AFFINITY_IO]);
+		a->io_node[node] = CPU_COUNT(&io) > 0;
+	}
+
+	if (!(a->mutex = lockstat_create("affinity"))) {
+		free(a);
+		return NULL;
+	}
+
+	return a;
+}
+
+/**
+ * @brief Destroys a placement.
+ *
+ * @param[in] a The placement.
+ */
+void affinity_destroy(struct affinity *a)
+{
+	if (a) {
+		lockstat_destroy(a->mutex);
+		free(a);
+	}
+}
+
+/**
+ * @brief Get the number of NUMA nodes told apart.
+ *
+ * @param[in] a The placement.
+ *
+ * @return The number of nodes, at least @c 1.
+ */
+int affinity_get_nodes(struct affinity *a)
+{
+	return a->nodes;
+}
+
+/**
+ * @brief Move the calling thread to a set of CPUs, if any role is pinned.
+ *
+ * Threads created afterwards by the calling thread start on the same CPUs.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+static int pin_self(struct affinity *a, const cpu_set_t *cpus)
+{
+	if (!a->any_pinned)
+		return 0;
+
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), cpus);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Move the calling thread to the CPUs of its role.
+ *
+ * @param[in] a The placement.
+ * @param[in] role What the thread does.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+int affinity_pin(struct affinity *a, enum affinity_role role)
+{
+	return pin_self(a, &a->role_cpus[role]);
+}
+
+/**
+ * @brief Choose the NUMA node serving a new connection.
+ *
+ * The node is the one of the CPU that received the last packet of the connection,
+ * as the kernel tells with @c SO_INCOMING_CPU, if that node has @c io CPUs.
+ * Otherwise it is the node serving the fewest connections.
+ *
+ * @param[in] a The placement.
+ * @param[in] sockfd The connection socket, @c -1 if it has none.
+ * @param[in] pin Whether to move the calling thread to the @c io CPUs of the node,
+ * so that what it allocates for the connection, and the threads it creates for it, are there.
+ *
+ * @return The node, until affinity_leave().
+ */
+int affinity_place(struct affinity *a, int sockfd, bool pin)
+{
+	int cpu = -1;
+#ifdef SO_INCOMING_CPU
+	socklen_t len = sizeof(cpu);
+	if (!a->steer || sockfd == -1 || getsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1)
+		cpu = -1;
+#else
+	(void)sockfd;
+#endif
+
+	lockstat_lock(a->mutex);
+	int node = cpu >= 0 && cpu < CPU_SETSIZE ? a->cpu_node[cpu] : -1;
+	if (node != -1 && a->io_node[node]) {
+		a->steered[node]++;
+	} else {
+		node = -1;
+		for (int i = 0; i < a->nodes; i++) {
+			if (a->io_node[i] && (node == -1 || a->connections[i] < a->connections[node]))
+				node = i;
+		}
+		if (node == -1)
+			node = 0;
+		a->spread[node]++;
+	}
+	a->connections[node]++;
+	lockstat_unlock(a->mutex);
+
+	if (pin) {
+		cpu_set_t cpus;
+		CPU_AND(&cpus, &a->node_cpus[node], &a->role_cpus[AFFINITY_IO]);
+		if (pin_self(a, &cpus) == -1) {
+			lockstat_lock(a->mutex);
+			a->pin_failures++;
+			lockstat_unlock(a->mutex);
+		}
+	}
+
+	return node;
+}
+
+/**
+ * @brief A connection placed with affinity_place() was closed.
+ *
+ * @param[in] a The placement.
+ * @param[in] node Its node.
+ */
+void affinity_leave(struct affinity *a, int node)
+{
+	lockstat_lock(a->mutex);
+	a->connections[node]--;
+	lockstat_unlock(a->mutex);
+}
+
+/**
+ * @brief Print the CPUs of every role, and how the connections are spread over the nodes.
+ *
+ * The imbalance is the connections of the busiest node over the average of the
+ * nodes serving connections; @c 1.00 is a perfect spread.
+ *
+ * @param[in] a The placement.
+ * @param[in] f Where to print.
+ */
+void affinity_print(struct affinity *a, FILE *f)
+{
+	char buf[256];
+
+	fprintf(f, "affinity: %d node%s, steering %s", a->nodes, a->nodes > 1 ? "s" : "",
+#ifdef SO_INCOMING_CPU
+			a->steer ? "on" : "off");
+#else
+			"unavailable");
+#endif
+	for (int role = 0; role < AFFINITY_ROLES; role++) {
+		fprintf(f, ", %s %s", AFFINITY_ROLE_NAMES[role],
+				a->pinned[role] ? format_cpu_list(&a->role_cpus[role], buf, sizeof(buf)) : "unpinned");
+	}
+	fprintf(f, "\n");
+
+	lockstat_lock(a->mutex);
+	unsigned total = 0, busiest = 0;
+	int serving = 0;
+	for (int node = 0; node < a->nodes; node++) {
+		fprintf(f, "  node %d: cpus %s, %u connections, %llu steered, %llu spread%s\n", node,
+				format_cpu_list(&a->node_cpus[node], buf, sizeof(buf)), a->connections[node],
+				a->steered[node], a->spread[node], a->io_node[node] ? "" : ", no io cpus");
+		if (a->io_node[node]) {
+			total += a->connections[node];
+			serving++;
+			if (a->connections[node] > busiest)
+				busiest = a->connections[node];
+		}
+	}
+	fprintf(f, "  imbalance %.2f, %llu threads not moved to their node\n",
+			total ? (double)busiest * serving / total : 1.0, a->pin_failures);
+	lockstat_unlock(a->mutex);
+}
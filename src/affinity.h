@@ -0,0 +1,31 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/** @brief Most NUMA nodes told apart; CPUs of the nodes past it count as the last one. */
+#define AFFINITY_MAX_NODES 16
+
+/**
+ * @brief What a server thread does, deciding which CPUs it may run on.
+ */
+enum affinity_role {
+	AFFINITY_ACCEPT, 	/**< Accepts connections, @c accept */
+	AFFINITY_IO, 		/**< Serves connections: handshake, reader and writer, or fiber worker, @c io */
+	AFFINITY_WORKER, 	/**< Works for the whole room: pipeline, sequencer, search, @c workers */
+	AFFINITY_ROLES 		/**< Number of roles */
+};
+
+struct affinity;
+
+struct affinity *affinity_create(const char *spec);
+void affinity_destroy(struct affinity *a);
+int affinity_get_nodes(struct affinity *a);
+int affinity_pin(struct affinity *a, enum affinity_role role);
+int affinity_place(struct affinity *a, int sockfd, bool pin);
+void affinity_leave(struct affinity *a, int node);
+void affinity_print(struct affinity *a, FILE *f);
+
+#endif
@@ -0,0 +1,420 @@
+#include "attach.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "textscan.h"
+#include "lockstat.h"
+
+/**
+ * @brief One file uploaded, or being uploaded, to the server.
+ */
+struct attachment {
+	char name[ATTACH_NAME_LEN]; 	/**< The file name, without directories */
+	uint64_t size; 					/**< The size announced by the uploader */
+	uint64_t written; 				/**< Bytes received so far */
+	int fd; 						/**< Open for writing while the upload goes on, @c -1 after */
+	bool complete; 					/**< Whether every byte arrived, so it can be downloaded */
+	time_t finished; 				/**< When the upload finished, if @c complete */
+};
+
+/**
+ * @brief A directory of files uploaded by the users.
+ *
+ * Every attachment is a file named after its id. Each upload is written by a single
+ * thread, the one reading the uploader connection, so only the table is locked;
+ * the attachments themselves never move.
+ *
+ * Files are kept @c ATTACH_TTL seconds, and the oldest ones are dropped early
+ * when an upload needs their room. A download already started goes on, since
+ * it holds the file open.
+ */
+struct attach_store {
+	char *dir; 						/**< The directory */
+	struct lockstat *mutex;			/**< Protects everything below */
+	struct attachment **table; 		/**< The attachment with id @c i is at @c i-1, NULL once dropped */
+	size_t count; 					/**< Ids given so far */
+	size_t cap; 					/**< Entries allocated for @c table */
+	uint64_t reserved; 				/**< Bytes announced by the attachments kept */
+	size_t oldest; 					/**< Ids up to this one were all dropped */
+	unsigned long long expired; 	/**< Attachments dropped after @c ATTACH_TTL */
+	unsigned long long evicted; 	/**< Attachments dropped to make room */
+};
+
+/**
+ * @brief Create an attachment store.
+ *
+ * @param[in] dir The directory, created if needed.
+ *
+ * @return A pointer to the store in case of success, NULL otherwise.
+ * The store must be freed, using attach_store_destroy().
+ */
+struct attach_store *attach_store_create(const char *dir)
+{
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+		return NULL;
+
+	struct attach_store *as = calloc(1, sizeof(struct attach_store));
+	if (as) {
+		as->dir = malloc(strlen(dir) + 1);
+		as->mutex = lockstat_create("attachments");
+		if (!as->dir || !as->mutex) {
+			free(as->dir);
+			lockstat_destroy(as->mutex);
+			free(as);
+			return NULL;
+		}
+		strcpy(as->dir, dir);
+	}
+
+	return as;
+}
+
+/**
+ * @brief Build the path of an attachment file.
+ */
+static void attach_path(struct attach_store *as, int id, char *path, size_t len)
+{
+	snprintf(path, len, "%s/%d", as->dir, id);
+}
+
+/**
+ * @brief Drop an attachment and its file.
+ *
+ * @warning The store mutex must be held.
+ */
+static void attach_drop(struct attach_store *as, int id)
+{
+	struct attachment *a = as->table[id - 1];
+	char path[4096];
+
+	attach_path(as, id, path, sizeof(path));
+	unlink(path);
+	if (a->fd != -1)
+		close(a->fd);
+	as->reserved -= a->size;
+	as->table[id - 1] = NULL;
+	free(a);
+}
+
+/**
+ * @brief Destroys an attachment store, removing the files.
+ *
+ * @param[in] as The store.
+ */
+void attach_store_destroy(struct attach_store *as)
+{
+	if (as) {
+		for (size_t i = 0; i < as->count; i++) {
+			if (as->table[i])
+				attach_drop(as, i + 1);
+		}
+		lockstat_destroy(as->mutex);
+		free(as->table);
+		free(as->dir);
+		free(as);
+	}
+}
+
+/**
+ * @brief Get an attachment.
+ *
+ * @warning The store mutex must be held.
+ *
+ * @return The attachment, NULL if there is none with that id.
+ */
+static struct attachment *attach_get(struct attach_store *as, int id)
+{
+	if (id <= 0 || (size_t)id > as->count)
+		return NULL;
+
+	return as->table[id - 1];
+}
+
+/**
+ * @brief Move @c oldest past the attachments dropped.
+ *
+ * @warning The store mutex must be held.
+ */
+static void skip_dropped(struct attach_store *as)
+{
+	while (as->oldest < as->count && !as->table[as->oldest])
+		as->oldest++;
+}
+
+/**
+ * @brief Drop complete attachments, oldest first, until @p size more bytes fit in the quota.
+ *
+ * Uploads still going on are never dropped.
+ *
+ * @warning The store mutex must be held.
+ */
+static void make_room(struct attach_store *as, uint64_t size)
+{
+	for (size_t i = as->oldest; i < as->count && as->reserved + size > ATTACH_QUOTA; i++) {
+		struct attachment *a = as->table[i];
+		if (a && a->complete) {
+			attach_drop(as, i + 1);
+			as->evicted++;
+		}
+	}
+	skip_dropped(as);
+}
+
+/**
+ * @brief Start receiving a file.
+ *
+ * Directories are stripped from the name, and it gets the same cleanup as chat text.
+ *
+ * @param[in] as The store.
+ * @param[in] name The file name given by the uploader.
+ * @param[in] size The file size.
+ *
+ * @return The attachment id in case of success, @c -1 otherwise, with @c errno set
+ * to @c EDQUOT if the store has no room for @p size more bytes, even once every
+ * complete attachment is dropped.
+ */
+int attach_begin(struct attach_store *as, const char *name, uint64_t size)
+{
+	struct attachment *a = malloc(sizeof(struct attachment));
+	if (!a)
+		return -1;
+
+	const char *base = strrchr(name, '/');
+	base = base ? base + 1 : name;
+	size_t len = strnlen(base, ATTACH_NAME_LEN - 1);
+	memcpy(a->name, base, len);
+	a->name[textscan_sanitize(a->name, len)] = '\0';
+	if (a->name[0] == '\0' || strcmp(a->name, ".") == 0 || strcmp(a->name, "..") == 0)
+		strcpy(a->name, "file");
+
+	a->size 	= size;
+	a->written 	= 0;
+	a->complete = false;
+
+	lockstat_lock(as->mutex);
+
+	if (size <= ATTACH_QUOTA)
+		make_room(as, size);
+	if (as->reserved + size > ATTACH_QUOTA || size > ATTACH_QUOTA) {
+		lockstat_unlock(as->mutex);
+		free(a);
+		errno = EDQUOT;
+		return -1;
+	}
+
+	if (as->count == as->cap) {
+		size_t cap = as->cap ? 2 * as->cap : 16;
+		struct attachment **tmp = realloc(as->table, cap * sizeof(struct attachment *));
+		if (!tmp) {
+			lockstat_unlock(as->mutex);
+			free(a);
+			return -1;
+		}
+		as->table 	= tmp;
+		as->cap 	= cap;
+	}
+
+	int id = ++as->count;
+	char path[4096];
+	attach_path(as, id, path, sizeof(path));
+	a->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (a->fd == -1) {
+		as->table[id - 1] = NULL;
+		lockstat_unlock(as->mutex);
+		free(a);
+		return -1;
+	}
+
+	as->table[id - 1] 	= a;
+	as->reserved 		+= size;
+
+	lockstat_unlock(as->mutex);
+
+	return id;
+}
+
+/**
+ * @brief Append the next bytes of an upload to its file.
+ *
+ * @param[in] as The store.
+ * @param[in] id The attachment id.
+ * @param[in] data The bytes.
+ * @param[in] len The number of bytes.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise, with @c errno set to @c EFBIG
+ * if the file would grow past the size announced.
+ */
+int attach_write(struct attach_store *as, int id, const char *data, size_t len)
+{
+	lockstat_lock(as->mutex);
+	struct attachment *a = attach_get(as, id);
+	lockstat_unlock(as->mutex);
+
+	if (!a || a->fd == -1) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (a->written + len > a->size) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	while (len > 0) {
+		ssize_t n = write(a->fd, data, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data 		+= n;
+		len 		-= n;
+		a->written 	+= n;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief End an upload, making the file available for download.
+ *
+ * @param[in] as The store.
+ * @param[in] id The attachment id.
+ * @param[out] size Where the file size will be stored.
+ * @param[out] name Where the file name will be stored; must hold @c ATTACH_NAME_LEN bytes.
+ *
+ * @return @c 0 in case of success, @c -1 if some bytes are missing, in which case
+ * the attachment is dropped.
+ */
+int attach_finish(struct attach_store *as, int id, uint64_t *size, char *name)
+{
+	int rv = -1;
+
+	lockstat_lock(as->mutex);
+
+	struct attachment *a = attach_get(as, id);
+	if (a && a->fd != -1) {
+		close(a->fd);
+		a->fd = -1;
+		if (a->written == a->size) {
+			a->complete = true;
+			a->finished = time(NULL);
+			*size = a->size;
+			strcpy(name, a->name);
+			rv = 0;
+		} else {
+			attach_drop(as, id);
+		}
+	}
+
+	lockstat_unlock(as->mutex);
+
+	if (rv == -1)
+		errno = EIO;
+
+	return rv;
+}
+
+/**
+ * @brief Drop an upload that did not finish.
+ *
+ * @param[in] as The store.
+ * @param[in] id The attachment id.
+ */
+void attach_abort(struct attach_store *as, int id)
+{
+	lockstat_lock(as->mutex);
+	if (attach_get(as, id) && !as->table[id - 1]->complete)
+		attach_drop(as, id);
+	lockstat_unlock(as->mutex);
+}
+
+/**
+ * @brief Drop the attachments whose upload finished @c ATTACH_TTL seconds ago or more.
+ *
+ * @param[in] as The store.
+ * @param[in] now The current time.
+ */
+void attach_expire(struct attach_store *as, time_t now)
+{
+	lockstat_lock(as->mutex);
+	for (size_t i = as->oldest; i < as->count; i++) {
+		struct attachment *a = as->table[i];
+		if (a && a->complete && now - a->finished >= ATTACH_TTL) {
+			attach_drop(as, i + 1);
+			as->expired++;
+		}
+	}
+	skip_dropped(as);
+	lockstat_unlock(as->mutex);
+}
+
+/**
+ * @brief Open an attachment for download.
+ *
+ * @param[in] as The store.
+ * @param[in] id The attachment id.
+ * @param[out] size Where the file size will be stored.
+ * @param[out] name Where the file name will be stored; must hold @c ATTACH_NAME_LEN bytes.
+ *
+ * @return A descriptor open for reading, which the caller must close, or @c -1 with
+ * @c errno set to @c ENOENT if there is no complete attachment with that id.
+ */
+int attach_open(struct attach_store *as, int id, uint64_t *size, char *name)
+{
+	int fd = -1;
+
+	lockstat_lock(as->mutex);
+
+	struct attachment *a = attach_get(as, id);
+	if (a && a->complete) {
+		char path[4096];
+		attach_path(as, id, path, sizeof(path));
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd != -1) {
+			*size = a->size;
+			strcpy(name, a->name);
+		}
+	} else {
+		errno = ENOENT;
+	}
+
+	lockstat_unlock(as->mutex);
+
+	return fd;
+}
+
+/**
+ * @brief Print how many attachments are kept, and their size.
+ *
+ * @param[in] as The store.
+ * @param[in] f Where to print.
+ */
+void attach_print(struct attach_store *as, FILE *f)
+{
+	size_t kept = 0;
+	size_t uploading = 0;
+
+	lockstat_lock(as->mutex);
+	for (size_t i = 0; i < as->count; i++) {
+		if (as->table[i] && as->table[i]->complete)
+			kept++;
+		else if (as->table[i])
+			uploading++;
+	}
+	uint64_t reserved 			= as->reserved;
+	unsigned long long expired 	= as->expired;
+	unsigned long long evicted 	= as->evicted;
+	lockstat_unlock(as->mutex);
+
+	fprintf(f, "attachments: %zu kept, %zu uploading, %" PRIu64 " of %llu bytes used, %llu expired, %llu evicted\n",
+			kept, uploading, reserved, ATTACH_QUOTA, expired, evicted);
+}
@@ -0,0 +1,31 @@
+#ifndef ATTACH_H
+#define ATTACH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+/** @brief Bytes all the attachments together may take; the oldest files make room for new ones. */
+#define ATTACH_QUOTA (4ULL << 30)
+
+/** @brief Seconds a file is kept after its upload finished. */
+#define ATTACH_TTL (24 * 60 * 60)
+
+/** @brief Longest attachment name kept, @c NUL included; longer names are truncated. */
+#define ATTACH_NAME_LEN 128
+
+struct attach_store;
+
+struct attach_store *attach_store_create(const char *dir);
+void attach_store_destroy(struct attach_store *as);
+int attach_begin(struct attach_store *as, const char *name, uint64_t size);
+int attach_write(struct attach_store *as, int id, const char *data, size_t len);
+int attach_finish(struct attach_store *as, int id, uint64_t *size, char *name);
+void attach_abort(struct attach_store *as, int id);
+void attach_expire(struct attach_store *as, time_t now);
+int attach_open(struct attach_store *as, int id, uint64_t *size, char *name);
+void attach_print(struct attach_store *as, FILE *f);
+
+#endif
@@ -0,0 +1,171 @@
+#include "bufpool.h"
+
+#include <pthread.h>
+
+#include "lockstat.h"
+
+/**
+ * @brief A buffer kept for the next bufpool_get(); the link lives in the buffer itself.
+ */
+struct bufpool_free {
+	struct bufpool_free *next; /**< The next idle buffer */
+};
+
+/**
+ * @brief Buffers of the same size, shared by whoever needs one for a while.
+ *
+ * Buffers are allocated on demand. Up to @c keep idle buffers are kept for
+ * reuse, the others are freed as they come back, so the memory follows the
+ * number of buffers actually in use.
+ */
+struct bufpool {
+	struct lockstat *mutex;		/**< Protects everything below */
+	size_t size; 				/**< Size of every buffer */
+	size_t keep; 				/**< Most idle buffers kept */
+	struct bufpool_free *idle; 	/**< The idle buffers */
+	size_t nidle; 				/**< Number of idle buffers */
+	size_t in_use; 				/**< Number of buffers handed out */
+	size_t peak; 				/**< Most buffers handed out at once */
+	unsigned long long allocs; 	/**< Buffers allocated so far */
+};
+
+/**
+ * @brief Create an empty pool.
+ *
+ * @param[in] size Size of every buffer.
+ * @param[in] keep Most idle buffers kept for reuse.
+ *
+ * @return A pointer to the pool in case of success, NULL otherwise.
+ * The pool must be freed, using bufpool_destroy().
+ */
+struct bufpool *bufpool_create(size_t size, size_t keep)
+{
+	struct bufpool *p = calloc(1, sizeof(struct bufpool));
+	if (p) {
+		if (!(p->mutex = lockstat_create("bufpool"))) {
+			free(p);
+			return NULL;
+		}
+		p->size = size < sizeof(struct bufpool_free) ? sizeof(struct bufpool_free) : size;
+		p->keep = keep;
+	}
+
+	return p;
+}
+
+/**
+ * @brief Destroys a pool, and its idle buffers.
+ *
+ * @param[in] p The pool.
+ */
+void bufpool_destroy(struct bufpool *p)
+{
+	if (p) {
+		while (p->idle) {
+			struct bufpool_free *b = p->idle;
+			p->idle = b->next;
+			free(b);
+		}
+		lockstat_destroy(p->mutex);
+		free(p);
+	}
+}
+
+/**
+ * @brief Take a buffer.
+ *
+ * @param[in] p The pool.
+ *
+ * @return A buffer of bufpool_get_size() bytes in case of success, NULL otherwise.
+ * It must be given back, using bufpool_put().
+ */
+void *bufpool_get(struct bufpool *p)
+{
+	lockstat_lock(p->mutex);
+	struct bufpool_free *b = p->idle;
+	if (b) {
+		p->idle = b->next;
+		p->nidle--;
+	}
+	p->in_use++;
+	if (p->in_use > p->peak)
+		p->peak = p->in_use;
+	lockstat_unlock(p->mutex);
+
+	if (!b) {
+		b = malloc(p->size);
+		lockstat_lock(p->mutex);
+		if (b)
+			p->allocs++;
+		else
+			p->in_use--;
+		lockstat_unlock(p->mutex);
+	}
+
+	return b;
+}
+
+/**
+ * @brief Give a buffer back.
+ *
+ * @param[in] p The pool.
+ * @param[in] buf The buffer, from bufpool_get().
+ */
+void bufpool_put(struct bufpool *p, void *buf)
+{
+	struct bufpool_free *b = (struct bufpool_free *)buf;
+
+	lockstat_lock(p->mutex);
+	p->in_use--;
+	if (p->nidle < p->keep) {
+		b->next = p->idle;
+		p->idle = b;
+		p->nidle++;
+		b = NULL;
+	}
+	lockstat_unlock(p->mutex);
+
+	free(b);
+}
+
+/**
+ * @brief Get the size of the buffers.
+ *
+ * @param[in] p The pool.
+ *
+ * @return The size, in bytes.
+ */
+size_t bufpool_get_size(struct bufpool *p)
+{
+	return p->size;
+}
+
+/**
+ * @brief Get the number of buffers handed out.
+ *
+ * @param[in] p The pool.
+ *
+ * @return The number of buffers.
+ */
+size_t bufpool_get_in_use(struct bufpool *p)
+{
+	lockstat_lock(p->mutex);
+	size_t n = p->in_use;
+	lockstat_unlock(p->mutex);
+
+	return n;
+}
+
+/**
+ * @brief Print the pool statistics.
+ *
+ * @param[in] p The pool.
+ * @param[in] f Where to print.
+ */
+void bufpool_print(struct bufpool *p, FILE *f)
+{
+	lockstat_lock(p->mutex);
+	fprintf(f, "buffer pool: %zu bytes each, %zu in use (peak %zu), %zu idle (keeps %zu), %llu allocated\n",
+			p->size, p->in_use, p->peak, p->nidle, p->keep, p->allocs);
+	lockstat_unlock(p->mutex);
+}
@@ -0,0 +1,17 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+struct bufpool;
+
+struct bufpool *bufpool_create(size_t size, size_t keep);
+void bufpool_destroy(struct bufpool *p);
+void *bufpool_get(struct bufpool *p);
+void bufpool_put(struct bufpool *p, void *buf);
+size_t bufpool_get_size(struct bufpool *p);
+size_t bufpool_get_in_use(struct bufpool *p);
+void bufpool_print(struct bufpool *p, FILE *f);
+
+#endif
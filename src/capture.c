@@ -0,0 +1,320 @@
+#include "capture.h"
+
+#include <endian.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "lockstat.h"
+
+/*
+ * File layout, all integers big endian:
+ *
+ *   CAPTURE_MAGIC, then records:
+ *
+ *   0      1      5            9     13
+ *   | kind | conn | delta (us) | len | payload
+ *
+ * @c delta is the time since the previous record, so the records are in the order
+ * they were taken; a longer gap than @c UINT32_MAX microseconds is cut short.
+ */
+
+/**
+ * @brief What the connections of a server sent, written to a file as it comes.
+ *
+ * Records go through a @c FILE buffer, written out at least every @c CAPTURE_FLUSH_MS
+ * as long as records come in, and by capture_flush() otherwise.
+ */
+struct capture {
+	struct lockstat *mutex;			/**< Protects everything below */
+	FILE *file; 					/**< The capture file, NULL once capture_end() closed it */
+	uint64_t start_us; 				/**< When the capture started, @c CLOCK_MONOTONIC microseconds */
+	uint64_t last_us; 				/**< When the previous record was taken */
+	uint64_t flushed_us; 			/**< When the file was last flushed */
+	uint32_t conns; 				/**< Connections recorded so far, the last id given */
+	unsigned long long records; 	/**< Records written */
+	unsigned long long bytes; 		/**< Bytes written, headers included */
+	unsigned long long errors; 		/**< Records lost because writing failed */
+};
+
+/**
+ * @brief A capture file read back, a record at a time.
+ */
+struct capture_reader {
+	FILE *file; 		/**< The capture file */
+	uint64_t time_us; 	/**< Time of the last record read */
+	char *payload; 		/**< Payload of the last record read */
+};
+
+/**
+ * @brief Read the @c CLOCK_MONOTONIC time in microseconds.
+ */
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Start a capture.
+ *
+ * @param[in] path The capture file, truncated if it exists.
+ *
+ * @return A pointer to the capture in case of success, NULL otherwise.
+ * The capture must be freed, using capture_destroy().
+ */
+struct capture *capture_create(const char *path)
+{
+	struct capture *cap = calloc(1, sizeof(struct capture));
+	if (!cap)
+		return NULL;
+
+	cap->file = fopen(path, "wb");
+	if (!cap->file || fwrite(CAPTURE_MAGIC, CAPTURE_MAGIC_LEN, 1, cap->file) != 1
+			|| !(cap->mutex = lockstat_create("capture"))) {
+		if (cap->file)
+			fclose(cap->file);
+		free(cap);
+		return NULL;
+	}
+
+	cap->start_us 	= now_us();
+	cap->last_us 	= cap->start_us;
+	cap->flushed_us = cap->start_us;
+	cap->bytes 		= CAPTURE_MAGIC_LEN;
+
+	return cap;
+}
+
+/**
+ * @brief Stop a capture, writing out what is left.
+ *
+ * @param[in] cap The capture.
+ */
+void capture_destroy(struct capture *cap)
+{
+	if (cap) {
+		capture_end(cap);
+		lockstat_destroy(cap->mutex);
+		free(cap);
+	}
+}
+
+/**
+ * @brief Write out the records waiting in memory.
+ *
+ * Called every now and then, so a quiet capture does not keep its last records
+ * past @c CAPTURE_FLUSH_MS.
+ *
+ * @param[in] cap The capture.
+ */
+void capture_flush(struct capture *cap)
+{
+	lockstat_lock(cap->mutex);
+	if (cap->file) {
+		fflush(cap->file);
+		cap->flushed_us = now_us();
+	}
+	lockstat_unlock(cap->mutex);
+}
+
+/**
+ * @brief Write out what is left and close the capture file.
+ *
+ * The capture itself stays valid: records taken from now on are dropped, and
+ * counted as lost.
+ *
+ * @param[in] cap The capture.
+ */
+void capture_end(struct capture *cap)
+{
+	lockstat_lock(cap->mutex);
+	if (cap->file && fclose(cap->file) == EOF)
+		cap->errors++;
+	cap->file = NULL;
+	lockstat_unlock(cap->mutex);
+}
+
+/**
+ * @brief Append a record.
+ *
+ * @warning The capture mutex must be held.
+ */
+static void capture_write(struct capture *cap, uint8_t kind, uint32_t conn, const void *payload, size_t len)
+{
+	uint64_t now 	= now_us();
+	uint64_t delta 	= now > cap->last_us ? now - cap->last_us : 0;
+	cap->last_us = now;
+
+	if (!cap->file) {
+		cap->errors++;
+		return;
+	}
+	if (len > CAPTURE_MAX_PAYLOAD)
+		len = CAPTURE_MAX_PAYLOAD;
+
+	char header[CAPTURE_RECORD_LEN];
+	uint32_t be_conn 	= htobe32(conn);
+	uint32_t be_delta 	= htobe32(delta > UINT32_MAX ? UINT32_MAX : delta);
+	uint32_t be_len 	= htobe32(len);
+	header[0] = kind;
+	memcpy(header + 1, &be_conn, sizeof(be_conn));
+	memcpy(header + 5, &be_delta, sizeof(be_delta));
+	memcpy(header + 9, &be_len, sizeof(be_len));
+
+	if (fwrite(header, sizeof(header), 1, cap->file) != 1
+			|| (len && fwrite(payload, len, 1, cap->file) != 1)) {
+		cap->errors++;
+		return;
+	}
+	cap->records++;
+	cap->bytes += sizeof(header) + len;
+
+	if (now - cap->flushed_us >= CAPTURE_FLUSH_MS * 1000) {
+		fflush(cap->file);
+		cap->flushed_us = now;
+	}
+}
+
+/**
+ * @brief Record a connection starting.
+ *
+ * @param[in] cap The capture.
+ * @param[in] handshake What the client sent first: its name and its options.
+ * @param[in] len The handshake length.
+ *
+ * @return The id of the connection in the capture.
+ */
+uint32_t capture_open(struct capture *cap, const void *handshake, size_t len)
+{
+	lockstat_lock(cap->mutex);
+	uint32_t conn = ++cap->conns;
+	capture_write(cap, CAPTURE_OPEN, conn, handshake, len);
+	lockstat_unlock(cap->mutex);
+
+	return conn;
+}
+
+/**
+ * @brief Record a frame a connection sent.
+ *
+ * @param[in] cap The capture.
+ * @param[in] conn The connection, as returned by capture_open().
+ * @param[in] frame The whole frame.
+ * @param[in] len The frame length.
+ */
+void capture_frame(struct capture *cap, uint32_t conn, const void *frame, size_t len)
+{
+	lockstat_lock(cap->mutex);
+	capture_write(cap, CAPTURE_FRAME, conn, frame, len);
+	lockstat_unlock(cap->mutex);
+}
+
+/**
+ * @brief Record a connection ending.
+ *
+ * @param[in] cap The capture.
+ * @param[in] conn The connection, as returned by capture_open().
+ */
+void capture_close(struct capture *cap, uint32_t conn)
+{
+	lockstat_lock(cap->mutex);
+	capture_write(cap, CAPTURE_CLOSE, conn, NULL, 0);
+	lockstat_unlock(cap->mutex);
+}
+
+/**
+ * @brief Print how much was captured.
+ *
+ * @param[in] cap The capture.
+ * @param[in] f Where to print.
+ */
+void capture_print(struct capture *cap, FILE *f)
+{
+	lockstat_lock(cap->mutex);
+	fprintf(f, "capture: %u connections, %llu records in %llu bytes, %llu lost, %.1f s\n",
+			cap->conns, cap->records, cap->bytes, cap->errors, (now_us() - cap->start_us) / 1e6);
+	lockstat_unlock(cap->mutex);
+}
+
+/**
+ * @brief Open a capture file to read it back.
+ *
+ * @param[in] path The capture file.
+ *
+ * @return A pointer to the reader in case of success, NULL if the file cannot be
+ * read or is not a capture. The reader must be freed, using capture_reader_destroy().
+ */
+struct capture_reader *capture_reader_create(const char *path)
+{
+	struct capture_reader *r = calloc(1, sizeof(struct capture_reader));
+	if (!r)
+		return NULL;
+
+	char magic[CAPTURE_MAGIC_LEN];
+	r->file 	= fopen(path, "rb");
+	r->payload 	= malloc(CAPTURE_MAX_PAYLOAD);
+	if (!r->file || !r->payload || fread(magic, sizeof(magic), 1, r->file) != 1
+			|| memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+		capture_reader_destroy(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+/**
+ * @brief Close a capture file.
+ *
+ * @param[in] r The reader.
+ */
+void capture_reader_destroy(struct capture_reader *r)
+{
+	if (r) {
+		if (r->file)
+			fclose(r->file);
+		free(r->payload);
+		free(r);
+	}
+}
+
+/**
+ * @brief Read the next record.
+ *
+ * @param[in] r The reader.
+ * @param[out] rec The record.
+ *
+ * @return @c 1 if a record was read, @c 0 at the end of the capture, @c -1 if the
+ * file is cut short or corrupt.
+ */
+int capture_reader_next(struct capture_reader *r, struct capture_record *rec)
+{
+	char header[CAPTURE_RECORD_LEN];
+	size_t n = fread(header, 1, sizeof(header), r->file);
+	if (n == 0 && feof(r->file))
+		return 0;
+	if (n != sizeof(header))
+		return -1;
+
+	uint32_t conn, delta, len;
+	memcpy(&conn, header + 1, sizeof(conn));
+	memcpy(&delta, header + 5, sizeof(delta));
+	memcpy(&len, header + 9, sizeof(len));
+	len = be32toh(len);
+
+	if (header[0] < CAPTURE_OPEN || header[0] > CAPTURE_CLOSE || len > CAPTURE_MAX_PAYLOAD
+			|| (len && fread(r->payload, len, 1, r->file) != 1))
+		return -1;
+
+	r->time_us += be32toh(delta);
+
+	rec->kind 		= header[0];
+	rec->conn 		= be32toh(conn);
+	rec->time_us 	= r->time_us;
+	rec->payload 	= r->payload;
+	rec->len 		= len;
+
+	return 1;
+}
@@ -0,0 +1,60 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/** @brief First bytes of a capture file: the name and the format version. */
+#define CAPTURE_MAGIC "ZZCAP\0\0\1"
+
+/** @brief Bytes of @c CAPTURE_MAGIC. */
+#define CAPTURE_MAGIC_LEN 8
+
+/** @brief Bytes of a record header: kind (u8), connection (u32), time delta (u32) and length (u32). */
+#define CAPTURE_RECORD_LEN 13
+
+/** @brief Largest record payload. */
+#define CAPTURE_MAX_PAYLOAD (64 * 1024)
+
+/** @brief Milliseconds records may wait in memory before they are written out, see capture_flush(). */
+#define CAPTURE_FLUSH_MS 1000
+
+/**
+ * @brief What a capture record tells.
+ */
+enum capture_kind {
+	CAPTURE_OPEN = 1, 	/**< A connection started; the payload is its handshake */
+	CAPTURE_FRAME, 		/**< The connection sent a frame; the payload is the whole frame */
+	CAPTURE_CLOSE 		/**< The connection ended */
+};
+
+/**
+ * @brief A record read by capture_reader_next().
+ *
+ * @warning The payload is only valid until the next call.
+ */
+struct capture_record {
+	uint8_t kind; 			/**< One of enum capture_kind */
+	uint32_t conn; 			/**< The connection, numbered from @c 1 in the order they started */
+	uint64_t time_us; 		/**< Microseconds since the capture started */
+	const char *payload; 	/**< The payload */
+	uint32_t len; 			/**< The payload length */
+};
+
+struct capture;
+struct capture_reader;
+
+struct capture *capture_create(const char *path);
+void capture_destroy(struct capture *cap);
+void capture_flush(struct capture *cap);
+void capture_end(struct capture *cap);
+uint32_t capture_open(struct capture *cap, const void *handshake, size_t len);
+void capture_frame(struct capture *cap, uint32_t conn, const void *frame, size_t len);
+void capture_close(struct capture *cap, uint32_t conn);
+void capture_print(struct capture *cap, FILE *f);
+struct capture_reader *capture_reader_create(const char *path);
+void capture_reader_destroy(struct capture_reader *r);
+int capture_reader_next(struct capture_reader *r, struct capture_record *rec);
+
+#endif
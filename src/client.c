@@ -1,23 +1,69 @@
+#define _GNU_SOURCE
 #include "client.h"
 
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include <sys/socket.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "frame.h"
+
 /**
  * @brief Struct representing a connect client in the server.
  */
 struct client {
 	const char *name; 	/**< Client name */
-	int sockfd; 		/**< Socket that holds the connection with this client */
+	struct transport tr; 	/**< The connection with this client, usually a socket */
 	pthread_t thread; 	/**< The server thread responsible to listen to this client's messages */
+	struct shmchan *shm; 	/**< Shared-memory channel used instead of the socket, NULL if not in use */
+	char *token; 			/**< Resume token of the client session, NULL if none */
+	bool superseded; 		/**< Whether a new connection resumed this client's session */
+	bool synced; 			/**< Whether the client got the member list, so it only needs presence deltas */
+	int upload; 			/**< Id of the attachment the client is uploading, @c 0 if none */
+	struct outq *outq; 		/**< Frames waiting to be written */
+	pthread_t writer; 		/**< The thread writing the @c outq */
+	_Atomic bool drained; 	/**< Whether the writer is over, see client_drain() */
+	_Atomic bool shut; 		/**< Whether client_shutdown() was called */
+	struct fiber *writer_fiber; 	/**< The fiber writing the @c outq instead, NULL if the client has threads */
+	struct topk *meter; 	/**< Where the bytes written are counted, NULL if nowhere */
+	int filter; 			/**< Id of the client subscription filter, @c -1 if it gets everything */
+	uint32_t capture; 		/**< Id of the connection in the traffic capture, @c 0 if not captured */
+	int node; 				/**< NUMA node serving the connection */
+	bool mcast; 			/**< Whether the client gets the room from the multicast group rather than its connection */
+	uint64_t mcast_left; 	/**< Last message sent to the group while the client was in it, once it left */
+	time_t replay_second; 	/**< Second the @c replays were counted in */
+	size_t replays; 		/**< Messages sent again in that second, see client_take_replays() */
 };
 
+/** @brief Attributes of the threads of every client, once client_set_stack_size() was called. */
+static pthread_attr_t CLIENT_THREAD_ATTR;
+
+/** @brief Stack size chosen with client_set_stack_size(), @c 0 for the default. */
+static size_t CLIENT_STACK_SIZE = 0;
+
+/** @brief Scheduler running the writers as fibers, NULL if every client has a writer thread. */
+static struct fiber_sched *CLIENT_FIBERS = NULL;
+
+static void *client_writer_thread(void *arg);
+
 /**
  * @brief Create a client instance.
  *
  * Both parameters will be copied into the message, so the user is free to @c free() 
- * the parameters passed to this function if necessary.
+ * the parameters passed to this function if necessary. The name is kept in the same
+ * allocation as the client.
  *
  * @param[in] name The client name.
  * @param[in] sockfd The socket connected to this client.
  *
+ * A thread is started to write what is queued for the client, see client_send(),
+ * or a fiber after client_set_fibers().
+ *
  * @return A pointer to the client in case of success, NULL otherwise.
  * The client must be freed, using client_destroy().
  * 
@@ -25,16 +71,69 @@ struct client {
  */
 struct client *client_create(const char *name, int sockfd)
 {
-	struct client *c = malloc(sizeof(struct client));
+	/* Frames waiting in the kernel cannot be overtaken, so most of a backlog should wait in the lanes */
+	int sndbuf = CLIENT_SNDBUF;
+	setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	/* A fiber must never block its worker thread */
+	if (CLIENT_FIBERS)
+		fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+
+	struct transport tr = transport_socket(sockfd);
+
+	return client_create_transport(name, &tr);
+}
+
+/**
+ * @brief Create a client talking through any transport.
+ *
+ * @param[in] name The client name, copied.
+ * @param[in] tr The connection with this client. It is not closed by client_destroy().
+ *
+ * @return A pointer to the client in case of success, NULL otherwise.
+ * The client must be freed, using client_destroy().
+ *
+ * @see client_create
+ */
+struct client *client_create_transport(const char *name, const struct transport *tr)
+{
+	size_t name_size = name ? strlen(name) + 1 : 0;
+	struct client *c = malloc(sizeof(struct client) + name_size);
 	if (c) {
+		client_set_name(c, NULL);
 		if (name) {
-			char *tmp_name = malloc(sizeof(char) * (strlen(name)+1));
-			if (tmp_name) {
-				strcpy(tmp_name, name);
-				client_set_name(c, tmp_name);
-			}
+			char *tmp_name = (char *)(c + 1);
+			memcpy(tmp_name, name, name_size);
+			client_set_name(c, tmp_name);
+		}
+		c->tr = *tr;
+		client_set_shm(c, NULL);
+		c->token 		= NULL;
+		c->superseded 	= false;
+		c->synced 		= false;
+		c->upload 		= 0;
+		c->meter 		= NULL;
+		c->filter 		= -1;
+		c->capture 		= 0;
+		c->node 		= 0;
+		c->mcast 		= false;
+		c->mcast_left 	= 0;
+		c->replay_second = 0;
+		c->replays 		= 0;
+		atomic_init(&c->drained, false);
+		atomic_init(&c->shut, false);
+
+		c->outq 		= outq_create(CLIENT_OUTQ_MAX);
+		c->writer_fiber = NULL;
+		if (c->outq && CLIENT_FIBERS) {
+			c->writer_fiber = fiber_spawn(CLIENT_FIBERS, client_writer_thread, c, false);
+		}
+		if (!c->outq || (CLIENT_FIBERS ? !c->writer_fiber
+					: pthread_create(&c->writer, client_get_thread_attr(), client_writer_thread, c) != 0)) {
+			outq_destroy(c->outq);
+			free(c);
+			return NULL;
 		}
-		client_set_socket(c, sockfd);
 	}
 
 	return c;
@@ -43,13 +142,36 @@ struct client *client_create(const char *name, int sockfd)
 /**
  * Destroys a client.
  *
+ * What is still queued gets up to @c CLIENT_DRAIN_MS to be written, then the
+ * connection is shut down so the writer stops. The connection is not closed.
+ *
  * @param[in] c A pointer to the client.
  */
 void client_destroy(struct client *c)
 {
 	if (c) {
-		char *tmp_name = (char *)client_get_name(c);
-		free(tmp_name);
+		outq_close(c->outq);
+
+		if (c->writer_fiber) {
+			if (fiber_join(c->writer_fiber, CLIENT_DRAIN_MS) == -1) {
+				client_shutdown(c);
+				fiber_join(c->writer_fiber, -1);
+			}
+		} else {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += CLIENT_DRAIN_MS * 1000000L;
+			deadline.tv_sec  += deadline.tv_nsec / 1000000000L;
+			deadline.tv_nsec %= 1000000000L;
+			if (pthread_timedjoin_np(c->writer, NULL, &deadline)) {
+				client_shutdown(c);
+				pthread_join(c->writer, NULL);
+			}
+		}
+		outq_destroy(c->outq);
+
+		shmchan_destroy(client_get_shm(c));
+		free(c->token);
 		free(c);
 	}
 }
@@ -75,17 +197,62 @@ const char *client_get_name(struct client *c)
  *
  * @param[in] c The client.
  *
- * @return The client socket.
+ * @return The client socket, @c -1 if its connection does not go through one.
  */
 int client_get_socket(struct client *c)
 {
 	if (c) {
-		return c->sockfd;
+		return transport_get_socket(&c->tr);
 	}
 	
 	return -1;
 }
 
+/**
+ * @brief Get the connection with the client.
+ *
+ * @param[in] c The client.
+ *
+ * @return The connection.
+ */
+const struct transport *client_get_transport(struct client *c)
+{
+	if (c) {
+		return &c->tr;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Shut the connection with the client down, so its reader and its writer stop.
+ *
+ * @param[in] c The client.
+ */
+void client_shutdown(struct client *c)
+{
+	if (c) {
+		atomic_store(&c->shut, true);
+		transport_shutdown(&c->tr);
+	}
+}
+
+/**
+ * @brief Checks if the connection with the client was shut down.
+ *
+ * @param[in] c The client.
+ *
+ * @return @c true if client_shutdown() was called, @c false otherwise.
+ */
+bool client_is_shut_down(struct client *c)
+{
+	if (c) {
+		return atomic_load(&c->shut);
+	}
+
+	return false;
+}
+
 /**
  * @brief Get the client thread.
  *
@@ -108,7 +275,7 @@ pthread_t *client_get_thread(struct client *c)
  * @brief Set the client name.
  *
  * @param[in] c The client.
- * @param[in] name The client name.
+ * @param[in] name The client name. It is neither copied nor freed by the client.
  */
 void client_set_name(struct client *c, const char *name)
 {
@@ -126,7 +293,7 @@ void client_set_name(struct client *c, const char *name)
 void client_set_socket(struct client *c, int sockfd)
 {
 	if (c) {
-		c->sockfd = sockfd;
+		c->tr = transport_socket(sockfd);
 	}
 }
 
@@ -142,3 +309,715 @@ void client_set_thread(struct client *c, pthread_t thread)
 		c->thread = thread;
 	}
 }
+
+/**
+ * @brief Get the client shared-memory channel.
+ *
+ * @param[in] c The client.
+ *
+ * @return The channel, NULL if the client talks through its socket.
+ */
+struct shmchan *client_get_shm(struct client *c)
+{
+	if (c) {
+		return c->shm;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Set the client shared-memory channel.
+ *
+ * Once set, queued frames and client_recv() go through the channel instead of the socket.
+ * The channel is destroyed together with the client.
+ *
+ * @param[in] c The client.
+ * @param[in] shm The channel.
+ */
+void client_set_shm(struct client *c, struct shmchan *shm)
+{
+	if (c) {
+		c->shm = shm;
+	}
+}
+
+/**
+ * @brief Write all of a buffer to the client connection.
+ *
+ * @return @c 0 in case of success, @c -1 on error.
+ */
+static int client_write_transport(struct client *c, const char *buf, size_t len, int flags)
+{
+	while (len > 0) {
+		ssize_t n = transport_send(&c->tr, buf, len, flags);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno == EAGAIN) {
+			if (transport_wait(&c->tr, POLLOUT, -1) == -1)
+				return -1;
+			continue;
+		}
+		if (n == -1)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Write frames to the other end of the client connection.
+ *
+ * On shared memory the frames go in as few records as possible; a record holds
+ * whole frames, up to @c SHMCHAN_RECORD_MAX bytes.
+ *
+ * @return @c 0 in case of success, @c -1 on error.
+ */
+static int client_write(struct client *c, const char *buf, size_t len)
+{
+	if (!client_get_shm(c))
+		return client_write_transport(c, buf, len, 0);
+
+	while (len > SHMCHAN_RECORD_MAX) {
+		struct frame f;
+		ssize_t flen;
+		size_t rec = 0;
+		while ((flen = frame_parse(buf + rec, len - rec, &f)) > 0 && rec + flen <= SHMCHAN_RECORD_MAX)
+			rec += flen;
+		if (rec == 0) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		if (shmchan_send(client_get_shm(c), buf, rec) == -1)
+			return -1;
+		buf += rec;
+		len -= rec;
+	}
+
+	return shmchan_send(client_get_shm(c), buf, len) == -1 ? -1 : 0;
+}
+
+/**
+ * @brief Write the next frame of a file queued with client_send_file().
+ *
+ * On a socket the file bytes go from the page cache straight to the socket, using
+ * @c sendfile(), other transports do their best. A shared-memory record must hold
+ * the whole frame, so there the bytes are read into it.
+ *
+ * @return @c 0 in case of success, @c -1 on error.
+ */
+static int client_write_chunk(struct client *c, struct outq_item *it)
+{
+	char frame[FRAME_MAX_LEN];
+	size_t len = it->left < FRAME_FILE_CHUNK ? it->left : FRAME_FILE_CHUNK;
+	size_t hlen = frame_write_file_header(frame, FRAME_FILE_DATA, it->id, len);
+
+	if (client_get_shm(c)) {
+		if (pread(it->fd, frame + hlen, len, it->off) != (ssize_t)len)
+			return -1;
+		if (shmchan_send(client_get_shm(c), frame, hlen + len) == -1)
+			return -1;
+	} else {
+		if (client_write_transport(c, frame, hlen, MSG_MORE) == -1)
+			return -1;
+		off_t off = it->off;
+		size_t sent = 0;
+		while (sent < len) {
+			ssize_t n = transport_sendfile(&c->tr, it->fd, &off, len - sent);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n == -1 && errno == EAGAIN) {
+				if (transport_wait(&c->tr, POLLOUT, -1) == -1)
+					return -1;
+				continue;
+			}
+			/* The header is already out, so a short file cannot be papered over */
+			if (n <= 0)
+				return -1;
+			sent += n;
+		}
+	}
+
+	it->off 	+= len;
+	it->left 	-= len;
+
+	return 0;
+}
+
+/**
+ * @brief Write what is queued for a client, most urgent lane first.
+ *
+ * A file goes out a frame at a time, and is put back in its lane after each one,
+ * so whatever is queued in the other lanes meanwhile goes first. When writing
+ * fails the connection is shut down, so the thread reading it notices.
+ *
+ * @param[in] arg The client.
+ */
+static void *client_writer_thread(void *arg)
+{
+	struct client *c = (struct client *)arg;
+	struct outq_item *it;
+	struct topk_batch written = { 0 };
+
+	while ((it = outq_pop(c->outq))) {
+		int rv;
+		if (it->fd != -1) {
+			uint64_t left = it->left;
+			rv = client_write_chunk(c, it);
+			if (rv == 0 && c->meter)
+				topk_add_batched(c->meter, &written, client_get_name(c), left - it->left);
+			if (rv == 0 && it->left > 0) {
+				outq_unpop(c->outq, it);
+				continue;
+			}
+		} else {
+			if (it->flags & OUTQ_TRACED)
+				frame_stamp_flush(it->data, frame_now());
+			rv = client_write(c, it->data, it->len);
+			if (rv == 0 && c->meter)
+				topk_add_batched(c->meter, &written, client_get_name(c), it->len);
+		}
+		outq_free(c->outq, it);
+
+		if (rv == -1) {
+			outq_close(c->outq);
+			client_shutdown(c);
+		}
+	}
+
+	if (c->meter)
+		topk_flush(c->meter, &written, client_get_name(c));
+	atomic_store_explicit(&c->drained, true, memory_order_release);
+
+	return NULL;
+}
+
+/**
+ * @brief Queue frames for the other end of the client connection.
+ *
+ * The frames are copied, and written by the client writer thread. A client that
+ * lets more than @c CLIENT_OUTQ_MAX bytes pile up is too slow to keep: its
+ * connection is shut down.
+ *
+ * @param[in] c The client.
+ * @param[in] lane The lane; control frames overtake chat, which overtakes bulk.
+ * @param[in] flags @c OUTQ_ORDERED for sequenced frames, @c OUTQ_TRACED for a traced frame.
+ * @param[in] buf The frames.
+ * @param[in] len The frames length.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ *
+ * @see client_set_shm
+ */
+int client_send(struct client *c, enum outq_lane lane, int flags, const void *buf, size_t len)
+{
+	if (outq_push(c->outq, lane, flags, buf, len) == 0)
+		return 0;
+
+	if (errno == ENOBUFS) {
+		fprintf(stderr, "%s is not reading, dropping the connection\n", client_get_name(c));
+		outq_close(c->outq);
+		client_shutdown(c);
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Stop queueing frames for the client; the writer goes on until what is queued is written.
+ *
+ * The connection stays open, see client_is_drained().
+ *
+ * @param[in] c The client.
+ */
+void client_drain(struct client *c)
+{
+	outq_close(c->outq);
+}
+
+/**
+ * @brief Check whether everything queued for a client drained with client_drain() was written.
+ *
+ * @param[in] c The client.
+ *
+ * @return @c true once the writer is over, @c false otherwise.
+ */
+bool client_is_drained(struct client *c)
+{
+	return atomic_load_explicit(&c->drained, memory_order_acquire);
+}
+
+/**
+ * @brief Queue a file for the other end of the client connection, in the bulk lane.
+ *
+ * @param[in] c The client.
+ * @param[in] fd The file, closed once it is sent.
+ * @param[in] id The transfer id of its @c FRAME_FILE_DATA frames.
+ * @param[in] size Number of bytes to send, from the start of the file.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise. The file is closed either way.
+ */
+int client_send_file(struct client *c, int fd, uint32_t id, uint64_t size)
+{
+	return outq_push_file(c->outq, fd, id, size);
+}
+
+/**
+ * @brief Get the bytes queued for the client.
+ *
+ * @param[in] c The client.
+ *
+ * @return The number of bytes, files not included.
+ */
+size_t client_get_queued(struct client *c)
+{
+	return outq_get_bytes(c->outq);
+}
+
+/**
+ * @brief Count the bytes written to the client.
+ *
+ * Must be set before anything is queued for the client.
+ *
+ * @param[in] c The client.
+ * @param[in] meter Where the bytes are counted, under the client name; NULL stops counting.
+ */
+void client_set_meter(struct client *c, struct topk *meter)
+{
+	if (c) {
+		c->meter = meter;
+	}
+}
+
+/**
+ * @brief Block until the other end of the client connection sent something.
+ *
+ * Lets a reader hold no buffer while the client is idle.
+ *
+ * @param[in] c The client.
+ *
+ * @return @c 1 once client_recv() would not block, @c -1 on error.
+ */
+int client_wait(struct client *c)
+{
+	if (client_get_shm(c)) {
+		/* A closed peer is for client_recv() to report */
+		return shmchan_wait(client_get_shm(c), client_get_socket(c)) == -1 ? -1 : 1;
+	}
+
+	return transport_wait(&c->tr, POLLIN, -1) == -1 ? -1 : 1;
+}
+
+/**
+ * @brief Receive data from the other end of the client connection.
+ *
+ * @param[in] c The client.
+ * @param[out] buf Where the data will be stored.
+ * @param[in] len The size of @p buf.
+ *
+ * @return The number of bytes received, @c 0 if the connection was closed, @c -1 on error.
+ *
+ * @see client_set_shm
+ */
+ssize_t client_recv(struct client *c, void *buf, size_t len)
+{
+	if (client_get_shm(c)) {
+		return shmchan_recv(client_get_shm(c), buf, len, client_get_socket(c));
+	}
+
+	ssize_t n;
+	while ((n = transport_recv(&c->tr, buf, len)) == -1 && errno == EAGAIN) {
+		if (transport_wait(&c->tr, POLLIN, -1) == -1)
+			return -1;
+	}
+
+	return n;
+}
+
+/**
+ * @brief Get the client resume token.
+ *
+ * @param[in] c The client.
+ *
+ * @return The token, NULL if the client has none.
+ */
+const char *client_get_token(struct client *c)
+{
+	if (c) {
+		return c->token;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Set the client resume token.
+ *
+ * The token is copied into the client.
+ *
+ * @param[in] c The client.
+ * @param[in] token The token.
+ */
+void client_set_token(struct client *c, const char *token)
+{
+	if (c) {
+		char *tmp = malloc(sizeof(char) * (strlen(token) + 1));
+		if (tmp) {
+			strcpy(tmp, token);
+			free(c->token);
+			c->token = tmp;
+		}
+	}
+}
+
+/**
+ * @brief Checks if a new connection took this client's session over.
+ *
+ * @param[in] c The client.
+ *
+ * @return @c true if the session was resumed elsewhere, @c false otherwise.
+ */
+bool client_is_superseded(struct client *c)
+{
+	if (c) {
+		return c->superseded;
+	}
+
+	return false;
+}
+
+/**
+ * @brief Mark this client's session as resumed by a new connection.
+ *
+ * @param[in] c The client.
+ * @param[in] superseded Whether the session was resumed elsewhere.
+ */
+void client_set_superseded(struct client *c, bool superseded)
+{
+	if (c) {
+		c->superseded = superseded;
+	}
+}
+
+/**
+ * @brief Checks if the client got the member list.
+ *
+ * @param[in] c The client.
+ *
+ * @return @c true if it did, @c false otherwise.
+ */
+bool client_is_synced(struct client *c)
+{
+	if (c) {
+		return c->synced;
+	}
+
+	return false;
+}
+
+/**
+ * @brief Set whether the client got the member list.
+ *
+ * @param[in] c The client.
+ * @param[in] synced Whether it did.
+ */
+void client_set_synced(struct client *c, bool synced)
+{
+	if (c) {
+		c->synced = synced;
+	}
+}
+
+/**
+ * @brief Get the attachment the client is uploading.
+ *
+ * @param[in] c The client.
+ *
+ * @return The attachment id, @c 0 if none.
+ */
+int client_get_upload(struct client *c)
+{
+	if (c) {
+		return c->upload;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Set the attachment the client is uploading.
+ *
+ * @param[in] c The client.
+ * @param[in] upload The attachment id, @c 0 if none.
+ */
+void client_set_upload(struct client *c, int upload)
+{
+	if (c) {
+		c->upload = upload;
+	}
+}
+
+/**
+ * @brief Get the subscription filter of the client.
+ *
+ * @param[in] c The client.
+ *
+ * @return The filter id, @c -1 if the client gets every message.
+ */
+int client_get_filter(struct client *c)
+{
+	if (c) {
+		return c->filter;
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Set the subscription filter of the client.
+ *
+ * @param[in] c The client.
+ * @param[in] filter The filter id, @c -1 if the client gets every message.
+ */
+void client_set_filter(struct client *c, int filter)
+{
+	if (c) {
+		c->filter = filter;
+	}
+}
+
+/**
+ * @brief Get the id of the client connection in the traffic capture.
+ *
+ * @param[in] c The client.
+ *
+ * @return The id, @c 0 if the connection is not captured.
+ */
+uint32_t client_get_capture(struct client *c)
+{
+	if (c) {
+		return c->capture;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Set the id of the client connection in the traffic capture.
+ *
+ * @param[in] c The client.
+ * @param[in] capture The id, as returned by capture_open(), @c 0 if not captured.
+ */
+void client_set_capture(struct client *c, uint32_t capture)
+{
+	if (c) {
+		c->capture = capture;
+	}
+}
+
+/**
+ * @brief Get the NUMA node serving the client connection.
+ *
+ * @param[in] c The client.
+ *
+ * @return The node, @c 0 if none was set.
+ */
+int client_get_node(struct client *c)
+{
+	if (c) {
+		return c->node;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Set the NUMA node serving the client connection.
+ *
+ * @param[in] c The client.
+ * @param[in] node The node, as chosen by affinity_place().
+ */
+void client_set_node(struct client *c, int node)
+{
+	if (c) {
+		c->node = node;
+	}
+}
+
+/**
+ * @brief Checks if the client gets the room from the multicast group.
+ *
+ * @param[in] c The client.
+ *
+ * @return @c true if it does, @c false if the room is sent over its connection.
+ */
+bool client_is_mcast(struct client *c)
+{
+	if (c) {
+		return c->mcast;
+	}
+
+	return false;
+}
+
+/**
+ * @brief Set whether the client gets the room from the multicast group.
+ *
+ * @param[in] c The client.
+ * @param[in] mcast Whether it does.
+ */
+void client_set_mcast(struct client *c, bool mcast)
+{
+	if (c) {
+		c->mcast = mcast;
+	}
+}
+
+/**
+ * @brief Get the last message sent to the multicast group while the client was in it.
+ *
+ * @param[in] c The client.
+ *
+ * @return The sequence number, @c 0 if it never left the group.
+ */
+uint64_t client_get_mcast_left(struct client *c)
+{
+	if (c) {
+		return c->mcast_left;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Set the last message sent to the multicast group while the client was in it.
+ *
+ * What the client missed of the group up to it may still be asked for.
+ *
+ * @param[in] c The client.
+ * @param[in] seq The sequence number.
+ */
+void client_set_mcast_left(struct client *c, uint64_t seq)
+{
+	if (c) {
+		c->mcast_left = seq;
+	}
+}
+
+/**
+ * @brief Take messages to send again out of what the client may get this second.
+ *
+ * A member of the multicast group asks for what it missed; however often it asks,
+ * it gets at most @c CLIENT_REPLAY_PER_S messages a second.
+ *
+ * @param[in] c The client.
+ * @param[in] n The number of messages it asked for.
+ *
+ * @return The number of messages it may get, up to @p n.
+ */
+size_t client_take_replays(struct client *c, size_t n)
+{
+	time_t now = time(NULL);
+
+	if (now != c->replay_second) {
+		c->replay_second 	= now;
+		c->replays 			= 0;
+	}
+	if (n > CLIENT_REPLAY_PER_S - c->replays)
+		n = CLIENT_REPLAY_PER_S - c->replays;
+	c->replays += n;
+
+	return n;
+}
+
+/**
+ * @brief Choose the stack size of the threads of every client created from now on.
+ *
+ * @param[in] size The stack size, in bytes.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise, with @c errno set to @c EINVAL
+ * if the size is too small.
+ */
+int client_set_stack_size(size_t size)
+{
+	int rv;
+
+	if (CLIENT_STACK_SIZE == 0 && (rv = pthread_attr_init(&CLIENT_THREAD_ATTR))) {
+		errno = rv;
+		return -1;
+	}
+	if ((rv = pthread_attr_setstacksize(&CLIENT_THREAD_ATTR, size))) {
+		errno = rv;
+		return -1;
+	}
+	CLIENT_STACK_SIZE = size;
+
+	return 0;
+}
+
+/**
+ * @brief Get the attributes the threads of a client must be created with.
+ *
+ * @return The attributes, NULL for the defaults.
+ */
+const pthread_attr_t *client_get_thread_attr(void)
+{
+	return CLIENT_STACK_SIZE ? &CLIENT_THREAD_ATTR : NULL;
+}
+
+/**
+ * @brief Run the writers of the clients created from now on as fibers.
+ *
+ * Their sockets are made non-blocking, so a writer or a reader that would block
+ * only parks its fiber. Clients talking through shared memory are not supported.
+ *
+ * @param[in] s The scheduler running the fibers.
+ */
+void client_set_fibers(struct fiber_sched *s)
+{
+	CLIENT_FIBERS = s;
+}
+
+/**
+ * @brief Get the stack size of the threads, or fibers, of a client.
+ *
+ * @return The stack size reserved for each thread, in bytes.
+ */
+size_t client_get_stack_size(void)
+{
+	if (CLIENT_FIBERS)
+		return fiber_sched_get_stack_size(CLIENT_FIBERS);
+	if (CLIENT_STACK_SIZE)
+		return CLIENT_STACK_SIZE;
+
+	size_t size = 0;
+	pthread_attr_t attr;
+	if (pthread_getattr_default_np(&attr) == 0) {
+		pthread_attr_getstacksize(&attr, &size);
+		pthread_attr_destroy(&attr);
+	}
+
+	return size;
+}
+
+/**
+ * @brief Get the memory the client costs, by component.
+ *
+ * The stacks are what is reserved for the two client threads, or fibers, the
+ * reader and the writer; only the pages they touched are resident.
+ *
+ * @param[in] c The client.
+ * @param[out] fp Where the bytes are added.
+ */
+void client_add_footprint(struct client *c, struct client_footprint *fp)
+{
+	fp->client += sizeof(struct client) + strlen(client_get_name(c)) + 1;
+	if (c->token)
+		fp->client += strlen(c->token) + 1;
+	fp->stacks 	+= 2 * client_get_stack_size();
+	fp->outq 	+= outq_get_footprint(c->outq);
+	if (client_get_shm(c))
+		fp->shm += shmchan_get_footprint();
+}
@@ -3,18 +3,89 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
 
+#include <sys/types.h>
 #include <pthread.h>
 
+#include "shmchan.h"
+#include "outq.h"
+#include "topk.h"
+#include "fiber.h"
+#include "transport.h"
+
+/** @brief Bytes of frames that may be queued for a client before it is dropped as too slow. */
+#define CLIENT_OUTQ_MAX (8 << 20)
+
+/** @brief Socket send buffer of a client, kept small so the lanes decide what goes first. */
+#define CLIENT_SNDBUF (64 * 1024)
+
+/** @brief Milliseconds client_destroy() lets what is queued be written. */
+#define CLIENT_DRAIN_MS 200
+
+/** @brief Messages a member of the multicast group may get again per second. */
+#define CLIENT_REPLAY_PER_S 1024
+
+/**
+ * @brief Memory connections cost, by component, see client_add_footprint().
+ */
+struct client_footprint {
+	size_t client; 	/**< The struct client, its name and its token */
+	size_t stacks; 	/**< Stacks reserved for its threads */
+	size_t recv; 	/**< Its receive buffer */
+	size_t outq; 	/**< Its outbound queue, with the frames in it */
+	size_t shm; 	/**< Its shared-memory rings */
+	size_t other; 	/**< Its list node, pipeline state and filter */
+};
+
 struct client;
 
 struct client *client_create(const char *name, int sockfd);
+struct client *client_create_transport(const char *name, const struct transport *tr);
 void client_destroy(struct client *c);
 const char *client_get_name(struct client *c);
 int client_get_socket(struct client *c);
+const struct transport *client_get_transport(struct client *c);
+void client_shutdown(struct client *c);
+bool client_is_shut_down(struct client *c);
 pthread_t *client_get_thread(struct client *c);
 void client_set_name(struct client *c, const char *name);
 void client_set_socket(struct client *c, int sockfd);
 void client_set_thread(struct client *c, pthread_t thread);
+struct shmchan *client_get_shm(struct client *c);
+void client_set_shm(struct client *c, struct shmchan *shm);
+int client_send(struct client *c, enum outq_lane lane, int flags, const void *buf, size_t len);
+int client_send_file(struct client *c, int fd, uint32_t id, uint64_t size);
+void client_drain(struct client *c);
+bool client_is_drained(struct client *c);
+size_t client_get_queued(struct client *c);
+void client_set_meter(struct client *c, struct topk *meter);
+int client_wait(struct client *c);
+ssize_t client_recv(struct client *c, void *buf, size_t len);
+const char *client_get_token(struct client *c);
+void client_set_token(struct client *c, const char *token);
+bool client_is_superseded(struct client *c);
+void client_set_superseded(struct client *c, bool superseded);
+bool client_is_synced(struct client *c);
+void client_set_synced(struct client *c, bool synced);
+int client_get_upload(struct client *c);
+void client_set_upload(struct client *c, int upload);
+int client_get_filter(struct client *c);
+void client_set_filter(struct client *c, int filter);
+uint32_t client_get_capture(struct client *c);
+void client_set_capture(struct client *c, uint32_t capture);
+int client_get_node(struct client *c);
+void client_set_node(struct client *c, int node);
+bool client_is_mcast(struct client *c);
+void client_set_mcast(struct client *c, bool mcast);
+uint64_t client_get_mcast_left(struct client *c);
+void client_set_mcast_left(struct client *c, uint64_t seq);
+size_t client_take_replays(struct client *c, size_t n);
+int client_set_stack_size(size_t size);
+const pthread_attr_t *client_get_thread_attr(void);
+void client_set_fibers(struct fiber_sched *s);
+size_t client_get_stack_size(void);
+void client_add_footprint(struct client *c, struct client_footprint *fp);
 
 #endif
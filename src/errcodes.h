@@ -11,7 +11,10 @@ enum errcodes {
 	E_LISTEN,           /**< Error code if liste() fails */
 	E_BAD_ARGS,         /**< Error code if the user gave a bad input */
 	E_CONNECT,          /**< Error code if connect() fails */
-	E_PTHREAD_CREATE    /**< Error code if it was not possible to create a new thread */
+	E_PTHREAD_CREATE,   /**< Error code if it was not possible to create a new thread */
+	E_ALLOC,            /**< Error code if a startup allocation fails */
+	E_REGRESSION,       /**< Error code if a replay did worse than its baseline */
+	E_MCAST             /**< Error code if the multicast group could not be set up */
 };
 
 #endif
@@ -0,0 +1,926 @@
+#define _GNU_SOURCE
+#include "fiber.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/**
+ * @brief What a worker does with the fiber that just switched back to it.
+ */
+enum fiber_post {
+	FIBER_POST_YIELD, 	/**< Queue it again */
+	FIBER_POST_PARK, 	/**< Leave it until fiber_wake(), unless it was woken meanwhile */
+	FIBER_POST_EXIT 	/**< It returned, release it */
+};
+
+/**
+ * @brief A function running on its own small stack, on whichever worker thread is free.
+ */
+struct fiber {
+	ucontext_t ctx; 				/**< Where it resumes */
+	struct fiber_sched *sched; 		/**< Its scheduler */
+	struct fiber_worker *home; 		/**< Worker it last ran on, where it is queued when woken */
+	struct fiber *next; 			/**< Next fiber of a run queue */
+	fiber_fn fn; 					/**< What it runs */
+	void *arg; 						/**< The argument given to @c fn */
+	void *stack; 					/**< Its stack mapping, guard page included */
+	pthread_mutex_t lock; 			/**< Protects the fields below, up to @c joiner */
+	pthread_cond_t cond; 			/**< Signaled when it returns, for the threads joining it */
+	bool parked; 					/**< Whether it waits for fiber_wake() */
+	bool permit; 					/**< Whether a wake came while it was not parked */
+	bool timed_out; 				/**< Whether its timed park expired */
+	bool done; 						/**< Whether it returned */
+	bool detached; 					/**< Whether it is freed when it returns, instead of by fiber_join() */
+	struct fiber *joiner; 			/**< Fiber waiting in fiber_join(), NULL if none */
+	bool in_timers; 				/**< Whether it is in the timer list; protected, with the next two, by the timer lock */
+	long long deadline; 			/**< When its timed park expires, in @c CLOCK_MONOTONIC milliseconds */
+	struct fiber *tnext; 			/**< Next fiber of the timer list */
+	struct pollfd *wait; 			/**< What it waits for in fiber_poll(); protected, with @c nwait, by the poll lock */
+	nfds_t nwait; 					/**< Number of descriptors in @c wait */
+};
+
+/**
+ * @brief A thread running fibers, its own first, then those it steals.
+ */
+struct fiber_worker {
+	struct fiber_sched *sched; 	/**< Its scheduler */
+	pthread_t thread; 			/**< The thread */
+	ucontext_t ctx; 			/**< Where the fibers switch back to */
+	enum fiber_post post; 		/**< What to do with the fiber that switched back */
+	pthread_mutex_t lock; 		/**< Protects the run queue */
+	struct fiber *head; 		/**< Next fiber to run */
+	struct fiber *tail; 		/**< Last fiber queued */
+	size_t len; 				/**< Fibers queued */
+	atomic_ullong runs; 		/**< Times a fiber was switched to */
+	atomic_ullong steals; 		/**< Fibers taken from other workers */
+};
+
+/**
+ * @brief The fibers waiting for a descriptor; one may read while another writes.
+ */
+struct fiber_fd {
+	struct fiber *in; 	/**< Fiber waiting to read, NULL if none */
+	struct fiber *out; 	/**< Fiber waiting to write, NULL if none */
+	bool added; 		/**< Whether the descriptor was added to the epoll set */
+};
+
+/**
+ * @brief Runs many fibers on a few threads.
+ *
+ * Every worker has its own run queue. A woken fiber goes back to the worker it last
+ * ran on, and a worker with nothing to run takes half the queue of another one.
+ * A poller thread waits, using @c epoll, for the descriptors the fibers wait for
+ * and for the timed parks to expire.
+ */
+struct fiber_sched {
+	struct fiber_worker *workers; 	/**< The workers */
+	int nworkers; 					/**< Number of workers */
+	size_t stack_size; 				/**< Stack of every fiber, guard page not included */
+	size_t page; 					/**< Page size, of the guard page */
+	atomic_size_t runnable; 		/**< Fibers queued, on any worker */
+	atomic_int sleepers; 			/**< Workers waiting for something to run */
+	pthread_mutex_t idle_lock; 		/**< Lets the workers sleep */
+	pthread_cond_t idle_cond; 		/**< Signaled when a fiber is queued and a worker sleeps */
+	atomic_uint spread; 			/**< Picks the worker of the fibers spawned outside the workers */
+	int epfd; 						/**< The epoll set of the poller */
+	int kickfd; 					/**< Event the poller wakes on when an earlier timer is set */
+	pthread_t poller; 				/**< The poller thread */
+	pthread_mutex_t poll_lock; 		/**< Protects @c fds, and what the fibers wait for */
+	struct fiber_fd *fds; 			/**< Waiting fibers, by descriptor */
+	size_t nfds; 					/**< Number of entries in @c fds */
+	pthread_mutex_t timer_lock; 	/**< Protects the timer list */
+	struct fiber *timers; 			/**< Fibers in a timed park, earliest deadline first */
+	atomic_size_t alive; 			/**< Fibers that did not return yet */
+	atomic_ullong spawned; 			/**< Fibers spawned so far */
+	atomic_ullong io_wakes; 		/**< Fibers woken by a descriptor */
+	atomic_ullong timeouts; 		/**< Timed parks that expired */
+};
+
+/** @brief Worker of the calling thread, NULL outside the workers. */
+static __thread struct fiber_worker *CURRENT_WORKER = NULL;
+
+/** @brief Fiber the calling worker runs, NULL outside the fibers. */
+static __thread struct fiber *CURRENT_FIBER = NULL;
+
+/**
+ * @brief Get the worker of the calling thread.
+ *
+ * Not inlined: a fiber may resume on another thread, so the address of a thread
+ * local variable must not be kept across a switch.
+ */
+static __attribute__((noinline)) struct fiber_worker *current_worker(void)
+{
+	return CURRENT_WORKER;
+}
+
+/**
+ * @brief Get the @c CLOCK_MONOTONIC time in milliseconds.
+ */
+static long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Queue a fiber on the worker it last ran on, and wake a worker if one sleeps.
+ */
+static void enqueue(struct fiber *f)
+{
+	struct fiber_sched *s = f->sched;
+	struct fiber_worker *w = f->home;
+
+	f->next = NULL;
+	pthread_mutex_lock(&w->lock);
+	if (w->tail)
+		w->tail->next = f;
+	else
+		w->head = f;
+	w->tail = f;
+	w->len++;
+	pthread_mutex_unlock(&w->lock);
+
+	atomic_fetch_add(&s->runnable, 1);
+	if (atomic_load(&s->sleepers)) {
+		pthread_mutex_lock(&s->idle_lock);
+		pthread_cond_signal(&s->idle_cond);
+		pthread_mutex_unlock(&s->idle_lock);
+	}
+}
+
+/**
+ * @brief Take the next fiber of a worker queue.
+ *
+ * @return The fiber, NULL if the queue is empty.
+ */
+static struct fiber *dequeue(struct fiber_worker *w)
+{
+	pthread_mutex_lock(&w->lock);
+	struct fiber *f = w->head;
+	if (f) {
+		w->head = f->next;
+		if (!w->head)
+			w->tail = NULL;
+		w->len--;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	if (f)
+		atomic_fetch_sub(&w->sched->runnable, 1);
+
+	return f;
+}
+
+/**
+ * @brief Take half the queue of the first other worker that has something queued.
+ *
+ * @return The first fiber taken, to run at once; the others go to the queue of @p w.
+ */
+static struct fiber *steal(struct fiber_worker *w)
+{
+	struct fiber_sched *s = w->sched;
+	int self = w - s->workers;
+
+	for (int i = 1; i < s->nworkers; i++) {
+		struct fiber_worker *v = &s->workers[(self + i) % s->nworkers];
+
+		pthread_mutex_lock(&v->lock);
+		size_t take = (v->len + 1) / 2;
+		struct fiber *first = v->head, *last = v->head;
+		for (size_t k = 1; k < take; k++)
+			last = last->next;
+		if (take) {
+			v->head = last->next;
+			if (!v->head)
+				v->tail = NULL;
+			v->len -= take;
+			last->next = NULL;
+		}
+		pthread_mutex_unlock(&v->lock);
+
+		if (!take)
+			continue;
+
+		atomic_fetch_add(&w->steals, take);
+		atomic_fetch_sub(&s->runnable, 1);
+
+		struct fiber *rest = first->next;
+		first->home = w;
+		if (rest) {
+			for (struct fiber *f = rest; f; f = f->next)
+				f->home = w;
+			pthread_mutex_lock(&w->lock);
+			if (w->tail)
+				w->tail->next = rest;
+			else
+				w->head = rest;
+			w->tail = last;
+			w->len += take - 1;
+			pthread_mutex_unlock(&w->lock);
+		}
+
+		return first;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Wait for a fiber to run: one of the worker's own, a stolen one, or the next one queued.
+ */
+static struct fiber *next_fiber(struct fiber_worker *w)
+{
+	struct fiber_sched *s = w->sched;
+
+	while (true) {
+		struct fiber *f = dequeue(w);
+		if (!f)
+			f = steal(w);
+		if (f)
+			return f;
+
+		pthread_mutex_lock(&s->idle_lock);
+		atomic_fetch_add(&s->sleepers, 1);
+		while (atomic_load(&s->runnable) == 0)
+			pthread_cond_wait(&s->idle_cond, &s->idle_lock);
+		atomic_fetch_sub(&s->sleepers, 1);
+		pthread_mutex_unlock(&s->idle_lock);
+	}
+}
+
+/**
+ * @brief Release a fiber that returned, once nobody needs it any more.
+ */
+static void fiber_free(struct fiber *f)
+{
+	pthread_cond_destroy(&f->cond);
+	pthread_mutex_destroy(&f->lock);
+	free(f);
+}
+
+/**
+ * @brief Release the stack of a fiber that returned, and tell whoever joins it.
+ */
+static void fiber_finish(struct fiber *f)
+{
+	struct fiber_sched *s = f->sched;
+
+	munmap(f->stack, s->stack_size + s->page);
+	atomic_fetch_sub(&s->alive, 1);
+
+	pthread_mutex_lock(&f->lock);
+	f->done = true;
+	if (f->joiner)
+		fiber_wake(f->joiner);
+	f->joiner = NULL;
+	pthread_cond_broadcast(&f->cond);
+	bool detached = f->detached;
+	pthread_mutex_unlock(&f->lock);
+
+	if (detached)
+		fiber_free(f);
+}
+
+/**
+ * @brief Keeps running the fibers of a worker.
+ *
+ * The fiber that switches back says what to do with it; that is done here, off its
+ * stack, so it may be picked up by another worker right away.
+ *
+ * @param[in] arg The worker.
+ */
+static void *worker_thread(void *arg)
+{
+	struct fiber_worker *w = (struct fiber_worker *)arg;
+	CURRENT_WORKER = w;
+
+	while (true) {
+		struct fiber *f = next_fiber(w);
+		f->home = w;
+		CURRENT_FIBER = f;
+		atomic_fetch_add_explicit(&w->runs, 1, memory_order_relaxed);
+		swapcontext(&w->ctx, &f->ctx);
+		CURRENT_FIBER = NULL;
+
+		switch (w->post) {
+		case FIBER_POST_YIELD:
+			enqueue(f);
+			break;
+		case FIBER_POST_PARK:
+			pthread_mutex_lock(&f->lock);
+			if (f->permit) {
+				f->permit = false;
+				pthread_mutex_unlock(&f->lock);
+				enqueue(f);
+			} else {
+				f->parked = true;
+				pthread_mutex_unlock(&f->lock);
+			}
+			break;
+		case FIBER_POST_EXIT:
+			fiber_finish(f);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Switch from a fiber back to its worker.
+ *
+ * @param[in] f The calling fiber.
+ * @param[in] post What the worker does with it.
+ */
+static void switch_out(struct fiber *f, enum fiber_post post)
+{
+	struct fiber_worker *w = current_worker();
+	w->post = post;
+	swapcontext(&f->ctx, &w->ctx);
+}
+
+/**
+ * @brief Where every fiber starts.
+ */
+static void fiber_entry(void)
+{
+	struct fiber *f = fiber_current();
+	f->fn(f->arg);
+	switch_out(f, FIBER_POST_EXIT);
+}
+
+/**
+ * @brief Put a fiber in the timer list, and wake the poller if it is the earliest.
+ */
+static void timer_add(struct fiber_sched *s, struct fiber *f, long long deadline)
+{
+	pthread_mutex_lock(&s->timer_lock);
+	f->deadline = deadline;
+	struct fiber **p = &s->timers;
+	while (*p && (*p)->deadline <= deadline)
+		p = &(*p)->tnext;
+	f->tnext = *p;
+	*p = f;
+	f->in_timers = true;
+	bool earliest = s->timers == f;
+	pthread_mutex_unlock(&s->timer_lock);
+
+	if (earliest) {
+		uint64_t one = 1;
+		if (write(s->kickfd, &one, sizeof(one)) == -1)
+			perror("fiber timer -> write()");
+	}
+}
+
+/**
+ * @brief Take a fiber out of the timer list, if it still is there.
+ */
+static void timer_remove(struct fiber_sched *s, struct fiber *f)
+{
+	pthread_mutex_lock(&s->timer_lock);
+	if (f->in_timers) {
+		struct fiber **p = &s->timers;
+		while (*p != f)
+			p = &(*p)->tnext;
+		*p = f->tnext;
+		f->in_timers = false;
+	}
+	pthread_mutex_unlock(&s->timer_lock);
+}
+
+/**
+ * @brief Wake the fibers whose timed park expired.
+ *
+ * The timer lock is held while they are woken, so none of them can return meanwhile.
+ *
+ * @return Milliseconds until the next deadline, @c -1 if there is none.
+ */
+static int timers_fire(struct fiber_sched *s)
+{
+	long long now = now_ms();
+	int timeout = -1;
+
+	pthread_mutex_lock(&s->timer_lock);
+	while (s->timers && s->timers->deadline <= now) {
+		struct fiber *f = s->timers;
+		s->timers = f->tnext;
+		f->in_timers = false;
+
+		pthread_mutex_lock(&f->lock);
+		f->timed_out = true;
+		if (f->parked) {
+			f->parked = false;
+			pthread_mutex_unlock(&f->lock);
+			enqueue(f);
+		} else {
+			f->permit = true;
+			pthread_mutex_unlock(&f->lock);
+		}
+		atomic_fetch_add(&s->timeouts, 1);
+	}
+	if (s->timers)
+		timeout = s->timers->deadline - now > INT_MAX ? INT_MAX : s->timers->deadline - now;
+	pthread_mutex_unlock(&s->timer_lock);
+
+	return timeout;
+}
+
+/**
+ * @brief Make sure @c fds has an entry for a descriptor.
+ *
+ * @warning The poll lock must be held.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+static int fds_reserve(struct fiber_sched *s, int fd)
+{
+	if ((size_t)fd < s->nfds)
+		return 0;
+
+	size_t n = s->nfds ? s->nfds : 1024;
+	while (n <= (size_t)fd)
+		n *= 2;
+	struct fiber_fd *fds = realloc(s->fds, n * sizeof(struct fiber_fd));
+	if (!fds)
+		return -1;
+	memset(fds + s->nfds, 0, (n - s->nfds) * sizeof(struct fiber_fd));
+	s->fds 	= fds;
+	s->nfds = n;
+
+	return 0;
+}
+
+/**
+ * @brief Ask the poller to report a descriptor once, for the fibers waiting for it.
+ *
+ * A descriptor closed and reused since it was added is gone from the epoll set, so
+ * it is added again.
+ *
+ * @warning The poll lock must be held.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+static int fds_arm(struct fiber_sched *s, int fd)
+{
+	struct fiber_fd *e = &s->fds[fd];
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events 	= EPOLLONESHOT | (e->in ? EPOLLIN : 0) | (e->out ? EPOLLOUT : 0);
+	ev.data.fd 	= fd;
+
+	if (e->added && epoll_ctl(s->epfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+		return 0;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) == 0
+			|| (errno == EEXIST && epoll_ctl(s->epfd, EPOLL_CTL_MOD, fd, &ev) == 0)) {
+		e->added = true;
+		return 0;
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Forget what a fiber waits for.
+ *
+ * @warning The poll lock must be held.
+ */
+static void fds_forget(struct fiber_sched *s, struct fiber *f)
+{
+	for (nfds_t i = 0; i < f->nwait; i++) {
+		int fd = f->wait[i].fd;
+		if (fd < 0)
+			continue;
+		if (s->fds[fd].in == f)
+			s->fds[fd].in = NULL;
+		if (s->fds[fd].out == f)
+			s->fds[fd].out = NULL;
+	}
+	f->wait 	= NULL;
+	f->nwait 	= 0;
+}
+
+/**
+ * @brief Wake a fiber waiting for a descriptor that is ready.
+ *
+ * @warning The poll lock must be held.
+ */
+static void fds_wake(struct fiber_sched *s, struct fiber *f, int fd, uint32_t events)
+{
+	for (nfds_t i = 0; i < f->nwait; i++) {
+		if (f->wait[i].fd == fd)
+			f->wait[i].revents = events & (f->wait[i].events | POLLERR | POLLHUP);
+	}
+	fds_forget(s, f);
+	atomic_fetch_add(&s->io_wakes, 1);
+	fiber_wake(f);
+}
+
+/**
+ * @brief Keeps waking the fibers whose descriptors are ready or whose timed park expired.
+ *
+ * @param[in] arg The scheduler.
+ */
+static void *poller_thread(void *arg)
+{
+	struct fiber_sched *s = (struct fiber_sched *)arg;
+	struct epoll_event events[FIBER_POLL_EVENTS];
+
+	while (true) {
+		int n = epoll_wait(s->epfd, events, FIBER_POLL_EVENTS, timers_fire(s));
+		if (n == -1) {
+			if (errno != EINTR)
+				perror("fiber poller -> epoll_wait()");
+			continue;
+		}
+
+		pthread_mutex_lock(&s->poll_lock);
+		for (int i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+			uint32_t ev = events[i].events;
+			if (fd == s->kickfd) {
+				uint64_t count;
+				if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+					perror("fiber poller -> read()");
+				continue;
+			}
+
+			struct fiber_fd *e = &s->fds[fd];
+			if (e->in && (ev & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+				fds_wake(s, e->in, fd, ev);
+			if (e->out && (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+				fds_wake(s, e->out, fd, ev);
+			/* The report was for one of them, the other still waits */
+			if ((e->in || e->out) && fds_arm(s, fd) == -1)
+				perror("fiber poller -> epoll_ctl()");
+		}
+		pthread_mutex_unlock(&s->poll_lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Create a scheduler, and start its worker and poller threads.
+ *
+ * Once started, a scheduler lives as long as the process.
+ *
+ * @param[in] nworkers Number of threads running the fibers.
+ * @param[in] stack_size Stack of every fiber, @c 0 for @c FIBER_STACK_SIZE.
+ *
+ * @return A pointer to the scheduler in case of success, NULL otherwise.
+ */
+struct fiber_sched *fiber_sched_create(int nworkers, size_t stack_size)
+{
+	if (nworkers < 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct fiber_sched *s = calloc(1, sizeof(struct fiber_sched));
+	if (!s)
+		return NULL;
+
+	s->page 		= sysconf(_SC_PAGESIZE);
+	s->stack_size 	= stack_size ? stack_size : FIBER_STACK_SIZE;
+	s->stack_size 	= (s->stack_size + s->page - 1) / s->page * s->page;
+	s->nworkers 	= nworkers;
+	s->workers 		= calloc(nworkers, sizeof(struct fiber_worker));
+	s->epfd 		= epoll_create1(EPOLL_CLOEXEC);
+	s->kickfd 		= eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events 	= EPOLLIN;
+	ev.data.fd 	= s->kickfd;
+
+	if (!s->workers || s->epfd == -1 || s->kickfd == -1
+			|| epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->kickfd, &ev) == -1) {
+		if (s->epfd != -1)
+			close(s->epfd);
+		if (s->kickfd != -1)
+			close(s->kickfd);
+		free(s->workers);
+		free(s);
+		return NULL;
+	}
+
+	pthread_mutex_init(&s->idle_lock, NULL);
+	pthread_cond_init(&s->idle_cond, NULL);
+	pthread_mutex_init(&s->poll_lock, NULL);
+	pthread_mutex_init(&s->timer_lock, NULL);
+
+	for (int i = 0; i < nworkers; i++) {
+		s->workers[i].sched = s;
+		pthread_mutex_init(&s->workers[i].lock, NULL);
+	}
+	for (int i = 0; i < nworkers; i++) {
+		if (pthread_create(&s->workers[i].thread, NULL, worker_thread, &s->workers[i]))
+			return NULL;
+	}
+	if (pthread_create(&s->poller, NULL, poller_thread, s))
+		return NULL;
+
+	return s;
+}
+
+/**
+ * @brief Get the stack size of the fibers.
+ *
+ * @param[in] s The scheduler.
+ *
+ * @return The stack reserved for each fiber, in bytes, guard page not included.
+ */
+size_t fiber_sched_get_stack_size(struct fiber_sched *s)
+{
+	return s->stack_size;
+}
+
+/**
+ * @brief Print what the scheduler did so far.
+ *
+ * @param[in] s The scheduler.
+ * @param[in] f Where to print.
+ */
+void fiber_sched_print(struct fiber_sched *s, FILE *f)
+{
+	fprintf(f, "fibers: %zu alive, %llu spawned, %zu KiB stacks, %llu woken by I/O, %llu timed out\n",
+			atomic_load(&s->alive), atomic_load(&s->spawned), s->stack_size / 1024,
+			atomic_load(&s->io_wakes), atomic_load(&s->timeouts));
+
+	for (int i = 0; i < s->nworkers; i++) {
+		struct fiber_worker *w = &s->workers[i];
+		pthread_mutex_lock(&w->lock);
+		size_t len = w->len;
+		pthread_mutex_unlock(&w->lock);
+		fprintf(f, "  worker %d: %llu runs, %llu stolen, %zu queued\n", i,
+				atomic_load(&w->runs), atomic_load(&w->steals), len);
+	}
+}
+
+/**
+ * @brief Start a function in a new fiber.
+ *
+ * The stack is reserved at once, with a guard page below it; only the pages the
+ * fiber touches take memory. Spawned from a fiber, the new one starts on the same
+ * worker, otherwise the workers take turns.
+ *
+ * @param[in] s The scheduler.
+ * @param[in] fn What the fiber runs; what it returns is ignored.
+ * @param[in] arg The argument given to @p fn.
+ * @param[in] detached Whether the fiber is released when it returns, instead of by fiber_join().
+ *
+ * @return The fiber in case of success, NULL otherwise.
+ */
+struct fiber *fiber_spawn(struct fiber_sched *s, fiber_fn fn, void *arg, bool detached)
+{
+	struct fiber *f = calloc(1, sizeof(struct fiber));
+	if (!f)
+		return NULL;
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	f->stack = mmap(NULL, s->stack_size + s->page, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+	if (f->stack == MAP_FAILED || mprotect(f->stack, s->page, PROT_NONE) == -1
+			|| getcontext(&f->ctx) == -1) {
+		if (f->stack != MAP_FAILED)
+			munmap(f->stack, s->stack_size + s->page);
+		fiber_free(f);
+		return NULL;
+	}
+
+	f->ctx.uc_stack.ss_sp 	= (char *)f->stack + s->page;
+	f->ctx.uc_stack.ss_size = s->stack_size;
+	f->ctx.uc_link 			= NULL;
+	makecontext(&f->ctx, fiber_entry, 0);
+
+	struct fiber_worker *w = current_worker();
+	f->sched 	= s;
+	f->home 	= w && w->sched == s ? w : &s->workers[atomic_fetch_add(&s->spread, 1) % s->nworkers];
+	f->fn 		= fn;
+	f->arg 		= arg;
+	f->detached = detached;
+
+	atomic_fetch_add(&s->alive, 1);
+	atomic_fetch_add(&s->spawned, 1);
+	enqueue(f);
+
+	return f;
+}
+
+/**
+ * @brief Wait for a fiber to return, and release it.
+ *
+ * Works from fibers and from plain threads alike.
+ *
+ * @param[in] f A fiber that was not detached.
+ * @param[in] timeout_ms Most milliseconds to wait, @c -1 for no limit.
+ *
+ * @return @c 0 in case of success, @c -1 with @c errno set to @c ETIMEDOUT if the
+ * fiber is still running; it may then be joined again.
+ */
+int fiber_join(struct fiber *f, int timeout_ms)
+{
+	long long deadline = timeout_ms >= 0 ? now_ms() + timeout_ms : -1;
+	struct fiber *self = fiber_current();
+
+	pthread_mutex_lock(&f->lock);
+	while (!f->done) {
+		long long left = deadline >= 0 ? deadline - now_ms() : -1;
+		if (deadline >= 0 && left <= 0) {
+			f->joiner = NULL;
+			pthread_mutex_unlock(&f->lock);
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		if (self) {
+			f->joiner = self;
+			pthread_mutex_unlock(&f->lock);
+			fiber_park(left);
+			pthread_mutex_lock(&f->lock);
+		} else if (deadline < 0) {
+			pthread_cond_wait(&f->cond, &f->lock);
+		} else {
+			struct timespec ts = { .tv_sec = deadline / 1000, .tv_nsec = deadline % 1000 * 1000000 };
+			pthread_cond_timedwait(&f->cond, &f->lock, &ts);
+		}
+	}
+	f->joiner = NULL;
+	pthread_mutex_unlock(&f->lock);
+
+	fiber_free(f);
+
+	return 0;
+}
+
+/**
+ * @brief Get the calling fiber.
+ *
+ * @return The fiber, NULL if not called from a fiber.
+ */
+__attribute__((noinline)) struct fiber *fiber_current(void)
+{
+	return CURRENT_FIBER;
+}
+
+/**
+ * @brief Let the other fibers of the worker run, if the caller is a fiber.
+ */
+void fiber_yield(void)
+{
+	struct fiber *f = fiber_current();
+	if (f)
+		switch_out(f, FIBER_POST_YIELD);
+}
+
+/**
+ * @brief Suspend the calling fiber until fiber_wake().
+ *
+ * A wake that came since the last park is not lost, the park returns at once. A
+ * fiber may resume on another worker thread.
+ *
+ * @param[in] timeout_ms Most milliseconds to wait, @c -1 for no limit.
+ *
+ * @return @c 0 once woken, @c -1 with @c errno set to @c ETIMEDOUT if the time ran out.
+ * Like a condition variable, it may return early: the caller checks again what it waits for.
+ *
+ * @warning Must be called from a fiber.
+ */
+int fiber_park(int timeout_ms)
+{
+	struct fiber *f = fiber_current();
+	struct fiber_sched *s = f->sched;
+
+	pthread_mutex_lock(&f->lock);
+	if (f->permit) {
+		f->permit = false;
+		pthread_mutex_unlock(&f->lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	if (timeout_ms >= 0)
+		timer_add(s, f, now_ms() + timeout_ms);
+	switch_out(f, FIBER_POST_PARK);
+	if (timeout_ms >= 0)
+		timer_remove(s, f);
+
+	pthread_mutex_lock(&f->lock);
+	bool timed_out = f->timed_out;
+	f->timed_out = false;
+	pthread_mutex_unlock(&f->lock);
+
+	if (timed_out) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Make a parked fiber runnable, or its next park return at once.
+ *
+ * May be called from any thread.
+ *
+ * @param[in] f The fiber.
+ */
+void fiber_wake(struct fiber *f)
+{
+	pthread_mutex_lock(&f->lock);
+	if (f->parked) {
+		f->parked = false;
+		pthread_mutex_unlock(&f->lock);
+		enqueue(f);
+	} else {
+		f->permit = true;
+		pthread_mutex_unlock(&f->lock);
+	}
+}
+
+/**
+ * @brief Wait for descriptors to be ready, like @c poll().
+ *
+ * In a fiber, only the fiber waits: the poller wakes it once one of the
+ * descriptors is ready. Elsewhere it is plain @c poll().
+ *
+ * @param[in,out] pfd The descriptors, with the @c POLLIN and @c POLLOUT events to wait for.
+ * @param[in] n Number of descriptors.
+ * @param[in] timeout_ms Most milliseconds to wait, @c -1 for no limit.
+ *
+ * @return The number of descriptors ready, @c 0 if the time ran out, @c -1 on error.
+ */
+int fiber_poll(struct pollfd *pfd, nfds_t n, int timeout_ms)
+{
+	struct fiber *f = fiber_current();
+	if (!f)
+		return poll(pfd, n, timeout_ms);
+
+	struct fiber_sched *s = f->sched;
+	long long deadline = timeout_ms >= 0 ? now_ms() + timeout_ms : -1;
+	int ready = 0;
+
+	pthread_mutex_lock(&s->poll_lock);
+	for (nfds_t i = 0; i < n; i++) {
+		pfd[i].revents = 0;
+		if (pfd[i].fd < 0)
+			continue;
+		if (fds_reserve(s, pfd[i].fd) == -1) {
+			pthread_mutex_unlock(&s->poll_lock);
+			return -1;
+		}
+		struct fiber_fd *e = &s->fds[pfd[i].fd];
+		if (pfd[i].events & POLLIN)
+			e->in = f;
+		if (pfd[i].events & POLLOUT)
+			e->out = f;
+		if (fds_arm(s, pfd[i].fd) == -1) {
+			pfd[i].revents = POLLNVAL;
+			ready++;
+		}
+	}
+	f->wait 	= pfd;
+	f->nwait 	= n;
+	pthread_mutex_unlock(&s->poll_lock);
+
+	bool timed_out = false;
+	while (true) {
+		if (!ready && !timed_out) {
+			long long left = deadline >= 0 ? deadline - now_ms() : -1;
+			timed_out = fiber_park(deadline >= 0 && left < 0 ? 0 : left) == -1;
+		}
+
+		pthread_mutex_lock(&s->poll_lock);
+		ready = 0;
+		for (nfds_t i = 0; i < n; i++)
+			ready += pfd[i].revents != 0;
+		if (ready || timed_out) {
+			fds_forget(s, f);
+			pthread_mutex_unlock(&s->poll_lock);
+			break;
+		}
+		pthread_mutex_unlock(&s->poll_lock);
+	}
+
+	return ready;
+}
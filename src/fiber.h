@@ -0,0 +1,35 @@
+#ifndef FIBER_H
+#define FIBER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <poll.h>
+
+/** @brief Stack of a fiber, unless fiber_sched_create() is given another size. */
+#define FIBER_STACK_SIZE (64 * 1024)
+
+/** @brief Most file descriptor events the poller handles per wakeup. */
+#define FIBER_POLL_EVENTS 64
+
+/**
+ * @brief Function run by a fiber, the same as a thread start routine.
+ */
+typedef void *(*fiber_fn)(void *arg);
+
+struct fiber_sched;
+struct fiber;
+
+struct fiber_sched *fiber_sched_create(int nworkers, size_t stack_size);
+size_t fiber_sched_get_stack_size(struct fiber_sched *s);
+void fiber_sched_print(struct fiber_sched *s, FILE *f);
+struct fiber *fiber_spawn(struct fiber_sched *s, fiber_fn fn, void *arg, bool detached);
+int fiber_join(struct fiber *f, int timeout_ms);
+struct fiber *fiber_current(void);
+void fiber_yield(void);
+int fiber_park(int timeout_ms);
+void fiber_wake(struct fiber *f);
+int fiber_poll(struct pollfd *pfd, nfds_t n, int timeout_ms);
+
+#endif
@@ -0,0 +1,556 @@
+#include "filter.h"
+
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+/**
+ * @brief One subscriber filter: a message passes if it contains any of the keywords.
+ */
+struct filter {
+	size_t nwords; 								/**< Number of keywords */
+	char words[FILTER_WORDS][FILTER_WORD_LEN]; 	/**< The keywords, lowercase */
+	uint32_t hit; 								/**< Generation of the last message that passed */
+	struct filter *next; 						/**< Next removed filter, once it is removed */
+};
+
+/**
+ * @brief A keyword, and the filters that have it.
+ */
+struct filter_pattern {
+	const char *word; 	/**< The keyword, in one of the filters */
+	int *ids; 			/**< The filters */
+	size_t nids; 		/**< Number of filters */
+	uint32_t hit; 		/**< Generation of the last message containing it */
+};
+
+/**
+ * @brief The filters of every subscriber at some point, compiled together into one automaton.
+ *
+ * The keywords of all the filters make an Aho-Corasick automaton, turned into a
+ * full transition table, so matching a message is a single pass over it with one
+ * table lookup per byte, however many filters there are. Bytes are mapped to
+ * classes first, the bytes no keyword uses sharing one, which keeps the table
+ * narrow; uppercase ASCII letters share the class of their lowercase, so matching
+ * ignores their case.
+ */
+struct filter_automaton {
+	struct filter **filters; 			/**< The filters it was built from, by id, NULL if none */
+	size_t cap; 						/**< Number of ids */
+	struct filter *retired; 			/**< Filters removed before it was built, freed with it */
+	bool broken; 						/**< Whether the build failed, so everything passes */
+	struct filter_pattern *patterns; 	/**< The distinct keywords */
+	size_t npatterns; 					/**< Number of keywords */
+	uint8_t classes[256]; 				/**< Class of every byte */
+	size_t nclasses; 					/**< Number of classes */
+	int32_t *delta; 					/**< Next state, by state and class */
+	int32_t *out; 						/**< Keyword ending at every state, @c -1 if none */
+	int32_t *dict; 						/**< Closest state with a keyword on the suffix chain, @c 0 if none */
+	size_t nstates; 					/**< Number of states */
+};
+
+/**
+ * @brief The filters of every subscriber, and the automaton matching them.
+ *
+ * The automaton is rebuilt off the matching path: filter_set_prepare() takes the
+ * list of filters, filter_automaton_build() compiles it without the caller lock, and
+ * filter_set_swap() puts it in place. Until then, a filter added since the list was
+ * taken passes every message. Filters are never changed, only added and removed, and
+ * a removed filter is freed once no automaton refers to it.
+ *
+ * The results of the last match are kept as generation stamps, so nothing has to
+ * be cleared between messages.
+ *
+ * @warning The set does no locking, the caller must serialize the calls, but
+ * filter_automaton_build().
+ */
+struct filter_set {
+	struct filter **filters; 			/**< The filters, by id, NULL if none */
+	size_t cap; 						/**< Number of ids */
+	size_t count; 						/**< Number of filters */
+	bool dirty; 						/**< Whether the automaton is out of date */
+	struct filter *retired; 			/**< Filters removed since the last filter_set_prepare() */
+	struct filter_automaton *automaton; /**< The automaton, NULL until the first one is built */
+	uint32_t gen; 						/**< Generation of the last match */
+	uint64_t matches; 					/**< Messages matched */
+	uint64_t rebuilds; 					/**< Automatons put in place */
+};
+
+
+/**
+ * @brief Create an empty filter set.
+ *
+ * @return A pointer to the set in case of success, NULL otherwise.
+ * The set must be freed, using filter_set_destroy().
+ */
+struct filter_set *filter_set_create(void)
+{
+	return calloc(1, sizeof(struct filter_set));
+}
+
+/**
+ * @brief Free a list of removed filters.
+ */
+static void filter_free_retired(struct filter *f)
+{
+	while (f) {
+		struct filter *next = f->next;
+		free(f);
+		f = next;
+	}
+}
+
+/**
+ * @brief Destroys an automaton, and the filters removed before it was built.
+ *
+ * @param[in] a The automaton, returned by filter_set_prepare() or filter_set_swap().
+ */
+void filter_automaton_destroy(struct filter_automaton *a)
+{
+	if (a) {
+		for (size_t i = 0; i < a->npatterns; i++) {
+			free(a->patterns[i].ids);
+		}
+		free(a->patterns);
+		free(a->delta);
+		free(a->out);
+		free(a->dict);
+		free(a->filters);
+		filter_free_retired(a->retired);
+		free(a);
+	}
+}
+
+/**
+ * @brief Destroys a filter set.
+ *
+ * @param[in] fs The set.
+ */
+void filter_set_destroy(struct filter_set *fs)
+{
+	if (fs) {
+		filter_automaton_destroy(fs->automaton);
+		filter_free_retired(fs->retired);
+		for (size_t i = 0; i < fs->cap; i++) {
+			free(fs->filters[i]);
+		}
+		free(fs->filters);
+		free(fs);
+	}
+}
+
+/**
+ * @brief Add a filter.
+ *
+ * @param[in] fs The set.
+ * @param[in] expr The keywords, separated by blanks; case is ignored.
+ *
+ * @return The filter id in case of success, @c -1 otherwise, with @c errno set to
+ * @c EINVAL if @p expr has no keyword.
+ */
+int filter_set_add(struct filter_set *fs, const char *expr)
+{
+	struct filter *f = malloc(sizeof(struct filter));
+	if (!f)
+		return -1;
+	f->nwords 	= 0;
+	f->hit 		= 0;
+	f->next 	= NULL;
+
+	while (*expr && f->nwords < FILTER_WORDS) {
+		while (isspace((unsigned char)*expr))
+			expr++;
+
+		size_t len = 0;
+		for ( ; *expr && !isspace((unsigned char)*expr); expr++) {
+			if (len < FILTER_WORD_LEN - 1)
+				f->words[f->nwords][len++] = tolower((unsigned char)*expr);
+		}
+		if (len > 0)
+			f->words[f->nwords++][len] = '\0';
+	}
+
+	if (f->nwords == 0) {
+		free(f);
+		errno = EINVAL;
+		return -1;
+	}
+
+	size_t id;
+	for (id = 0; id < fs->cap && fs->filters[id]; id++) {
+		/* Empty body */
+	}
+	if (id == fs->cap) {
+		size_t cap = fs->cap ? 2 * fs->cap : 16;
+		struct filter **filters = realloc(fs->filters, cap * sizeof(struct filter *));
+		if (!filters) {
+			free(f);
+			return -1;
+		}
+		for (size_t i = fs->cap; i < cap; i++) {
+			filters[i] = NULL;
+		}
+		fs->filters = filters;
+		fs->cap 	= cap;
+	}
+
+	fs->filters[id] = f;
+	fs->count++;
+	fs->dirty = true;
+
+	return id;
+}
+
+/**
+ * @brief Remove a filter.
+ *
+ * The automaton may still refer to it, so it is kept until the next one is in place.
+ *
+ * @param[in] fs The set.
+ * @param[in] id The filter id, given by filter_set_add().
+ */
+void filter_set_remove(struct filter_set *fs, int id)
+{
+	if (id >= 0 && (size_t)id < fs->cap && fs->filters[id]) {
+		fs->filters[id]->next = fs->retired;
+		fs->retired 		  = fs->filters[id];
+		fs->filters[id] 	  = NULL;
+		fs->count--;
+		fs->dirty = true;
+	}
+}
+
+/**
+ * @brief Get the size of a filter, for memory accounting.
+ *
+ * @return The size of a filter, in bytes; the automaton is shared and not included.
+ */
+size_t filter_size(void)
+{
+	return sizeof(struct filter);
+}
+
+/**
+ * @brief Get the number of filters.
+ *
+ * @param[in] fs The set.
+ *
+ * @return The number of filters.
+ */
+size_t filter_set_count(struct filter_set *fs)
+{
+	return fs->count;
+}
+
+/**
+ * @brief Take the filters to build a new automaton from, if they changed since the last one.
+ *
+ * @param[in] fs The set.
+ *
+ * @return The automaton to give to filter_automaton_build() then filter_set_swap(),
+ * NULL if the current one is up to date, or if there is not enough memory; the
+ * next call tries again then.
+ */
+struct filter_automaton *filter_set_prepare(struct filter_set *fs)
+{
+	if (!fs->dirty)
+		return NULL;
+
+	struct filter_automaton *a = calloc(1, sizeof(struct filter_automaton));
+	if (!a)
+		return NULL;
+	a->filters = malloc((fs->cap ? fs->cap : 1) * sizeof(struct filter *));
+	if (!a->filters) {
+		free(a);
+		return NULL;
+	}
+	memcpy(a->filters, fs->filters, fs->cap * sizeof(struct filter *));
+	a->cap 		= fs->cap;
+	/* The current automaton may refer to them until this one replaces it */
+	a->retired 	= fs->retired;
+	fs->retired = NULL;
+	fs->dirty 	= false;
+
+	return a;
+}
+
+/**
+ * @brief A keyword of one filter, while building the automaton.
+ */
+struct filter_word {
+	const char *word; 	/**< The keyword */
+	int id; 			/**< The filter */
+};
+
+/**
+ * @brief Compare keywords, for qsort().
+ */
+static int filter_word_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct filter_word *)a)->word, ((const struct filter_word *)b)->word);
+}
+
+/**
+ * @brief Gather the distinct keywords, with the filters having each one.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+static int filter_automaton_gather(struct filter_automaton *a)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < a->cap; i++) {
+		if (a->filters[i])
+			n += a->filters[i]->nwords;
+	}
+
+	struct filter_word *all = malloc((n ? n : 1) * sizeof(struct filter_word));
+	a->patterns = calloc(n ? n : 1, sizeof(struct filter_pattern));
+	if (!all || !a->patterns) {
+		free(all);
+		return -1;
+	}
+
+	n = 0;
+	for (size_t i = 0; i < a->cap; i++) {
+		for (size_t w = 0; a->filters[i] && w < a->filters[i]->nwords; w++) {
+			all[n].word = a->filters[i]->words[w];
+			all[n].id 	= i;
+			n++;
+		}
+	}
+	qsort(all, n, sizeof(struct filter_word), filter_word_cmp);
+
+	for (size_t i = 0; i < n; ) {
+		size_t j = i;
+		while (j < n && strcmp(all[j].word, all[i].word) == 0)
+			j++;
+
+		struct filter_pattern *p = &a->patterns[a->npatterns++];
+		p->word = all[i].word;
+		p->ids 	= malloc((j - i) * sizeof(int));
+		if (!p->ids) {
+			free(all);
+			return -1;
+		}
+		for ( ; i < j; i++) {
+			/* A filter naming a keyword twice is listed once */
+			if (p->nids == 0 || p->ids[p->nids - 1] != all[i].id)
+				p->ids[p->nids++] = all[i].id;
+		}
+	}
+
+	free(all);
+
+	return 0;
+}
+
+/**
+ * @brief Compile the filters taken by filter_set_prepare().
+ *
+ * Needs no lock: nothing else uses the automaton until filter_set_swap(), and the
+ * filters it refers to are never changed. If there is not enough memory, the
+ * automaton lets every message pass.
+ *
+ * @param[in,out] a The automaton.
+ */
+void filter_automaton_build(struct filter_automaton *a)
+{
+	if (filter_automaton_gather(a) == -1) {
+		a->broken = true;
+		return;
+	}
+
+	/* Class 0 is every byte no keyword uses */
+	size_t chars = 0;
+	memset(a->classes, 0, sizeof(a->classes));
+	a->nclasses = 1;
+	for (size_t i = 0; i < a->npatterns; i++) {
+		for (const unsigned char *c = (const unsigned char *)a->patterns[i].word; *c; c++, chars++) {
+			if (!a->classes[*c]) {
+				a->classes[*c] = a->nclasses++;
+				if (*c >= 'a' && *c <= 'z')
+					a->classes[toupper(*c)] = a->classes[*c];
+			}
+		}
+	}
+
+	size_t max = chars + 1;
+	size_t nc = a->nclasses;
+	a->delta 	= malloc(max * nc * sizeof(int32_t));
+	a->out 		= malloc(max * sizeof(int32_t));
+	a->dict 	= calloc(max, sizeof(int32_t));
+	int32_t *fail = calloc(max, sizeof(int32_t));
+	int32_t *queue = malloc(max * sizeof(int32_t));
+	if (!a->delta || !a->out || !a->dict || !fail || !queue) {
+		free(fail);
+		free(queue);
+		a->broken = true;
+		return;
+	}
+
+	/* The trie, -1 being no edge yet */
+	memset(a->delta, 0xff, max * nc * sizeof(int32_t));
+	a->out[0] 	= -1;
+	a->nstates 	= 1;
+	for (size_t i = 0; i < a->npatterns; i++) {
+		int32_t s = 0;
+		for (const unsigned char *c = (const unsigned char *)a->patterns[i].word; *c; c++) {
+			int32_t *next = &a->delta[s * nc + a->classes[*c]];
+			if (*next == -1) {
+				*next = a->nstates;
+				a->out[a->nstates++] = -1;
+			}
+			s = *next;
+		}
+		a->out[s] = i;
+	}
+
+	/* Breadth first, every missing edge takes the one of the failure state */
+	size_t head = 0, tail = 0;
+	for (size_t c = 0; c < nc; c++) {
+		int32_t *next = &a->delta[c];
+		if (*next == -1) {
+			*next = 0;
+		} else {
+			fail[*next] = 0;
+			queue[tail++] = *next;
+		}
+	}
+	while (head < tail) {
+		int32_t s = queue[head++];
+		a->dict[s] = a->out[fail[s]] >= 0 ? fail[s] : a->dict[fail[s]];
+		for (size_t c = 0; c < nc; c++) {
+			int32_t *next = &a->delta[s * nc + c];
+			if (*next == -1) {
+				*next = a->delta[fail[s] * nc + c];
+			} else {
+				fail[*next] = a->delta[fail[s] * nc + c];
+				queue[tail++] = *next;
+			}
+		}
+	}
+
+	free(fail);
+	free(queue);
+}
+
+/**
+ * @brief Put a built automaton in place.
+ *
+ * @param[in] fs The set.
+ * @param[in] a The automaton, from filter_set_prepare() and filter_automaton_build().
+ *
+ * @return The automaton it replaces, to be freed using filter_automaton_destroy(),
+ * preferably without the caller lock.
+ */
+struct filter_automaton *filter_set_swap(struct filter_set *fs, struct filter_automaton *a)
+{
+	struct filter_automaton *old = fs->automaton;
+
+	/* The filters removed before a was built go with the automaton that may refer to them */
+	if (old) {
+		struct filter **last = &old->retired;
+		while (*last)
+			last = &(*last)->next;
+		*last = a->retired;
+	} else {
+		filter_free_retired(a->retired);
+	}
+	a->retired = NULL;
+
+	fs->automaton = a;
+	fs->rebuilds++;
+
+	return old;
+}
+
+/**
+ * @brief Mark a keyword, and the filters having it, as found in the current message.
+ */
+static void filter_set_mark(struct filter_set *fs, int32_t pattern)
+{
+	struct filter_automaton *a = fs->automaton;
+	struct filter_pattern *p = &a->patterns[pattern];
+	if (p->hit == fs->gen)
+		return;
+
+	p->hit = fs->gen;
+	for (size_t i = 0; i < p->nids; i++) {
+		a->filters[p->ids[i]]->hit = fs->gen;
+	}
+}
+
+/**
+ * @brief Find which filters a message passes; filter_set_hit() tells the results.
+ *
+ * @param[in] fs The set.
+ * @param[in] text The message.
+ * @param[in] len The message length.
+ */
+void filter_set_match(struct filter_set *fs, const char *text, size_t len)
+{
+	struct filter_automaton *a = fs->automaton;
+
+	if (++fs->gen == 0) {
+		/* Stamps from the previous round could look current */
+		for (size_t i = 0; a && i < a->cap; i++) {
+			if (a->filters[i])
+				a->filters[i]->hit = 0;
+		}
+		for (size_t i = 0; a && i < a->npatterns; i++) {
+			a->patterns[i].hit = 0;
+		}
+		fs->gen = 1;
+	}
+	fs->matches++;
+
+	if (!a || a->broken || a->nstates == 0)
+		return;
+
+	size_t nc = a->nclasses;
+	int32_t s = 0;
+	for (size_t i = 0; i < len; i++) {
+		s = a->delta[s * nc + a->classes[(unsigned char)text[i]]];
+		for (int32_t t = a->out[s] >= 0 ? s : a->dict[s]; t > 0; t = a->dict[t]) {
+			filter_set_mark(fs, a->out[t]);
+		}
+	}
+}
+
+/**
+ * @brief Checks if the message given to the last filter_set_match() passes a filter.
+ *
+ * @param[in] fs The set.
+ * @param[in] id The filter id.
+ *
+ * @return @c true if the message has one of the filter keywords, if the filter is
+ * not in the automaton yet, or if the automaton could not be built, @c false otherwise.
+ */
+bool filter_set_hit(struct filter_set *fs, int id)
+{
+	struct filter_automaton *a = fs->automaton;
+
+	if (!a || a->broken || (size_t)id >= a->cap || a->filters[id] != fs->filters[id])
+		return true;
+
+	return fs->filters[id]->hit == fs->gen;
+}
+
+/**
+ * @brief Print the set statistics.
+ *
+ * @param[in] fs The set.
+ * @param[in] f Where to print.
+ */
+void filter_set_print(struct filter_set *fs, FILE *f)
+{
+	struct filter_automaton *a = fs->automaton;
+	size_t npatterns 	= a ? a->npatterns : 0;
+	size_t nstates 		= a ? a->nstates : 0;
+	size_t nclasses 	= a ? a->nclasses : 0;
+
+	fprintf(f, "filters: %zu active, %zu keywords, %zu states x %zu classes (%zu bytes)%s%s, %llu rebuilds, %llu messages matched\n",
+			fs->count, npatterns, nstates, nclasses, nstates * nclasses * sizeof(int32_t),
+			a && a->broken ? ", out of memory" : "", fs->dirty ? ", rebuild pending" : "",
+			(unsigned long long)fs->rebuilds, (unsigned long long)fs->matches);
+}
@@ -0,0 +1,32 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/** @brief Most keywords in a filter expression; the rest are ignored. */
+#define FILTER_WORDS 16
+
+/** @brief Longest keyword; longer ones are truncated. */
+#define FILTER_WORD_LEN 64
+
+struct filter_set;
+struct filter_automaton;
+
+struct filter_set *filter_set_create(void);
+void filter_set_destroy(struct filter_set *fs);
+int filter_set_add(struct filter_set *fs, const char *expr);
+void filter_set_remove(struct filter_set *fs, int id);
+size_t filter_set_count(struct filter_set *fs);
+size_t filter_size(void);
+struct filter_automaton *filter_set_prepare(struct filter_set *fs);
+void filter_automaton_build(struct filter_automaton *a);
+struct filter_automaton *filter_set_swap(struct filter_set *fs, struct filter_automaton *a);
+void filter_automaton_destroy(struct filter_automaton *a);
+void filter_set_match(struct filter_set *fs, const char *text, size_t len);
+bool filter_set_hit(struct filter_set *fs, int id);
+void filter_set_print(struct filter_set *fs, FILE *f);
+
+#endif
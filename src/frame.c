@@ -0,0 +1,334 @@
+#define _GNU_SOURCE
+#include "frame.h"
+
+#include <endian.h>
+#include <time.h>
+
+/*
+ * Wire layout, all integers big endian:
+ *
+ *   0    4        5         6          8
+ *   | len | type | flags | reserved | [seq: u64] | [trace: 4 x u64] | payload
+ *
+ * @c len counts every byte after the fixed header, optional blocks included.
+ */
+
+/**
+ * @brief Get the offset of the trace block.
+ */
+static size_t trace_offset(uint8_t flags)
+{
+	return FRAME_HEADER_LEN + ((flags & FRAME_F_SEQ) ? FRAME_SEQ_LEN : 0);
+}
+
+/**
+ * @brief Read the monotonic clock used by the frame trace stamps.
+ *
+ * @return The @c CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t frame_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Get the number of bytes that come before the payload.
+ *
+ * @param[in] flags The frame flags.
+ *
+ * @return The header length, trace block included.
+ */
+size_t frame_header_len(uint8_t flags)
+{
+	if (flags & FRAME_F_TRACE)
+		return trace_offset(flags) + FRAME_TRACE_LEN;
+
+	return trace_offset(flags);
+}
+
+/**
+ * @brief Write a frame header.
+ *
+ * The payload is expected right after the bytes written here.
+ *
+ * @param[out] buf Where the header will be written; must hold frame_header_len() bytes.
+ * @param[in] type The frame type.
+ * @param[in] flags The frame flags.
+ * @param[in] payload_len The payload length.
+ * @param[in] seq The sequence number, only used if @p flags has @c FRAME_F_SEQ.
+ * @param[in] t The trace stamps, only used if @p flags has @c FRAME_F_TRACE.
+ *
+ * @return The number of bytes written.
+ */
+size_t frame_write_header(char *buf, uint8_t type, uint8_t flags, uint32_t payload_len, uint64_t seq,
+		const struct frame_trace *t)
+{
+	size_t hlen = frame_header_len(flags);
+	uint32_t len = htobe32(hlen - FRAME_HEADER_LEN + payload_len);
+
+	memcpy(buf, &len, sizeof(len));
+	buf[4] = type;
+	buf[5] = flags;
+	buf[6] = 0;
+	buf[7] = 0;
+
+	if (flags & FRAME_F_SEQ) {
+		uint64_t be = htobe64(seq);
+		memcpy(buf + FRAME_HEADER_LEN, &be, sizeof(be));
+	}
+
+	if (flags & FRAME_F_TRACE) {
+		uint64_t stamps[4] = {
+			htobe64(t->client_send),
+			htobe64(t->server_recv),
+			htobe64(t->server_enqueue),
+			htobe64(t->server_flush)
+		};
+		memcpy(buf + trace_offset(flags), stamps, sizeof(stamps));
+	}
+
+	return hlen;
+}
+
+/**
+ * @brief Overwrite the server_flush stamp of an already written traced frame.
+ *
+ * Lets the same frame be stamped again for every recipient of a broadcast.
+ *
+ * @param[in,out] frame The frame; it must have @c FRAME_F_TRACE set.
+ * @param[in] now The stamp.
+ */
+void frame_stamp_flush(char *frame, uint64_t now)
+{
+	uint64_t be = htobe64(now);
+	memcpy(frame + trace_offset(frame[5]) + 3 * sizeof(uint64_t), &be, sizeof(be));
+}
+
+/**
+ * @brief Parse the frame at the start of a buffer.
+ *
+ * @param[in] buf The received bytes.
+ * @param[in] len The number of bytes in @p buf.
+ * @param[out] f Where the parsed frame will be stored.
+ *
+ * @return The length of the whole frame if it is complete, @c 0 if more bytes are
+ * needed, @c -1 if the bytes cannot be a frame.
+ */
+ssize_t frame_parse(const char *buf, size_t len, struct frame *f)
+{
+	if (len < FRAME_HEADER_LEN)
+		return 0;
+
+	uint32_t body;
+	memcpy(&body, buf, sizeof(body));
+	body = be32toh(body);
+
+	f->type  = buf[4];
+	f->flags = buf[5];
+
+	size_t hlen = frame_header_len(f->flags);
+	if (body < hlen - FRAME_HEADER_LEN || body - (hlen - FRAME_HEADER_LEN) > FRAME_MAX_PAYLOAD)
+		return -1;
+
+	if (len < FRAME_HEADER_LEN + body)
+		return 0;
+
+	if (f->flags & FRAME_F_SEQ) {
+		memcpy(&f->seq, buf + FRAME_HEADER_LEN, sizeof(f->seq));
+		f->seq = be64toh(f->seq);
+	}
+
+	if (f->flags & FRAME_F_TRACE) {
+		uint64_t stamps[4];
+		memcpy(stamps, buf + trace_offset(f->flags), sizeof(stamps));
+		f->trace.client_send 	= be64toh(stamps[0]);
+		f->trace.server_recv 	= be64toh(stamps[1]);
+		f->trace.server_enqueue = be64toh(stamps[2]);
+		f->trace.server_flush 	= be64toh(stamps[3]);
+	}
+
+	f->payload 		= buf + hlen;
+	f->payload_len 	= FRAME_HEADER_LEN + body - hlen;
+
+	return FRAME_HEADER_LEN + body;
+}
+
+/**
+ * @brief Write the header of a file frame, transfer id included.
+ *
+ * @param[out] buf Where the header will be written; must hold @c FRAME_HEADER_LEN + @c FRAME_FILE_ID_LEN bytes.
+ * @param[in] type @c FRAME_FILE_BEGIN, @c FRAME_FILE_DATA or @c FRAME_FILE_END.
+ * @param[in] id The transfer id.
+ * @param[in] len The number of payload bytes that follow the transfer id.
+ *
+ * @return The number of bytes written.
+ */
+size_t frame_write_file_header(char *buf, uint8_t type, uint32_t id, uint32_t len)
+{
+	size_t hlen = frame_write_header(buf, type, 0, FRAME_FILE_ID_LEN + len, 0, NULL);
+	uint32_t be = htobe32(id);
+	memcpy(buf + hlen, &be, sizeof(be));
+
+	return hlen + FRAME_FILE_ID_LEN;
+}
+
+/**
+ * @brief Parse the payload of a file frame.
+ *
+ * @param[in] f The frame, of one of the @c FRAME_FILE_* types.
+ * @param[out] ff Where the parsed file frame will be stored.
+ *
+ * @return @c 0 in case of success, @c -1 if the payload is malformed.
+ */
+int frame_parse_file(const struct frame *f, struct frame_file *ff)
+{
+	if (f->payload_len < FRAME_FILE_ID_LEN)
+		return -1;
+
+	uint32_t id;
+	memcpy(&id, f->payload, sizeof(id));
+	ff->id 		= be32toh(id);
+	ff->size 	= 0;
+	ff->name 	= NULL;
+	ff->data 	= f->payload + FRAME_FILE_ID_LEN;
+	ff->len 	= f->payload_len - FRAME_FILE_ID_LEN;
+
+	if (f->type == FRAME_FILE_BEGIN) {
+		uint64_t size;
+		if (ff->len < sizeof(size) + 2 || ff->data[ff->len - 1] != '\0')
+			return -1;
+		memcpy(&size, ff->data, sizeof(size));
+		ff->size 	= be64toh(size);
+		ff->name 	= ff->data + sizeof(size);
+		ff->data 	= NULL;
+		ff->len 	= 0;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Write a whole @c FRAME_BUSY frame.
+ *
+ * @param[out] buf Where the frame will be written; must hold @c FRAME_HEADER_LEN + 4 bytes.
+ * @param[in] retry_after Seconds the client should wait before connecting again.
+ *
+ * @return The number of bytes written.
+ */
+size_t frame_write_busy(char *buf, uint32_t retry_after)
+{
+	size_t hlen = frame_write_header(buf, FRAME_BUSY, 0, sizeof(retry_after), 0, NULL);
+	uint32_t be = htobe32(retry_after);
+	memcpy(buf + hlen, &be, sizeof(be));
+
+	return hlen + sizeof(be);
+}
+
+/**
+ * @brief Parse the payload of a @c FRAME_BUSY frame.
+ *
+ * @param[in] f The frame.
+ * @param[out] retry_after Seconds the client should wait before connecting again.
+ *
+ * @return @c 0 in case of success, @c -1 if the payload is malformed.
+ */
+int frame_parse_busy(const struct frame *f, uint32_t *retry_after)
+{
+	uint32_t be;
+	if (f->payload_len != sizeof(be))
+		return -1;
+
+	memcpy(&be, f->payload, sizeof(be));
+	*retry_after = be32toh(be);
+
+	return 0;
+}
+
+/**
+ * @brief Write a whole @c FRAME_MCAST frame.
+ *
+ * @param[out] buf Where to write; must hold @c FRAME_HEADER_LEN + @c FRAME_SEQ_LEN + 6 bytes.
+ * @param[in] seq The last message sent before.
+ * @param[in] group The IPv4 address of the group, in network order; @c 0 to leave the group.
+ * @param[in] port The port of the group, in network order.
+ *
+ * @return The frame length.
+ */
+size_t frame_write_mcast(char *buf, uint64_t seq, uint32_t group, uint16_t port)
+{
+	uint32_t len = group ? sizeof(group) + sizeof(port) : 0;
+	size_t hlen = frame_write_header(buf, FRAME_MCAST, FRAME_F_SEQ, len, seq, NULL);
+	if (group) {
+		memcpy(buf + hlen, &group, sizeof(group));
+		memcpy(buf + hlen + sizeof(group), &port, sizeof(port));
+	}
+
+	return hlen + len;
+}
+
+/**
+ * @brief Parse the payload of a @c FRAME_MCAST frame.
+ *
+ * @param[in] f The frame.
+ * @param[out] group The IPv4 address of the group, in network order; @c 0 to leave the group.
+ * @param[out] port The port of the group, in network order.
+ *
+ * @return @c 0 in case of success, @c -1 if the payload is malformed.
+ */
+int frame_parse_mcast(const struct frame *f, uint32_t *group, uint16_t *port)
+{
+	*group 	= 0;
+	*port 	= 0;
+	if (f->payload_len == 0)
+		return 0;
+	if (f->payload_len != sizeof(*group) + sizeof(*port))
+		return -1;
+
+	memcpy(group, f->payload, sizeof(*group));
+	memcpy(port, f->payload + sizeof(*group), sizeof(*port));
+
+	return 0;
+}
+
+/**
+ * @brief Write a whole @c FRAME_REPLAY frame, asking for messages again.
+ *
+ * @param[out] buf Where to write; must hold @c FRAME_HEADER_LEN + 16 bytes.
+ * @param[in] first The first message to send again.
+ * @param[in] last The last message to send again.
+ *
+ * @return The frame length.
+ */
+size_t frame_write_replay(char *buf, uint64_t first, uint64_t last)
+{
+	size_t hlen = frame_write_header(buf, FRAME_REPLAY, 0, 2 * sizeof(uint64_t), 0, NULL);
+	uint64_t be[2] = { htobe64(first), htobe64(last) };
+	memcpy(buf + hlen, be, sizeof(be));
+
+	return hlen + sizeof(be);
+}
+
+/**
+ * @brief Parse the payload of a @c FRAME_REPLAY frame asking for messages again.
+ *
+ * @param[in] f The frame.
+ * @param[out] first The first message to send again.
+ * @param[out] last The last message to send again.
+ *
+ * @return @c 0 in case of success, @c -1 if the payload is malformed.
+ */
+int frame_parse_replay(const struct frame *f, uint64_t *first, uint64_t *last)
+{
+	uint64_t be[2];
+	if (f->payload_len != sizeof(be))
+		return -1;
+
+	memcpy(be, f->payload, sizeof(be));
+	*first 	= be64toh(be[0]);
+	*last 	= be64toh(be[1]);
+
+	return *first <= *last ? 0 : -1;
+}
@@ -0,0 +1,110 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+/** @brief Bytes of the fixed frame header. */
+#define FRAME_HEADER_LEN 8
+
+/** @brief Bytes of the optional sequence number that follows the header. */
+#define FRAME_SEQ_LEN 8
+
+/** @brief Bytes of the optional trace block that follows the header and the sequence number. */
+#define FRAME_TRACE_LEN 32
+
+/** @brief Largest payload a frame may carry. */
+#define FRAME_MAX_PAYLOAD 4096
+
+/** @brief Size of a buffer able to hold any single frame. */
+#define FRAME_MAX_LEN (FRAME_HEADER_LEN + FRAME_SEQ_LEN + FRAME_TRACE_LEN + FRAME_MAX_PAYLOAD)
+
+/** @brief Frame flag: a trace block follows the header. */
+#define FRAME_F_TRACE 0x01
+
+/** @brief Frame flag: a server-assigned sequence number follows the header. */
+#define FRAME_F_SEQ 0x02
+
+/**
+ * @brief What a frame carries.
+ */
+enum frame_type {
+	FRAME_CHAT = 1, 	/**< A chat message; from clients the @c NUL terminated content, to clients a packed struct message */
+	FRAME_SESSION, 		/**< Server to client, first frame of a session: the resume token and whether it was resumed ("0" or "1"), both @c NUL terminated */
+	FRAME_BYE, 			/**< Client to server: the client is leaving for good, do not keep its session; server to client: the server is shutting down, nothing comes after it */
+	FRAME_PRESENCE, 	/**< Server to client: joins and leaves, each a '+' or '-' followed by the @c NUL terminated username */
+	FRAME_MEMBERS, 		/**< Server to client: the member list as @c NUL terminated usernames; a long list is split over consecutive frames */
+	FRAME_FILE_BEGIN, 	/**< A file transfer starts: the transfer id, the file size (u64) and the @c NUL terminated file name */
+	FRAME_FILE_DATA, 	/**< The transfer id and the next bytes of the file */
+	FRAME_FILE_END, 	/**< The transfer id; every byte of the file was sent */
+	FRAME_BUSY, 		/**< Server to client, instead of the session: the server is overloaded and closes the connection; the seconds to wait before retrying (u32) */
+	FRAME_MCAST, 		/**< Server to client: the multicast group carrying the room (IPv4 address and port, network order), none to leave it; its sequence number is the last message sent before. Client to server, without payload: the group cannot be received, its sequence number is the last message got */
+	FRAME_REPLAY 		/**< Client to server: the first and last sequence numbers (u64) of messages to send again; server to client, without payload: the replay up to its sequence number is over */
+};
+
+/** @brief Bytes of the transfer id that starts the payload of every file frame. */
+#define FRAME_FILE_ID_LEN 4
+
+/** @brief Most file bytes carried by a single @c FRAME_FILE_DATA frame. */
+#define FRAME_FILE_CHUNK (FRAME_MAX_PAYLOAD - FRAME_FILE_ID_LEN)
+
+/**
+ * @brief Timestamps carried by traced frames.
+ *
+ * All of them are @c CLOCK_MONOTONIC nanoseconds, as returned by frame_now(), so
+ * differences between stamps taken on different hosts are meaningless. Stamps not
+ * taken yet are @c 0.
+ */
+struct frame_trace {
+	uint64_t client_send; 		/**< The sender handed the frame to the library */
+	uint64_t server_recv; 		/**< The server read the whole frame */
+	uint64_t server_enqueue; 	/**< The server started the fan-out (the client list lock is held) */
+	uint64_t server_flush; 		/**< The server handed this copy to the recipient transport */
+};
+
+/**
+ * @brief A frame parsed by frame_parse().
+ *
+ * @warning The payload points into the buffer given to frame_parse().
+ */
+struct frame {
+	uint8_t type; 				/**< One of enum frame_type */
+	uint8_t flags; 				/**< @c FRAME_F_* flags */
+	uint64_t seq; 				/**< Valid if @c FRAME_F_SEQ is set */
+	struct frame_trace trace; 	/**< Valid if @c FRAME_F_TRACE is set */
+	const char *payload; 		/**< The payload */
+	uint32_t payload_len; 		/**< The payload length */
+};
+
+/**
+ * @brief A file frame parsed by frame_parse_file().
+ *
+ * @warning The name and the data point into the frame payload.
+ */
+struct frame_file {
+	uint32_t id; 		/**< The transfer id */
+	uint64_t size; 		/**< The file size, @c FRAME_FILE_BEGIN only */
+	const char *name; 	/**< The file name, @c FRAME_FILE_BEGIN only */
+	const char *data; 	/**< The file bytes, @c FRAME_FILE_DATA only */
+	uint32_t len; 		/**< Number of file bytes, @c FRAME_FILE_DATA only */
+};
+
+uint64_t frame_now(void);
+size_t frame_header_len(uint8_t flags);
+size_t frame_write_header(char *buf, uint8_t type, uint8_t flags, uint32_t payload_len, uint64_t seq,
+		const struct frame_trace *t);
+void frame_stamp_flush(char *frame, uint64_t now);
+ssize_t frame_parse(const char *buf, size_t len, struct frame *f);
+size_t frame_write_file_header(char *buf, uint8_t type, uint32_t id, uint32_t len);
+int frame_parse_file(const struct frame *f, struct frame_file *ff);
+size_t frame_write_busy(char *buf, uint32_t retry_after);
+int frame_parse_busy(const struct frame *f, uint32_t *retry_after);
+size_t frame_write_mcast(char *buf, uint64_t seq, uint32_t group, uint16_t port);
+int frame_parse_mcast(const struct frame *f, uint32_t *group, uint16_t *port);
+size_t frame_write_replay(char *buf, uint64_t first, uint64_t last);
+int frame_parse_replay(const struct frame *f, uint64_t *first, uint64_t *last);
+
+#endif
@@ -0,0 +1,127 @@
+#include "hist.h"
+
+#include <string.h>
+#include <stdatomic.h>
+
+/**
+ * @brief A latency histogram with power of two buckets.
+ *
+ * Recording is a handful of relaxed atomic operations, so any number of
+ * threads can record without taking a lock.
+ */
+struct hist {
+	const char *name; 						/**< Name shown by hist_print() */
+	_Atomic uint64_t count; 				/**< Number of samples */
+	_Atomic uint64_t sum; 					/**< Sum of all samples, in nanoseconds */
+	_Atomic uint64_t max; 					/**< Largest sample, in nanoseconds */
+	_Atomic uint64_t buckets[HIST_BUCKETS]; /**< Samples per bucket */
+};
+
+/**
+ * @brief Create an empty histogram.
+ *
+ * @param[in] name The histogram name. It is not copied.
+ *
+ * @return A pointer to the histogram in case of success, NULL otherwise.
+ * The histogram must be freed, using hist_destroy().
+ */
+struct hist *hist_create(const char *name)
+{
+	struct hist *h = calloc(1, sizeof(struct hist));
+	if (h) {
+		h->name = name;
+	}
+
+	return h;
+}
+
+/**
+ * @brief Destroys a histogram.
+ *
+ * @param[in] h The histogram.
+ */
+void hist_destroy(struct hist *h)
+{
+	free(h);
+}
+
+/**
+ * @brief Record one sample.
+ *
+ * @param[in] h The histogram.
+ * @param[in] ns The sample, in nanoseconds.
+ */
+void hist_record(struct hist *h, uint64_t ns)
+{
+	int b = ns ? 63 - __builtin_clzll(ns) : 0;
+	if (b >= HIST_BUCKETS)
+		b = HIST_BUCKETS - 1;
+
+	atomic_fetch_add_explicit(&h->buckets[b], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->sum, ns, memory_order_relaxed);
+
+	uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+	while (ns > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, ns,
+				memory_order_relaxed, memory_order_relaxed)) {
+		/* Empty body */
+	}
+}
+
+/**
+ * @brief Get the number of samples recorded.
+ *
+ * @param[in] h The histogram.
+ *
+ * @return The number of samples.
+ */
+uint64_t hist_count(struct hist *h)
+{
+	return atomic_load_explicit(&h->count, memory_order_relaxed);
+}
+
+/**
+ * @brief Estimate a percentile.
+ *
+ * @param[in] h The histogram.
+ * @param[in] p The percentile, between @c 0 and @c 100.
+ *
+ * @return The upper bound of the bucket holding the percentile, in nanoseconds.
+ */
+uint64_t hist_percentile(struct hist *h, double p)
+{
+	uint64_t count = hist_count(h);
+	uint64_t rank = (uint64_t)(count * p / 100.0);
+	uint64_t seen = 0;
+
+	for (int b = 0; b < HIST_BUCKETS; b++) {
+		seen += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+		if (seen > rank)
+			return (uint64_t)2 << b;
+	}
+
+	return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+/**
+ * @brief Print a summary line followed by the non empty buckets.
+ *
+ * @param[in] h The histogram.
+ * @param[in] f Where to print.
+ */
+void hist_print(struct hist *h, FILE *f)
+{
+	uint64_t count 	= hist_count(h);
+	uint64_t sum 	= atomic_load_explicit(&h->sum, memory_order_relaxed);
+	uint64_t max 	= atomic_load_explicit(&h->max, memory_order_relaxed);
+
+	fprintf(f, "%-24s n=%-8llu mean=%9.1fus p50<%9.1fus p99<%9.1fus max=%9.1fus\n",
+			h->name, (unsigned long long)count, count ? sum / 1000.0 / count : 0.0,
+			hist_percentile(h, 50) / 1000.0, hist_percentile(h, 99) / 1000.0, max / 1000.0);
+
+	for (int b = 0; b < HIST_BUCKETS; b++) {
+		uint64_t n = atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+		if (n)
+			fprintf(f, "    < %12.1fus %llu\n", ((uint64_t)2 << b) / 1000.0, (unsigned long long)n);
+	}
+}
@@ -0,0 +1,20 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/** @brief Number of buckets; bucket @c i counts samples in [2^i, 2^(i+1)) nanoseconds. */
+#define HIST_BUCKETS 40
+
+struct hist;
+
+struct hist *hist_create(const char *name);
+void hist_destroy(struct hist *h);
+void hist_record(struct hist *h, uint64_t ns);
+uint64_t hist_count(struct hist *h);
+uint64_t hist_percentile(struct hist *h, double p);
+void hist_print(struct hist *h, FILE *f);
+
+#endif
@@ -0,0 +1,159 @@
+#include "history.h"
+
+/**
+ * @brief One message kept in the history.
+ */
+struct history_entry {
+	uint64_t seq; 	/**< Sequence number given to history_append() */
+	char *pack; 	/**< The packed message */
+	int len; 		/**< The packed message length */
+};
+
+/**
+ * @brief The most recent messages broadcast, with their sequence numbers.
+ *
+ * A ring of @c capacity entries: once full, every append drops the oldest message.
+ *
+ * @warning The history does no locking, the caller must serialize the calls.
+ */
+struct history {
+	struct history_entry *entries; 	/**< The ring */
+	size_t capacity; 				/**< Number of entries in the ring */
+	uint64_t next_seq; 				/**< Sequence number of the next message */
+};
+
+/**
+ * @brief Create an empty history.
+ *
+ * @param[in] capacity How many messages are kept.
+ *
+ * @return A pointer to the history in case of success, NULL otherwise.
+ * The history must be freed, using history_destroy().
+ */
+struct history *history_create(size_t capacity)
+{
+	struct history *h = malloc(sizeof(struct history));
+	if (h) {
+		h->entries = calloc(capacity, sizeof(struct history_entry));
+		if (!h->entries) {
+			free(h);
+			return NULL;
+		}
+		h->capacity = capacity;
+		h->next_seq = 1;
+	}
+
+	return h;
+}
+
+/**
+ * @brief Destroys a history.
+ *
+ * @param[in] h The history.
+ */
+void history_destroy(struct history *h)
+{
+	if (h) {
+		for (size_t i = 0; i < h->capacity; i++) {
+			free(h->entries[i].pack);
+		}
+		free(h->entries);
+		free(h);
+	}
+}
+
+/**
+ * @brief Append a message, with the sequence number it was given.
+ *
+ * The message is copied. If the copy fails the message still takes its sequence
+ * number, but it cannot be replayed.
+ *
+ * @param[in] h The history.
+ * @param[in] seq The sequence number, above that of every message appended before, starting at @c 1.
+ * @param[in] pack The packed message.
+ * @param[in] len The packed message length.
+ */
+void history_append(struct history *h, uint64_t seq, const char *pack, int len)
+{
+	struct history_entry *e = &h->entries[seq % h->capacity];
+	h->next_seq = seq + 1;
+
+	free(e->pack);
+	e->seq 	= seq;
+	e->len 	= len;
+	e->pack = malloc(len);
+	if (e->pack)
+		memcpy(e->pack, pack, len);
+}
+
+/**
+ * @brief Get the sequence number of the last message appended.
+ *
+ * @param[in] h The history.
+ *
+ * @return The sequence number, @c 0 if nothing was appended yet.
+ */
+uint64_t history_last_seq(struct history *h)
+{
+	return h->next_seq - 1;
+}
+
+/**
+ * @brief Get the sequence number of the oldest message still kept.
+ *
+ * @param[in] h The history.
+ *
+ * @return The sequence number.
+ */
+uint64_t history_first_seq(struct history *h)
+{
+	if (h->next_seq <= h->capacity)
+		return 1;
+
+	return h->next_seq - h->capacity;
+}
+
+/**
+ * @brief Call @p fn, in order, for every message kept that came after @p after, up to @p last.
+ *
+ * @param[in] h The history.
+ * @param[in] after The last sequence number already seen.
+ * @param[in] last The last sequence number wanted.
+ * @param[in] fn The function.
+ * @param[in] arg The argument given to @p fn.
+ *
+ * @return The number of messages replayed.
+ */
+size_t history_replay_range(struct history *h, uint64_t after, uint64_t last, history_fn fn, void *arg)
+{
+	size_t n = 0;
+	uint64_t seq = after + 1;
+
+	if (seq < history_first_seq(h))
+		seq = history_first_seq(h);
+
+	for ( ; seq < h->next_seq && seq <= last; seq++) {
+		struct history_entry *e = &h->entries[seq % h->capacity];
+		if (e->seq == seq && e->pack) {
+			fn(seq, e->pack, e->len, arg);
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/**
+ * @brief Call @p fn, in order, for every message kept that came after @p after.
+ *
+ * @param[in] h The history.
+ * @param[in] after The last sequence number already seen.
+ * @param[in] fn The function.
+ * @param[in] arg The argument given to @p fn.
+ *
+ * @return The number of messages replayed.
+ */
+size_t history_replay(struct history *h, uint64_t after, history_fn fn, void *arg)
+{
+	return history_replay_range(h, after, UINT64_MAX, fn, arg);
+}
@@ -0,0 +1,23 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+struct history;
+
+/**
+ * @brief Function called by history_replay() for every message replayed.
+ */
+typedef void (*history_fn)(uint64_t seq, const char *pack, int len, void *arg);
+
+struct history *history_create(size_t capacity);
+void history_destroy(struct history *h);
+void history_append(struct history *h, uint64_t seq, const char *pack, int len);
+uint64_t history_last_seq(struct history *h);
+uint64_t history_first_seq(struct history *h);
+size_t history_replay_range(struct history *h, uint64_t after, uint64_t last, history_fn fn, void *arg);
+size_t history_replay(struct history *h, uint64_t after, history_fn fn, void *arg);
+
+#endif
@@ -0,0 +1,365 @@
+#include "lockstat.h"
+
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "sllist.h"
+
+/**
+ * @brief Statistics of one call site of one lock.
+ */
+struct lockstat_site_stats {
+	const struct lockstat_site *site; 	/**< The call site, NULL if the slot is free */
+	uint64_t acquisitions; 				/**< Times the lock was taken here */
+	uint64_t contended; 				/**< Times the lock was already held when this site asked for it */
+	uint64_t wait_ns; 					/**< Time spent waiting for the lock */
+	uint64_t hold_ns; 					/**< Time the lock was held after being taken here */
+	uint64_t max_hold_ns; 				/**< Longest single hold */
+};
+
+/**
+ * @brief A mutex, or a readers-writer lock, that keeps contention statistics.
+ *
+ * All the statistics are only written while holding the lock exclusively, so
+ * recording them needs no atomic operation. An uncontended acquisition costs
+ * a @c pthread_mutex_trylock() and two monotonic clock reads (acquire and release).
+ *
+ * Readers of a readers-writer lock hold it together, so they only count
+ * their acquisitions and waits, atomically, and not per call site.
+ */
+struct lockstat {
+	pthread_mutex_t mutex; 								/**< The lock, unless @c rw */
+	pthread_rwlock_t rwlock; 							/**< The lock, if @c rw */
+	bool rw; 											/**< Whether it was created with lockstat_create_rw() */
+	const char *name; 									/**< Name shown in the statistics */
+	uint64_t acquisitions; 								/**< Times the lock was taken */
+	uint64_t contended; 								/**< Times a thread had to wait */
+	uint64_t wait_ns; 									/**< Total time spent waiting */
+	uint64_t max_wait_ns; 								/**< Longest single wait */
+	uint64_t hold_ns; 									/**< Total time the lock was held */
+	uint64_t max_hold_ns; 								/**< Longest single hold */
+	const struct lockstat_site *max_hold_site; 			/**< Where the longest hold started */
+	struct lockstat_site_stats sites[LOCKSTAT_SITES]; 	/**< Per call site statistics */
+	struct lockstat_site_stats *holder; 				/**< Statistics of the current holder's call site */
+	uint64_t held_since; 								/**< When the current holder got the lock */
+	_Atomic uint64_t reads; 							/**< Times the lock was taken for reading */
+	_Atomic uint64_t reads_contended; 					/**< Times a reader had to wait */
+	_Atomic uint64_t read_wait_ns; 						/**< Total time readers spent waiting */
+};
+
+/** @brief All the locks created, so they can be printed together. */
+static struct sllist *LOCKSTAT_LIST = SLL_INIT();
+
+/** @brief Protects @c LOCKSTAT_LIST. */
+static pthread_mutex_t LOCKSTAT_LIST_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Read the monotonic clock.
+ *
+ * @return The time in nanoseconds.
+ */
+static uint64_t lockstat_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Create a lock, register it so that lockstat_print_all() shows it.
+ */
+static struct lockstat *lockstat_new(const char *name, bool rw)
+{
+	struct lockstat *l = calloc(1, sizeof(struct lockstat));
+	if (!l)
+		return NULL;
+
+	if (rw ? pthread_rwlock_init(&l->rwlock, NULL) : pthread_mutex_init(&l->mutex, NULL)) {
+		free(l);
+		return NULL;
+	}
+	l->rw 	= rw;
+	l->name = name;
+
+	pthread_mutex_lock(&LOCKSTAT_LIST_MUTEX);
+	sll_insert_last(&LOCKSTAT_LIST, l);
+	pthread_mutex_unlock(&LOCKSTAT_LIST_MUTEX);
+
+	return l;
+}
+
+/**
+ * @brief Create a lock.
+ *
+ * The lock is registered so that lockstat_print_all() shows it.
+ *
+ * @param[in] name The lock name. It is not copied.
+ *
+ * @return A pointer to the lock in case of success, NULL otherwise.
+ * The lock must be freed, using lockstat_destroy().
+ */
+struct lockstat *lockstat_create(const char *name)
+{
+	return lockstat_new(name, false);
+}
+
+/**
+ * @brief Create a readers-writer lock.
+ *
+ * Writers take it with lockstat_lock() and lockstat_unlock(), readers with
+ * lockstat_rdlock() and lockstat_rdunlock().
+ *
+ * @param[in] name The lock name. It is not copied.
+ *
+ * @return A pointer to the lock in case of success, NULL otherwise.
+ * The lock must be freed, using lockstat_destroy().
+ */
+struct lockstat *lockstat_create_rw(const char *name)
+{
+	return lockstat_new(name, true);
+}
+
+/**
+ * @brief Destroys a lock.
+ *
+ * @param[in] l The lock.
+ */
+void lockstat_destroy(struct lockstat *l)
+{
+	if (l) {
+		pthread_mutex_lock(&LOCKSTAT_LIST_MUTEX);
+		sll_remove_elm(&LOCKSTAT_LIST, l);
+		pthread_mutex_unlock(&LOCKSTAT_LIST_MUTEX);
+
+		if (l->rw)
+			pthread_rwlock_destroy(&l->rwlock);
+		else
+			pthread_mutex_destroy(&l->mutex);
+		free(l);
+	}
+}
+
+/**
+ * @brief Find the statistics slot of a call site, taking a free one if needed.
+ *
+ * Sites beyond @c LOCKSTAT_SITES share the last slot.
+ */
+static struct lockstat_site_stats *site_stats(struct lockstat *l, const struct lockstat_site *site)
+{
+	int i;
+	for (i = 0; i < LOCKSTAT_SITES - 1; i++) {
+		if (l->sites[i].site == site)
+			return &l->sites[i];
+		if (!l->sites[i].site) {
+			l->sites[i].site = site;
+			return &l->sites[i];
+		}
+	}
+
+	if (!l->sites[i].site)
+		l->sites[i].site = site;
+	return &l->sites[i];
+}
+
+/**
+ * @brief Lock, recording the time spent waiting.
+ *
+ * Use the lockstat_lock() macro, which fills the call site in. A
+ * readers-writer lock is taken for writing.
+ *
+ * @param[in] l The lock.
+ * @param[in] site Where the lock is being taken.
+ */
+void lockstat_lock_at(struct lockstat *l, const struct lockstat_site *site)
+{
+	uint64_t wait = 0;
+	uint64_t now;
+
+	if ((l->rw ? pthread_rwlock_trywrlock(&l->rwlock) : pthread_mutex_trylock(&l->mutex)) == 0) {
+		now = lockstat_now();
+	} else {
+		uint64_t start = lockstat_now();
+		if (l->rw)
+			pthread_rwlock_wrlock(&l->rwlock);
+		else
+			pthread_mutex_lock(&l->mutex);
+		now  = lockstat_now();
+		wait = now - start;
+	}
+
+	struct lockstat_site_stats *ss = site_stats(l, site);
+	ss->acquisitions++;
+	l->acquisitions++;
+	if (wait) {
+		ss->contended++;
+		ss->wait_ns += wait;
+		l->contended++;
+		l->wait_ns += wait;
+		if (wait > l->max_wait_ns)
+			l->max_wait_ns = wait;
+	}
+
+	l->holder 		= ss;
+	l->held_since 	= now;
+}
+
+/**
+ * @brief Record how long the current holder held the lock, before it lets it go.
+ */
+static void record_hold(struct lockstat *l)
+{
+	uint64_t hold = lockstat_now() - l->held_since;
+	struct lockstat_site_stats *ss = l->holder;
+
+	ss->hold_ns += hold;
+	if (hold > ss->max_hold_ns)
+		ss->max_hold_ns = hold;
+
+	l->hold_ns += hold;
+	if (hold > l->max_hold_ns) {
+		l->max_hold_ns 		= hold;
+		l->max_hold_site 	= ss->site;
+	}
+}
+
+/**
+ * @brief Unlock, recording how long the lock was held.
+ *
+ * @param[in] l The lock.
+ */
+void lockstat_unlock(struct lockstat *l)
+{
+	record_hold(l);
+
+	if (l->rw)
+		pthread_rwlock_unlock(&l->rwlock);
+	else
+		pthread_mutex_unlock(&l->mutex);
+}
+
+/**
+ * @brief Take a readers-writer lock for reading, counting the time spent waiting.
+ *
+ * @param[in] l The lock, created with lockstat_create_rw().
+ */
+void lockstat_rdlock(struct lockstat *l)
+{
+	if (pthread_rwlock_tryrdlock(&l->rwlock) != 0) {
+		uint64_t start = lockstat_now();
+		pthread_rwlock_rdlock(&l->rwlock);
+		atomic_fetch_add_explicit(&l->reads_contended, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&l->read_wait_ns, lockstat_now() - start, memory_order_relaxed);
+	}
+	atomic_fetch_add_explicit(&l->reads, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Release a readers-writer lock taken with lockstat_rdlock().
+ *
+ * @param[in] l The lock.
+ */
+void lockstat_rdunlock(struct lockstat *l)
+{
+	pthread_rwlock_unlock(&l->rwlock);
+}
+
+/**
+ * @brief Wait on a condition variable, like @c pthread_cond_wait() on the lock.
+ *
+ * The lock is let go while waiting, so the hold so far is recorded first; once it
+ * is taken back, the hold goes on for the same call site. Others taking the lock
+ * meanwhile are counted as usual.
+ *
+ * @param[in] l The lock, created with lockstat_create() and held.
+ * @param[in] cond The condition variable.
+ */
+void lockstat_cond_wait(struct lockstat *l, pthread_cond_t *cond)
+{
+	struct lockstat_site_stats *ss = l->holder;
+
+	record_hold(l);
+	pthread_cond_wait(cond, &l->mutex);
+
+	l->holder 		= ss;
+	l->held_since 	= lockstat_now();
+}
+
+/**
+ * @brief Get the underlying mutex.
+ *
+ * @warning Waiting on a condition variable with it leaves the statistics of the
+ * lock to whoever took it meanwhile; use lockstat_cond_wait() instead.
+ *
+ * @param[in] l The lock, created with lockstat_create().
+ *
+ * @return The mutex.
+ */
+pthread_mutex_t *lockstat_get_mutex(struct lockstat *l)
+{
+	return &l->mutex;
+}
+
+/**
+ * @brief Print the statistics of a lock.
+ *
+ * The lock is taken, without being counted, to get a consistent snapshot.
+ *
+ * @param[in] l The lock.
+ * @param[in] f Where to print.
+ */
+void lockstat_print(struct lockstat *l, FILE *f)
+{
+	if (l->rw)
+		pthread_rwlock_rdlock(&l->rwlock);
+	else
+		pthread_mutex_lock(&l->mutex);
+
+	fprintf(f, "lock %-16s acquired=%llu contended=%llu (%.1f%%) wait=%.1fus (max %.1fus) hold=%.1fus (max %.1fus",
+			l->name, (unsigned long long)l->acquisitions, (unsigned long long)l->contended,
+			l->acquisitions ? 100.0 * l->contended / l->acquisitions : 0.0,
+			l->wait_ns / 1000.0, l->max_wait_ns / 1000.0, l->hold_ns / 1000.0, l->max_hold_ns / 1000.0);
+	if (l->max_hold_site)
+		fprintf(f, " in %s at %s:%d", l->max_hold_site->func, l->max_hold_site->file, l->max_hold_site->line);
+	fprintf(f, ")\n");
+
+	if (l->rw) {
+		uint64_t reads = atomic_load_explicit(&l->reads, memory_order_relaxed);
+		uint64_t contended = atomic_load_explicit(&l->reads_contended, memory_order_relaxed);
+		fprintf(f, "    %-28s read=%-8llu contended=%-8llu (%.1f%%) wait=%.1fus\n", "(readers)",
+				(unsigned long long)reads, (unsigned long long)contended, reads ? 100.0 * contended / reads : 0.0,
+				atomic_load_explicit(&l->read_wait_ns, memory_order_relaxed) / 1000.0);
+	}
+
+	for (int i = 0; i < LOCKSTAT_SITES && l->sites[i].site; i++) {
+		struct lockstat_site_stats *ss = &l->sites[i];
+		fprintf(f, "    %-28s %s:%-5d acquired=%-8llu contended=%-8llu wait=%.1fus hold=%.1fus (max %.1fus)\n",
+				ss->site->func, ss->site->file, ss->site->line,
+				(unsigned long long)ss->acquisitions, (unsigned long long)ss->contended,
+				ss->wait_ns / 1000.0, ss->hold_ns / 1000.0, ss->max_hold_ns / 1000.0);
+	}
+
+	if (l->rw)
+		pthread_rwlock_unlock(&l->rwlock);
+	else
+		pthread_mutex_unlock(&l->mutex);
+}
+
+/**
+ * @brief Print the statistics of every lock.
+ *
+ * @param[in] f Where to print.
+ *
+ * @see lockstat_print
+ */
+void lockstat_print_all(FILE *f)
+{
+	pthread_mutex_lock(&LOCKSTAT_LIST_MUTEX);
+
+	for (struct sllist *p = LOCKSTAT_LIST; p; p = sll_get_next(&p)) {
+		lockstat_print((struct lockstat *)sll_get_key(p), f);
+	}
+
+	pthread_mutex_unlock(&LOCKSTAT_LIST_MUTEX);
+}
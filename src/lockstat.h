@@ -0,0 +1,51 @@
+#ifndef LOCKSTAT_H
+#define LOCKSTAT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <pthread.h>
+
+/** @brief Number of distinct call sites whose statistics are kept per lock. */
+#define LOCKSTAT_SITES 16
+
+/**
+ * @brief A place in the code that takes a lock.
+ *
+ * One is created statically by every use of lockstat_lock().
+ */
+struct lockstat_site {
+	const char *file; 	/**< Source file */
+	int line; 			/**< Source line */
+	const char *func; 	/**< Function */
+};
+
+struct lockstat;
+
+/**
+ * @brief Lock @p l, recording the call site.
+ *
+ * @param[in] l The lock.
+ *
+ * @see lockstat_lock_at
+ */
+#define lockstat_lock(l) do { \
+	static const struct lockstat_site lockstat_site_ = { __FILE__, __LINE__, __func__ }; \
+	lockstat_lock_at((l), &lockstat_site_); \
+} while (0)
+
+struct lockstat *lockstat_create(const char *name);
+struct lockstat *lockstat_create_rw(const char *name);
+void lockstat_destroy(struct lockstat *l);
+void lockstat_lock_at(struct lockstat *l, const struct lockstat_site *site);
+void lockstat_unlock(struct lockstat *l);
+void lockstat_rdlock(struct lockstat *l);
+void lockstat_rdunlock(struct lockstat *l);
+void lockstat_cond_wait(struct lockstat *l, pthread_cond_t *cond);
+pthread_mutex_t *lockstat_get_mutex(struct lockstat *l);
+void lockstat_print(struct lockstat *l, FILE *f);
+void lockstat_print_all(FILE *f);
+
+#endif
@@ -0,0 +1,507 @@
+#include "mailbox.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "lockstat.h"
+
+/** @brief Magic number at the start of every mailbox file. */
+#define MAILBOX_MAGIC 0x424d5a5a
+
+/** @brief Bytes of the mailbox file header: magic, version and delivery cursor. */
+#define MAILBOX_HEADER_LEN 16
+
+/** @brief Bytes of the header of every record: length, reserved and time. */
+#define MAILBOX_RECORD_LEN 16
+
+/**
+ * @brief The header at the start of every mailbox file.
+ *
+ * Everything before @c cursor was already delivered. It is the only part of the file
+ * ever written in place; records are only appended.
+ */
+struct mailbox_header {
+	uint32_t magic; 	/**< @c MAILBOX_MAGIC */
+	uint32_t version; 	/**< Layout version, @c 1 */
+	uint64_t cursor; 	/**< Offset of the first record not delivered yet */
+};
+
+/**
+ * @brief The header of every message in a mailbox file; the packed message follows.
+ */
+struct mailbox_record {
+	uint32_t len; 		/**< Length of the packed message */
+	uint32_t reserved; 	/**< Zero */
+	uint64_t when; 		/**< When the message was spooled, seconds since the epoch */
+};
+
+/**
+ * @brief What is known about one mailbox, so busy ones skip the file system.
+ */
+struct mailbox_cache_entry {
+	char *name; 		/**< The username, NULL if the slot is free */
+	int fd; 			/**< The open mailbox file, @c -1 if the user has no mailbox */
+	uint64_t cursor; 	/**< Copy of the header cursor */
+	uint64_t size; 		/**< Size of the file */
+	uint64_t used; 		/**< When the entry was last used, in store ticks */
+};
+
+/**
+ * @brief A directory of per-user mailboxes.
+ *
+ * Each user has one file, named after the hexadecimal encoding of the username.
+ * Messages are appended to it and delivered from the header cursor on; once all of
+ * them are delivered the file is truncated back to its header. The state of the
+ * @c MAILBOX_CACHE_LEN most recently used mailboxes, including users known to have
+ * none or to have nothing waiting, is kept in memory along with their descriptor.
+ *
+ * The modification time of a file is when its user last logged in or got mail: a
+ * mailbox untouched for @c MAILBOX_EXPIRY holds nothing worth delivering, and goes.
+ */
+struct mailbox_store {
+	char *dir; 												/**< The directory */
+	struct lockstat *mutex;									/**< Protects everything below */
+	struct mailbox_cache_entry cache[MAILBOX_CACHE_LEN]; 	/**< The hot mailboxes */
+	uint64_t tick; 											/**< Incremented on every lookup */
+	time_t swept; 											/**< When mailbox_expire() last looked at the directory */
+};
+
+/**
+ * @brief Create a mailbox store.
+ *
+ * @param[in] dir The directory, created if needed.
+ *
+ * @return A pointer to the store in case of success, NULL otherwise.
+ * The store must be freed, using mailbox_store_destroy().
+ */
+struct mailbox_store *mailbox_store_create(const char *dir)
+{
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+		return NULL;
+
+	struct mailbox_store *ms = calloc(1, sizeof(struct mailbox_store));
+	if (ms) {
+		ms->dir = malloc(strlen(dir) + 1);
+		ms->mutex = lockstat_create("mailboxes");
+		if (!ms->dir || !ms->mutex) {
+			free(ms->dir);
+			lockstat_destroy(ms->mutex);
+			free(ms);
+			return NULL;
+		}
+		strcpy(ms->dir, dir);
+		for (int i = 0; i < MAILBOX_CACHE_LEN; i++) {
+			ms->cache[i].fd = -1;
+		}
+	}
+
+	return ms;
+}
+
+/**
+ * @brief Forget a cached mailbox.
+ */
+static void cache_evict(struct mailbox_cache_entry *e)
+{
+	if (e->fd != -1)
+		close(e->fd);
+	free(e->name);
+	e->name = NULL;
+	e->fd 	= -1;
+}
+
+/**
+ * @brief Destroys a mailbox store. The mailboxes stay on disk.
+ *
+ * @param[in] ms The store.
+ */
+void mailbox_store_destroy(struct mailbox_store *ms)
+{
+	if (ms) {
+		for (int i = 0; i < MAILBOX_CACHE_LEN; i++) {
+			cache_evict(&ms->cache[i]);
+		}
+		lockstat_destroy(ms->mutex);
+		free(ms->dir);
+		free(ms);
+	}
+}
+
+/**
+ * @brief Build the path of a user mailbox.
+ *
+ * The username is hex encoded, so it cannot escape the directory.
+ *
+ * @return @c 0 in case of success, @c -1 if the path does not fit.
+ */
+static int mailbox_path(struct mailbox_store *ms, const char *name, char *path, size_t len)
+{
+	int n = snprintf(path, len, "%s/", ms->dir);
+	if (n < 0 || (size_t)n + 2 * strlen(name) + sizeof(".mbox") > len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+		n += sprintf(path + n, "%02x", *p);
+	}
+	strcpy(path + n, ".mbox");
+
+	return 0;
+}
+
+/**
+ * @brief Open a mailbox file and load its state into a cache entry.
+ *
+ * A missing file leaves the entry with no descriptor, unless @p create is set.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+static int cache_load(struct mailbox_store *ms, struct mailbox_cache_entry *e, const char *name, bool create)
+{
+	char path[4096];
+	if (mailbox_path(ms, name, path, sizeof(path)) == -1)
+		return -1;
+
+	e->fd 		= open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+	e->cursor 	= MAILBOX_HEADER_LEN;
+	e->size 	= MAILBOX_HEADER_LEN;
+	if (e->fd == -1)
+		return errno == ENOENT ? 0 : -1;
+
+	struct mailbox_header h;
+	ssize_t n = pread(e->fd, &h, sizeof(h), 0);
+	if (n == 0) {
+		/* A new mailbox */
+		h.magic 	= MAILBOX_MAGIC;
+		h.version 	= 1;
+		h.cursor 	= MAILBOX_HEADER_LEN;
+		if (pwrite(e->fd, &h, sizeof(h), 0) != sizeof(h))
+			goto fail;
+	} else if (n != sizeof(h) || h.magic != MAILBOX_MAGIC) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	struct stat st;
+	if (fstat(e->fd, &st) == -1)
+		goto fail;
+
+	e->cursor 	= h.cursor;
+	e->size 	= st.st_size;
+	/* Truncated after a delivery, but the cursor was not moved back */
+	if (e->cursor > e->size)
+		e->cursor = MAILBOX_HEADER_LEN;
+
+	return 0;
+
+fail:
+	close(e->fd);
+	e->fd = -1;
+	return -1;
+}
+
+/**
+ * @brief Find the cache entry of a mailbox, loading it in place of the least recently used one.
+ *
+ * @warning The store mutex must be held.
+ *
+ * @return The entry, NULL in case of error.
+ */
+static struct mailbox_cache_entry *cache_get(struct mailbox_store *ms, const char *name, bool create)
+{
+	struct mailbox_cache_entry *victim = &ms->cache[0];
+
+	ms->tick++;
+	for (int i = 0; i < MAILBOX_CACHE_LEN; i++) {
+		struct mailbox_cache_entry *e = &ms->cache[i];
+		if (e->name && strcmp(e->name, name) == 0) {
+			e->used = ms->tick;
+			if (e->fd == -1 && create && cache_load(ms, e, name, true) == -1)
+				return NULL;
+			return e;
+		}
+		if (!e->name || (victim->name && e->used < victim->used))
+			victim = e;
+	}
+
+	cache_evict(victim);
+	victim->name = malloc(strlen(name) + 1);
+	if (!victim->name)
+		return NULL;
+	strcpy(victim->name, name);
+
+	if (cache_load(ms, victim, name, create) == -1) {
+		cache_evict(victim);
+		return NULL;
+	}
+	victim->used = ms->tick;
+
+	return victim;
+}
+
+/**
+ * @brief Make sure a user has a mailbox, so messages can be spooled for them.
+ *
+ * Called when the user logs in. Only users who did so can get mail.
+ *
+ * @param[in] ms The store.
+ * @param[in] name The username.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+int mailbox_open(struct mailbox_store *ms, const char *name)
+{
+	lockstat_lock(ms->mutex);
+	struct mailbox_cache_entry *e = cache_get(ms, name, true);
+	/* The user is still around, see mailbox_expire() */
+	if (e && e->fd != -1 && futimens(e->fd, NULL) == -1)
+		perror("mailbox_open -> futimens()");
+	lockstat_unlock(ms->mutex);
+
+	return e ? 0 : -1;
+}
+
+/**
+ * @brief Drop the messages of a mailbox older than @c MAILBOX_EXPIRY, so they no longer count against the quota.
+ *
+ * Messages are appended in time order, so the expired ones come first. A mailbox
+ * left with nothing waiting is truncated back to its header; otherwise the messages
+ * left are copied to a new file, which then replaces the mailbox.
+ *
+ * @warning The store mutex must be held.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+static int cache_compact(struct mailbox_store *ms, struct mailbox_cache_entry *e)
+{
+	size_t len = e->size - e->cursor;
+	char *buf = malloc(len);
+	if (!buf || pread(e->fd, buf, len, e->cursor) != (ssize_t)len) {
+		free(buf);
+		return -1;
+	}
+
+	time_t oldest = time(NULL) - MAILBOX_EXPIRY;
+	size_t off = 0;
+	while (off + MAILBOX_RECORD_LEN <= len) {
+		struct mailbox_record r;
+		memcpy(&r, buf + off, MAILBOX_RECORD_LEN);
+		if (r.len > len - off - MAILBOX_RECORD_LEN || (time_t)r.when >= oldest)
+			break;
+		off += MAILBOX_RECORD_LEN + r.len;
+	}
+
+	int rv = 0;
+	if (off == len) {
+		/* Like after a delivery, a cursor past the end is moved back when loaded */
+		uint64_t cursor = MAILBOX_HEADER_LEN;
+		if (ftruncate(e->fd, MAILBOX_HEADER_LEN) == -1
+				|| pwrite(e->fd, &cursor, sizeof(cursor), offsetof(struct mailbox_header, cursor)) != sizeof(cursor)) {
+			rv = -1;
+		} else {
+			e->cursor 	= MAILBOX_HEADER_LEN;
+			e->size 	= MAILBOX_HEADER_LEN;
+		}
+	} else if (off > 0) {
+		char path[4096];
+		char tmp[4096 + sizeof(".tmp")];
+		int fd = -1;
+		struct mailbox_header h = { MAILBOX_MAGIC, 1, MAILBOX_HEADER_LEN };
+		struct iovec iov[2] = {
+			{ .iov_base = &h, 			.iov_len = MAILBOX_HEADER_LEN },
+			{ .iov_base = buf + off, 	.iov_len = len - off }
+		};
+
+		if (mailbox_path(ms, e->name, path, sizeof(path)) == -1)
+			rv = -1;
+		else
+			snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+		if (rv == 0 && (fd = open(tmp, O_RDWR | O_CLOEXEC | O_CREAT | O_TRUNC, 0600)) == -1)
+			rv = -1;
+		if (rv == 0 && (pwritev(fd, iov, 2, 0) != (ssize_t)(MAILBOX_HEADER_LEN + len - off)
+					|| rename(tmp, path) == -1)) {
+			close(fd);
+			unlink(tmp);
+			rv = -1;
+		}
+		if (rv == 0) {
+			close(e->fd);
+			e->fd 		= fd;
+			e->cursor 	= MAILBOX_HEADER_LEN;
+			e->size 	= MAILBOX_HEADER_LEN + len - off;
+		}
+	}
+
+	free(buf);
+	return rv;
+}
+
+/**
+ * @brief Spool a message for a user.
+ *
+ * @param[in] ms The store.
+ * @param[in] name The username.
+ * @param[in] pack The packed message.
+ * @param[in] len The packed message length.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise, with @c errno set to @c ENOENT
+ * if the user has no mailbox or @c EDQUOT if the mailbox is full, expired messages aside.
+ */
+int mailbox_append(struct mailbox_store *ms, const char *name, const char *pack, uint32_t len)
+{
+	int rv = -1;
+
+	lockstat_lock(ms->mutex);
+
+	struct mailbox_cache_entry *e = cache_get(ms, name, false);
+	if (!e)
+		goto out;
+	if (e->fd == -1) {
+		errno = ENOENT;
+		goto out;
+	}
+	/* Expired messages are never delivered, the quota is for the others */
+	if (e->size - e->cursor + MAILBOX_RECORD_LEN + len > MAILBOX_QUOTA && cache_compact(ms, e) == -1)
+		goto out;
+	if (e->size - e->cursor + MAILBOX_RECORD_LEN + len > MAILBOX_QUOTA) {
+		errno = EDQUOT;
+		goto out;
+	}
+
+	struct mailbox_record r = { len, 0, (uint64_t)time(NULL) };
+	struct iovec iov[2] = {
+		{ .iov_base = &r, 			.iov_len = MAILBOX_RECORD_LEN },
+		{ .iov_base = (void *)pack, .iov_len = len }
+	};
+
+	if (pwritev(e->fd, iov, 2, e->size) != (ssize_t)(MAILBOX_RECORD_LEN + len))
+		goto out;
+	e->size += MAILBOX_RECORD_LEN + len;
+	rv = 0;
+
+out:
+	lockstat_unlock(ms->mutex);
+	return rv;
+}
+
+/**
+ * @brief Deliver, in order, every message waiting in a user mailbox and empty it.
+ *
+ * Messages older than @c MAILBOX_EXPIRY are dropped. A user with nothing waiting
+ * whose mailbox is cached costs no system call.
+ *
+ * @param[in] ms The store.
+ * @param[in] name The username.
+ * @param[in] fn Called for every message delivered.
+ * @param[in] arg The argument given to @p fn.
+ *
+ * @return The number of messages delivered, @c -1 in case of error.
+ */
+ssize_t mailbox_fetch(struct mailbox_store *ms, const char *name, mailbox_fn fn, void *arg)
+{
+	ssize_t n = -1;
+	char *buf = NULL;
+
+	lockstat_lock(ms->mutex);
+
+	struct mailbox_cache_entry *e = cache_get(ms, name, false);
+	if (!e)
+		goto out;
+	n = 0;
+	if (e->fd == -1 || e->cursor >= e->size)
+		goto out;
+
+	size_t len = e->size - e->cursor;
+	buf = malloc(len);
+	if (!buf || pread(e->fd, buf, len, e->cursor) != (ssize_t)len) {
+		n = -1;
+		goto out;
+	}
+
+	time_t oldest = time(NULL) - MAILBOX_EXPIRY;
+	for (size_t off = 0; off + MAILBOX_RECORD_LEN <= len; ) {
+		struct mailbox_record r;
+		memcpy(&r, buf + off, MAILBOX_RECORD_LEN);
+		if (r.len > len - off - MAILBOX_RECORD_LEN)
+			break;
+		if ((time_t)r.when >= oldest) {
+			fn(buf + off + MAILBOX_RECORD_LEN, r.len, r.when, arg);
+			n++;
+		}
+		off += MAILBOX_RECORD_LEN + r.len;
+	}
+
+	/* Move the cursor first, so a crash before the truncation does not deliver twice */
+	uint64_t cursor = e->size;
+	if (pwrite(e->fd, &cursor, sizeof(cursor), offsetof(struct mailbox_header, cursor)) != sizeof(cursor)) {
+		perror("mailbox_fetch -> pwrite()");
+		goto out;
+	}
+	e->cursor = cursor;
+
+	cursor = MAILBOX_HEADER_LEN;
+	if (ftruncate(e->fd, MAILBOX_HEADER_LEN) == 0
+			&& pwrite(e->fd, &cursor, sizeof(cursor), offsetof(struct mailbox_header, cursor)) == sizeof(cursor)) {
+		e->cursor 	= MAILBOX_HEADER_LEN;
+		e->size 	= MAILBOX_HEADER_LEN;
+	}
+
+out:
+	lockstat_unlock(ms->mutex);
+	free(buf);
+	return n;
+}
+
+/**
+ * @brief Remove the mailboxes of the users gone for @c MAILBOX_EXPIRY, at most every @c MAILBOX_SWEEP_S.
+ *
+ * Whatever such a mailbox holds is expired, and its user is no longer known: messages
+ * for them are refused until they log in again.
+ *
+ * @param[in] ms The store.
+ * @param[in] now The current time.
+ */
+void mailbox_expire(struct mailbox_store *ms, time_t now)
+{
+	lockstat_lock(ms->mutex);
+
+	DIR *dir = now - ms->swept >= MAILBOX_SWEEP_S ? opendir(ms->dir) : NULL;
+	if (dir) {
+		ms->swept = now;
+
+		struct dirent *de;
+		while ((de = readdir(dir))) {
+			char path[4096];
+			struct stat st;
+			size_t len = strlen(de->d_name);
+			if (len < sizeof(".mbox") || strcmp(de->d_name + len - strlen(".mbox"), ".mbox") != 0
+					|| snprintf(path, sizeof(path), "%s/%s", ms->dir, de->d_name) >= (int)sizeof(path)
+					|| stat(path, &st) == -1 || st.st_mtime > now - MAILBOX_EXPIRY)
+				continue;
+
+			/* A cached mailbox goes along with its file */
+			for (int i = 0; i < MAILBOX_CACHE_LEN; i++) {
+				char cached[4096];
+				struct mailbox_cache_entry *e = &ms->cache[i];
+				if (e->name && mailbox_path(ms, e->name, cached, sizeof(cached)) == 0 && strcmp(cached, path) == 0)
+					cache_evict(e);
+			}
+			if (unlink(path) == -1)
+				perror("mailbox_expire -> unlink()");
+		}
+		closedir(dir);
+	}
+
+	lockstat_unlock(ms->mutex);
+}
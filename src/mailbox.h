@@ -0,0 +1,35 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+/** @brief Bytes a mailbox may hold waiting for delivery; appends beyond it fail with @c EDQUOT. */
+#define MAILBOX_QUOTA (256 * 1024)
+
+/** @brief Seconds after which a message waiting in a mailbox is dropped instead of delivered. */
+#define MAILBOX_EXPIRY (7 * 24 * 3600)
+
+/** @brief Seconds between two looks at the mailboxes of users gone for @c MAILBOX_EXPIRY, see mailbox_expire(). */
+#define MAILBOX_SWEEP_S 3600
+
+/** @brief Number of mailboxes whose state is kept in memory. */
+#define MAILBOX_CACHE_LEN 64
+
+struct mailbox_store;
+
+/**
+ * @brief Function called by mailbox_fetch() for every message delivered.
+ */
+typedef void (*mailbox_fn)(const char *pack, uint32_t len, time_t when, void *arg);
+
+struct mailbox_store *mailbox_store_create(const char *dir);
+void mailbox_store_destroy(struct mailbox_store *ms);
+int mailbox_open(struct mailbox_store *ms, const char *name);
+int mailbox_append(struct mailbox_store *ms, const char *name, const char *pack, uint32_t len);
+ssize_t mailbox_fetch(struct mailbox_store *ms, const char *name, mailbox_fn fn, void *arg);
+void mailbox_expire(struct mailbox_store *ms, time_t now);
+
+#endif
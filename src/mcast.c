@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include "mcast.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "lockstat.h"
+
+/**
+ * @brief The multicast group the room is sent to, once per message rather than once per client.
+ *
+ * Frames are sent exactly as they would be over a connection, several of them
+ * per datagram, in sequence order. Nothing is sent again: clients ask for what
+ * they missed over their connection. While no message comes, the last sequence
+ * number is sent every @c MCAST_HEARTBEAT_MS, so a client missing the last
+ * datagram of a burst finds out.
+ */
+struct mcast {
+	int fd; 								/**< UDP socket connected to the group */
+	struct sockaddr_in group; 				/**< The group */
+	struct in_addr iface; 					/**< Address of the interface the group is sent on, @c INADDR_ANY for the default */
+	unsigned drop; 							/**< Drop one datagram in this many, to try out recovery; @c 0 drops none */
+	struct lockstat *mutex;					/**< Protects everything below */
+	char pending[FRAME_MAX_LEN]; 			/**< The datagram being filled */
+	size_t pending_len; 					/**< Bytes in @c pending */
+	uint64_t pending_seq; 					/**< Last message in @c pending */
+	uint64_t sent_seq; 						/**< Last message sent */
+	uint64_t sent_ms; 						/**< When the last datagram was sent, in @c CLOCK_MONOTONIC milliseconds */
+	unsigned members; 						/**< Clients getting the room from the group */
+	unsigned long long datagrams; 			/**< Datagrams sent, heartbeats included */
+	unsigned long long frames; 				/**< Messages sent */
+	unsigned long long bytes; 				/**< Bytes sent */
+	unsigned long long saved; 				/**< Copies of messages not sent over connections */
+	unsigned long long dropped; 			/**< Datagrams dropped on purpose */
+	unsigned long long errors; 				/**< Datagrams that could not be sent */
+	unsigned long long replays; 			/**< Times clients asked for messages again */
+	unsigned long long replayed; 			/**< Messages sent again */
+};
+
+/**
+ * @brief Read the @c CLOCK_MONOTONIC time in milliseconds.
+ */
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Parse a spec such as <tt>239.255.42.99:4243\@127.0.0.1,drop=20</tt>.
+ *
+ * The group and its port, then optionally the address of the interface to send
+ * on, and how many datagrams to send for each one dropped.
+ *
+ * @return @c 0 in case of success, @c -1 if the spec is wrong.
+ */
+static int parse_spec(struct mcast *m, const char *spec)
+{
+	char buf[128];
+	if (strlen(spec) >= sizeof(buf))
+		return -1;
+	strcpy(buf, spec);
+
+	char *drop = strchr(buf, ',');
+	if (drop) {
+		*drop++ = '\0';
+		char *end;
+		if (strncmp(drop, "drop=", 5) != 0)
+			return -1;
+		m->drop = strtoul(drop + 5, &end, 10);
+		if (end == drop + 5 || *end != '\0')
+			return -1;
+	}
+
+	char *iface = strchr(buf, '@');
+	if (iface) {
+		*iface++ = '\0';
+		if (inet_pton(AF_INET, iface, &m->iface) != 1)
+			return -1;
+	}
+
+	char *port = strchr(buf, ':');
+	if (!port)
+		return -1;
+	*port++ = '\0';
+
+	char *end;
+	unsigned long p = strtoul(port, &end, 10);
+	if (end == port || *end != '\0' || p == 0 || p > 65535)
+		return -1;
+
+	m->group.sin_family = AF_INET;
+	m->group.sin_port 	= htons(p);
+	if (inet_pton(AF_INET, buf, &m->group.sin_addr) != 1 || !IN_MULTICAST(ntohl(m->group.sin_addr.s_addr)))
+		return -1;
+
+	return 0;
+}
+
+/**
+ * @brief Create the sending side of a multicast group.
+ *
+ * The datagrams live one hop, and are looped back to the clients on the same host.
+ *
+ * @param[in] spec The group, see parse_spec().
+ *
+ * @return A pointer to the group in case of success, NULL otherwise, with
+ * @c errno set to @c EINVAL if the spec is wrong. It must be freed, using mcast_destroy().
+ */
+struct mcast *mcast_create(const char *spec)
+{
+	struct mcast *m = calloc(1, sizeof(struct mcast));
+	if (!m)
+		return NULL;
+
+	if (parse_spec(m, spec) == -1) {
+		free(m);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	unsigned char ttl 	= 1;
+	unsigned char loop 	= 1;
+	m->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (m->fd == -1
+			|| setsockopt(m->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) == -1
+			|| setsockopt(m->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) == -1
+			|| (m->iface.s_addr != INADDR_ANY
+				&& setsockopt(m->fd, IPPROTO_IP, IP_MULTICAST_IF, &m->iface, sizeof(m->iface)) == -1)
+			|| connect(m->fd, (struct sockaddr *)&m->group, sizeof(m->group)) == -1
+			|| !(m->mutex = lockstat_create("mcast"))) {
+		if (m->fd != -1)
+			close(m->fd);
+		free(m);
+		return NULL;
+	}
+
+	m->sent_ms = now_ms();
+
+	return m;
+}
+
+/**
+ * @brief Destroys the sending side of a multicast group.
+ *
+ * @param[in] m The group.
+ */
+void mcast_destroy(struct mcast *m)
+{
+	if (m) {
+		close(m->fd);
+		lockstat_destroy(m->mutex);
+		free(m);
+	}
+}
+
+/**
+ * @brief Write the frame telling a client to get the room from the group from now on.
+ *
+ * The client counts as a member until mcast_write_leave() or mcast_forget().
+ *
+ * @param[in] m The group.
+ * @param[out] buf Where to write; must hold @c FRAME_HEADER_LEN + @c FRAME_SEQ_LEN + 6 bytes.
+ * @param[in] seq The last message sent to the client over its connection.
+ *
+ * @return The frame length.
+ */
+size_t mcast_write_join(struct mcast *m, char *buf, uint64_t seq)
+{
+	lockstat_lock(m->mutex);
+	m->members++;
+	lockstat_unlock(m->mutex);
+
+	return frame_write_mcast(buf, seq, m->group.sin_addr.s_addr, m->group.sin_port);
+}
+
+/**
+ * @brief Write the frame telling a member to get the room over its connection again.
+ *
+ * @param[in] m The group.
+ * @param[out] buf Where to write; must hold @c FRAME_HEADER_LEN + @c FRAME_SEQ_LEN bytes.
+ * @param[in] seq The last message sent to the group.
+ *
+ * @return The frame length.
+ */
+size_t mcast_write_leave(struct mcast *m, char *buf, uint64_t seq)
+{
+	mcast_forget(m);
+
+	return frame_write_mcast(buf, seq, 0, 0);
+}
+
+/**
+ * @brief A member is gone.
+ *
+ * @param[in] m The group.
+ */
+void mcast_forget(struct mcast *m)
+{
+	lockstat_lock(m->mutex);
+	m->members--;
+	lockstat_unlock(m->mutex);
+}
+
+/**
+ * @brief Send the datagram being filled.
+ *
+ * @warning The mutex must be held.
+ */
+static void send_pending(struct mcast *m)
+{
+	if (m->pending_len == 0)
+		return;
+
+	m->datagrams++;
+	if (m->drop && m->datagrams % m->drop == 0) {
+		m->dropped++;
+	} else if (send(m->fd, m->pending, m->pending_len, MSG_DONTWAIT) == -1) {
+		m->errors++;
+	} else {
+		m->bytes += m->pending_len;
+	}
+
+	m->sent_seq 	= m->pending_seq;
+	m->sent_ms 		= now_ms();
+	m->pending_len 	= 0;
+}
+
+/**
+ * @brief Send a message to the group, after those sent before.
+ *
+ * Messages are gathered into datagrams of up to @c MCAST_DATAGRAM_MAX bytes; the
+ * last one goes with mcast_flush(). Without members, nothing is sent.
+ *
+ * @param[in] m The group.
+ * @param[in] frame The whole frame, with the sequence number.
+ * @param[in] len The frame length, at most @c FRAME_MAX_LEN.
+ * @param[in] seq The sequence number.
+ * @param[in] saved Members that did not get a copy over their connection because of it.
+ */
+void mcast_send(struct mcast *m, const char *frame, size_t len, uint64_t seq, size_t saved)
+{
+	lockstat_lock(m->mutex);
+
+	if (m->members) {
+		if (m->pending_len + len > MCAST_DATAGRAM_MAX)
+			send_pending(m);
+		memcpy(m->pending + m->pending_len, frame, len);
+		m->pending_len += len;
+		m->frames++;
+		m->saved += saved;
+	}
+	m->pending_seq = seq;
+	if (m->pending_len == 0)
+		m->sent_seq = seq;
+
+	lockstat_unlock(m->mutex);
+}
+
+/**
+ * @brief Send what mcast_send() gathered.
+ *
+ * @param[in] m The group.
+ */
+void mcast_flush(struct mcast *m)
+{
+	lockstat_lock(m->mutex);
+	send_pending(m);
+	lockstat_unlock(m->mutex);
+}
+
+/**
+ * @brief Send the last sequence number, if the group was quiet for @c MCAST_HEARTBEAT_MS.
+ *
+ * @param[in] m The group.
+ */
+void mcast_heartbeat(struct mcast *m)
+{
+	lockstat_lock(m->mutex);
+
+	if (m->members && m->pending_len == 0 && now_ms() - m->sent_ms >= MCAST_HEARTBEAT_MS) {
+		m->pending_len 	= frame_write_mcast(m->pending, m->sent_seq, m->group.sin_addr.s_addr, m->group.sin_port);
+		m->pending_seq 	= m->sent_seq;
+		send_pending(m);
+	}
+
+	lockstat_unlock(m->mutex);
+}
+
+/**
+ * @brief Count a member asking for messages it missed.
+ *
+ * @param[in] m The group.
+ * @param[in] frames The number of messages sent again.
+ */
+void mcast_count_replay(struct mcast *m, size_t frames)
+{
+	lockstat_lock(m->mutex);
+	m->replays++;
+	m->replayed += frames;
+	lockstat_unlock(m->mutex);
+}
+
+/**
+ * @brief Print what was sent to the group, and what it saved.
+ *
+ * @param[in] m The group.
+ * @param[in] f Where to print.
+ */
+void mcast_print(struct mcast *m, FILE *f)
+{
+	char group[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &m->group.sin_addr, group, sizeof(group));
+
+	lockstat_lock(m->mutex);
+	fprintf(f, "multicast: %s:%u, %u members, %llu messages in %llu datagrams (%llu bytes), %llu copies saved\n",
+			group, ntohs(m->group.sin_port), m->members, m->frames, m->datagrams, m->bytes, m->saved);
+	fprintf(f, "  %llu dropped on purpose, %llu send errors, %llu replays asked, %llu messages sent again\n",
+			m->dropped, m->errors, m->replays, m->replayed);
+	lockstat_unlock(m->mutex);
+}
+
+/**
+ * @brief Open a socket receiving a multicast group.
+ *
+ * The group is joined on the interface of another socket, the connection to the
+ * server, so that a client connected through the loopback joins it there.
+ *
+ * @param[in] group The IPv4 address of the group, in network order.
+ * @param[in] port The port of the group, in network order.
+ * @param[in] near_fd The socket whose interface to join on, @c -1 for the default one.
+ *
+ * @return The non-blocking socket in case of success, @c -1 otherwise.
+ */
+int mcast_open_receiver(uint32_t group, uint16_t port, int near_fd)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family 		= AF_INET;
+	addr.sin_port 			= port;
+	addr.sin_addr.s_addr 	= group;
+
+	struct ip_mreq mreq;
+	mreq.imr_multiaddr.s_addr 	= group;
+	mreq.imr_interface.s_addr 	= htonl(INADDR_ANY);
+
+	struct sockaddr_in near;
+	socklen_t len = sizeof(near);
+	if (near_fd != -1 && getsockname(near_fd, (struct sockaddr *)&near, &len) == 0 && near.sin_family == AF_INET)
+		mreq.imr_interface = near.sin_addr;
+
+	int one = 1;
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+	/* Bound to the group, so other traffic to the port is not received */
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1
+			|| bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+			|| setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
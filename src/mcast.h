@@ -0,0 +1,34 @@
+#ifndef MCAST_H
+#define MCAST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "frame.h"
+
+/** @brief Handshake option a client sends after its name to get the room over multicast. */
+#define MCAST_HANDSHAKE_OPT "mcast"
+
+/** @brief Most bytes of frames sent in one datagram, unless a single frame is larger. */
+#define MCAST_DATAGRAM_MAX 1472
+
+/** @brief Milliseconds without a datagram after which the last sequence number is sent again. */
+#define MCAST_HEARTBEAT_MS 1000
+
+struct mcast;
+
+struct mcast *mcast_create(const char *spec);
+void mcast_destroy(struct mcast *m);
+size_t mcast_write_join(struct mcast *m, char *buf, uint64_t seq);
+size_t mcast_write_leave(struct mcast *m, char *buf, uint64_t seq);
+void mcast_forget(struct mcast *m);
+void mcast_send(struct mcast *m, const char *frame, size_t len, uint64_t seq, size_t saved);
+void mcast_flush(struct mcast *m);
+void mcast_heartbeat(struct mcast *m);
+void mcast_count_replay(struct mcast *m, size_t frames);
+void mcast_print(struct mcast *m, FILE *f);
+int mcast_open_receiver(uint32_t group, uint16_t port, int near_fd);
+
+#endif
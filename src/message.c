@@ -117,14 +117,37 @@ char *message_pack(struct message *m, int *len)
 		char *content = (char *)message_get_content(m);
 		char *sender  = (char *)message_get_sender(m);
 
-		int size = strlen(content) + strlen(sender) + 2;
+		pack = message_pack_text(content, strlen(content), sender, len);
+	}
 
-		pack = malloc(sizeof(char) * size);
-		if (pack) {
-			strcpy(pack, content);
-			strcpy(pack + strlen(pack) + 1, sender);
-		}
+	return pack;
+}
+
+/**
+ * @brief Serialize a message without creating it first.
+ *
+ * Produces the same bytes as message_pack(), with a single allocation and no
+ * pass over the content to find its length.
+ *
+ * @param[in] content The content of the message.
+ * @param[in] content_len The content length, without the @c '\0'.
+ * @param[in] sender_name The username of the sender.
+ * @param[out] len A pointer to a integer where the length of the serialized message will be stored.
+ *
+ * @return A pointer to the serialized message, NULL in case of failure. This should be freed when is not necessary anymore.
+ *
+ * @see message_pack
+ */
+char *message_pack_text(const char *content, size_t content_len, const char *sender_name, int *len)
+{
+	size_t sender_len = strlen(sender_name);
+	size_t size = content_len + sender_len + 2;
 
+	char *pack = malloc(sizeof(char) * size);
+	if (pack) {
+		memcpy(pack, content, content_len);
+		pack[content_len] = '\0';
+		memcpy(pack + content_len + 1, sender_name, sender_len + 1);
 		*len = size;
 	}
 
@@ -141,6 +164,7 @@ char *message_pack(struct message *m, int *len)
  * @return A pointer to the deserialized message. This should be freed when is not necessary anymore.
  *
  * @see message_pack
+ * @see message_view_decode
  */
 struct message *message_unpack(char *pack)
 {
@@ -155,3 +179,49 @@ struct message *message_unpack(char *pack)
 	return m;
 }
 
+/**
+ * @brief Decode a packed message without copying it.
+ *
+ * Nothing is allocated: the view points into @p pack.
+ *
+ * @param[out] v The view.
+ * @param[in] pack The packed message generated by message_pack().
+ * @param[in] len The packed message length.
+ *
+ * @return @c 0 in case of success, @c -1 if @p pack is not a content and a sender, both @c NUL terminated.
+ *
+ * @see message_view_promote
+ */
+int message_view_decode(struct message_view *v, const char *pack, size_t len)
+{
+	if (len < 2 || pack[len - 1] != '\0')
+		return -1;
+
+	const char *nul = memchr(pack, '\0', len - 1);
+	if (!nul)
+		return -1;
+
+	v->content 		= pack;
+	v->content_len 	= nul - pack;
+	v->sender 		= nul + 1;
+	v->sender_len 	= len - 2 - v->content_len;
+
+	/* Anything after the sender is not part of the message */
+	if (memchr(v->sender, '\0', v->sender_len))
+		return -1;
+
+	return 0;
+}
+
+/**
+ * @brief Copy a view into a message of its own.
+ *
+ * @param[in] v The view.
+ *
+ * @return A pointer to the message in case of success, NULL otherwise.
+ * The message must be freed, using message_destroy().
+ */
+struct message *message_view_promote(const struct message_view *v)
+{
+	return message_create(v->content, v->sender);
+}
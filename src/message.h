@@ -6,11 +6,27 @@
 
 struct message;
 
+/**
+ * @brief A packed message decoded in place.
+ *
+ * The strings point into the buffer given to message_view_decode(), so the view is
+ * only valid as long as that buffer is. Use message_view_promote() to keep it.
+ */
+struct message_view {
+	const char *content; 	/**< The content of the message, @c NUL terminated */
+	size_t content_len; 	/**< The content length */
+	const char *sender; 	/**< The username of the sender, @c NUL terminated */
+	size_t sender_len; 		/**< The sender length */
+};
+
 struct message *message_create(const char *content, const char *sender_name);
 void message_destroy(struct message *m);
 const char *message_get_content(struct message *m);
 const char *message_get_sender(struct message *m);
 char *message_pack(struct message *m, int *len);
+char *message_pack_text(const char *content, size_t content_len, const char *sender_name, int *len);
 struct message *message_unpack(char *pack);
+int message_view_decode(struct message_view *v, const char *pack, size_t len);
+struct message *message_view_promote(const struct message_view *v);
 
 #endif
@@ -0,0 +1,376 @@
+#include "outq.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "fiber.h"
+
+/**
+ * @brief One lane of an outbound queue, first in first out.
+ */
+struct outq_lane_list {
+	struct outq_item *head; 	/**< Next item to go */
+	struct outq_item *tail; 	/**< Last item pushed */
+};
+
+/**
+ * @brief What is waiting to be written to one connection.
+ *
+ * Lanes are served in strict priority, an item at a time, so a notice only waits
+ * for the item being written when it arrives. Sequence numbered frames keep their
+ * order: while a history replay is waiting in the bulk lane, newer sequenced
+ * frames join it there instead of overtaking it in the chat lane. A file is
+ * streamed a chunk at a time from the head of the bulk lane, and sequenced
+ * frames behind it pass it between chunks, so they never wait for a whole download.
+ */
+struct outq {
+	pthread_mutex_t mutex; 						/**< Protects everything below */
+	pthread_cond_t cond; 						/**< Signaled when an item is pushed or the queue closes */
+	struct fiber *waiter; 						/**< Writer fiber parked until then, NULL if none */
+	struct outq_lane_list lanes[OUTQ_LANES]; 	/**< The lanes */
+	size_t ordered_bulk; 						/**< Sequenced items waiting in the bulk lane */
+	size_t bytes; 								/**< Bytes of frames waiting, files not included */
+	size_t items; 								/**< Items pushed and not freed yet */
+	size_t max_bytes; 							/**< Limit of @c bytes; pushes beyond it fail */
+	bool closed; 								/**< Whether outq_close() was called */
+};
+
+/** @brief Bytes of frames waiting in every queue. */
+static _Atomic size_t OUTQ_TOTAL_BYTES = 0;
+
+/**
+ * @brief Create an empty outbound queue.
+ *
+ * @param[in] max_bytes Most bytes of frames that may wait in the queue.
+ *
+ * @return A pointer to the queue in case of success, NULL otherwise.
+ * The queue must be freed, using outq_destroy().
+ */
+struct outq *outq_create(size_t max_bytes)
+{
+	struct outq *q = calloc(1, sizeof(struct outq));
+	if (q) {
+		pthread_mutex_init(&q->mutex, NULL);
+		pthread_cond_init(&q->cond, NULL);
+		q->max_bytes = max_bytes;
+	}
+
+	return q;
+}
+
+/**
+ * @brief Destroys an outbound queue and whatever is still waiting in it.
+ *
+ * @param[in] q The queue.
+ */
+void outq_destroy(struct outq *q)
+{
+	if (q) {
+		for (int i = 0; i < OUTQ_LANES; i++) {
+			struct outq_item *it;
+			while ((it = q->lanes[i].head)) {
+				q->lanes[i].head = it->next;
+				outq_free(q, it);
+			}
+		}
+		pthread_cond_destroy(&q->cond);
+		pthread_mutex_destroy(&q->mutex);
+		free(q);
+	}
+}
+
+/**
+ * @brief Append an item to a lane and wake the writer.
+ *
+ * @warning The queue mutex must be held.
+ */
+static void lane_append(struct outq *q, enum outq_lane lane, struct outq_item *it)
+{
+	it->next = NULL;
+	if (q->lanes[lane].tail)
+		q->lanes[lane].tail->next = it;
+	else
+		q->lanes[lane].head = it;
+	q->lanes[lane].tail = it;
+
+	pthread_cond_signal(&q->cond);
+	if (q->waiter) {
+		fiber_wake(q->waiter);
+		q->waiter = NULL;
+	}
+}
+
+/**
+ * @brief Queue frames.
+ *
+ * The frames are copied. Frames flagged @c OUTQ_ORDERED go to the bulk lane while
+ * other sequenced frames wait there.
+ *
+ * @param[in] q The queue.
+ * @param[in] lane The lane.
+ * @param[in] flags @c OUTQ_* flags.
+ * @param[in] buf The frames.
+ * @param[in] len The frames length.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise, with @c errno set to
+ * @c ESHUTDOWN if the queue is closed or @c ENOBUFS if it is full.
+ */
+int outq_push(struct outq *q, enum outq_lane lane, int flags, const void *buf, size_t len)
+{
+	struct outq_item *it = malloc(sizeof(struct outq_item) + len);
+	if (!it)
+		return -1;
+
+	it->flags 	= flags;
+	it->fd 		= -1;
+	it->len 	= len;
+	memcpy(it->data, buf, len);
+
+	pthread_mutex_lock(&q->mutex);
+
+	if (q->closed || q->bytes + len > q->max_bytes) {
+		errno = q->closed ? ESHUTDOWN : ENOBUFS;
+		pthread_mutex_unlock(&q->mutex);
+		free(it);
+		return -1;
+	}
+
+	if ((flags & OUTQ_ORDERED) && q->ordered_bulk)
+		lane = OUTQ_BULK;
+	if ((flags & OUTQ_ORDERED) && lane == OUTQ_BULK)
+		q->ordered_bulk++;
+
+	q->bytes += len;
+	q->items++;
+	atomic_fetch_add_explicit(&OUTQ_TOTAL_BYTES, len, memory_order_relaxed);
+	lane_append(q, lane, it);
+
+	pthread_mutex_unlock(&q->mutex);
+
+	return 0;
+}
+
+/**
+ * @brief Queue a file, to be streamed in the bulk lane.
+ *
+ * Other items of the bulk lane wait for the whole file, except sequenced frames.
+ *
+ * @param[in] q The queue.
+ * @param[in] fd The file, which the queue closes once it is sent or dropped.
+ * @param[in] id The transfer id.
+ * @param[in] size Number of bytes to send, from the start of the file.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise, with @c errno set to
+ * @c ESHUTDOWN if the queue is closed. The file is closed either way.
+ */
+int outq_push_file(struct outq *q, int fd, uint32_t id, uint64_t size)
+{
+	struct outq_item *it = malloc(sizeof(struct outq_item));
+	if (!it) {
+		close(fd);
+		return -1;
+	}
+
+	it->flags 	= 0;
+	it->fd 		= fd;
+	it->id 		= id;
+	it->off 	= 0;
+	it->left 	= size;
+	it->len 	= 0;
+
+	pthread_mutex_lock(&q->mutex);
+
+	if (q->closed) {
+		q->items++;
+		pthread_mutex_unlock(&q->mutex);
+		outq_free(q, it);
+		errno = ESHUTDOWN;
+		return -1;
+	}
+
+	q->items++;
+	lane_append(q, OUTQ_BULK, it);
+
+	pthread_mutex_unlock(&q->mutex);
+
+	return 0;
+}
+
+/**
+ * @brief Take the next item of a lane out.
+ *
+ * The first sequenced frame of the bulk lane goes before a file at the head of it.
+ *
+ * @warning The queue mutex must be held.
+ *
+ * @return The item, NULL if the lane is empty.
+ */
+static struct outq_item *lane_take(struct outq *q, enum outq_lane lane)
+{
+	struct outq_lane_list *l = &q->lanes[lane];
+	struct outq_item *prev = NULL;
+	struct outq_item *it = l->head;
+
+	if (it && it->fd != -1 && lane == OUTQ_BULK && q->ordered_bulk) {
+		while (!(it->flags & OUTQ_ORDERED)) {
+			prev = it;
+			it = it->next;
+		}
+	}
+	if (!it)
+		return NULL;
+
+	if (prev)
+		prev->next = it->next;
+	else
+		l->head = it->next;
+	if (l->tail == it)
+		l->tail = prev;
+	if (lane == OUTQ_BULK && (it->flags & OUTQ_ORDERED))
+		q->ordered_bulk--;
+
+	return it;
+}
+
+/**
+ * @brief Wait for the most urgent item.
+ *
+ * Once the queue is closed, what is left is still handed out; NULL comes after.
+ * A writer running in a fiber parks instead of blocking its worker thread.
+ *
+ * @param[in] q The queue.
+ *
+ * @return The item, to be given back with outq_free() or outq_unpop(), NULL if the
+ * queue is closed and empty.
+ */
+struct outq_item *outq_pop(struct outq *q)
+{
+	struct outq_item *it = NULL;
+
+	pthread_mutex_lock(&q->mutex);
+
+	while (true) {
+		for (int i = 0; i < OUTQ_LANES && !it; i++) {
+			it = lane_take(q, i);
+		}
+		if (it || q->closed)
+			break;
+
+		struct fiber *self = fiber_current();
+		if (self) {
+			q->waiter = self;
+			pthread_mutex_unlock(&q->mutex);
+			fiber_park(-1);
+			pthread_mutex_lock(&q->mutex);
+			if (q->waiter == self)
+				q->waiter = NULL;
+		} else {
+			pthread_cond_wait(&q->cond, &q->mutex);
+		}
+	}
+
+	pthread_mutex_unlock(&q->mutex);
+
+	return it;
+}
+
+/**
+ * @brief Put a file back at the head of the bulk lane, with what is left of it.
+ *
+ * Lets the writer go through a file a frame at a time, so the other lanes still go first.
+ *
+ * @param[in] q The queue.
+ * @param[in] it The file item returned by outq_pop().
+ */
+void outq_unpop(struct outq *q, struct outq_item *it)
+{
+	pthread_mutex_lock(&q->mutex);
+
+	it->next = q->lanes[OUTQ_BULK].head;
+	q->lanes[OUTQ_BULK].head = it;
+	if (!q->lanes[OUTQ_BULK].tail)
+		q->lanes[OUTQ_BULK].tail = it;
+
+	pthread_mutex_unlock(&q->mutex);
+}
+
+/**
+ * @brief Release an item that was written, or dropped.
+ *
+ * @param[in] q The queue.
+ * @param[in] it The item.
+ */
+void outq_free(struct outq *q, struct outq_item *it)
+{
+	if (it->fd != -1)
+		close(it->fd);
+
+	pthread_mutex_lock(&q->mutex);
+	q->bytes -= it->len;
+	q->items--;
+	pthread_mutex_unlock(&q->mutex);
+	atomic_fetch_sub_explicit(&OUTQ_TOTAL_BYTES, it->len, memory_order_relaxed);
+
+	free(it);
+}
+
+/**
+ * @brief Refuse new items, and wake the writer once the queue is empty.
+ *
+ * @param[in] q The queue.
+ */
+void outq_close(struct outq *q)
+{
+	pthread_mutex_lock(&q->mutex);
+	q->closed = true;
+	pthread_cond_broadcast(&q->cond);
+	if (q->waiter) {
+		fiber_wake(q->waiter);
+		q->waiter = NULL;
+	}
+	pthread_mutex_unlock(&q->mutex);
+}
+
+/**
+ * @brief Get the bytes of frames waiting.
+ *
+ * @param[in] q The queue.
+ *
+ * @return The number of bytes, files not included.
+ */
+size_t outq_get_bytes(struct outq *q)
+{
+	pthread_mutex_lock(&q->mutex);
+	size_t bytes = q->bytes;
+	pthread_mutex_unlock(&q->mutex);
+
+	return bytes;
+}
+
+/**
+ * @brief Get the bytes of frames waiting in every queue.
+ *
+ * @return The number of bytes, files not included.
+ */
+size_t outq_get_total_bytes(void)
+{
+	return atomic_load_explicit(&OUTQ_TOTAL_BYTES, memory_order_relaxed);
+}
+
+/**
+ * @brief Get the memory the queue takes.
+ *
+ * @param[in] q The queue.
+ *
+ * @return The number of bytes: the queue, its items and their frames.
+ */
+size_t outq_get_footprint(struct outq *q)
+{
+	pthread_mutex_lock(&q->mutex);
+	size_t bytes = sizeof(struct outq) + q->items * sizeof(struct outq_item) + q->bytes;
+	pthread_mutex_unlock(&q->mutex);
+
+	return bytes;
+}
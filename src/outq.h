@@ -0,0 +1,55 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <sys/types.h>
+
+/** @brief Push flag: the frames carry a sequence number, so they must not overtake each other. */
+#define OUTQ_ORDERED 0x1
+
+/** @brief Push flag: the frame is traced, its @c server_flush stamp is written when it leaves. */
+#define OUTQ_TRACED 0x2
+
+/**
+ * @brief The lanes of an outbound queue, in priority order.
+ */
+enum outq_lane {
+	OUTQ_CONTROL, 	/**< Session, presence and server notices */
+	OUTQ_CHAT, 		/**< Interactive chat */
+	OUTQ_BULK, 		/**< History replay, mailbox bursts and files */
+	OUTQ_LANES 		/**< Number of lanes */
+};
+
+/**
+ * @brief Something waiting in an outbound queue: frames, or a file to stream.
+ */
+struct outq_item {
+	struct outq_item *next; 	/**< Next item of the lane */
+	int flags; 					/**< @c OUTQ_* push flags */
+	int fd; 					/**< File sent as @c FRAME_FILE_DATA frames, @c -1 for plain frames */
+	uint32_t id; 				/**< Transfer id of the file */
+	off_t off; 					/**< Where the rest of the file starts */
+	uint64_t left; 				/**< File bytes not sent yet */
+	size_t len; 				/**< Bytes of @c data */
+	char data[]; 				/**< The frames */
+};
+
+struct outq;
+
+struct outq *outq_create(size_t max_bytes);
+void outq_destroy(struct outq *q);
+int outq_push(struct outq *q, enum outq_lane lane, int flags, const void *buf, size_t len);
+int outq_push_file(struct outq *q, int fd, uint32_t id, uint64_t size);
+struct outq_item *outq_pop(struct outq *q);
+void outq_unpop(struct outq *q, struct outq_item *it);
+void outq_free(struct outq *q, struct outq_item *it);
+void outq_close(struct outq *q);
+size_t outq_get_bytes(struct outq *q);
+size_t outq_get_total_bytes(void);
+size_t outq_get_footprint(struct outq *q);
+
+#endif
@@ -0,0 +1,524 @@
+#include "pipeline.h"
+
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <dlfcn.h>
+
+#include "hist.h"
+
+/**
+ * @brief A stage added to a pipeline, with its statistics.
+ */
+struct pipeline_stage {
+	struct pipeline_stage_def def; 	/**< What was added */
+	struct hist *time; 				/**< Time spent per batch */
+	_Atomic uint64_t msgs; 			/**< Messages that went in */
+	_Atomic uint64_t taken; 		/**< Messages it dropped or fully handled */
+};
+
+/**
+ * @brief A thread running the heavy stages, and the batches waiting for it.
+ */
+struct pipeline_worker {
+	struct pipeline *p; 			/**< The pipeline */
+	pthread_t thread; 				/**< The thread */
+	pthread_mutex_t mutex; 			/**< Protects the queue */
+	pthread_cond_t cond; 			/**< Signaled when a batch is queued */
+	struct pipeline_batch *head; 	/**< First batch waiting */
+	struct pipeline_batch *tail; 	/**< Last batch waiting */
+	bool stop; 						/**< Whether the thread must stop once the queue is empty */
+};
+
+/**
+ * @brief The stages messages go through between being read and being queued for the room.
+ *
+ * A batch runs on the thread that submitted it until it reaches a @c PIPELINE_HEAVY
+ * stage; from there on it runs on a worker. All the batches of the same origin go
+ * to the same worker, so their messages keep their order.
+ *
+ * Stages are added before pipeline_start(), and not changed afterwards, so running
+ * a batch takes no lock.
+ */
+struct pipeline {
+	struct pipeline_stage stages[PIPELINE_MAX_STAGES]; 	/**< The stages, by phase */
+	size_t nstages; 									/**< Number of stages */
+	bool started; 										/**< Whether pipeline_start() was called */
+	bool heavy; 										/**< Whether any stage is @c PIPELINE_HEAVY */
+	struct pipeline_worker workers[PIPELINE_WORKERS]; 	/**< The workers, started only if needed */
+	_Atomic uint64_t handoffs; 							/**< Batches handed to a worker */
+};
+
+/**
+ * @brief Who submits batches, so it can wait for them before going away.
+ */
+struct pipeline_source {
+	pthread_mutex_t mutex; 	/**< Protects @c inflight */
+	pthread_cond_t cond; 	/**< Signaled when a batch is done */
+	size_t inflight; 		/**< Batches created and not done */
+};
+
+/** @brief Batches created and not done, of every submitter. */
+static _Atomic size_t PIPELINE_INFLIGHT = 0;
+
+/**
+ * @brief Messages going through the pipeline together, with their contents.
+ */
+struct pipeline_batch {
+	struct pipeline_batch *next; 			/**< Next batch in a worker queue */
+	struct pipeline_source *src; 			/**< Who submitted it */
+	void *origin; 							/**< Who sent the messages */
+	const char *sender; 					/**< The sender name */
+	size_t stage; 							/**< Next stage to run */
+	size_t n; 								/**< Number of messages */
+	struct pipeline_msg msgs[PIPELINE_BATCH]; /**< The messages */
+	size_t used; 							/**< Bytes of @c arena in use */
+	char arena[PIPELINE_ARENA]; 			/**< The message contents */
+};
+
+static void *pipeline_worker_thread(void *arg);
+
+/**
+ * @brief Create a pipeline without stages.
+ *
+ * @return A pointer to the pipeline in case of success, NULL otherwise.
+ * The pipeline must be freed, using pipeline_destroy().
+ */
+struct pipeline *pipeline_create(void)
+{
+	return calloc(1, sizeof(struct pipeline));
+}
+
+/**
+ * @brief Destroys a pipeline.
+ *
+ * The workers finish the batches queued for them first.
+ *
+ * @param[in] p The pipeline.
+ */
+void pipeline_destroy(struct pipeline *p)
+{
+	if (p) {
+		if (p->started && p->heavy) {
+			for (int i = 0; i < PIPELINE_WORKERS; i++) {
+				struct pipeline_worker *w = &p->workers[i];
+				pthread_mutex_lock(&w->mutex);
+				w->stop = true;
+				pthread_cond_signal(&w->cond);
+				pthread_mutex_unlock(&w->mutex);
+				pthread_join(w->thread, NULL);
+				pthread_mutex_destroy(&w->mutex);
+				pthread_cond_destroy(&w->cond);
+			}
+		}
+		for (size_t i = 0; i < p->nstages; i++) {
+			hist_destroy(p->stages[i].time);
+		}
+		free(p);
+	}
+}
+
+/**
+ * @brief Add a stage, after the stages of the same phase already added.
+ *
+ * The definition is copied, its name is not.
+ *
+ * @param[in] p The pipeline.
+ * @param[in] def The stage.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise, with @c errno set to @c EBUSY
+ * if the pipeline is started, or @c ENOSPC if it has @c PIPELINE_MAX_STAGES stages.
+ */
+int pipeline_add_stage(struct pipeline *p, const struct pipeline_stage_def *def)
+{
+	if (p->started) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (p->nstages == PIPELINE_MAX_STAGES) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (def->phase >= PIPELINE_PHASES || !def->fn) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct hist *time = hist_create(def->name);
+	if (!time)
+		return -1;
+
+	size_t i = p->nstages;
+	while (i > 0 && p->stages[i - 1].def.phase > def->phase) {
+		p->stages[i] = p->stages[i - 1];
+		i--;
+	}
+
+	memset(&p->stages[i], 0, sizeof(struct pipeline_stage));
+	p->stages[i].def 	= *def;
+	p->stages[i].time 	= time;
+	p->nstages++;
+
+	if (def->flags & PIPELINE_HEAVY)
+		p->heavy = true;
+
+	return 0;
+}
+
+/**
+ * @brief Add the stages of a plugin.
+ *
+ * The plugin is a shared object exporting @c PIPELINE_PLUGIN_SYMBOL; it stays loaded.
+ *
+ * @param[in] p The pipeline.
+ * @param[in] path The shared object.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise. The reason is printed on @c stderr.
+ */
+int pipeline_load_plugin(struct pipeline *p, const char *path)
+{
+	void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!handle) {
+		fprintf(stderr, "%s\n", dlerror());
+		return -1;
+	}
+
+	const struct pipeline_stage_def *defs = dlsym(handle, PIPELINE_PLUGIN_SYMBOL);
+	if (!defs) {
+		fprintf(stderr, "%s\n", dlerror());
+		dlclose(handle);
+		return -1;
+	}
+
+	for ( ; defs->name; defs++) {
+		if (pipeline_add_stage(p, defs) == -1) {
+			perror(defs->name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Freeze the stages, and start the workers if a stage needs them.
+ *
+ * @param[in] p The pipeline.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+int pipeline_start(struct pipeline *p)
+{
+	p->started = true;
+	if (!p->heavy)
+		return 0;
+
+	for (int i = 0; i < PIPELINE_WORKERS; i++) {
+		struct pipeline_worker *w = &p->workers[i];
+		w->p = p;
+		if (pthread_mutex_init(&w->mutex, NULL) || pthread_cond_init(&w->cond, NULL)
+				|| pthread_create(&w->thread, NULL, pipeline_worker_thread, w))
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Create a batch submitter.
+ *
+ * @return A pointer to the submitter in case of success, NULL otherwise.
+ * The submitter must be freed, using pipeline_source_destroy().
+ */
+struct pipeline_source *pipeline_source_create(void)
+{
+	struct pipeline_source *src = calloc(1, sizeof(struct pipeline_source));
+	if (src) {
+		if (pthread_mutex_init(&src->mutex, NULL)) {
+			free(src);
+			return NULL;
+		}
+		if (pthread_cond_init(&src->cond, NULL)) {
+			pthread_mutex_destroy(&src->mutex);
+			free(src);
+			return NULL;
+		}
+	}
+
+	return src;
+}
+
+/**
+ * @brief Destroys a batch submitter, once its batches are done.
+ *
+ * @param[in] src The submitter.
+ */
+void pipeline_source_destroy(struct pipeline_source *src)
+{
+	if (src) {
+		pipeline_source_drain(src);
+		pthread_mutex_destroy(&src->mutex);
+		pthread_cond_destroy(&src->cond);
+		free(src);
+	}
+}
+
+/**
+ * @brief Get the size of a batch submitter, for memory accounting.
+ *
+ * @return The size of a submitter, in bytes.
+ */
+size_t pipeline_source_size(void)
+{
+	return sizeof(struct pipeline_source);
+}
+
+/**
+ * @brief Wait until every batch created by the submitter is done.
+ *
+ * After that the origin and sender given to pipeline_batch_create() are no longer used.
+ *
+ * @param[in] src The submitter.
+ */
+void pipeline_source_drain(struct pipeline_source *src)
+{
+	pthread_mutex_lock(&src->mutex);
+	while (src->inflight > 0) {
+		pthread_cond_wait(&src->cond, &src->mutex);
+	}
+	pthread_mutex_unlock(&src->mutex);
+}
+
+/**
+ * @brief Get the batches of every submitter that are not done.
+ *
+ * Once it is @c 0 and no batch is being created, every message read went through the pipeline.
+ *
+ * @return The number of batches.
+ */
+size_t pipeline_get_inflight(void)
+{
+	return atomic_load_explicit(&PIPELINE_INFLIGHT, memory_order_acquire);
+}
+
+/**
+ * @brief Create an empty batch.
+ *
+ * @param[in] src The submitter.
+ * @param[in] origin Who sent the messages; batches of the same origin keep their order.
+ * @param[in] sender The sender name. It is not copied.
+ *
+ * @return A pointer to the batch in case of success, NULL otherwise.
+ * The batch must be given to pipeline_run().
+ */
+struct pipeline_batch *pipeline_batch_create(struct pipeline_source *src, void *origin, const char *sender)
+{
+	struct pipeline_batch *b = malloc(sizeof(struct pipeline_batch));
+	if (b) {
+		b->next 	= NULL;
+		b->src 		= src;
+		b->origin 	= origin;
+		b->sender 	= sender;
+		b->stage 	= 0;
+		b->n 		= 0;
+		b->used 	= 0;
+
+		pthread_mutex_lock(&src->mutex);
+		src->inflight++;
+		pthread_mutex_unlock(&src->mutex);
+		atomic_fetch_add_explicit(&PIPELINE_INFLIGHT, 1, memory_order_acq_rel);
+	}
+
+	return b;
+}
+
+/**
+ * @brief Add a message to a batch.
+ *
+ * @param[in] b The batch.
+ * @param[in] payload The payload of the frame carrying the message. It is copied.
+ * @param[in] len The payload length.
+ *
+ * @return The message, so the caller can fill in the trace, NULL if the batch is full.
+ */
+struct pipeline_msg *pipeline_batch_add(struct pipeline_batch *b, const char *payload, size_t len)
+{
+	if (b->n == PIPELINE_BATCH || len > PIPELINE_ARENA - b->used)
+		return NULL;
+
+	struct pipeline_msg *m = &b->msgs[b->n++];
+	m->origin 		= b->origin;
+	m->sender 		= b->sender;
+	m->content 		= b->arena + b->used;
+	m->content_len 	= len;
+	m->verdict 		= PIPELINE_PASS;
+	m->traced 		= false;
+	m->out 			= NULL;
+	m->out_len 		= 0;
+	m->out_hlen 	= 0;
+
+	memcpy(m->content, payload, len);
+	b->used += len;
+
+	return m;
+}
+
+/**
+ * @brief Get the number of messages in a batch.
+ *
+ * @param[in] b The batch.
+ *
+ * @return The number of messages.
+ */
+size_t pipeline_batch_len(struct pipeline_batch *b)
+{
+	return b->n;
+}
+
+/**
+ * @brief Count the messages of a batch still going on.
+ */
+static size_t pipeline_batch_live(struct pipeline_batch *b)
+{
+	size_t live = 0;
+
+	for (size_t i = 0; i < b->n; i++) {
+		live += b->msgs[i].verdict == PIPELINE_PASS;
+	}
+
+	return live;
+}
+
+/**
+ * @brief Free a batch that went through every stage, and tell its submitter.
+ */
+static void pipeline_batch_done(struct pipeline_batch *b)
+{
+	struct pipeline_source *src = b->src;
+
+	for (size_t i = 0; i < b->n; i++) {
+		free(b->msgs[i].out);
+	}
+	free(b);
+
+	pthread_mutex_lock(&src->mutex);
+	if (--src->inflight == 0)
+		pthread_cond_broadcast(&src->cond);
+	pthread_mutex_unlock(&src->mutex);
+	atomic_fetch_sub_explicit(&PIPELINE_INFLIGHT, 1, memory_order_acq_rel);
+}
+
+/**
+ * @brief Queue a batch for the worker of its origin.
+ */
+static void pipeline_handoff(struct pipeline *p, struct pipeline_batch *b)
+{
+	uint64_t h = (uintptr_t)b->origin * 0x9e3779b97f4a7c15ULL;
+	struct pipeline_worker *w = &p->workers[(h >> 32) % PIPELINE_WORKERS];
+
+	atomic_fetch_add_explicit(&p->handoffs, 1, memory_order_relaxed);
+
+	pthread_mutex_lock(&w->mutex);
+	if (w->tail)
+		w->tail->next = b;
+	else
+		w->head = b;
+	w->tail = b;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+/**
+ * @brief Run the stages a batch has left.
+ *
+ * @param[in] p The pipeline.
+ * @param[in] b The batch.
+ * @param[in] on_worker Whether this is a worker; if not, the batch is handed off at the first heavy stage.
+ */
+static void pipeline_continue(struct pipeline *p, struct pipeline_batch *b, bool on_worker)
+{
+	size_t live = pipeline_batch_live(b);
+
+	for ( ; b->stage < p->nstages && live > 0; b->stage++) {
+		struct pipeline_stage *s = &p->stages[b->stage];
+
+		if ((s->def.flags & PIPELINE_HEAVY) && !on_worker) {
+			pipeline_handoff(p, b);
+			return;
+		}
+
+		uint64_t start = frame_now();
+		s->def.fn(b->msgs, b->n, s->def.arg);
+		hist_record(s->time, frame_now() - start);
+
+		size_t left = pipeline_batch_live(b);
+		atomic_fetch_add_explicit(&s->msgs, live, memory_order_relaxed);
+		atomic_fetch_add_explicit(&s->taken, live - left, memory_order_relaxed);
+		live = left;
+	}
+
+	pipeline_batch_done(b);
+}
+
+/**
+ * @brief Run a batch through the pipeline.
+ *
+ * @param[in] p The pipeline.
+ * @param[in] b The batch, freed once done.
+ */
+void pipeline_run(struct pipeline *p, struct pipeline_batch *b)
+{
+	pipeline_continue(p, b, false);
+}
+
+/**
+ * @brief Keeps running the batches handed to a worker.
+ *
+ * @param[in] arg The worker.
+ */
+static void *pipeline_worker_thread(void *arg)
+{
+	struct pipeline_worker *w = (struct pipeline_worker *)arg;
+
+	while (true) {
+		pthread_mutex_lock(&w->mutex);
+		while (!w->head && !w->stop) {
+			pthread_cond_wait(&w->cond, &w->mutex);
+		}
+		struct pipeline_batch *b = w->head;
+		if (b) {
+			w->head = b->next;
+			if (!w->head)
+				w->tail = NULL;
+		}
+		pthread_mutex_unlock(&w->mutex);
+
+		if (!b)
+			return NULL;
+
+		pipeline_continue(w->p, b, true);
+	}
+}
+
+/**
+ * @brief Print the stages, what they took out and their time per batch.
+ *
+ * @param[in] p The pipeline.
+ * @param[in] f Where to print.
+ */
+void pipeline_print(struct pipeline *p, FILE *f)
+{
+	static const char *phases[PIPELINE_PHASES] = { "validate", "filter", "route", "encode", "enqueue" };
+
+	fprintf(f, "pipeline: %zu stages, %llu batches handed to workers\n", p->nstages,
+			(unsigned long long)atomic_load_explicit(&p->handoffs, memory_order_relaxed));
+	for (size_t i = 0; i < p->nstages; i++) {
+		struct pipeline_stage *s = &p->stages[i];
+		fprintf(f, "stage %s (%s%s): %llu messages in, %llu taken out\n", s->def.name,
+				phases[s->def.phase], s->def.flags & PIPELINE_HEAVY ? ", worker" : "",
+				(unsigned long long)atomic_load_explicit(&s->msgs, memory_order_relaxed),
+				(unsigned long long)atomic_load_explicit(&s->taken, memory_order_relaxed));
+		hist_print(s->time, f);
+	}
+}
@@ -0,0 +1,104 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "frame.h"
+
+/** @brief Most messages in a batch. */
+#define PIPELINE_BATCH 64
+
+/** @brief Bytes of message content a batch holds. */
+#define PIPELINE_ARENA (2 * FRAME_MAX_LEN)
+
+/** @brief Most stages in a pipeline. */
+#define PIPELINE_MAX_STAGES 16
+
+/** @brief Threads running the stages that are too slow for the threads reading the clients. */
+#define PIPELINE_WORKERS 4
+
+/** @brief Symbol a plugin exports: an array of struct pipeline_stage_def, ended by one with a NULL name. */
+#define PIPELINE_PLUGIN_SYMBOL "pipeline_stages"
+
+/** @brief The stage may block or take long, it runs on a pipeline worker. */
+#define PIPELINE_HEAVY 0x1
+
+/**
+ * @brief Where a stage goes in the pipeline; stages of the same phase run in the order they were added.
+ */
+enum pipeline_phase {
+	PIPELINE_VALIDATE, 	/**< Checks and cleans up what the client sent */
+	PIPELINE_FILTER, 	/**< Drops or rewrites messages, where plugins usually go */
+	PIPELINE_ROUTE, 	/**< Takes out the messages that are not for the room */
+	PIPELINE_ENCODE, 	/**< Packs and frames the messages */
+	PIPELINE_ENQUEUE, 	/**< Queues the frames for the clients */
+	PIPELINE_PHASES 	/**< Number of phases */
+};
+
+/**
+ * @brief What becomes of a message.
+ */
+enum pipeline_verdict {
+	PIPELINE_PASS, 		/**< Goes on to the next stage */
+	PIPELINE_DROP, 		/**< Thrown away */
+	PIPELINE_DONE 		/**< Fully handled, the next stages skip it */
+};
+
+/**
+ * @brief A message going through the pipeline.
+ *
+ * Stages skip the messages that are not @c PIPELINE_PASS.
+ */
+struct pipeline_msg {
+	void *origin; 					/**< Who sent it, as given to pipeline_batch_create() */
+	const char *sender; 			/**< The sender name */
+	char *content; 					/**< The content, @c NUL terminated once validated; may be shortened in place */
+	size_t content_len; 			/**< The content length; before validation, the payload length */
+	enum pipeline_verdict verdict; 	/**< What becomes of it */
+	bool traced; 					/**< Whether @c trace is in use */
+	struct frame_trace trace; 		/**< The trace stamps taken so far */
+	char *out; 						/**< The frame built from it, freed with the batch */
+	size_t out_len; 				/**< The frame length */
+	size_t out_hlen; 				/**< The frame header length */
+};
+
+/**
+ * @brief Function run by a stage on a batch of messages.
+ */
+typedef void (*pipeline_fn)(struct pipeline_msg *msgs, size_t n, void *arg);
+
+/**
+ * @brief A stage, as added to a pipeline or exported by a plugin.
+ */
+struct pipeline_stage_def {
+	const char *name; 			/**< Name shown by pipeline_print() */
+	enum pipeline_phase phase; 	/**< Where it goes */
+	int flags; 					/**< @c PIPELINE_HEAVY or @c 0 */
+	pipeline_fn fn; 			/**< What it runs */
+	void *arg; 					/**< The argument given to @c fn */
+};
+
+struct pipeline;
+struct pipeline_batch;
+struct pipeline_source;
+
+struct pipeline *pipeline_create(void);
+void pipeline_destroy(struct pipeline *p);
+int pipeline_add_stage(struct pipeline *p, const struct pipeline_stage_def *def);
+int pipeline_load_plugin(struct pipeline *p, const char *path);
+int pipeline_start(struct pipeline *p);
+struct pipeline_source *pipeline_source_create(void);
+void pipeline_source_destroy(struct pipeline_source *src);
+void pipeline_source_drain(struct pipeline_source *src);
+size_t pipeline_source_size(void);
+size_t pipeline_get_inflight(void);
+struct pipeline_batch *pipeline_batch_create(struct pipeline_source *src, void *origin, const char *sender);
+struct pipeline_msg *pipeline_batch_add(struct pipeline_batch *b, const char *payload, size_t len);
+size_t pipeline_batch_len(struct pipeline_batch *b);
+void pipeline_run(struct pipeline *p, struct pipeline_batch *b);
+void pipeline_print(struct pipeline *p, FILE *f);
+
+#endif
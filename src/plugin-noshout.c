@@ -0,0 +1,42 @@
+#include <ctype.h>
+
+#include "pipeline.h"
+
+/** @brief Messages shorter than this may be all capitals, like "OK" or "LOL". */
+#define NOSHOUT_MIN_LEN 8
+
+/**
+ * @brief Filter stage: lowercases the messages written only in capitals.
+ *
+ * @param[in,out] msgs The batch.
+ * @param[in] n The number of messages.
+ * @param[in] arg Unused.
+ */
+static void noshout(struct pipeline_msg *msgs, size_t n, void *arg)
+{
+	(void)arg;
+
+	for (size_t i = 0; i < n; i++) {
+		struct pipeline_msg *m = &msgs[i];
+		if (m->verdict != PIPELINE_PASS || m->content_len < NOSHOUT_MIN_LEN)
+			continue;
+
+		size_t upper = 0, lower = 0;
+		for (size_t j = 0; j < m->content_len; j++) {
+			upper += isupper((unsigned char)m->content[j]) != 0;
+			lower += islower((unsigned char)m->content[j]) != 0;
+		}
+
+		if (upper >= NOSHOUT_MIN_LEN && lower == 0) {
+			for (size_t j = 0; j < m->content_len; j++) {
+				m->content[j] = tolower((unsigned char)m->content[j]);
+			}
+		}
+	}
+}
+
+/** @brief The stages of the plugin, see pipeline_load_plugin(). */
+const struct pipeline_stage_def pipeline_stages[] = {
+	{ "noshout", 	PIPELINE_FILTER, 	0, noshout, 	NULL },
+	{ NULL, 		0, 					0, NULL, 		NULL }
+};
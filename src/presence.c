@@ -0,0 +1,175 @@
+#include "presence.h"
+
+/**
+ * @brief One pending presence change.
+ */
+struct presence_entry {
+	char *name; 	/**< The username */
+	char kind; 		/**< @c PRESENCE_JOIN or @c PRESENCE_LEAVE */
+};
+
+/**
+ * @brief The joins and leaves waiting to be sent in the next presence delta.
+ *
+ * A join and a leave of the same name in the same window cancel each other, so
+ * a client that drops and comes back between two deltas is not shown at all.
+ *
+ * @warning The presence does no locking, the caller must serialize the calls.
+ */
+struct presence {
+	struct presence_entry *entries; 	/**< The changes, in the order they happened */
+	size_t len; 						/**< Number of changes */
+	size_t cap; 						/**< Number of entries allocated */
+	size_t joins; 						/**< Number of changes that are joins */
+};
+
+/**
+ * @brief Create an empty presence delta.
+ *
+ * @return A pointer to the presence in case of success, NULL otherwise.
+ * The presence must be freed, using presence_destroy().
+ */
+struct presence *presence_create(void)
+{
+	return calloc(1, sizeof(struct presence));
+}
+
+/**
+ * @brief Destroys a presence delta.
+ *
+ * @param[in] p The presence.
+ */
+void presence_destroy(struct presence *p)
+{
+	if (p) {
+		presence_clear(p);
+		free(p->entries);
+		free(p);
+	}
+}
+
+/**
+ * @brief Record a change, or cancel the opposite change of the same name.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+static int presence_add(struct presence *p, const char *name, char kind)
+{
+	/* Only look for the opposite change if there is one, so a join storm stays linear */
+	size_t opposite = (kind == PRESENCE_JOIN) ? p->len - p->joins : p->joins;
+
+	for (size_t i = p->len; opposite && i-- > 0; ) {
+		struct presence_entry *e = &p->entries[i];
+		if (e->kind != kind && strcmp(e->name, name) == 0) {
+			free(e->name);
+			memmove(e, e + 1, (p->len - i - 1) * sizeof(struct presence_entry));
+			p->len--;
+			if (kind == PRESENCE_LEAVE)
+				p->joins--;
+			return 0;
+		}
+	}
+
+	if (p->len == p->cap) {
+		size_t cap = p->cap ? 2 * p->cap : 64;
+		struct presence_entry *tmp = realloc(p->entries, cap * sizeof(struct presence_entry));
+		if (!tmp)
+			return -1;
+		p->entries 	= tmp;
+		p->cap 		= cap;
+	}
+
+	char *copy = malloc(strlen(name) + 1);
+	if (!copy)
+		return -1;
+	strcpy(copy, name);
+
+	p->entries[p->len].name = copy;
+	p->entries[p->len].kind = kind;
+	p->len++;
+	if (kind == PRESENCE_JOIN)
+		p->joins++;
+
+	return 0;
+}
+
+/**
+ * @brief Record that a user entered the room.
+ *
+ * @param[in] p The presence.
+ * @param[in] name The username; it is copied.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+int presence_join(struct presence *p, const char *name)
+{
+	return presence_add(p, name, PRESENCE_JOIN);
+}
+
+/**
+ * @brief Record that a user left the room.
+ *
+ * @param[in] p The presence.
+ * @param[in] name The username; it is copied.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+int presence_leave(struct presence *p, const char *name)
+{
+	return presence_add(p, name, PRESENCE_LEAVE);
+}
+
+/**
+ * @brief Checks if there are changes waiting to be sent.
+ *
+ * @param[in] p The presence.
+ *
+ * @return @c true if there are, @c false otherwise.
+ */
+bool presence_is_pending(struct presence *p)
+{
+	return p->len > 0;
+}
+
+/**
+ * @brief Pack as many changes as fit in a buffer.
+ *
+ * Every change is its kind followed by the @c NUL terminated username.
+ *
+ * @param[in] p The presence.
+ * @param[in,out] from The first change to pack; updated to the first one that did not fit.
+ * @param[out] buf Where the changes are packed.
+ * @param[in] len The buffer length.
+ *
+ * @return The number of bytes packed.
+ */
+size_t presence_pack(struct presence *p, size_t *from, char *buf, size_t len)
+{
+	size_t off = 0;
+
+	for ( ; *from < p->len; (*from)++) {
+		struct presence_entry *e = &p->entries[*from];
+		size_t need = strlen(e->name) + 2;
+		if (off + need > len)
+			break;
+		buf[off] = e->kind;
+		memcpy(buf + off + 1, e->name, need - 1);
+		off += need;
+	}
+
+	return off;
+}
+
+/**
+ * @brief Forget all the changes, once they were sent.
+ *
+ * @param[in] p The presence.
+ */
+void presence_clear(struct presence *p)
+{
+	for (size_t i = 0; i < p->len; i++) {
+		free(p->entries[i].name);
+	}
+	p->len 	 = 0;
+	p->joins = 0;
+}
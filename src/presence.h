@@ -0,0 +1,24 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+/** @brief Presence record kind: the user entered the room. */
+#define PRESENCE_JOIN '+'
+
+/** @brief Presence record kind: the user left the room. */
+#define PRESENCE_LEAVE '-'
+
+struct presence;
+
+struct presence *presence_create(void);
+void presence_destroy(struct presence *p);
+int presence_join(struct presence *p, const char *name);
+int presence_leave(struct presence *p, const char *name);
+bool presence_is_pending(struct presence *p);
+size_t presence_pack(struct presence *p, size_t *from, char *buf, size_t len);
+void presence_clear(struct presence *p);
+
+#endif
@@ -0,0 +1,1078 @@
+#include "search.h"
+#include "message.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+
+#include <pthread.h>
+
+#include "lockstat.h"
+
+/**
+ * @brief A message that can be returned by a query.
+ */
+struct search_doc {
+	uint64_t seq; 	/**< Sequence number given by the history */
+	time_t when; 	/**< When the message was broadcast */
+	char *pack; 	/**< The packed message */
+	uint32_t len; 	/**< The packed message length */
+};
+
+/**
+ * @brief A message waiting to be indexed.
+ */
+struct search_pending {
+	struct search_pending *next; 	/**< The next one, in broadcast order */
+	struct search_doc doc; 			/**< The message */
+};
+
+/**
+ * @brief The documents containing a term, in the segment being filled.
+ */
+struct search_posting_list {
+	char *term; 	/**< The term, NULL if the slot is free */
+	uint32_t *docs; /**< The documents, in increasing order */
+	uint32_t n; 	/**< Number of documents */
+	uint32_t cap; 	/**< Number of documents allocated */
+};
+
+/**
+ * @brief The segment being filled: a hash table from terms to uncompressed postings.
+ */
+struct search_active {
+	struct search_posting_list *slots; 	/**< Open addressing table */
+	size_t cap; 						/**< Number of slots, a power of two */
+	size_t used; 						/**< Number of slots taken */
+	uint32_t first_doc; 				/**< First document of the segment */
+	uint32_t ndocs; 					/**< Number of documents in the segment */
+};
+
+/**
+ * @brief A term of a frozen segment.
+ */
+struct search_term {
+	uint32_t text; 	/**< Offset of the term in the segment text pool */
+	uint32_t df; 	/**< Number of documents containing it */
+	uint64_t off; 	/**< Offset of its postings */
+	uint32_t len; 	/**< Bytes of its postings */
+};
+
+/**
+ * @brief An immutable segment.
+ *
+ * Terms are sorted, and their postings are the documents as variable length
+ * deltas from the previous one, the first from @c first_doc.
+ */
+struct search_segment {
+	uint32_t first_doc; 		/**< First document of the segment */
+	uint32_t ndocs; 			/**< Number of documents in the segment */
+	int level; 					/**< How many merges built it; merges combine segments of the same level */
+	struct search_term *terms; 	/**< The sorted terms */
+	size_t nterms; 				/**< Number of terms */
+	char *text; 				/**< The terms text, all of them @c NUL terminated */
+	uint8_t *postings; 			/**< The compressed postings */
+	size_t postings_len; 		/**< Bytes of postings */
+};
+
+/**
+ * @brief An inverted index over the broadcast messages.
+ *
+ * Messages are handed over by search_submit(), which only queues them; an indexing
+ * thread adds them to the active segment, and freezes it every @c SEARCH_SEGMENT_DOCS
+ * messages. A merging thread combines @c SEARCH_MERGE_FANOUT segments of the same
+ * level into one, so a query visits a logarithmic number of segments.
+ *
+ * Documents are never moved or freed before search_destroy(), so a query may read
+ * them after releasing the lock.
+ */
+struct search_index {
+	struct lockstat *lock;								/**< Protects the fields up to @c merges */
+	struct search_doc *chunks[SEARCH_MAX_CHUNKS]; 		/**< The document store */
+	uint32_t ndocs; 									/**< Number of documents indexed */
+	struct search_active active; 						/**< The segment being filled */
+	struct search_segment **segments; 					/**< The frozen segments, oldest first */
+	size_t nsegments; 									/**< Number of frozen segments */
+	size_t segcap; 										/**< Number of segments allocated */
+	uint64_t merges; 									/**< Number of merges done */
+
+	struct lockstat *queue_mutex;						/**< Protects the fields up to @c stop */
+	pthread_cond_t queue_cond; 							/**< Signaled when a message is queued */
+	struct search_pending *head; 						/**< Oldest message waiting */
+	struct search_pending *tail; 						/**< Newest message waiting */
+	size_t queued; 										/**< Number of messages waiting */
+	bool merge_wanted; 									/**< Whether a segment was frozen since the last merge pass */
+	bool stop; 											/**< Whether the threads must exit */
+	pthread_cond_t merge_cond; 							/**< Signaled when a segment is frozen */
+
+	pthread_t indexer; 									/**< Runs indexer_thread() */
+	pthread_t merger; 									/**< Runs merger_thread() */
+};
+
+/**
+ * @brief FNV-1a hash of a term.
+ */
+static uint64_t term_hash(const char *term)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for ( ; *term; term++) {
+		h ^= (unsigned char)*term;
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
+
+/**
+ * @brief Find the slot of a term in the active segment.
+ *
+ * @return The slot holding the term, or the free slot where it belongs.
+ */
+static struct search_posting_list *active_slot(struct search_active *a, const char *term)
+{
+	size_t i = term_hash(term) & (a->cap - 1);
+
+	while (a->slots[i].term && strcmp(a->slots[i].term, term) != 0) {
+		i = (i + 1) & (a->cap - 1);
+	}
+
+	return &a->slots[i];
+}
+
+/**
+ * @brief Double the active segment table.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+static int active_grow(struct search_active *a)
+{
+	struct search_active bigger = *a;
+	bigger.cap 		= a->cap ? 2 * a->cap : 1024;
+	bigger.slots 	= calloc(bigger.cap, sizeof(struct search_posting_list));
+	if (!bigger.slots)
+		return -1;
+
+	for (size_t i = 0; i < a->cap; i++) {
+		if (a->slots[i].term)
+			*active_slot(&bigger, a->slots[i].term) = a->slots[i];
+	}
+
+	free(a->slots);
+	*a = bigger;
+
+	return 0;
+}
+
+/**
+ * @brief Add a document to the postings of a term in the active segment.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+static int active_add(struct search_active *a, const char *term, uint32_t doc)
+{
+	if (2 * (a->used + 1) > a->cap && active_grow(a) == -1)
+		return -1;
+
+	struct search_posting_list *pl = active_slot(a, term);
+	if (!pl->term) {
+		pl->term = malloc(strlen(term) + 1);
+		if (!pl->term)
+			return -1;
+		strcpy(pl->term, term);
+		a->used++;
+	}
+
+	/* The same term twice in a message */
+	if (pl->n && pl->docs[pl->n - 1] == doc)
+		return 0;
+
+	if (pl->n == pl->cap) {
+		uint32_t cap = pl->cap ? 2 * pl->cap : 4;
+		uint32_t *tmp = realloc(pl->docs, cap * sizeof(uint32_t));
+		if (!tmp)
+			return -1;
+		pl->docs = tmp;
+		pl->cap  = cap;
+	}
+	pl->docs[pl->n++] = doc;
+
+	return 0;
+}
+
+/**
+ * @brief Free the postings of the active segment.
+ */
+static void active_free(struct search_active *a)
+{
+	for (size_t i = 0; i < a->cap; i++) {
+		free(a->slots[i].term);
+		free(a->slots[i].docs);
+	}
+	free(a->slots);
+	memset(a, 0, sizeof(*a));
+}
+
+/**
+ * @brief Free a frozen segment.
+ */
+static void segment_free(struct search_segment *seg)
+{
+	if (seg) {
+		free(seg->terms);
+		free(seg->text);
+		free(seg->postings);
+		free(seg);
+	}
+}
+
+/**
+ * @brief A segment being written by segment_builder_add().
+ */
+struct segment_builder {
+	struct search_segment *seg; /**< The segment */
+	size_t text_len; 			/**< Bytes used in the text pool */
+	size_t text_cap; 			/**< Bytes allocated for the text pool */
+	size_t terms_cap; 			/**< Number of terms allocated */
+	size_t postings_cap; 		/**< Bytes allocated for the postings */
+};
+
+/**
+ * @brief Make room for @p len more elements of @p size bytes in a growing buffer.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+static int reserve(void **buf, size_t *cap, size_t used, size_t len, size_t size)
+{
+	if (used + len <= *cap)
+		return 0;
+
+	size_t newcap = *cap ? *cap : 256;
+	while (newcap < used + len)
+		newcap *= 2;
+
+	void *tmp = realloc(*buf, newcap * size);
+	if (!tmp)
+		return -1;
+	*buf = tmp;
+	*cap = newcap;
+
+	return 0;
+}
+
+/**
+ * @brief Append a term and its documents to a segment; terms must come in order.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+static int segment_builder_add(struct segment_builder *b, const char *term, const uint32_t *docs, uint32_t n)
+{
+	struct search_segment *seg = b->seg;
+	size_t tlen = strlen(term) + 1;
+
+	if (reserve((void **)&seg->terms, &b->terms_cap, seg->nterms, 1, sizeof(struct search_term)) == -1
+			|| reserve((void **)&seg->text, &b->text_cap, b->text_len, tlen, 1) == -1
+			|| reserve((void **)&seg->postings, &b->postings_cap, seg->postings_len, 5 * (size_t)n, 1) == -1)
+		return -1;
+
+	struct search_term *t = &seg->terms[seg->nterms++];
+	t->text = b->text_len;
+	t->df 	= n;
+	t->off 	= seg->postings_len;
+	memcpy(seg->text + b->text_len, term, tlen);
+	b->text_len += tlen;
+
+	uint32_t prev = seg->first_doc;
+	uint8_t *p = seg->postings + seg->postings_len;
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t delta = docs[i] - prev;
+		prev = docs[i];
+		while (delta >= 0x80) {
+			*p++ = (delta & 0x7f) | 0x80;
+			delta >>= 7;
+		}
+		*p++ = delta;
+	}
+	t->len = p - (seg->postings + seg->postings_len);
+	seg->postings_len += t->len;
+
+	return 0;
+}
+
+/**
+ * @brief Decode postings.
+ *
+ * @param[in] p The postings.
+ * @param[in] len Bytes of postings.
+ * @param[in] base The first document of the segment.
+ * @param[out] out The documents; must hold the term document frequency.
+ *
+ * @return The number of documents decoded.
+ */
+static uint32_t decode_postings(const uint8_t *p, uint32_t len, uint32_t base, uint32_t *out)
+{
+	const uint8_t *end = p + len;
+	uint32_t n = 0;
+	uint32_t doc = base;
+
+	while (p < end) {
+		uint32_t delta = 0;
+		int shift = 0;
+		while (*p & 0x80) {
+			delta |= (uint32_t)(*p++ & 0x7f) << shift;
+			shift += 7;
+		}
+		delta |= (uint32_t)*p++ << shift;
+		doc += delta;
+		out[n++] = doc;
+	}
+
+	return n;
+}
+
+/**
+ * @brief Find a term in a frozen segment.
+ *
+ * @return The term, NULL if the segment does not have it.
+ */
+static const struct search_term *segment_find(const struct search_segment *seg, const char *term)
+{
+	size_t lo = 0;
+	size_t hi = seg->nterms;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(seg->text + seg->terms[mid].text, term);
+		if (cmp == 0)
+			return &seg->terms[mid];
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Compare two posting lists by term, for qsort().
+ */
+static int compare_posting_lists(const void *a, const void *b)
+{
+	const struct search_posting_list *x = *(const struct search_posting_list * const *)a;
+	const struct search_posting_list *y = *(const struct search_posting_list * const *)b;
+
+	return strcmp(x->term, y->term);
+}
+
+/**
+ * @brief Build a frozen segment out of the active one.
+ *
+ * Only the indexer thread changes the active segment, so it can read it unlocked.
+ *
+ * @return The segment, NULL in case of error.
+ */
+static struct search_segment *active_freeze(struct search_active *a)
+{
+	struct search_posting_list **lists = malloc(a->used * sizeof(*lists));
+	struct segment_builder b = { calloc(1, sizeof(struct search_segment)), 0, 0, 0, 0 };
+	if (!lists || !b.seg)
+		goto fail;
+
+	size_t n = 0;
+	for (size_t i = 0; i < a->cap; i++) {
+		if (a->slots[i].term)
+			lists[n++] = &a->slots[i];
+	}
+	qsort(lists, n, sizeof(*lists), compare_posting_lists);
+
+	b.seg->first_doc 	= a->first_doc;
+	b.seg->ndocs 		= a->ndocs;
+	for (size_t i = 0; i < n; i++) {
+		if (segment_builder_add(&b, lists[i]->term, lists[i]->docs, lists[i]->n) == -1)
+			goto fail;
+	}
+
+	free(lists);
+	return b.seg;
+
+fail:
+	free(lists);
+	segment_free(b.seg);
+	return NULL;
+}
+
+/**
+ * @brief A term of one of the segments being merged.
+ */
+struct merge_term {
+	const char *text; 					/**< The term */
+	const struct search_segment *seg; 	/**< Its segment */
+	const struct search_term *term; 	/**< Its entry in the segment */
+	size_t order; 						/**< Position of the segment in the run */
+};
+
+/**
+ * @brief Compare merge terms by term, then by segment, for qsort().
+ */
+static int compare_merge_terms(const void *a, const void *b)
+{
+	const struct merge_term *x = a;
+	const struct merge_term *y = b;
+	int cmp = strcmp(x->text, y->text);
+	if (cmp)
+		return cmp;
+
+	return (x->order > y->order) - (x->order < y->order);
+}
+
+/**
+ * @brief Merge consecutive segments into one.
+ *
+ * Their documents do not overlap and come in order, so the postings of a term are
+ * the concatenation of its postings in every segment.
+ *
+ * @return The merged segment, NULL in case of error.
+ */
+static struct search_segment *segments_merge(struct search_segment **segs, size_t n)
+{
+	size_t total = 0;
+	uint32_t ndocs = 0;
+	for (size_t i = 0; i < n; i++) {
+		total += segs[i]->nterms;
+		ndocs += segs[i]->ndocs;
+	}
+
+	struct merge_term *all 	= malloc(total * sizeof(struct merge_term));
+	uint32_t *docs 			= malloc(ndocs * sizeof(uint32_t));
+	struct segment_builder b = { calloc(1, sizeof(struct search_segment)), 0, 0, 0, 0 };
+	if (!all || !docs || !b.seg)
+		goto fail;
+
+	size_t k = 0;
+	for (size_t i = 0; i < n; i++) {
+		for (size_t j = 0; j < segs[i]->nterms; j++) {
+			const struct search_term *t = &segs[i]->terms[j];
+			all[k++] = (struct merge_term){ segs[i]->text + t->text, segs[i], t, i };
+		}
+	}
+	qsort(all, total, sizeof(struct merge_term), compare_merge_terms);
+
+	b.seg->first_doc 	= segs[0]->first_doc;
+	b.seg->ndocs 		= ndocs;
+	b.seg->level 		= segs[0]->level + 1;
+
+	for (size_t i = 0; i < total; ) {
+		uint32_t count = 0;
+		size_t j = i;
+		for ( ; j < total && strcmp(all[j].text, all[i].text) == 0; j++) {
+			const struct search_term *t = all[j].term;
+			count += decode_postings(all[j].seg->postings + t->off, t->len, all[j].seg->first_doc, docs + count);
+		}
+		if (segment_builder_add(&b, all[i].text, docs, count) == -1)
+			goto fail;
+		i = j;
+	}
+
+	free(all);
+	free(docs);
+	return b.seg;
+
+fail:
+	free(all);
+	free(docs);
+	segment_free(b.seg);
+	return NULL;
+}
+
+/**
+ * @brief Split a message into the terms it is indexed under.
+ *
+ * Words are runs of letters, digits, @c '_' and non-ASCII bytes, lower cased.
+ * The sender is indexed as @c from:name.
+ *
+ * @param[in] pack The packed message.
+ * @param[in] len The packed message length.
+ * @param[out] terms The terms, @c NUL terminated one after the other; must hold @c 2*len + @c SEARCH_TERM_MAX + 8 bytes.
+ *
+ * @return The number of terms.
+ */
+static size_t tokenize_message(const char *pack, uint32_t len, char *terms)
+{
+	struct message_view m;
+	if (message_view_decode(&m, pack, len) == -1)
+		return 0;
+
+	const char *end = m.content + m.content_len;
+	size_t n = 0;
+	char *out = terms;
+
+	for (const char *p = m.content; p < end; ) {
+		while (p < end && !(isalnum((unsigned char)*p) || *p == '_' || (unsigned char)*p >= 0x80))
+			p++;
+		if (p == end)
+			break;
+
+		size_t tlen = 0;
+		while (p < end && (isalnum((unsigned char)*p) || *p == '_' || (unsigned char)*p >= 0x80)) {
+			if (tlen < SEARCH_TERM_MAX)
+				out[tlen++] = tolower((unsigned char)*p);
+			p++;
+		}
+		out[tlen] = '\0';
+		out += tlen + 1;
+		n++;
+	}
+
+	if (m.sender_len) {
+		snprintf(out, SEARCH_TERM_MAX + 1, "from:%s", m.sender);
+		for (char *c = out; *c; c++) {
+			*c = tolower((unsigned char)*c);
+		}
+		n++;
+	}
+
+	return n;
+}
+
+/**
+ * @brief Index one message.
+ */
+static void index_doc(struct search_index *si, struct search_doc *doc)
+{
+	uint32_t id = si->ndocs;
+	if (id == SEARCH_MAX_CHUNKS * SEARCH_CHUNK_DOCS) {
+		free(doc->pack);
+		return;
+	}
+
+	if (!si->chunks[id / SEARCH_CHUNK_DOCS]) {
+		si->chunks[id / SEARCH_CHUNK_DOCS] = malloc(SEARCH_CHUNK_DOCS * sizeof(struct search_doc));
+		if (!si->chunks[id / SEARCH_CHUNK_DOCS]) {
+			free(doc->pack);
+			return;
+		}
+	}
+
+	char *terms = malloc(2 * (size_t)doc->len + SEARCH_TERM_MAX + 8);
+	if (!terms) {
+		free(doc->pack);
+		return;
+	}
+	size_t n = tokenize_message(doc->pack, doc->len, terms);
+
+	lockstat_lock(si->lock);
+
+	si->chunks[id / SEARCH_CHUNK_DOCS][id % SEARCH_CHUNK_DOCS] = *doc;
+	const char *t = terms;
+	for (size_t i = 0; i < n; i++, t += strlen(t) + 1) {
+		if (active_add(&si->active, t, id) == -1)
+			break;
+	}
+	si->active.ndocs++;
+	si->ndocs++;
+
+	lockstat_unlock(si->lock);
+
+	free(terms);
+}
+
+/**
+ * @brief Freeze the active segment, if it is full, and wake the merger up.
+ */
+static void maybe_freeze(struct search_index *si)
+{
+	if (si->active.ndocs < SEARCH_SEGMENT_DOCS)
+		return;
+
+	struct search_segment *seg = active_freeze(&si->active);
+	if (!seg)
+		return;
+
+	lockstat_lock(si->lock);
+
+	if (reserve((void **)&si->segments, &si->segcap, si->nsegments, 1, sizeof(*si->segments)) == -1) {
+		lockstat_unlock(si->lock);
+		segment_free(seg);
+		return;
+	}
+	si->segments[si->nsegments++] = seg;
+
+	uint32_t next = si->active.first_doc + si->active.ndocs;
+	active_free(&si->active);
+	si->active.first_doc = next;
+
+	lockstat_unlock(si->lock);
+
+	lockstat_lock(si->queue_mutex);
+	si->merge_wanted = true;
+	pthread_cond_signal(&si->merge_cond);
+	lockstat_unlock(si->queue_mutex);
+}
+
+/**
+ * @brief Keeps indexing the messages queued by search_submit().
+ */
+static void *indexer_thread(void *arg)
+{
+	struct search_index *si = arg;
+
+	while (true) {
+		lockstat_lock(si->queue_mutex);
+		while (!si->head && !si->stop) {
+			lockstat_cond_wait(si->queue_mutex, &si->queue_cond);
+		}
+		if (si->stop) {
+			lockstat_unlock(si->queue_mutex);
+			break;
+		}
+		struct search_pending *p = si->head;
+		si->head 	= NULL;
+		si->tail 	= NULL;
+		si->queued 	= 0;
+		lockstat_unlock(si->queue_mutex);
+
+		while (p) {
+			struct search_pending *next = p->next;
+			index_doc(si, &p->doc);
+			maybe_freeze(si);
+			free(p);
+			p = next;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Find @c SEARCH_MERGE_FANOUT consecutive segments of the same level.
+ *
+ * @param[in] si The index.
+ * @param[out] run The segments.
+ *
+ * @return The position of the first one, @c -1 if there are none.
+ */
+static ssize_t find_merge_run(struct search_index *si, struct search_segment *run[SEARCH_MERGE_FANOUT])
+{
+	ssize_t start = -1;
+
+	lockstat_rdlock(si->lock);
+	for (size_t i = 0; i + SEARCH_MERGE_FANOUT <= si->nsegments && start == -1; i++) {
+		size_t j = 1;
+		while (j < SEARCH_MERGE_FANOUT && si->segments[i + j]->level == si->segments[i]->level)
+			j++;
+		if (j == SEARCH_MERGE_FANOUT) {
+			start = i;
+			memcpy(run, &si->segments[i], SEARCH_MERGE_FANOUT * sizeof(*run));
+		}
+	}
+	lockstat_rdunlock(si->lock);
+
+	return start;
+}
+
+/**
+ * @brief Keeps merging segments, off the indexing path.
+ *
+ * Only this thread removes segments, and the indexer only appends them, so the run
+ * being merged stays where it was found, and its segments can be read without the lock.
+ */
+static void *merger_thread(void *arg)
+{
+	struct search_index *si = arg;
+
+	while (true) {
+		lockstat_lock(si->queue_mutex);
+		while (!si->merge_wanted && !si->stop) {
+			lockstat_cond_wait(si->queue_mutex, &si->merge_cond);
+		}
+		bool stop = si->stop;
+		si->merge_wanted = false;
+		lockstat_unlock(si->queue_mutex);
+		if (stop)
+			break;
+
+		struct search_segment *run[SEARCH_MERGE_FANOUT];
+		ssize_t start;
+		while ((start = find_merge_run(si, run)) != -1) {
+			struct search_segment *merged = segments_merge(run, SEARCH_MERGE_FANOUT);
+			if (!merged)
+				break;
+
+			lockstat_lock(si->lock);
+			si->segments[start] = merged;
+			memmove(&si->segments[start + 1], &si->segments[start + SEARCH_MERGE_FANOUT],
+					(si->nsegments - start - SEARCH_MERGE_FANOUT) * sizeof(*si->segments));
+			si->nsegments -= SEARCH_MERGE_FANOUT - 1;
+			si->merges++;
+			lockstat_unlock(si->lock);
+
+			for (int i = 0; i < SEARCH_MERGE_FANOUT; i++) {
+				segment_free(run[i]);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Create an empty index, and start its indexing and merging threads.
+ *
+ * @return A pointer to the index in case of success, NULL otherwise.
+ * The index must be freed, using search_destroy().
+ */
+struct search_index *search_create(void)
+{
+	struct search_index *si = calloc(1, sizeof(struct search_index));
+	if (!si)
+		return NULL;
+
+	si->lock 		= lockstat_create_rw("search index");
+	si->queue_mutex = lockstat_create("search queue");
+	pthread_cond_init(&si->queue_cond, NULL);
+	pthread_cond_init(&si->merge_cond, NULL);
+
+	if (!si->lock || !si->queue_mutex || pthread_create(&si->indexer, NULL, indexer_thread, si)) {
+		lockstat_destroy(si->lock);
+		lockstat_destroy(si->queue_mutex);
+		free(si);
+		return NULL;
+	}
+	if (pthread_create(&si->merger, NULL, merger_thread, si)) {
+		lockstat_lock(si->queue_mutex);
+		si->stop = true;
+		pthread_cond_signal(&si->queue_cond);
+		lockstat_unlock(si->queue_mutex);
+		pthread_join(si->indexer, NULL);
+		lockstat_destroy(si->lock);
+		lockstat_destroy(si->queue_mutex);
+		free(si);
+		return NULL;
+	}
+
+	return si;
+}
+
+/**
+ * @brief Stop the index threads and free everything.
+ *
+ * Messages still queued are dropped.
+ *
+ * @param[in] si The index.
+ */
+void search_destroy(struct search_index *si)
+{
+	if (!si)
+		return;
+
+	lockstat_lock(si->queue_mutex);
+	si->stop = true;
+	pthread_cond_signal(&si->queue_cond);
+	pthread_cond_signal(&si->merge_cond);
+	lockstat_unlock(si->queue_mutex);
+	pthread_join(si->indexer, NULL);
+	pthread_join(si->merger, NULL);
+
+	for (struct search_pending *p = si->head, *next; p; p = next) {
+		next = p->next;
+		free(p->doc.pack);
+		free(p);
+	}
+	for (uint32_t i = 0; i < si->ndocs; i++) {
+		free(si->chunks[i / SEARCH_CHUNK_DOCS][i % SEARCH_CHUNK_DOCS].pack);
+	}
+	for (int i = 0; i < SEARCH_MAX_CHUNKS; i++) {
+		free(si->chunks[i]);
+	}
+	for (size_t i = 0; i < si->nsegments; i++) {
+		segment_free(si->segments[i]);
+	}
+	free(si->segments);
+	active_free(&si->active);
+
+	lockstat_destroy(si->lock);
+	lockstat_destroy(si->queue_mutex);
+	pthread_cond_destroy(&si->queue_cond);
+	pthread_cond_destroy(&si->merge_cond);
+	free(si);
+}
+
+/**
+ * @brief Queue a message to be indexed.
+ *
+ * Only copies the message and queues it; the indexing happens in another thread.
+ *
+ * @param[in] si The index.
+ * @param[in] seq The message sequence number.
+ * @param[in] pack The packed message.
+ * @param[in] len The packed message length.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+int search_submit(struct search_index *si, uint64_t seq, const char *pack, uint32_t len)
+{
+	struct search_pending *p = malloc(sizeof(struct search_pending));
+	char *copy = malloc(len);
+	if (!p || !copy) {
+		free(p);
+		free(copy);
+		return -1;
+	}
+	memcpy(copy, pack, len);
+
+	p->next = NULL;
+	p->doc 	= (struct search_doc){ seq, time(NULL), copy, len };
+
+	lockstat_lock(si->queue_mutex);
+	if (si->tail)
+		si->tail->next = p;
+	else
+		si->head = p;
+	si->tail = p;
+	si->queued++;
+	pthread_cond_signal(&si->queue_cond);
+	lockstat_unlock(si->queue_mutex);
+
+	return 0;
+}
+
+/**
+ * @brief Split a query into terms, the way messages are.
+ *
+ * Words starting with @c from: are kept whole, to look for a sender.
+ *
+ * @return The number of terms.
+ */
+static size_t tokenize_query(const char *query, char terms[SEARCH_QUERY_TERMS][SEARCH_TERM_MAX + 1])
+{
+	size_t n = 0;
+	const char *p = query;
+
+	while (*p && n < SEARCH_QUERY_TERMS) {
+		while (*p == ' ' || *p == '\t')
+			p++;
+		size_t wlen = strcspn(p, " \t");
+		if (wlen == 0)
+			break;
+
+		if (wlen > 5 && strncmp(p, "from:", 5) == 0) {
+			size_t tlen = wlen < SEARCH_TERM_MAX ? wlen : SEARCH_TERM_MAX;
+			for (size_t i = 0; i < tlen; i++) {
+				terms[n][i] = tolower((unsigned char)p[i]);
+			}
+			terms[n++][tlen] = '\0';
+		} else {
+			for (const char *w = p; w < p + wlen && n < SEARCH_QUERY_TERMS; ) {
+				while (w < p + wlen && !(isalnum((unsigned char)*w) || *w == '_' || (unsigned char)*w >= 0x80))
+					w++;
+				size_t tlen = 0;
+				while (w < p + wlen && (isalnum((unsigned char)*w) || *w == '_' || (unsigned char)*w >= 0x80)) {
+					if (tlen < SEARCH_TERM_MAX)
+						terms[n][tlen++] = tolower((unsigned char)*w);
+					w++;
+				}
+				if (tlen) {
+					terms[n++][tlen] = '\0';
+				}
+			}
+		}
+		p += wlen;
+	}
+
+	return n;
+}
+
+/**
+ * @brief Intersect two sorted lists of documents in place.
+ *
+ * @return The length of the intersection, stored in @p a.
+ */
+static uint32_t intersect(uint32_t *a, uint32_t na, const uint32_t *b, uint32_t nb)
+{
+	uint32_t i = 0, j = 0, n = 0;
+
+	while (i < na && j < nb) {
+		if (a[i] < b[j])
+			i++;
+		else if (a[i] > b[j])
+			j++;
+		else {
+			a[n++] = a[i];
+			i++;
+			j++;
+		}
+	}
+
+	return n;
+}
+
+/**
+ * @brief Collect the documents of a segment that contain every term.
+ *
+ * @warning The index lock must be held.
+ *
+ * @return The matches, in increasing order, NULL if none; @p n is set to their number.
+ */
+static uint32_t *segment_match(const struct search_segment *seg, char terms[][SEARCH_TERM_MAX + 1],
+		size_t nterms, uint32_t *n)
+{
+	const struct search_term *found[SEARCH_QUERY_TERMS];
+
+	*n = 0;
+	/* Start with the rarest term, so the working set is as small as possible */
+	size_t rarest = 0;
+	for (size_t i = 0; i < nterms; i++) {
+		found[i] = segment_find(seg, terms[i]);
+		if (!found[i])
+			return NULL;
+		if (found[i]->df < found[rarest]->df)
+			rarest = i;
+	}
+
+	uint32_t *docs 	= malloc(found[rarest]->df * sizeof(uint32_t));
+	uint32_t *other = NULL;
+	if (!docs)
+		return NULL;
+	*n = decode_postings(seg->postings + found[rarest]->off, found[rarest]->len, seg->first_doc, docs);
+
+	for (size_t i = 0; i < nterms && *n; i++) {
+		if (i == rarest)
+			continue;
+		uint32_t *tmp = realloc(other, found[i]->df * sizeof(uint32_t));
+		if (!tmp) {
+			*n = 0;
+			break;
+		}
+		other = tmp;
+		uint32_t m = decode_postings(seg->postings + found[i]->off, found[i]->len, seg->first_doc, other);
+		*n = intersect(docs, *n, other, m);
+	}
+
+	free(other);
+	return docs;
+}
+
+/**
+ * @brief Collect the documents of the active segment that contain every term.
+ *
+ * @warning The index lock must be held.
+ *
+ * @return The matches, in increasing order, NULL if none; @p n is set to their number.
+ */
+static uint32_t *active_match(struct search_active *a, char terms[][SEARCH_TERM_MAX + 1], size_t nterms, uint32_t *n)
+{
+	struct search_posting_list *found[SEARCH_QUERY_TERMS];
+
+	*n = 0;
+	if (!a->cap)
+		return NULL;
+
+	size_t rarest = 0;
+	for (size_t i = 0; i < nterms; i++) {
+		found[i] = active_slot(a, terms[i]);
+		if (!found[i]->term)
+			return NULL;
+		if (found[i]->n < found[rarest]->n)
+			rarest = i;
+	}
+
+	uint32_t *docs = malloc(found[rarest]->n * sizeof(uint32_t));
+	if (!docs)
+		return NULL;
+	memcpy(docs, found[rarest]->docs, found[rarest]->n * sizeof(uint32_t));
+	*n = found[rarest]->n;
+
+	for (size_t i = 0; i < nterms && *n; i++) {
+		if (i != rarest)
+			*n = intersect(docs, *n, found[i]->docs, found[i]->n);
+	}
+
+	return docs;
+}
+
+/**
+ * @brief Look for the messages containing every word of a query.
+ *
+ * @param[in] si The index.
+ * @param[in] query The words; @c from:name only matches messages sent by @c name.
+ * @param[in] max Maximum number of matches given to @p fn.
+ * @param[in] fn Called for the @p max most recent matches, newest first.
+ * @param[in] arg The argument given to @p fn.
+ *
+ * @return The number of messages matching, which may be more than @p max.
+ */
+size_t search_query(struct search_index *si, const char *query, size_t max, search_fn fn, void *arg)
+{
+	char terms[SEARCH_QUERY_TERMS][SEARCH_TERM_MAX + 1];
+	size_t nterms = tokenize_query(query, terms);
+	if (nterms == 0)
+		return 0;
+
+	uint32_t *best = malloc(max * sizeof(uint32_t));
+	if (!best)
+		return 0;
+	size_t nbest = 0;
+	size_t total = 0;
+
+	lockstat_rdlock(si->lock);
+
+	/* From the newest segment to the oldest */
+	for (ssize_t i = si->nsegments; i >= 0; i--) {
+		uint32_t n;
+		uint32_t *docs = (i == (ssize_t)si->nsegments)
+				? active_match(&si->active, terms, nterms, &n)
+				: segment_match(si->segments[i], terms, nterms, &n);
+
+		total += n;
+		for (uint32_t j = n; j-- > 0 && nbest < max; ) {
+			best[nbest++] = docs[j];
+		}
+		free(docs);
+	}
+
+	lockstat_rdunlock(si->lock);
+
+	/* Documents never move once indexed */
+	for (size_t i = 0; i < nbest; i++) {
+		struct search_doc *d = &si->chunks[best[i] / SEARCH_CHUNK_DOCS][best[i] % SEARCH_CHUNK_DOCS];
+		fn(d->seq, d->when, d->pack, d->len, arg);
+	}
+
+	free(best);
+	return total;
+}
+
+/**
+ * @brief Print the index statistics.
+ *
+ * @param[in] si The index.
+ * @param[in] f Where to print.
+ */
+void search_print(struct search_index *si, FILE *f)
+{
+	lockstat_lock(si->queue_mutex);
+	size_t queued = si->queued;
+	lockstat_unlock(si->queue_mutex);
+
+	lockstat_rdlock(si->lock);
+
+	size_t postings = 0, entries = 0, nterms = 0;
+	for (size_t i = 0; i < si->nsegments; i++) {
+		struct search_segment *seg = si->segments[i];
+		postings += seg->postings_len;
+		nterms += seg->nterms;
+		for (size_t j = 0; j < seg->nterms; j++) {
+			entries += seg->terms[j].df;
+		}
+	}
+
+	fprintf(f, "search: %u messages indexed, %zu queued, %zu segments (+%u messages in memory), %llu merges\n",
+			si->ndocs, queued, si->nsegments, si->active.ndocs, (unsigned long long)si->merges);
+	fprintf(f, "    %zu terms, %zu postings in %zu bytes (%.2f bytes each)\n",
+			nterms, entries, postings, entries ? (double)postings / entries : 0.0);
+	for (size_t i = 0; i < si->nsegments; i++) {
+		fprintf(f, "    segment %zu: level %d, %u messages, %zu terms\n",
+				i, si->segments[i]->level, si->segments[i]->ndocs, si->segments[i]->nterms);
+	}
+
+	lockstat_rdunlock(si->lock);
+}
@@ -0,0 +1,41 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+/** @brief Messages indexed in memory before they are frozen into a compressed segment. */
+#define SEARCH_SEGMENT_DOCS 4096
+
+/** @brief Number of segments of the same size that are merged into one. */
+#define SEARCH_MERGE_FANOUT 4
+
+/** @brief Longest term indexed; longer words are truncated. */
+#define SEARCH_TERM_MAX 32
+
+/** @brief Maximum number of terms in a query. */
+#define SEARCH_QUERY_TERMS 8
+
+/** @brief Messages per chunk of the document store. */
+#define SEARCH_CHUNK_DOCS 65536
+
+/** @brief Maximum number of chunks of the document store; messages beyond it are not indexed. */
+#define SEARCH_MAX_CHUNKS 1024
+
+struct search_index;
+
+/**
+ * @brief Function called by search_query() for every match returned.
+ */
+typedef void (*search_fn)(uint64_t seq, time_t when, const char *pack, uint32_t len, void *arg);
+
+struct search_index *search_create(void);
+void search_destroy(struct search_index *si);
+int search_submit(struct search_index *si, uint64_t seq, const char *pack, uint32_t len);
+size_t search_query(struct search_index *si, const char *query, size_t max, search_fn fn, void *arg);
+void search_print(struct search_index *si, FILE *f);
+
+#endif
@@ -0,0 +1,297 @@
+#include "sequencer.h"
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "lockstat.h"
+
+/**
+ * @brief Gives the messages of a room their total order, and hands them to the fan-out.
+ *
+ * Any number of threads push messages, one thread takes them out. The queue is
+ * intrusive and lock-free: a push swaps itself in as the last message and then
+ * links the one before to it, so pushers never wait for each other nor for the
+ * sequencer. A message whose predecessor is not linked yet is invisible until it
+ * is; the sequencer yields meanwhile. The stub stands in as the first message
+ * when the queue would otherwise be empty.
+ *
+ * Only a push onto an empty queue takes the mutex, to wake the sequencer up.
+ */
+struct sequencer {
+	struct sequencer_msg *_Atomic tail; 	/**< Last message pushed, swapped in by the pushers */
+	struct sequencer_msg *head; 			/**< Next message to take out, sequencer only */
+	struct sequencer_msg stub; 				/**< Placeholder keeping the queue non-empty */
+	_Atomic size_t pending; 				/**< Messages being pushed or pushed, until their batch is fanned out */
+	struct lockstat *mutex;					/**< Protects the sleep of the sequencer */
+	pthread_cond_t cond; 					/**< Signaled when a message is pushed onto an empty queue */
+	bool stop; 								/**< Whether the thread must stop once the queue is empty */
+	pthread_t thread; 						/**< The sequencer thread */
+	sequencer_fn fn; 						/**< The fan-out */
+	void *arg; 								/**< The argument given to @c fn */
+	uint64_t next_seq; 						/**< Sequence number of the next message */
+	_Atomic uint64_t msgs; 					/**< Messages handed to the fan-out */
+	_Atomic uint64_t batches; 				/**< Batches handed to the fan-out */
+	_Atomic uint64_t largest; 				/**< Most messages in a batch */
+	_Atomic uint64_t wakeups; 				/**< Times a push woke the sequencer up */
+};
+
+static void *sequencer_thread(void *arg);
+
+/**
+ * @brief Create a message to push.
+ *
+ * @param[in] frame @p hlen bytes of room, then the packed message; freed with the message.
+ * @param[in] hlen Room for the header.
+ * @param[in] len The packed message length.
+ *
+ * @return A pointer to the message in case of success, NULL otherwise.
+ * The message must be pushed, or freed using sequencer_msg_destroy().
+ */
+struct sequencer_msg *sequencer_msg_create(char *frame, size_t hlen, size_t len)
+{
+	struct sequencer_msg *m = malloc(sizeof(struct sequencer_msg));
+	if (m) {
+		atomic_init(&m->next, NULL);
+		m->seq 			= 0;
+		m->from_client 	= false;
+		m->traced 		= false;
+		m->frame 		= frame;
+		m->hlen 		= hlen;
+		m->len 			= len;
+	}
+
+	return m;
+}
+
+/**
+ * @brief Destroys a message, and its frame.
+ *
+ * @param[in] m The message.
+ */
+void sequencer_msg_destroy(struct sequencer_msg *m)
+{
+	if (m) {
+		free(m->frame);
+		free(m);
+	}
+}
+
+/**
+ * @brief Create a sequencer, and start its thread.
+ *
+ * @param[in] first_seq Sequence number of the first message.
+ * @param[in] fn What the batches are handed to, on the sequencer thread.
+ * @param[in] arg The argument given to @p fn.
+ *
+ * @return A pointer to the sequencer in case of success, NULL otherwise.
+ * The sequencer must be freed, using sequencer_destroy().
+ */
+struct sequencer *sequencer_create(uint64_t first_seq, sequencer_fn fn, void *arg)
+{
+	struct sequencer *s = calloc(1, sizeof(struct sequencer));
+	if (!s)
+		return NULL;
+
+	atomic_init(&s->stub.next, NULL);
+	atomic_init(&s->tail, &s->stub);
+	s->head 	= &s->stub;
+	s->fn 		= fn;
+	s->arg 		= arg;
+	s->next_seq = first_seq;
+
+	if (!(s->mutex = lockstat_create("sequencer"))) {
+		free(s);
+		return NULL;
+	}
+	if (pthread_cond_init(&s->cond, NULL)) {
+		lockstat_destroy(s->mutex);
+		free(s);
+		return NULL;
+	}
+	if (pthread_create(&s->thread, NULL, sequencer_thread, s)) {
+		pthread_cond_destroy(&s->cond);
+		lockstat_destroy(s->mutex);
+		free(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+/**
+ * @brief Destroys a sequencer, once every message pushed was handed to the fan-out.
+ *
+ * Nothing may be pushed anymore.
+ *
+ * @param[in] s The sequencer.
+ */
+void sequencer_destroy(struct sequencer *s)
+{
+	if (s) {
+		lockstat_lock(s->mutex);
+		s->stop = true;
+		pthread_cond_signal(&s->cond);
+		lockstat_unlock(s->mutex);
+		pthread_join(s->thread, NULL);
+
+		pthread_cond_destroy(&s->cond);
+		lockstat_destroy(s->mutex);
+		free(s);
+	}
+}
+
+/**
+ * @brief Put a message at the end of the queue, without counting it.
+ */
+static void link_msg(struct sequencer *s, struct sequencer_msg *m)
+{
+	atomic_store_explicit(&m->next, NULL, memory_order_relaxed);
+	struct sequencer_msg *prev = atomic_exchange_explicit(&s->tail, m, memory_order_acq_rel);
+	atomic_store_explicit(&prev->next, m, memory_order_release);
+}
+
+/**
+ * @brief Push a message; it is freed once handed to the fan-out.
+ *
+ * Safe to call from any number of threads at once, it never blocks on another pusher.
+ *
+ * @param[in] s The sequencer.
+ * @param[in] m The message.
+ */
+void sequencer_push(struct sequencer *s, struct sequencer_msg *m)
+{
+	/* Counted first, so the sequencer never takes out more than was counted */
+	size_t pending = atomic_fetch_add_explicit(&s->pending, 1, memory_order_acq_rel);
+	link_msg(s, m);
+
+	if (pending == 0) {
+		/* The sequencer may be asleep */
+		lockstat_lock(s->mutex);
+		pthread_cond_signal(&s->cond);
+		lockstat_unlock(s->mutex);
+		atomic_fetch_add_explicit(&s->wakeups, 1, memory_order_relaxed);
+	}
+}
+
+/**
+ * @brief Take the first message out, sequencer thread only.
+ *
+ * @return The message, NULL if the queue is empty or the first message is not linked yet.
+ */
+static struct sequencer_msg *take_msg(struct sequencer *s)
+{
+	struct sequencer_msg *head = s->head;
+	struct sequencer_msg *next = atomic_load_explicit(&head->next, memory_order_acquire);
+
+	if (head == &s->stub) {
+		if (!next)
+			return NULL;
+		s->head = head = next;
+		next 	= atomic_load_explicit(&head->next, memory_order_acquire);
+	}
+
+	if (next) {
+		s->head = next;
+		return head;
+	}
+
+	/* The last message can only be taken out once the stub is behind it */
+	if (head != atomic_load_explicit(&s->tail, memory_order_acquire))
+		return NULL;
+	link_msg(s, &s->stub);
+
+	next = atomic_load_explicit(&head->next, memory_order_acquire);
+	if (next) {
+		s->head = next;
+		return head;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Keeps numbering the messages pushed and handing them to the fan-out, in batches.
+ *
+ * A batch is whatever was pushed while the fan-out was busy with the one before,
+ * up to @c SEQUENCER_BATCH messages.
+ *
+ * @param[in] arg The sequencer.
+ */
+static void *sequencer_thread(void *arg)
+{
+	struct sequencer *s = (struct sequencer *)arg;
+	struct sequencer_msg *batch[SEQUENCER_BATCH];
+
+	while (true) {
+		size_t n = 0;
+		struct sequencer_msg *m;
+		while (n < SEQUENCER_BATCH && (m = take_msg(s))) {
+			m->seq 		= s->next_seq++;
+			batch[n++] 	= m;
+		}
+
+		if (n > 0) {
+			s->fn(batch, n, s->arg);
+			for (size_t i = 0; i < n; i++) {
+				sequencer_msg_destroy(batch[i]);
+			}
+
+			atomic_fetch_add_explicit(&s->msgs, n, memory_order_relaxed);
+			atomic_fetch_add_explicit(&s->batches, 1, memory_order_relaxed);
+			if (n > atomic_load_explicit(&s->largest, memory_order_relaxed))
+				atomic_store_explicit(&s->largest, n, memory_order_relaxed);
+			atomic_fetch_sub_explicit(&s->pending, n, memory_order_acq_rel);
+			continue;
+		}
+
+		if (atomic_load_explicit(&s->pending, memory_order_acquire) > 0) {
+			/* A pusher is between its two steps */
+			sched_yield();
+			continue;
+		}
+
+		lockstat_lock(s->mutex);
+		while (atomic_load_explicit(&s->pending, memory_order_acquire) == 0 && !s->stop) {
+			lockstat_cond_wait(s->mutex, &s->cond);
+		}
+		bool stop = s->stop && atomic_load_explicit(&s->pending, memory_order_acquire) == 0;
+		lockstat_unlock(s->mutex);
+
+		if (stop)
+			return NULL;
+	}
+}
+
+/**
+ * @brief Get the messages pushed and not handed to the fan-out yet.
+ *
+ * A message counts until the fan-out returns, so at @c 0 everything pushed before was fanned out.
+ *
+ * @param[in] s The sequencer.
+ *
+ * @return The number of messages.
+ */
+size_t sequencer_get_pending(struct sequencer *s)
+{
+	return atomic_load_explicit(&s->pending, memory_order_acquire);
+}
+
+/**
+ * @brief Print how many messages were sequenced, and in how many batches.
+ *
+ * @param[in] s The sequencer.
+ * @param[in] f Where to print.
+ */
+void sequencer_print(struct sequencer *s, FILE *f)
+{
+	uint64_t batches = atomic_load_explicit(&s->batches, memory_order_relaxed);
+	uint64_t pending = atomic_load_explicit(&s->pending, memory_order_relaxed);
+
+	fprintf(f, "sequencer: %llu messages in %llu batches (%.1f each, %llu at most), %llu wakeups, %llu pending\n",
+			(unsigned long long)atomic_load_explicit(&s->msgs, memory_order_relaxed), (unsigned long long)batches,
+			batches ? (double)atomic_load_explicit(&s->msgs, memory_order_relaxed) / batches : 0.0,
+			(unsigned long long)atomic_load_explicit(&s->largest, memory_order_relaxed),
+			(unsigned long long)atomic_load_explicit(&s->wakeups, memory_order_relaxed),
+			(unsigned long long)pending);
+}
@@ -0,0 +1,43 @@
+#ifndef SEQUENCER_H
+#define SEQUENCER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "frame.h"
+
+/** @brief Most messages handed to the fan-out at once. */
+#define SEQUENCER_BATCH 256
+
+/**
+ * @brief A message waiting in a sequencer, see sequencer_msg_create().
+ */
+struct sequencer_msg {
+	struct sequencer_msg *_Atomic next; 	/**< Next message pushed, used by the sequencer */
+	uint64_t seq; 							/**< Sequence number, given by the sequencer */
+	bool from_client; 						/**< Whether a client sent it, rather than the server */
+	bool traced; 							/**< Whether @c trace is in use */
+	struct frame_trace trace; 				/**< The trace stamps taken so far */
+	char *frame; 							/**< @c hlen bytes of room for the header, then the packed message */
+	size_t hlen; 							/**< Room for the header */
+	size_t len; 							/**< The packed message length */
+};
+
+/**
+ * @brief Function the sequencer hands every batch of messages to, in sequence order.
+ */
+typedef void (*sequencer_fn)(struct sequencer_msg **msgs, size_t n, void *arg);
+
+struct sequencer;
+
+struct sequencer_msg *sequencer_msg_create(char *frame, size_t hlen, size_t len);
+void sequencer_msg_destroy(struct sequencer_msg *m);
+struct sequencer *sequencer_create(uint64_t first_seq, sequencer_fn fn, void *arg);
+void sequencer_destroy(struct sequencer *s);
+void sequencer_push(struct sequencer *s, struct sequencer_msg *m);
+size_t sequencer_get_pending(struct sequencer *s);
+void sequencer_print(struct sequencer *s, FILE *f);
+
+#endif
@@ -0,0 +1,115 @@
+#include "session.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <sys/random.h>
+
+/**
+ * @brief A session whose connection dropped and that may still be resumed.
+ */
+struct session {
+	char *name; 							/**< The username */
+	char token[SESSION_TOKEN_LEN + 1]; 		/**< The resume token */
+	time_t expires; 						/**< When the session stops being resumable */
+};
+
+/**
+ * @brief Generate a new random resume token.
+ *
+ * @param[out] token Where the token will be stored; must hold @c SESSION_TOKEN_LEN + 1 bytes.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+int session_new_token(char *token)
+{
+	uint8_t bytes[SESSION_TOKEN_LEN / 2];
+
+	if (getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes))
+		return -1;
+
+	for (size_t i = 0; i < sizeof(bytes); i++) {
+		sprintf(token + 2 * i, "%02x", bytes[i]);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Create a parked session.
+ *
+ * Both strings are copied into the session.
+ *
+ * @param[in] name The username.
+ * @param[in] token The resume token.
+ * @param[in] expires When the session stops being resumable.
+ *
+ * @return A pointer to the session in case of success, NULL otherwise.
+ * The session must be freed, using session_destroy().
+ */
+struct session *session_create(const char *name, const char *token, time_t expires)
+{
+	struct session *s = malloc(sizeof(struct session));
+	if (s) {
+		s->name = malloc(strlen(name) + 1);
+		if (!s->name) {
+			free(s);
+			return NULL;
+		}
+		strcpy(s->name, name);
+		strncpy(s->token, token, SESSION_TOKEN_LEN);
+		s->token[SESSION_TOKEN_LEN] = '\0';
+		s->expires = expires;
+	}
+
+	return s;
+}
+
+/**
+ * @brief Destroys a session.
+ *
+ * @param[in] s The session.
+ */
+void session_destroy(struct session *s)
+{
+	if (s) {
+		free(s->name);
+		free(s);
+	}
+}
+
+/**
+ * @brief Get the session username.
+ *
+ * @param[in] s The session.
+ *
+ * @return The username.
+ */
+const char *session_get_name(struct session *s)
+{
+	return s->name;
+}
+
+/**
+ * @brief Get the session resume token.
+ *
+ * @param[in] s The session.
+ *
+ * @return The token.
+ */
+const char *session_get_token(struct session *s)
+{
+	return s->token;
+}
+
+/**
+ * @brief Get when the session stops being resumable.
+ *
+ * @param[in] s The session.
+ *
+ * @return The expiry time.
+ */
+time_t session_get_expiry(struct session *s)
+{
+	return s->expires;
+}
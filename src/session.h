@@ -0,0 +1,20 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/** @brief Length of a resume token, without the terminating @c NUL. */
+#define SESSION_TOKEN_LEN 32
+
+struct session;
+
+int session_new_token(char *token);
+struct session *session_create(const char *name, const char *token, time_t expires);
+void session_destroy(struct session *s);
+const char *session_get_name(struct session *s);
+const char *session_get_token(struct session *s);
+time_t session_get_expiry(struct session *s);
+
+#endif
@@ -0,0 +1,694 @@
+#define _GNU_SOURCE
+#include "shmchan.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+/** @brief Record length used to mark that the producer wrapped around to the start of the ring. */
+#define SHMCHAN_WRAP UINT32_MAX
+
+/** @brief Number of file descriptors handed over the Unix socket: the memfd and the two eventfds. */
+#define SHMCHAN_NFDS 3
+
+/**
+ * @brief A single producer, single consumer ring living in shared memory.
+ *
+ * Records are stored as a 32 bit length followed by the bytes, padded to 8 bytes.
+ * @c head and @c tail are free running byte counters, so the ring is empty when
+ * they are equal. Each counter lives in its own cache line, since they are written
+ * by different processes.
+ */
+struct shmring {
+	_Atomic uint64_t head; 				/**< Written only by the producer */
+	char pad0[64 - sizeof(uint64_t)];
+	_Atomic uint64_t tail; 				/**< Written only by the consumer */
+	char pad1[64 - sizeof(uint64_t)];
+	_Atomic uint32_t consumer_waiting; 	/**< Set by the consumer before sleeping on its eventfd */
+	char pad2[64 - sizeof(uint32_t)];
+	_Atomic uint32_t producer_waiting; 	/**< Set by a producer that found the ring full, see shmchan_try_reserve() */
+	char pad3[64 - sizeof(uint32_t)];
+	char data[SHMCHAN_RING_SIZE]; 		/**< The records */
+};
+
+/**
+ * @brief One end of a shared-memory channel.
+ *
+ * The mapping holds two rings: the first one carries server to client frames and the
+ * second one client to server frames.
+ */
+struct shmchan {
+	int memfd; 				/**< The memfd backing both rings */
+	int efd[2]; 			/**< eventfd used to wake the consumer of each ring */
+	struct shmring *rings; 	/**< The shared mapping */
+	struct shmring *tx; 	/**< The ring this end writes on */
+	struct shmring *rx; 	/**< The ring this end reads from */
+	int tx_efd; 			/**< eventfd that wakes the other end */
+	int rx_efd; 			/**< eventfd this end sleeps on */
+	size_t peeked; 			/**< Bytes of the record returned by the last shmchan_peek() */
+	size_t reserved; 		/**< Bytes of the record returned by the last shmchan_reserve() */
+	bool broken; 			/**< Whether the peer wrote a record or an index that does not fit the ring */
+};
+
+/**
+ * @brief Round a record size up to the ring alignment.
+ */
+static size_t record_size(size_t len)
+{
+	return (sizeof(uint32_t) + len + 7) & ~(size_t)7;
+}
+
+/**
+ * @brief Map the rings and pick the direction of each one according to the role.
+ *
+ * @return A pointer to the channel in case of success, NULL otherwise.
+ */
+static struct shmchan *shmchan_map(int memfd, int efd_s2c, int efd_c2s, enum shmchan_role role)
+{
+	struct shmchan *ch = malloc(sizeof(struct shmchan));
+	if (!ch)
+		return NULL;
+
+	ch->rings = mmap(NULL, 2 * sizeof(struct shmring), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (ch->rings == MAP_FAILED) {
+		free(ch);
+		return NULL;
+	}
+
+	ch->memfd 	= memfd;
+	ch->efd[0] 	= efd_s2c;
+	ch->efd[1] 	= efd_c2s;
+	ch->peeked 	= 0;
+	ch->reserved = 0;
+	ch->broken 	= false;
+
+	if (role == SHMCHAN_SERVER) {
+		ch->tx 		= &ch->rings[0];
+		ch->rx 		= &ch->rings[1];
+		ch->tx_efd 	= efd_s2c;
+		ch->rx_efd 	= efd_c2s;
+	} else {
+		ch->tx 		= &ch->rings[1];
+		ch->rx 		= &ch->rings[0];
+		ch->tx_efd 	= efd_c2s;
+		ch->rx_efd 	= efd_s2c;
+	}
+
+	return ch;
+}
+
+/**
+ * @brief Create the server end of a new shared-memory channel.
+ *
+ * A memfd big enough for both rings is created together with one eventfd per direction.
+ *
+ * @return A pointer to the channel in case of success, NULL otherwise.
+ * The channel must be freed, using shmchan_destroy().
+ *
+ * @see shmchan_send_fds
+ */
+struct shmchan *shmchan_create(void)
+{
+	int memfd = memfd_create("zip-zop-shm", MFD_CLOEXEC);
+	if (memfd == -1)
+		return NULL;
+
+	if (ftruncate(memfd, 2 * sizeof(struct shmring)) == -1) {
+		close(memfd);
+		return NULL;
+	}
+
+	int efd_s2c = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	int efd_c2s = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	struct shmchan *ch = NULL;
+	if (efd_s2c != -1 && efd_c2s != -1)
+		ch = shmchan_map(memfd, efd_s2c, efd_c2s, SHMCHAN_SERVER);
+
+	if (!ch) {
+		close(memfd);
+		if (efd_s2c != -1)
+			close(efd_s2c);
+		if (efd_c2s != -1)
+			close(efd_c2s);
+	}
+
+	return ch;
+}
+
+/**
+ * @brief Hand the channel over a Unix domain socket.
+ *
+ * The memfd and both eventfds are sent with @c SCM_RIGHTS, so the peer can attach
+ * to the channel with shmchan_recv_fds().
+ *
+ * @param[in] ch The channel.
+ * @param[in] sockfd A connected @c AF_UNIX socket.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+int shmchan_send_fds(struct shmchan *ch, int sockfd)
+{
+	int fds[SHMCHAN_NFDS] = { ch->memfd, ch->efd[0], ch->efd[1] };
+	char byte = SHMCHAN_ACCEPTED;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+
+	union {
+		char buf[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr align;
+	} ctrl;
+	memset(&ctrl, 0, sizeof(ctrl));
+
+	struct msghdr msg = {
+		.msg_iov 		= &iov,
+		.msg_iovlen 	= 1,
+		.msg_control 	= ctrl.buf,
+		.msg_controllen = sizeof(ctrl.buf)
+	};
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level 	= SOL_SOCKET;
+	cmsg->cmsg_type 	= SCM_RIGHTS;
+	cmsg->cmsg_len 		= CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(sockfd, &msg, 0) != 1)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * @brief Answer a handshake without handing a channel.
+ *
+ * Sent instead of shmchan_send_fds() when the client did not ask for shared 
+ * memory or it could not be set up, so the client knows it keeps using the socket.
+ *
+ * @param[in] sockfd The socket connected to the client.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+int shmchan_refuse(int sockfd)
+{
+	char byte = SHMCHAN_REFUSED;
+
+	if (send(sockfd, &byte, 1, MSG_NOSIGNAL) != 1)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * @brief Read the handshake answer and attach to the channel it carries, if any.
+ *
+ * @param[in] sockfd The socket connected to the server.
+ *
+ * @return The client end of the channel in case of success, NULL otherwise.
+ * On a non-blocking socket @c errno is @c EAGAIN while the answer has not arrived, 
+ * and @c ENOTSUP when the server answered with shmchan_refuse().
+ * The channel must be freed, using shmchan_destroy().
+ *
+ * @see shmchan_send_fds
+ */
+struct shmchan *shmchan_recv_fds(int sockfd)
+{
+	int fds[SHMCHAN_NFDS];
+	char byte;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+
+	union {
+		char buf[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr align;
+	} ctrl;
+
+	struct msghdr msg = {
+		.msg_iov 		= &iov,
+		.msg_iovlen 	= 1,
+		.msg_control 	= ctrl.buf,
+		.msg_controllen = sizeof(ctrl.buf)
+	};
+
+	ssize_t n = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+	if (n == 0)
+		errno = ECONNRESET;
+	if (n != 1)
+		return NULL;
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (byte != SHMCHAN_ACCEPTED || !cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	struct shmchan *ch = shmchan_map(fds[0], fds[1], fds[2], SHMCHAN_CLIENT);
+	if (!ch) {
+		for (int i = 0; i < SHMCHAN_NFDS; i++)
+			close(fds[i]);
+	}
+
+	return ch;
+}
+
+/**
+ * @brief Destroys a channel.
+ *
+ * Unmaps the rings and closes the descriptors of this end. The memory is released
+ * once both ends are gone.
+ *
+ * @param[in] ch The channel.
+ */
+void shmchan_destroy(struct shmchan *ch)
+{
+	if (ch) {
+		munmap(ch->rings, 2 * sizeof(struct shmring));
+		close(ch->memfd);
+		close(ch->efd[0]);
+		close(ch->efd[1]);
+		free(ch);
+	}
+}
+
+/**
+ * @brief Reserve room for one record, waiting up to @p wait_ms for the consumer to make some.
+ *
+ * With no wait, a full ring asks the consumer to write the eventfd of this end
+ * once it releases a record.
+ *
+ * @return A pointer to @p len writable bytes in case of success, NULL otherwise, with @c errno set.
+ */
+static void *reserve(struct shmchan *ch, size_t len, int wait_ms)
+{
+	struct shmring *r = ch->tx;
+	size_t need = record_size(len);
+
+	if (len > SHMCHAN_RECORD_MAX) {
+		errno = EMSGSIZE;
+		return NULL;
+	}
+
+	uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t off 	  = head % SHMCHAN_RING_SIZE;
+	size_t to_end = SHMCHAN_RING_SIZE - off;
+	size_t total  = need + (to_end < need ? to_end : 0);
+
+	for (int waited = 0; ; waited++) {
+		uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+		if (SHMCHAN_RING_SIZE - (head - tail) >= total)
+			break;
+
+		if (wait_ms == 0) {
+			/* Pairs with the fence in shmchan_release(), so either we see the room or the consumer sees the flag */
+			atomic_store_explicit(&r->producer_waiting, 1, memory_order_relaxed);
+			atomic_thread_fence(memory_order_seq_cst);
+			tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+			if (SHMCHAN_RING_SIZE - (head - tail) >= total) {
+				atomic_store_explicit(&r->producer_waiting, 0, memory_order_relaxed);
+				break;
+			}
+			errno = EAGAIN;
+			return NULL;
+		}
+
+		if (waited >= wait_ms * 10) {
+			errno = EAGAIN;
+			return NULL;
+		}
+		usleep(100);
+	}
+
+	if (to_end < need) {
+		*(uint32_t *)(r->data + off) = SHMCHAN_WRAP;
+		head += to_end;
+		off = 0;
+		atomic_store_explicit(&r->head, head, memory_order_release);
+	}
+
+	*(uint32_t *)(r->data + off) = len;
+	ch->reserved = len;
+
+	return r->data + off + sizeof(uint32_t);
+}
+
+/**
+ * @brief Reserve room for one record on the channel.
+ *
+ * The caller writes the record straight into the shared ring and then 
+ * publishes it with shmchan_commit(), so no intermediate copy is needed.
+ *
+ * If the ring is full the caller waits up to @c SHMCHAN_SEND_TIMEOUT_MS for the
+ * consumer to make room.
+ *
+ * @warning There must be a single writer at a time on each end.
+ *
+ * @param[in] ch The channel.
+ * @param[in] len The record length.
+ *
+ * @return A pointer to @p len writable bytes in case of success, NULL otherwise, with @c errno set.
+ *
+ * @see shmchan_commit
+ * @see shmchan_try_reserve
+ */
+void *shmchan_reserve(struct shmchan *ch, size_t len)
+{
+	return reserve(ch, len, SHMCHAN_SEND_TIMEOUT_MS);
+}
+
+/**
+ * @brief Reserve room for one record on the channel, without waiting.
+ *
+ * Meant for an event loop: if the ring is full, the consumer writes the eventfd
+ * of this end, see shmchan_get_event_fd(), once it has made room, and the caller
+ * tries again then.
+ *
+ * @warning There must be a single writer at a time on each end.
+ *
+ * @param[in] ch The channel.
+ * @param[in] len The record length.
+ *
+ * @return A pointer to @p len writable bytes in case of success, NULL otherwise,
+ * with @c errno set to @c EAGAIN if the ring is full or @c EMSGSIZE if the record
+ * is longer than @c SHMCHAN_RECORD_MAX.
+ *
+ * @see shmchan_commit
+ */
+void *shmchan_try_reserve(struct shmchan *ch, size_t len)
+{
+	return reserve(ch, len, 0);
+}
+
+/**
+ * @brief Publish the record reserved with shmchan_reserve().
+ *
+ * The record may be shorter than reserved, when less was written into it; the
+ * rest of the room goes back to the ring.
+ *
+ * The other end is only woken through its eventfd when it is sleeping, so a busy
+ * consumer costs no system call per message.
+ *
+ * @param[in] ch The channel.
+ * @param[in] len The record length, at most the length reserved.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise, with @c errno set to
+ * @c EINVAL if @p len is more than was reserved.
+ */
+int shmchan_commit(struct shmchan *ch, size_t len)
+{
+	struct shmring *r = ch->tx;
+	uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+	if (len > ch->reserved) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (len < ch->reserved)
+		*(uint32_t *)(r->data + head % SHMCHAN_RING_SIZE) = len;
+
+	atomic_store_explicit(&r->head, head + record_size(len), memory_order_release);
+	ch->reserved = 0;
+
+	/* Pairs with the fence in shmchan_arm(), so either we see the flag or the consumer sees the record */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&r->consumer_waiting, memory_order_relaxed)) {
+		uint64_t one = 1;
+		if (write(ch->tx_efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Write one record on the channel.
+ *
+ * @param[in] ch The channel.
+ * @param[in] buf The record.
+ * @param[in] len The record length.
+ *
+ * @return @p len in case of success, @c -1 otherwise, with @c errno set.
+ *
+ * @see shmchan_reserve
+ */
+ssize_t shmchan_send(struct shmchan *ch, const void *buf, size_t len)
+{
+	void *rec = shmchan_reserve(ch, len);
+	if (!rec)
+		return -1;
+
+	memcpy(rec, buf, len);
+	if (shmchan_commit(ch, len) == -1)
+		return -1;
+
+	return len;
+}
+
+/**
+ * @brief Look at the next record without copying it.
+ *
+ * The returned pointer points straight into the shared ring and stays valid
+ * until shmchan_release() is called.
+ *
+ * The indices and the record length come from the peer, so they are checked
+ * against the ring before anything is handed out: a record that does not fit 
+ * breaks the channel for good.
+ *
+ * @param[in] ch The channel.
+ * @param[out] len Where the record length will be stored.
+ *
+ * @return A pointer to the record, NULL if the ring is empty, or if the channel
+ * is broken, with @c errno set to @c EPROTO.
+ *
+ * @see shmchan_release
+ * @see shmchan_is_broken
+ */
+const void *shmchan_peek(struct shmchan *ch, size_t *len)
+{
+	struct shmring *r = ch->rx;
+
+	while (!ch->broken) {
+		uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+		uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+		uint64_t used = head - tail;
+		if (used == 0)
+			return NULL;
+
+		size_t off = tail % SHMCHAN_RING_SIZE;
+		if (used > SHMCHAN_RING_SIZE || off % 8 != 0 || used < sizeof(uint32_t))
+			break;
+
+		/* Read once, the peer may still be writing to it */
+		uint32_t rlen = atomic_load_explicit((_Atomic uint32_t *)(r->data + off), memory_order_relaxed);
+
+		if (rlen == SHMCHAN_WRAP) {
+			if (SHMCHAN_RING_SIZE - off > used)
+				break;
+			atomic_store_explicit(&r->tail, tail + SHMCHAN_RING_SIZE - off, memory_order_release);
+			continue;
+		}
+
+		if (record_size(rlen) > SHMCHAN_RING_SIZE - off || record_size(rlen) > used)
+			break;
+
+		ch->peeked = rlen;
+		*len = rlen;
+		return r->data + off + sizeof(uint32_t);
+	}
+
+	ch->broken = true;
+	errno = EPROTO;
+	return NULL;
+}
+
+/**
+ * @brief Give back to the producer the record returned by shmchan_peek().
+ *
+ * A producer waiting for room after shmchan_try_reserve() is woken.
+ *
+ * @param[in] ch The channel.
+ */
+void shmchan_release(struct shmchan *ch)
+{
+	struct shmring *r = ch->rx;
+	uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+	atomic_store_explicit(&r->tail, tail + record_size(ch->peeked), memory_order_release);
+	ch->peeked = 0;
+
+	/* A producer that found the ring full sleeps on the eventfd this end writes to */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&r->producer_waiting, memory_order_relaxed)
+			&& atomic_exchange_explicit(&r->producer_waiting, 0, memory_order_relaxed)) {
+		uint64_t one = 1;
+		if (write(ch->tx_efd, &one, sizeof(one)) == -1) {
+			/* The eventfd is only full if the producer was already woken */
+		}
+	}
+}
+
+/**
+ * @brief Block until there is a record to read.
+ *
+ * The Unix socket that carried the handshake is watched as well, so a peer that goes
+ * away is noticed.
+ *
+ * @param[in] ch The channel.
+ * @param[in] sockfd The socket connected to the peer, or @c -1.
+ *
+ * @return @c 1 once a record is there, @c 0 if the peer closed the connection, @c -1 on error,
+ * with @c errno set to @c EPROTO if the channel is broken.
+ */
+int shmchan_wait(struct shmchan *ch, int sockfd)
+{
+	while (true) {
+		size_t rlen;
+		if (shmchan_peek(ch, &rlen))
+			return 1;
+		if (ch->broken)
+			return -1;
+
+		if (!shmchan_arm(ch))
+			continue;
+
+		struct pollfd pfd[2] = {
+			{ .fd = ch->rx_efd, .events = POLLIN },
+			{ .fd = sockfd, 	.events = POLLIN }
+		};
+		int rv = poll(pfd, sockfd >= 0 ? 2 : 1, -1);
+		shmchan_disarm(ch);
+
+		if (rv == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		if (sockfd >= 0 && pfd[1].revents) {
+			/* Nothing is expected on the socket once the rings are in use, so this is the peer leaving */
+			char byte;
+			ssize_t n = recv(sockfd, &byte, 1, MSG_DONTWAIT);
+			if (n == 0)
+				return 0;
+			if (n == -1 && errno != EAGAIN)
+				return -1;
+		}
+	}
+}
+
+/**
+ * @brief Read one record from the channel, blocking until there is one.
+ *
+ * Works like @c recv() on a datagram socket: records longer than @p len are truncated.
+ *
+ * @param[in] ch The channel.
+ * @param[out] buf Where the record will be copied.
+ * @param[in] len The size of @p buf.
+ * @param[in] sockfd The socket connected to the peer, or @c -1; see shmchan_wait().
+ *
+ * @return The number of bytes copied, @c 0 if the peer closed the connection, @c -1 on error,
+ * with @c errno set to @c EPROTO if the peer wrote a malformed record.
+ */
+ssize_t shmchan_recv(struct shmchan *ch, void *buf, size_t len, int sockfd)
+{
+	int rv = shmchan_wait(ch, sockfd);
+	if (rv <= 0)
+		return rv;
+
+	size_t rlen;
+	const void *rec = shmchan_peek(ch, &rlen);
+	if (!rec)
+		return -1;
+	if (rlen > len)
+		rlen = len;
+	memcpy(buf, rec, rlen);
+	shmchan_release(ch);
+
+	return rlen;
+}
+
+/**
+ * @brief Get ready to sleep on the channel eventfd.
+ *
+ * Tells the producer that this end is about to sleep, so the next record it
+ * commits also writes the eventfd. Callers driving their own event loop call 
+ * this before waiting on shmchan_get_event_fd() and shmchan_disarm() once woken.
+ *
+ * @param[in] ch The channel.
+ *
+ * @return @c true if the ring is empty and it is safe to sleep, @c false if
+ * records arrived meanwhile (the channel is left disarmed).
+ */
+bool shmchan_arm(struct shmchan *ch)
+{
+	size_t len;
+
+	atomic_store_explicit(&ch->rx->consumer_waiting, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (shmchan_peek(ch, &len)) {
+		atomic_store_explicit(&ch->rx->consumer_waiting, 0, memory_order_relaxed);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * @brief Tell the producer this end is awake again, and drain the eventfd.
+ *
+ * @param[in] ch The channel.
+ *
+ * @see shmchan_arm
+ */
+void shmchan_disarm(struct shmchan *ch)
+{
+	uint64_t v;
+
+	atomic_store_explicit(&ch->rx->consumer_waiting, 0, memory_order_relaxed);
+	while (read(ch->rx_efd, &v, sizeof(v)) > 0) {
+		/* Empty body */
+	}
+}
+
+/**
+ * @brief Tell whether the peer wrote something that does not fit the ring.
+ *
+ * A broken channel yields no more records; the connection must be closed.
+ *
+ * @param[in] ch The channel.
+ *
+ * @return @c true if the channel is broken, @c false otherwise.
+ */
+bool shmchan_is_broken(struct shmchan *ch)
+{
+	return ch->broken;
+}
+
+/**
+ * @brief Get the eventfd that becomes readable when records arrive on this end.
+ *
+ * It also does when the peer makes room in a ring shmchan_try_reserve() found full.
+ *
+ * @param[in] ch The channel.
+ *
+ * @return The eventfd.
+ */
+int shmchan_get_event_fd(struct shmchan *ch)
+{
+	return ch->rx_efd;
+}
+
+/**
+ * @brief Get the memory a channel takes.
+ *
+ * @return The number of bytes of the shared mapping holding both rings.
+ */
+size_t shmchan_get_footprint(void)
+{
+	return 2 * sizeof(struct shmring);
+}
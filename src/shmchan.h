@@ -0,0 +1,61 @@
+#ifndef SHMCHAN_H
+#define SHMCHAN_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+/** @brief Handshake option a client sends after its name to ask for the shared-memory transport. */
+#define SHMCHAN_HANDSHAKE_OPT "shm"
+
+/** @brief Handshake answer byte that comes with the channel descriptors. */
+#define SHMCHAN_ACCEPTED 'S'
+
+/** @brief Handshake answer byte telling the client to keep using its socket. */
+#define SHMCHAN_REFUSED 'N'
+
+/** @brief Size in bytes of the data area of each ring (one ring per direction). */
+#define SHMCHAN_RING_SIZE (1 << 20)
+
+/** @brief Longest record, in bytes, that fits a ring; see shmchan_reserve(). */
+#define SHMCHAN_RECORD_MAX (SHMCHAN_RING_SIZE / 2 - sizeof(uint32_t))
+
+/** @brief How long, in milliseconds, shmchan_reserve() waits for room in a full ring before giving up. */
+#define SHMCHAN_SEND_TIMEOUT_MS 1000
+
+/**
+ * @brief Which end of the channel the process is.
+ *
+ * The server writes on the server-to-client ring and reads from the
+ * client-to-server ring; the client does the opposite.
+ */
+enum shmchan_role {
+	SHMCHAN_SERVER, /**< The end created by the server */
+	SHMCHAN_CLIENT  /**< The end attached by the client */
+};
+
+struct shmchan;
+
+struct shmchan *shmchan_create(void);
+int shmchan_send_fds(struct shmchan *ch, int sockfd);
+int shmchan_refuse(int sockfd);
+struct shmchan *shmchan_recv_fds(int sockfd);
+void shmchan_destroy(struct shmchan *ch);
+void *shmchan_reserve(struct shmchan *ch, size_t len);
+void *shmchan_try_reserve(struct shmchan *ch, size_t len);
+int shmchan_commit(struct shmchan *ch, size_t len);
+ssize_t shmchan_send(struct shmchan *ch, const void *buf, size_t len);
+int shmchan_wait(struct shmchan *ch, int sockfd);
+ssize_t shmchan_recv(struct shmchan *ch, void *buf, size_t len, int sockfd);
+const void *shmchan_peek(struct shmchan *ch, size_t *len);
+void shmchan_release(struct shmchan *ch);
+bool shmchan_arm(struct shmchan *ch);
+void shmchan_disarm(struct shmchan *ch);
+bool shmchan_is_broken(struct shmchan *ch);
+int shmchan_get_event_fd(struct shmchan *ch);
+size_t shmchan_get_footprint(void);
+
+#endif
@@ -0,0 +1,688 @@
+#include "simnet.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "frame.h"
+#include "hist.h"
+#include "fiber.h"
+
+/** @brief Nanoseconds in a second. */
+#define NS_PER_S 1000000000ULL
+
+/**
+ * @brief A simulated client, and its link with the server.
+ *
+ * The client side is computed, not run: the messages it sends come out of its
+ * random generator when the server reads, and what the server writes is timed
+ * through the link model and counted as it is written.
+ *
+ * The link toward the client is a queue drained at @c bandwidth: bytes written
+ * while it holds @c SIMNET_SNDBUF wait, as they would on a full socket, and each
+ * frame arrives @c latency_ms after its last byte left the queue.
+ */
+struct simnet_conn {
+	struct simnet *net; 		/**< The network */
+	unsigned id; 				/**< Index of the client */
+	uint64_t rng; 				/**< State of its random generator */
+	bool sender; 				/**< Whether it sends messages */
+	bool slow; 					/**< Whether it reads at @c slow_bandwidth */
+	pthread_mutex_t lock; 		/**< Protects @c waiters, and setting @c shut */
+	pthread_cond_t cond; 		/**< Signaled when the connection is shut down */
+	struct fiber *waiters[2]; 	/**< Reader and writer fibers parked on the connection */
+	_Atomic bool shut; 			/**< Whether the server shut the connection down */
+	bool greeted; 				/**< Whether the handshake was read */
+	bool left; 					/**< Whether the client left by itself */
+	uint64_t next_send; 		/**< When the client sends its next message */
+	char *up; 					/**< The frame being read, once rendered */
+	size_t up_len; 				/**< Bytes of @c up */
+	size_t up_off; 				/**< Bytes of @c up already read */
+	uint64_t link_free; 		/**< When the link is done with what was written so far */
+	char *down; 				/**< Start of a frame written but not complete */
+	size_t down_len; 			/**< Bytes of @c down */
+};
+
+/**
+ * @brief An in-process network of simulated clients.
+ */
+struct simnet {
+	struct simnet_params params; 	/**< What is modeled */
+	uint64_t start; 				/**< When the simulation started, as returned by frame_now() */
+	uint64_t stop; 					/**< When the senders stop */
+	uint64_t leave; 				/**< When the clients leave */
+	uint64_t latency; 				/**< Link delay in nanoseconds */
+	struct simnet_conn *conns; 		/**< The clients */
+	unsigned senders; 				/**< Clients that send */
+	unsigned slow; 					/**< Clients that read slowly */
+	pthread_mutex_t mutex; 			/**< Protects @c closed */
+	pthread_cond_t done; 			/**< Signaled when every connection is closed */
+	unsigned closed; 				/**< Connections closed by the server */
+	_Atomic uint64_t connected; 	/**< Handshakes read */
+	_Atomic uint64_t left; 			/**< Clients that left by themselves */
+	_Atomic uint64_t dropped; 		/**< Clients the server shut down before they left */
+	_Atomic uint64_t dropped_slow; 	/**< Slow ones among them */
+	_Atomic uint64_t busy; 			/**< Clients the server refused as busy */
+	_Atomic uint64_t sent; 			/**< Messages the clients sent */
+	_Atomic uint64_t frames; 		/**< Frames delivered */
+	_Atomic uint64_t chat; 			/**< Chat messages delivered */
+	_Atomic uint64_t bytes; 		/**< Bytes delivered */
+	struct hist *latency_hist[2]; 	/**< From sending a message to a copy arriving, at fast and at slow clients */
+};
+
+/**
+ * @brief Next number of a random generator (SplitMix64).
+ */
+static uint64_t rng_next(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+	return z ^ (z >> 31);
+}
+
+/**
+ * @brief Draw the time between two messages of a sender, averaging @c 1 / @c rate.
+ */
+static uint64_t rng_gap(struct simnet_conn *sc)
+{
+	uint64_t mean = sc->net->params.rate > 0 ? (uint64_t)(NS_PER_S / sc->net->params.rate) : 0;
+
+	return mean ? rng_next(&sc->rng) % (2 * mean) + 1 : UINT64_MAX;
+}
+
+/**
+ * @brief Fill in the defaults: a thousand clients, a tenth of them chatting once a second for ten seconds.
+ *
+ * @param[out] p The parameters.
+ */
+void simnet_default_params(struct simnet_params *p)
+{
+	p->clients 			= 1000;
+	p->seed 			= 1;
+	p->senders 			= 10;
+	p->rate 			= 1;
+	p->len 				= 64;
+	p->duration 		= 10;
+	p->bandwidth 		= 1000000;
+	p->slow 			= 5;
+	p->slow_bandwidth 	= 8000;
+	p->latency_ms 		= 10;
+}
+
+/**
+ * @brief Read a count that may end with @c k or @c m, for thousands and millions.
+ *
+ * @return @c 0 in case of success, @c -1 if it is not a count.
+ */
+static int parse_count(const char *s, uint64_t *out)
+{
+	char *end;
+	errno = 0;
+	unsigned long long v = strtoull(s, &end, 10);
+	if (errno || end == s || *s == '-')
+		return -1;
+	if (*end == 'k' || *end == 'K') {
+		v *= 1000;
+		end++;
+	} else if (*end == 'm' || *end == 'M') {
+		v *= 1000000;
+		end++;
+	}
+	if (*end != '\0')
+		return -1;
+
+	*out = v;
+	return 0;
+}
+
+/**
+ * @brief Change parameters from a spec such as <tt>clients=50k,slow=10,seed=7</tt>.
+ *
+ * The keys are given with struct simnet_params; counts may end with @c k or @c m,
+ * the @c rate may have decimals.
+ *
+ * @param[in] spec Comma separated @c key=value pairs.
+ * @param[in,out] p The parameters, changed as the spec says.
+ *
+ * @return @c 0 in case of success, @c -1 if the spec is wrong.
+ */
+int simnet_parse_params(const char *spec, struct simnet_params *p)
+{
+	char *copy = strdup(spec);
+	if (!copy)
+		return -1;
+
+	int rv = 0;
+	char *save;
+	for (char *tok = strtok_r(copy, ",", &save); tok && rv == 0; tok = strtok_r(NULL, ",", &save)) {
+		char *value = strchr(tok, '=');
+		uint64_t v = 0;
+		if (!value) {
+			rv = -1;
+			break;
+		}
+		*value++ = '\0';
+
+		if (strcmp(tok, "rate") == 0) {
+			char *end;
+			p->rate = strtod(value, &end);
+			rv = *end == '\0' && p->rate >= 0 ? 0 : -1;
+			continue;
+		}
+		if (parse_count(value, &v) == -1) {
+			rv = -1;
+		} else if (strcmp(tok, "clients") == 0 && v > 0 && v <= UINT32_MAX) {
+			p->clients = v;
+		} else if (strcmp(tok, "seed") == 0) {
+			p->seed = v;
+		} else if (strcmp(tok, "senders") == 0 && v <= 100) {
+			p->senders = v;
+		} else if (strcmp(tok, "len") == 0 && v > 0 && v < FRAME_MAX_PAYLOAD / 2) {
+			p->len = v;
+		} else if (strcmp(tok, "time") == 0 && v <= UINT32_MAX) {
+			p->duration = v;
+		} else if (strcmp(tok, "bw") == 0 && v > 0) {
+			p->bandwidth = v;
+		} else if (strcmp(tok, "slow") == 0 && v <= 100) {
+			p->slow = v;
+		} else if (strcmp(tok, "slowbw") == 0 && v > 0) {
+			p->slow_bandwidth = v;
+		} else if (strcmp(tok, "latency") == 0 && v <= UINT32_MAX) {
+			p->latency_ms = v;
+		} else {
+			rv = -1;
+		}
+	}
+
+	free(copy);
+
+	return rv;
+}
+
+/**
+ * @brief Create a network of simulated clients.
+ *
+ * Which clients send, what and when, and which ones read slowly, all derive from
+ * the seed, so runs with the same parameters put the same load on the server;
+ * only how the server schedules its own work differs. The clock starts now: the
+ * clients should be connected right away, see simnet_connect().
+ *
+ * @param[in] p What to model.
+ *
+ * @return A pointer to the network in case of success, NULL otherwise.
+ * The network must be freed, using simnet_destroy(), once every connection was closed.
+ */
+struct simnet *simnet_create(const struct simnet_params *p)
+{
+	struct simnet *net = calloc(1, sizeof(struct simnet));
+	if (!net)
+		return NULL;
+
+	net->params 	= *p;
+	net->conns 		= calloc(p->clients, sizeof(struct simnet_conn));
+	net->latency_hist[0] = hist_create("simnet latency (fast)");
+	net->latency_hist[1] = hist_create("simnet latency (slow)");
+	if (!net->conns || !net->latency_hist[0] || !net->latency_hist[1]) {
+		hist_destroy(net->latency_hist[0]);
+		hist_destroy(net->latency_hist[1]);
+		free(net->conns);
+		free(net);
+		return NULL;
+	}
+	pthread_mutex_init(&net->mutex, NULL);
+	pthread_cond_init(&net->done, NULL);
+
+	/* Timed waits go by the clock of frame_now() */
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+	net->start 		= frame_now();
+	net->stop 		= net->start + p->duration * NS_PER_S;
+	net->leave 		= net->stop + SIMNET_LINGER_MS * 1000000ULL;
+	net->latency 	= p->latency_ms * 1000000ULL;
+
+	for (unsigned i = 0; i < p->clients; i++) {
+		struct simnet_conn *sc = &net->conns[i];
+		sc->net 	= net;
+		sc->id 		= i;
+		sc->rng 	= p->seed ^ ((uint64_t)i << 32);
+		sc->sender 	= rng_next(&sc->rng) % 100 < p->senders;
+		sc->slow 	= rng_next(&sc->rng) % 100 < p->slow;
+		/* The first messages are spread over the first gap */
+		uint64_t gap 	= rng_gap(sc);
+		sc->next_send 	= sc->sender && gap != UINT64_MAX && net->start + gap / 2 < net->stop
+			? net->start + gap / 2 : UINT64_MAX;
+		sc->link_free 	= net->start;
+		pthread_mutex_init(&sc->lock, NULL);
+		pthread_cond_init(&sc->cond, &attr);
+
+		net->senders 	+= sc->sender;
+		net->slow 		+= sc->slow;
+	}
+	pthread_condattr_destroy(&attr);
+
+	return net;
+}
+
+/**
+ * @brief Destroys a network.
+ *
+ * @param[in] net The network.
+ */
+void simnet_destroy(struct simnet *net)
+{
+	if (net) {
+		for (unsigned i = 0; i < net->params.clients; i++) {
+			pthread_mutex_destroy(&net->conns[i].lock);
+			pthread_cond_destroy(&net->conns[i].cond);
+			free(net->conns[i].up);
+			free(net->conns[i].down);
+		}
+		pthread_mutex_destroy(&net->mutex);
+		pthread_cond_destroy(&net->done);
+		hist_destroy(net->latency_hist[0]);
+		hist_destroy(net->latency_hist[1]);
+		free(net->conns);
+		free(net);
+	}
+}
+
+/**
+ * @brief Get the number of simulated clients.
+ *
+ * @param[in] net The network.
+ *
+ * @return The number of clients.
+ */
+unsigned simnet_get_clients(struct simnet *net)
+{
+	return net->params.clients;
+}
+
+/**
+ * @brief Block until @p deadline, the connection is shut down, or a waiter is woken.
+ *
+ * @param[in] sc The connection, its lock held.
+ * @param[in] who @c 0 for the reader, @c 1 for the writer.
+ * @param[in] deadline As returned by frame_now().
+ */
+static void conn_sleep(struct simnet_conn *sc, int who, uint64_t deadline)
+{
+	struct fiber *self = fiber_current();
+	if (self) {
+		uint64_t now = frame_now();
+		sc->waiters[who] = self;
+		pthread_mutex_unlock(&sc->lock);
+		fiber_park(deadline > now ? (deadline - now + 999999) / 1000000 : 0);
+		pthread_mutex_lock(&sc->lock);
+		if (sc->waiters[who] == self)
+			sc->waiters[who] = NULL;
+	} else {
+		struct timespec ts = { .tv_sec = deadline / NS_PER_S, .tv_nsec = deadline % NS_PER_S };
+		pthread_cond_timedwait(&sc->cond, &sc->lock, &ts);
+	}
+}
+
+/**
+ * @brief Render the next message of a sender as a traced chat frame, stamped with when it was sent.
+ */
+static void render_message(struct simnet_conn *sc)
+{
+	struct simnet *net = sc->net;
+	size_t len = rng_next(&sc->rng) % (2 * net->params.len - 1) + 1;
+
+	struct frame_trace t;
+	memset(&t, 0, sizeof(t));
+	t.client_send = sc->next_send;
+	size_t hlen = frame_write_header(sc->up, FRAME_CHAT, FRAME_F_TRACE, len + 1, 0, &t);
+
+	char *content = sc->up + hlen;
+	for (size_t i = 0; i < len; i++) {
+		uint64_t r = rng_next(&sc->rng);
+		content[i] = r % 6 ? 'a' + (r >> 8) % 26 : ' ';
+	}
+	content[len] = '\0';
+
+	sc->up_len 		= hlen + len + 1;
+	sc->up_off 		= 0;
+	sc->next_send 	+= rng_gap(sc);
+	if (sc->next_send >= net->stop)
+		sc->next_send = UINT64_MAX;
+	atomic_fetch_add_explicit(&net->sent, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Whether the reader has something to read, or should get @c 0.
+ */
+static bool conn_readable(struct simnet_conn *sc, uint64_t now)
+{
+	return sc->shut || !sc->greeted || now >= sc->net->leave || sc->up_off < sc->up_len
+			|| (sc->next_send != UINT64_MAX && now >= sc->next_send + sc->net->latency);
+}
+
+/**
+ * @brief Read what the client sent: its handshake, then the messages that went through the link by now.
+ */
+static ssize_t conn_recv(void *conn, void *buf, size_t len)
+{
+	struct simnet_conn *sc = (struct simnet_conn *)conn;
+	struct simnet *net = sc->net;
+	uint64_t now = frame_now();
+
+	if (sc->shut)
+		return 0;
+
+	/* The server reads the handshake on its own */
+	if (!sc->greeted) {
+		sc->greeted = true;
+		atomic_fetch_add_explicit(&net->connected, 1, memory_order_relaxed);
+		return snprintf(buf, len, "sim%u", sc->id) + 1;
+	}
+
+	size_t n = 0;
+	while (n < len) {
+		if (sc->up_off == sc->up_len) {
+			if (sc->next_send == UINT64_MAX || now < sc->next_send + net->latency)
+				break;
+			if (!sc->up && !(sc->up = malloc(FRAME_MAX_LEN)))
+				break;
+			render_message(sc);
+		}
+		size_t part = sc->up_len - sc->up_off < len - n ? sc->up_len - sc->up_off : len - n;
+		memcpy((char *)buf + n, sc->up + sc->up_off, part);
+		sc->up_off 	+= part;
+		n 			+= part;
+	}
+	if (n > 0)
+		return n;
+
+	if (now >= net->leave) {
+		if (!sc->left) {
+			sc->left = true;
+			atomic_fetch_add_explicit(&net->left, 1, memory_order_relaxed);
+		}
+		return 0;
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
+
+/**
+ * @brief Count the frames that arrived, each @c latency after its last byte left the link.
+ *
+ * @param[in] sc The connection.
+ * @param[in] buf The bytes written.
+ * @param[in] len Number of bytes.
+ * @param[in] start When the first of them leaves.
+ * @param[in] ns_per_byte How long each takes.
+ */
+static void deliver(struct simnet_conn *sc, const char *buf, size_t len, uint64_t start, double ns_per_byte)
+{
+	struct simnet *net = sc->net;
+	const char *p = buf;
+	size_t avail = len, carried = 0;
+
+	/* A frame cut in two by the writer is put back together */
+	if (sc->down_len > 0) {
+		char *down = realloc(sc->down, sc->down_len + len);
+		if (!down)
+			return;
+		memcpy(down + sc->down_len, buf, len);
+		sc->down 	= down;
+		carried 	= sc->down_len;
+		p 			= down;
+		avail 		= sc->down_len + len;
+	}
+
+	struct frame f;
+	size_t off = 0;
+	ssize_t flen;
+	while ((flen = frame_parse(p + off, avail - off, &f)) > 0) {
+		off += flen;
+		uint64_t arrival = start + (uint64_t)((off - carried) * ns_per_byte) + net->latency;
+
+		atomic_fetch_add_explicit(&net->frames, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&net->bytes, flen, memory_order_relaxed);
+		if (f.type == FRAME_BUSY)
+			atomic_fetch_add_explicit(&net->busy, 1, memory_order_relaxed);
+		if (f.type == FRAME_CHAT) {
+			atomic_fetch_add_explicit(&net->chat, 1, memory_order_relaxed);
+			if ((f.flags & FRAME_F_TRACE) && f.trace.client_send && f.trace.client_send < arrival)
+				hist_record(net->latency_hist[sc->slow], arrival - f.trace.client_send);
+		}
+	}
+
+	size_t rest = avail - off;
+	if (rest == 0) {
+		free(sc->down);
+		sc->down 		= NULL;
+		sc->down_len 	= 0;
+	} else if (p == sc->down) {
+		memmove(sc->down, sc->down + off, rest);
+		sc->down_len = rest;
+	} else if ((sc->down = malloc(rest))) {
+		memcpy(sc->down, p + off, rest);
+		sc->down_len = rest;
+	}
+}
+
+/**
+ * @brief Get the bandwidth of the client link, in bytes per second.
+ */
+static uint64_t conn_bandwidth(struct simnet_conn *sc)
+{
+	return sc->slow ? sc->net->params.slow_bandwidth : sc->net->params.bandwidth;
+}
+
+/**
+ * @brief Get the bytes the link still holds.
+ */
+static uint64_t conn_backlog(struct simnet_conn *sc, uint64_t now)
+{
+	if (sc->link_free <= now)
+		return 0;
+
+	return (sc->link_free - now) * conn_bandwidth(sc) / NS_PER_S;
+}
+
+/**
+ * @brief Write to the client, as much as its link has room for.
+ */
+static ssize_t conn_send(void *conn, const void *buf, size_t len, int flags)
+{
+	struct simnet_conn *sc = (struct simnet_conn *)conn;
+	uint64_t now = frame_now();
+	(void)flags;
+
+	if (sc->shut) {
+		errno = EPIPE;
+		return -1;
+	}
+
+	uint64_t backlog = conn_backlog(sc, now);
+	if (backlog >= SIMNET_SNDBUF) {
+		errno = EAGAIN;
+		return -1;
+	}
+	size_t n = len < SIMNET_SNDBUF - backlog ? len : SIMNET_SNDBUF - backlog;
+
+	double ns_per_byte = (double)NS_PER_S / conn_bandwidth(sc);
+	uint64_t start = sc->link_free > now ? sc->link_free : now;
+	sc->link_free = start + (uint64_t)(n * ns_per_byte);
+	deliver(sc, buf, n, start, ns_per_byte);
+
+	return n;
+}
+
+/**
+ * @brief Write a file to the client, read in pieces of a frame.
+ */
+static ssize_t conn_sendfile(void *conn, int fd, off_t *off, size_t len)
+{
+	char buf[FRAME_MAX_PAYLOAD];
+	ssize_t n = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), *off);
+	if (n <= 0)
+		return n;
+
+	n = conn_send(conn, buf, n, 0);
+	if (n > 0)
+		*off += n;
+
+	return n;
+}
+
+/**
+ * @brief Block until the client sent something, its link has room, or it is gone.
+ */
+static int conn_wait(void *conn, short events, int timeout_ms)
+{
+	struct simnet_conn *sc = (struct simnet_conn *)conn;
+	struct simnet *net = sc->net;
+	uint64_t limit = timeout_ms >= 0 ? frame_now() + timeout_ms * 1000000ULL : UINT64_MAX;
+	int rv = 0;
+
+	pthread_mutex_lock(&sc->lock);
+	for (;;) {
+		uint64_t now = frame_now();
+		uint64_t deadline;
+		if (events & POLLIN) {
+			if (conn_readable(sc, now))
+				break;
+			deadline = sc->next_send != UINT64_MAX && sc->next_send + net->latency < net->leave
+				? sc->next_send + net->latency : net->leave;
+		} else {
+			if (sc->shut || conn_backlog(sc, now) < SIMNET_SNDBUF)
+				break;
+			deadline = sc->link_free - SIMNET_SNDBUF * NS_PER_S / conn_bandwidth(sc) + 1;
+		}
+		if (now >= limit) {
+			errno 	= ETIMEDOUT;
+			rv 		= -1;
+			break;
+		}
+		conn_sleep(sc, (events & POLLIN) ? 0 : 1, deadline < limit ? deadline : limit);
+	}
+	pthread_mutex_unlock(&sc->lock);
+
+	return rv;
+}
+
+/**
+ * @brief Shut the connection down; a client that had not left yet counts as dropped.
+ */
+static void conn_shutdown(void *conn)
+{
+	struct simnet_conn *sc = (struct simnet_conn *)conn;
+	struct simnet *net = sc->net;
+
+	pthread_mutex_lock(&sc->lock);
+	if (!sc->shut) {
+		sc->shut = true;
+		if (!sc->left) {
+			atomic_fetch_add_explicit(&net->dropped, 1, memory_order_relaxed);
+			if (sc->slow)
+				atomic_fetch_add_explicit(&net->dropped_slow, 1, memory_order_relaxed);
+		}
+		pthread_cond_broadcast(&sc->cond);
+		for (int i = 0; i < 2; i++) {
+			if (sc->waiters[i]) {
+				fiber_wake(sc->waiters[i]);
+				sc->waiters[i] = NULL;
+			}
+		}
+	}
+	pthread_mutex_unlock(&sc->lock);
+}
+
+/**
+ * @brief The server is done with the connection.
+ */
+static void conn_close(void *conn)
+{
+	struct simnet_conn *sc = (struct simnet_conn *)conn;
+	struct simnet *net = sc->net;
+
+	pthread_mutex_lock(&net->mutex);
+	if (++net->closed == net->params.clients)
+		pthread_cond_broadcast(&net->done);
+	pthread_mutex_unlock(&net->mutex);
+}
+
+/** @brief Transport to the simulated clients. */
+static const struct transport_ops TRANSPORT_SIMNET = {
+	.name 		= "simnet",
+	.send 		= conn_send,
+	.sendfile 	= conn_sendfile,
+	.recv 		= conn_recv,
+	.wait 		= conn_wait,
+	.shutdown 	= conn_shutdown,
+	.close 		= conn_close
+};
+
+/**
+ * @brief Get the connection of a simulated client.
+ *
+ * Each connection must be handed to the server once, and closed once.
+ *
+ * @param[in] net The network.
+ * @param[in] i The client, below simnet_get_clients().
+ *
+ * @return The connection; the server reads its handshake first.
+ */
+struct transport simnet_connect(struct simnet *net, unsigned i)
+{
+	struct transport t = { .ops = &TRANSPORT_SIMNET, .conn = &net->conns[i] };
+
+	return t;
+}
+
+/**
+ * @brief Block until the server closed every connection.
+ *
+ * @param[in] net The network.
+ */
+void simnet_wait(struct simnet *net)
+{
+	pthread_mutex_lock(&net->mutex);
+	while (net->closed < net->params.clients)
+		pthread_cond_wait(&net->done, &net->mutex);
+	pthread_mutex_unlock(&net->mutex);
+}
+
+/**
+ * @brief Print what the simulation modeled, and how the server coped.
+ *
+ * @param[in] net The network.
+ * @param[in] f Where to print.
+ */
+void simnet_print(struct simnet *net, FILE *f)
+{
+	const struct simnet_params *p = &net->params;
+
+	pthread_mutex_lock(&net->mutex);
+	unsigned closed = net->closed;
+	pthread_mutex_unlock(&net->mutex);
+
+	fprintf(f, "simnet: %u clients, seed %llu, %u sending %.2f/s for %u s, %llu B/s links, %u slow at %llu B/s, %u ms latency\n",
+			p->clients, (unsigned long long)p->seed, net->senders, p->rate, p->duration,
+			(unsigned long long)p->bandwidth, net->slow, (unsigned long long)p->slow_bandwidth, p->latency_ms);
+	fprintf(f, "  connected %llu, refused busy %llu, left %llu, dropped by the server %llu (%llu slow), closed %u, %.1f s\n",
+			(unsigned long long)atomic_load(&net->connected), (unsigned long long)atomic_load(&net->busy),
+			(unsigned long long)atomic_load(&net->left),
+			(unsigned long long)atomic_load(&net->dropped), (unsigned long long)atomic_load(&net->dropped_slow),
+			closed, (frame_now() - net->start) / 1e9);
+	fprintf(f, "  sent %llu messages, delivered %llu frames, %llu chat messages, %llu bytes\n",
+			(unsigned long long)atomic_load(&net->sent), (unsigned long long)atomic_load(&net->frames),
+			(unsigned long long)atomic_load(&net->chat), (unsigned long long)atomic_load(&net->bytes));
+	hist_print(net->latency_hist[0], f);
+	hist_print(net->latency_hist[1], f);
+}
@@ -0,0 +1,43 @@
+#ifndef SIMNET_H
+#define SIMNET_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "transport.h"
+
+/** @brief Bytes a simulated connection buffers before its link, as the socket send buffer would. */
+#define SIMNET_SNDBUF (64 * 1024)
+
+/** @brief Milliseconds a simulated client keeps reading once it is done sending, before it leaves. */
+#define SIMNET_LINGER_MS 2000
+
+/**
+ * @brief What a simulation models, see simnet_parse_params().
+ */
+struct simnet_params {
+	unsigned clients; 			/**< Simulated clients, @c clients */
+	uint64_t seed; 				/**< Seed every choice is derived from, @c seed */
+	unsigned senders; 			/**< Percent of the clients that send messages, @c senders */
+	double rate; 				/**< Messages per second of each sender, @c rate */
+	unsigned len; 				/**< Average message length, @c len */
+	unsigned duration; 			/**< Seconds the senders keep sending, @c time */
+	uint64_t bandwidth; 		/**< Bytes per second a client reads, @c bw */
+	unsigned slow; 				/**< Percent of the clients that read slower, @c slow */
+	uint64_t slow_bandwidth; 	/**< Bytes per second a slow client reads, @c slowbw */
+	unsigned latency_ms; 		/**< One-way delay of every link, @c latency */
+};
+
+struct simnet;
+
+void simnet_default_params(struct simnet_params *p);
+int simnet_parse_params(const char *spec, struct simnet_params *p);
+struct simnet *simnet_create(const struct simnet_params *p);
+void simnet_destroy(struct simnet *net);
+unsigned simnet_get_clients(struct simnet *net);
+struct transport simnet_connect(struct simnet *net, unsigned i);
+void simnet_wait(struct simnet *net);
+void simnet_print(struct simnet *net, FILE *f);
+
+#endif
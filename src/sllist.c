@@ -169,3 +169,12 @@ void *sll_get_key(struct sllist *l)
 	return NULL;
 }
 
+/**
+ * @brief Get the size of a node, for memory accounting.
+ *
+ * @return The size of a node, in bytes.
+ */
+size_t sll_node_size(void)
+{
+	return sizeof(struct sllist);
+}
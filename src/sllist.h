@@ -24,4 +24,5 @@ void *sll_remove_first(struct sllist **l);
 void *sll_remove_last(struct sllist **l);
 void *sll_remove_elm(struct sllist **l, void *elm);
 void *sll_get_key(struct sllist *l);
+size_t sll_node_size(void);
 #endif
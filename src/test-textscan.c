@@ -0,0 +1,160 @@
+/*
+ * Checks every textscan kernel against a byte at a time version.
+ *
+ * The kernels are static, so the module is built right into the test.
+ */
+#include "textscan.c"
+
+#include <stdio.h>
+
+/** @brief Longest buffer checked, past a whole AVX2 block plus the scalar tail. */
+#define TEST_MAX_LEN 160
+
+/** @brief Random buffers checked per length and alignment. */
+#define TEST_ROUNDS 64
+
+/** @brief Bytes on either side of each range boundary, and the new line. */
+static const unsigned char EDGE_BYTES[] = { 0x00, 0x0a, 0x1f, 0x20, 0x41, 0x7e, 0x7f, 0x80, 0xc3, 0xff };
+
+/**
+ * @brief A kernel under test.
+ */
+struct kernel {
+	const char *name; 																/**< Shown on failure */
+	size_t (*printable_prefix)(const char *buf, size_t len); 						/**< The prefix kernel */
+	size_t (*find_newlines)(const char *buf, size_t len, uint32_t *pos, size_t max); /**< The new line kernel */
+};
+
+/** @brief Failures so far. */
+static unsigned FAILURES = 0;
+
+/**
+ * @brief Reference textscan_printable_prefix().
+ */
+static size_t printable_prefix_ref(const char *buf, size_t len)
+{
+	size_t i = 0;
+	while (i < len && is_printable_ascii(buf[i]))
+		i++;
+
+	return i;
+}
+
+/**
+ * @brief Reference textscan_find_newlines().
+ */
+static size_t find_newlines_ref(const char *buf, size_t len, uint32_t *pos, size_t max)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < len && n < max; i++) {
+		if (buf[i] == '\n')
+			pos[n++] = i;
+	}
+
+	return n;
+}
+
+/**
+ * @brief Print a buffer that made a kernel fail.
+ */
+static void dump(const char *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		fprintf(stderr, "%02x%s", (unsigned char)buf[i], i + 1 < len ? " " : "\n");
+	if (len == 0)
+		fprintf(stderr, "(empty)\n");
+}
+
+/**
+ * @brief Run both kernels on a buffer and compare them with the reference.
+ */
+static void check(const struct kernel *k, const char *buf, size_t len)
+{
+	size_t want = printable_prefix_ref(buf, len);
+	size_t got 	= k->printable_prefix(buf, len);
+	if (got != want) {
+		fprintf(stderr, "%s printable_prefix: got %zu, want %zu, len %zu: ", k->name, got, want, len);
+		dump(buf, len);
+		FAILURES++;
+	}
+
+	/* Every cutoff up to one past the number of new lines */
+	uint32_t want_pos[TEST_MAX_LEN + 1], got_pos[TEST_MAX_LEN + 1];
+	size_t all = find_newlines_ref(buf, len, want_pos, TEST_MAX_LEN);
+	for (size_t max = 0; max <= all + 1; max++) {
+		size_t want_n 	= find_newlines_ref(buf, len, want_pos, max);
+		size_t got_n 	= k->find_newlines(buf, len, got_pos, max);
+		if (got_n != want_n || memcmp(got_pos, want_pos, want_n * sizeof(uint32_t)) != 0) {
+			fprintf(stderr, "%s find_newlines: got %zu, want %zu, len %zu, max %zu: ", k->name, got_n, want_n, len, max);
+			dump(buf, len);
+			FAILURES++;
+			return;
+		}
+	}
+}
+
+/**
+ * @brief Check a kernel on every length up to @c TEST_MAX_LEN and every alignment in a 32 byte block.
+ *
+ * Each length gets a printable buffer with each edge byte planted at each
+ * position, then random buffers mostly made of edge bytes.
+ */
+static void check_kernel(const struct kernel *k)
+{
+	/* Room to move the buffer across alignments */
+	static char block[TEST_MAX_LEN + 32];
+	unsigned failures = FAILURES;
+
+	for (size_t len = 0; len <= TEST_MAX_LEN; len++) {
+		char *buf = block + len % 32;
+
+		for (size_t at = 0; at < len; at++) {
+			for (size_t e = 0; e < sizeof(EDGE_BYTES); e++) {
+				memset(buf, 'a', len);
+				buf[at] = EDGE_BYTES[e];
+				check(k, buf, len);
+			}
+		}
+		memset(buf, 'a', len);
+		check(k, buf, len);
+
+		for (int round = 0; round < TEST_ROUNDS; round++) {
+			for (size_t i = 0; i < len; i++) {
+				int r = rand();
+				buf[i] = r % 4 ? EDGE_BYTES[(r >> 2) % sizeof(EDGE_BYTES)] : (char)(r >> 8);
+			}
+			check(k, buf, len);
+		}
+	}
+
+	printf("%-8s %s\n", k->name, FAILURES == failures ? "ok" : "FAILED");
+}
+
+int main(void)
+{
+	struct kernel kernels[] = {
+		{ "scalar", printable_prefix_scalar, find_newlines_scalar },
+#ifdef TEXTSCAN_X86
+		{ "sse2", 	printable_prefix_sse2, 	 find_newlines_sse2 },
+		{ "avx2", 	printable_prefix_avx2, 	 find_newlines_avx2 },
+#endif
+	};
+
+	srand(1);
+
+#ifdef TEXTSCAN_X86
+	__builtin_cpu_init();
+#endif
+	for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+#ifdef TEXTSCAN_X86
+		if ((kernels[i].printable_prefix == printable_prefix_sse2 && !__builtin_cpu_supports("sse2"))
+				|| (kernels[i].printable_prefix == printable_prefix_avx2 && !__builtin_cpu_supports("avx2"))) {
+			printf("%-8s skipped, not supported by this CPU\n", kernels[i].name);
+			continue;
+		}
+#endif
+		check_kernel(&kernels[i]);
+	}
+
+	return FAILURES ? EXIT_FAILURE : EXIT_SUCCESS;
+}
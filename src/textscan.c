@@ -0,0 +1,343 @@
+#include "textscan.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TEXTSCAN_X86
+#endif
+
+/**
+ * @brief Checks if a byte is printable ASCII, that is, neither a control character nor part of a multi-byte sequence.
+ */
+static inline bool is_printable_ascii(unsigned char c)
+{
+	return c >= 0x20 && c < 0x7f;
+}
+
+/**
+ * @brief Portable version of textscan_printable_prefix(), eight bytes at a time.
+ */
+static size_t printable_prefix_scalar(const char *buf, size_t len)
+{
+	size_t i = 0;
+
+	/* A byte is out of range if adding 0x60 overflows past 0x7f (< 0x20), or it is >= 0x7f */
+	for ( ; i + 8 <= len; i += 8) {
+		uint64_t v;
+		memcpy(&v, buf + i, 8);
+		uint64_t low 	= (v + 0x6060606060606060ULL) | v;
+		uint64_t high 	= v + 0x0101010101010101ULL;
+		if (((~low | high | v) & 0x8080808080808080ULL) != 0)
+			break;
+	}
+
+	while (i < len && is_printable_ascii(buf[i]))
+		i++;
+
+	return i;
+}
+
+#ifdef TEXTSCAN_X86
+/**
+ * @brief SSE2 version of textscan_printable_prefix().
+ */
+__attribute__((target("sse2")))
+static size_t printable_prefix_sse2(const char *buf, size_t len)
+{
+	const __m128i lo = _mm_set1_epi8(0x1f);
+	const __m128i hi = _mm_set1_epi8(0x7f);
+	size_t i = 0;
+
+	for ( ; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		/* Signed compares: bytes >= 0x80 are negative, so they fail the first one */
+		__m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+		unsigned mask = _mm_movemask_epi8(ok);
+		if (mask != 0xffff)
+			return i + __builtin_ctz(~mask);
+	}
+
+	return i + printable_prefix_scalar(buf + i, len - i);
+}
+
+/**
+ * @brief AVX2 version of textscan_printable_prefix().
+ */
+__attribute__((target("avx2")))
+static size_t printable_prefix_avx2(const char *buf, size_t len)
+{
+	const __m256i lo = _mm256_set1_epi8(0x1f);
+	const __m256i hi = _mm256_set1_epi8(0x7f);
+	size_t i = 0;
+
+	for ( ; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		__m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v));
+		uint32_t mask = _mm256_movemask_epi8(ok);
+		if (mask != 0xffffffffu)
+			return i + __builtin_ctz(~mask);
+	}
+
+	return i + printable_prefix_sse2(buf + i, len - i);
+}
+#endif
+
+/**
+ * @brief Portable version of textscan_find_newlines().
+ */
+static size_t find_newlines_scalar(const char *buf, size_t len, uint32_t *pos, size_t max)
+{
+	size_t n = 0;
+	const char *p = buf, *end = buf + len;
+
+	while (n < max && (p = memchr(p, '\n', end - p))) {
+		pos[n++] = p - buf;
+		p++;
+	}
+
+	return n;
+}
+
+#ifdef TEXTSCAN_X86
+/**
+ * @brief SSE2 version of textscan_find_newlines().
+ */
+__attribute__((target("sse2")))
+static size_t find_newlines_sse2(const char *buf, size_t len, uint32_t *pos, size_t max)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	size_t i = 0, n = 0;
+
+	for ( ; i + 16 <= len && n < max; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		while (mask && n < max) {
+			pos[n++] 	= i + __builtin_ctz(mask);
+			mask 		&= mask - 1;
+		}
+		if (mask)
+			return n;
+	}
+
+	if (n < max) {
+		size_t rest = find_newlines_scalar(buf + i, len - i, pos + n, max - n);
+		for (size_t j = n; j < n + rest; j++)
+			pos[j] += i;
+		n += rest;
+	}
+
+	return n;
+}
+
+/**
+ * @brief AVX2 version of textscan_find_newlines().
+ */
+__attribute__((target("avx2")))
+static size_t find_newlines_avx2(const char *buf, size_t len, uint32_t *pos, size_t max)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	size_t i = 0, n = 0;
+
+	for ( ; i + 32 <= len && n < max; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		while (mask && n < max) {
+			pos[n++] 	= i + __builtin_ctz(mask);
+			mask 		&= mask - 1;
+		}
+		if (mask)
+			return n;
+	}
+
+	if (n < max) {
+		size_t rest = find_newlines_sse2(buf + i, len - i, pos + n, max - n);
+		for (size_t j = n; j < n + rest; j++)
+			pos[j] += i;
+		n += rest;
+	}
+
+	return n;
+}
+#endif
+
+/** @brief The kernel picked by textscan_init(). */
+static size_t (*PRINTABLE_PREFIX)(const char *buf, size_t len) = printable_prefix_scalar;
+
+/** @brief The kernel picked by textscan_init(). */
+static size_t (*FIND_NEWLINES)(const char *buf, size_t len, uint32_t *pos, size_t max) = find_newlines_scalar;
+
+/** @brief The kind of kernel picked by textscan_init(). */
+static enum textscan_impl IMPL = TEXTSCAN_SCALAR;
+
+/** @brief Makes sure textscan_init() runs once. */
+static pthread_once_t TEXTSCAN_ONCE = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Pick the widest kernels the CPU runs.
+ */
+static void textscan_init(void)
+{
+#ifdef TEXTSCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		PRINTABLE_PREFIX 	= printable_prefix_avx2;
+		FIND_NEWLINES 		= find_newlines_avx2;
+		IMPL 				= TEXTSCAN_AVX2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		PRINTABLE_PREFIX 	= printable_prefix_sse2;
+		FIND_NEWLINES 		= find_newlines_sse2;
+		IMPL 				= TEXTSCAN_SSE2;
+	}
+#endif
+}
+
+/**
+ * @brief Get the kernels in use.
+ *
+ * @return Which kernels were picked for this CPU.
+ */
+enum textscan_impl textscan_get_impl(void)
+{
+	pthread_once(&TEXTSCAN_ONCE, textscan_init);
+	return IMPL;
+}
+
+/**
+ * @brief Get the name of a kind of kernel.
+ *
+ * @param[in] impl The kind of kernel.
+ *
+ * @return The name.
+ */
+const char *textscan_impl_name(enum textscan_impl impl)
+{
+	switch (impl) {
+	case TEXTSCAN_AVX2:
+		return "avx2";
+	case TEXTSCAN_SSE2:
+		return "sse2";
+	default:
+		return "scalar";
+	}
+}
+
+/**
+ * @brief Count the printable ASCII bytes at the start of a buffer.
+ *
+ * @param[in] buf The buffer.
+ * @param[in] len The buffer length.
+ *
+ * @return The length of the longest prefix made of bytes in @c [0x20, @c 0x7e].
+ */
+size_t textscan_printable_prefix(const char *buf, size_t len)
+{
+	pthread_once(&TEXTSCAN_ONCE, textscan_init);
+	return PRINTABLE_PREFIX(buf, len);
+}
+
+/**
+ * @brief Find the new line characters of a buffer, many lines in a single pass.
+ *
+ * @param[in] buf The buffer.
+ * @param[in] len The buffer length, below 4 GiB.
+ * @param[out] pos Where the offsets of the new lines are stored, in order.
+ * @param[in] max Most offsets to store; the scan stops once that many are found.
+ *
+ * @return The number of offsets stored.
+ */
+size_t textscan_find_newlines(const char *buf, size_t len, uint32_t *pos, size_t max)
+{
+	pthread_once(&TEXTSCAN_ONCE, textscan_init);
+	return FIND_NEWLINES(buf, len, pos, max);
+}
+
+/**
+ * @brief Length of the valid UTF-8 sequence starting a buffer.
+ *
+ * Overlong forms, surrogates, code points above U+10FFFF and the C1 control
+ * characters (U+0080 to U+009F) are not valid here.
+ *
+ * @return The sequence length, @c 0 if it is not valid.
+ */
+static size_t utf8_sequence_len(const unsigned char *p, size_t len)
+{
+	unsigned char c = p[0];
+	size_t n;
+	uint32_t cp;
+
+	if (c >= 0xc2 && c <= 0xdf) {
+		n = 2;
+		cp = c & 0x1f;
+	} else if (c >= 0xe0 && c <= 0xef) {
+		n = 3;
+		cp = c & 0x0f;
+	} else if (c >= 0xf0 && c <= 0xf4) {
+		n = 4;
+		cp = c & 0x07;
+	} else {
+		return 0;
+	}
+
+	if (n > len)
+		return 0;
+
+	for (size_t i = 1; i < n; i++) {
+		if ((p[i] & 0xc0) != 0x80)
+			return 0;
+		cp = (cp << 6) | (p[i] & 0x3f);
+	}
+
+	if ((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000) || cp > 0x10ffff
+			|| (cp >= 0xd800 && cp <= 0xdfff) || (cp >= 0x80 && cp <= 0x9f))
+		return 0;
+
+	return n;
+}
+
+/**
+ * @brief Validate UTF-8 and strip control characters, in place and in one pass.
+ *
+ * Runs of printable ASCII, the common case, are skipped by the vector kernel; the
+ * bytes it stops at are looked at one sequence at a time. Control characters
+ * (including @c NUL and @c DEL, but not tabs) and bytes that do not start a valid
+ * UTF-8 sequence are removed.
+ *
+ * @param[in,out] buf The text.
+ * @param[in] len The text length.
+ *
+ * @return The length of the sanitized text, which is never longer.
+ */
+size_t textscan_sanitize(char *buf, size_t len)
+{
+	pthread_once(&TEXTSCAN_ONCE, textscan_init);
+
+	size_t r = 0;
+	size_t w = 0;
+
+	while (r < len) {
+		size_t run = PRINTABLE_PREFIX(buf + r, len - r);
+		if (w != r)
+			memmove(buf + w, buf + r, run);
+		r += run;
+		w += run;
+		if (r == len)
+			break;
+
+		unsigned char c = buf[r];
+		size_t n = (c == '\t') ? 1 : (c >= 0x80) ? utf8_sequence_len((unsigned char *)buf + r, len - r) : 0;
+		if (n == 0) {
+			r++;
+			continue;
+		}
+
+		memmove(buf + w, buf + r, n);
+		r += n;
+		w += n;
+	}
+
+	return w;
+}
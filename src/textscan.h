@@ -0,0 +1,23 @@
+#ifndef TEXTSCAN_H
+#define TEXTSCAN_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/**
+ * @brief The kernels textscan picked for this CPU.
+ */
+enum textscan_impl {
+	TEXTSCAN_SCALAR, 	/**< Portable C */
+	TEXTSCAN_SSE2, 		/**< 16 bytes at a time */
+	TEXTSCAN_AVX2 		/**< 32 bytes at a time */
+};
+
+enum textscan_impl textscan_get_impl(void);
+const char *textscan_impl_name(enum textscan_impl impl);
+size_t textscan_printable_prefix(const char *buf, size_t len);
+size_t textscan_find_newlines(const char *buf, size_t len, uint32_t *pos, size_t max);
+size_t textscan_sanitize(char *buf, size_t len);
+
+#endif
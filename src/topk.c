@@ -0,0 +1,403 @@
+#include "topk.h"
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "lockstat.h"
+
+/**
+ * @brief The heaviest keys of a stream, in bounded memory.
+ *
+ * A count-min sketch estimates the count of any key: adding is one relaxed
+ * atomic add per row, and the estimate is the smallest of the rows, which is
+ * never below the real count. A min-heap of the @c TOPK_K keys with the
+ * largest estimates is kept next to it; its mutex is only taken when a key may
+ * enter, or move in, the heap. Callers counting every read or write go through
+ * a topk_batch, so even the heaviest keys only get there a few times a second.
+ *
+ * Memory does not depend on the number of keys, only on @c TOPK_DEPTH,
+ * @c TOPK_WIDTH and @c TOPK_K.
+ *
+ * Counts are halved every @c TOPK_HALF_LIFE seconds, by topk_tick() or by the
+ * next look at the ranking, never while adding.
+ */
+struct topk {
+	const char *name; 									/**< Name shown by topk_print() */
+	_Atomic uint64_t rows[TOPK_DEPTH][TOPK_WIDTH]; 		/**< The sketch counters */
+	_Atomic uint64_t total; 							/**< Sum of everything added */
+	_Atomic uint64_t floor; 							/**< Smallest count in the heap once it is full, @c 0 before */
+	_Atomic uint64_t epoch; 							/**< Half-lives elapsed when the counts were last halved */
+	struct lockstat *mutex;								/**< Protects the heap */
+	struct topk_entry heap[TOPK_K]; 					/**< Min-heap on the counts */
+	uint64_t hashes[TOPK_K]; 							/**< Hash of the key of each heap entry */
+	size_t heap_len; 									/**< Number of keys in the heap */
+};
+
+/**
+ * @brief Half-lives elapsed since an arbitrary point in the past.
+ */
+static uint64_t topk_epoch_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec / TOPK_HALF_LIFE;
+}
+
+/**
+ * @brief Read the coarse monotonic clock, which costs no system call.
+ *
+ * @return The time in milliseconds.
+ */
+static uint64_t topk_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Swap two heap entries, and their hashes.
+ */
+static void topk_swap(struct topk *tk, size_t i, size_t j)
+{
+	struct topk_entry tmp 	= tk->heap[i];
+	tk->heap[i] 			= tk->heap[j];
+	tk->heap[j] 			= tmp;
+
+	uint64_t h 		= tk->hashes[i];
+	tk->hashes[i] 	= tk->hashes[j];
+	tk->hashes[j] 	= h;
+}
+
+/**
+ * @brief Hash a key, FNV-1a.
+ */
+static uint64_t topk_hash(const char *key)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (size_t i = 0; i < TOPK_KEY_LEN - 1 && key[i]; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+/**
+ * @brief Column of a key in row @p row, derived from its hash as @c h1 + @c row * @c h2.
+ */
+static size_t topk_column(uint64_t hash, int row)
+{
+	uint32_t h1 = (uint32_t)hash;
+	uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+
+	return (h1 + (uint32_t)row * h2) & (TOPK_WIDTH - 1);
+}
+
+/**
+ * @brief Create an empty tracker.
+ *
+ * @param[in] name The tracker name. It is not copied.
+ *
+ * @return A pointer to the tracker in case of success, NULL otherwise.
+ * The tracker must be freed, using topk_destroy().
+ */
+struct topk *topk_create(const char *name)
+{
+	struct topk *tk = calloc(1, sizeof(struct topk));
+	if (tk) {
+		if (!(tk->mutex = lockstat_create(name))) {
+			free(tk);
+			return NULL;
+		}
+		tk->name = name;
+		tk->epoch = topk_epoch_now();
+	}
+
+	return tk;
+}
+
+/**
+ * @brief Destroys a tracker.
+ *
+ * @param[in] tk The tracker.
+ */
+void topk_destroy(struct topk *tk)
+{
+	if (tk) {
+		lockstat_destroy(tk->mutex);
+		free(tk);
+	}
+}
+
+/**
+ * @brief Restore the heap property downwards from @p i.
+ */
+static void topk_sift_down(struct topk *tk, size_t i)
+{
+	for (;;) {
+		size_t l = 2 * i + 1;
+		size_t r = l + 1;
+		size_t min = i;
+
+		if (l < tk->heap_len && tk->heap[l].count < tk->heap[min].count)
+			min = l;
+		if (r < tk->heap_len && tk->heap[r].count < tk->heap[min].count)
+			min = r;
+		if (min == i)
+			return;
+
+		topk_swap(tk, i, min);
+		i = min;
+	}
+}
+
+/**
+ * @brief Restore the heap property upwards from @p i.
+ */
+static void topk_sift_up(struct topk *tk, size_t i)
+{
+	while (i > 0 && tk->heap[(i - 1) / 2].count > tk->heap[i].count) {
+		topk_swap(tk, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+/**
+ * @brief Publish the smallest count of a full heap, so topk_add() can skip the mutex.
+ *
+ * @warning The mutex must be held.
+ */
+static void topk_set_floor(struct topk *tk)
+{
+	uint64_t floor = tk->heap_len == TOPK_K ? tk->heap[0].count : 0;
+	atomic_store_explicit(&tk->floor, floor, memory_order_relaxed);
+}
+
+/**
+ * @brief Halve every count once per half-life elapsed since it was last done.
+ *
+ * Subtracting, instead of storing the halved value, keeps what other threads
+ * add meanwhile.
+ */
+static void topk_decay(struct topk *tk)
+{
+	uint64_t now = topk_epoch_now();
+	uint64_t then = atomic_load_explicit(&tk->epoch, memory_order_relaxed);
+
+	if (now == then || !atomic_compare_exchange_strong(&tk->epoch, &then, now))
+		return;
+
+	unsigned shift = now - then < 63 ? now - then : 63;
+
+	for (int r = 0; r < TOPK_DEPTH; r++) {
+		for (size_t i = 0; i < TOPK_WIDTH; i++) {
+			uint64_t v = atomic_load_explicit(&tk->rows[r][i], memory_order_relaxed);
+			if (v)
+				atomic_fetch_sub_explicit(&tk->rows[r][i], v - (v >> shift), memory_order_relaxed);
+		}
+	}
+	uint64_t v = atomic_load_explicit(&tk->total, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&tk->total, v - (v >> shift), memory_order_relaxed);
+
+	/* Halving every count keeps the heap order */
+	lockstat_lock(tk->mutex);
+	for (size_t i = 0; i < tk->heap_len; i++) {
+		tk->heap[i].count >>= shift;
+	}
+	topk_set_floor(tk);
+	lockstat_unlock(tk->mutex);
+}
+
+/**
+ * @brief Count @p n more for a key.
+ *
+ * @param[in] tk The tracker.
+ * @param[in] key The key, usually a username.
+ * @param[in] n How much to add.
+ */
+void topk_add(struct topk *tk, const char *key, uint64_t n)
+{
+	if (!n)
+		return;
+
+	uint64_t hash = topk_hash(key);
+	uint64_t est = UINT64_MAX;
+	for (int r = 0; r < TOPK_DEPTH; r++) {
+		uint64_t v = atomic_fetch_add_explicit(&tk->rows[r][topk_column(hash, r)], n, memory_order_relaxed) + n;
+		if (v < est)
+			est = v;
+	}
+	atomic_fetch_add_explicit(&tk->total, n, memory_order_relaxed);
+
+	/* A key in the heap has a count of at least the floor, and its estimate is never below it */
+	if (est <= atomic_load_explicit(&tk->floor, memory_order_relaxed))
+		return;
+
+	lockstat_lock(tk->mutex);
+
+	size_t i;
+	for (i = 0; i < tk->heap_len; i++) {
+		if (tk->hashes[i] == hash && strncmp(tk->heap[i].key, key, TOPK_KEY_LEN - 1) == 0)
+			break;
+	}
+
+	if (i < tk->heap_len) {
+		if (est > tk->heap[i].count) {
+			tk->heap[i].count = est;
+			topk_sift_down(tk, i);
+		}
+	} else if (tk->heap_len < TOPK_K) {
+		i = tk->heap_len++;
+		strncpy(tk->heap[i].key, key, TOPK_KEY_LEN - 1);
+		tk->heap[i].key[TOPK_KEY_LEN - 1] = '\0';
+		tk->heap[i].count = est;
+		tk->hashes[i] = hash;
+		topk_sift_up(tk, i);
+	} else if (est > tk->heap[0].count) {
+		strncpy(tk->heap[0].key, key, TOPK_KEY_LEN - 1);
+		tk->heap[0].key[TOPK_KEY_LEN - 1] = '\0';
+		tk->heap[0].count = est;
+		tk->hashes[0] = hash;
+		topk_sift_down(tk, 0);
+	}
+	topk_set_floor(tk);
+
+	lockstat_unlock(tk->mutex);
+}
+
+/**
+ * @brief Count @p n more for a key, adding to the tracker once enough was counted or some time passed.
+ *
+ * @param[in] tk The tracker.
+ * @param[in,out] b The batch of the calling thread for @p key.
+ * @param[in] key The key.
+ * @param[in] n How much to add.
+ *
+ * @see topk_flush
+ */
+void topk_add_batched(struct topk *tk, struct topk_batch *b, const char *key, uint64_t n)
+{
+	b->pending += n;
+	if (b->pending < TOPK_BATCH_MAX && topk_now_ms() - b->since_ms < TOPK_BATCH_MS)
+		return;
+
+	topk_flush(tk, b, key);
+}
+
+/**
+ * @brief Add what a batch counted to the tracker.
+ *
+ * @param[in] tk The tracker.
+ * @param[in,out] b The batch, emptied.
+ * @param[in] key The key it counted for.
+ */
+void topk_flush(struct topk *tk, struct topk_batch *b, const char *key)
+{
+	topk_add(tk, key, b->pending);
+	b->pending 	= 0;
+	b->since_ms = topk_now_ms();
+}
+
+/**
+ * @brief Halve the counts if a half-life passed, off the path of topk_add().
+ *
+ * Meant to be called every second or so by a housekeeping thread.
+ *
+ * @param[in] tk The tracker.
+ */
+void topk_tick(struct topk *tk)
+{
+	topk_decay(tk);
+}
+
+/**
+ * @brief Estimate the count of a key.
+ *
+ * @param[in] tk The tracker.
+ * @param[in] key The key.
+ *
+ * @return The estimate, never below the real (decayed) count.
+ */
+uint64_t topk_estimate(struct topk *tk, const char *key)
+{
+	topk_decay(tk);
+
+	uint64_t hash = topk_hash(key);
+	uint64_t est = UINT64_MAX;
+	for (int r = 0; r < TOPK_DEPTH; r++) {
+		uint64_t v = atomic_load_explicit(&tk->rows[r][topk_column(hash, r)], memory_order_relaxed);
+		if (v < est)
+			est = v;
+	}
+
+	return est;
+}
+
+/**
+ * @brief Compare entries by decreasing count, for qsort().
+ */
+static int topk_entry_cmp(const void *a, const void *b)
+{
+	uint64_t ca = ((const struct topk_entry *)a)->count;
+	uint64_t cb = ((const struct topk_entry *)b)->count;
+
+	return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+/**
+ * @brief Get the heaviest keys, heaviest first.
+ *
+ * @param[in] tk The tracker.
+ * @param[out] entries Where the keys will be stored.
+ * @param[in] max The size of @p entries.
+ *
+ * @return The number of keys stored.
+ */
+size_t topk_get(struct topk *tk, struct topk_entry *entries, size_t max)
+{
+	struct topk_entry all[TOPK_K];
+
+	topk_decay(tk);
+
+	lockstat_lock(tk->mutex);
+	size_t n = tk->heap_len;
+	memcpy(all, tk->heap, n * sizeof(struct topk_entry));
+	lockstat_unlock(tk->mutex);
+
+	qsort(all, n, sizeof(struct topk_entry), topk_entry_cmp);
+
+	size_t i;
+	for (i = 0; i < n && i < max && all[i].count; i++) {
+		entries[i] = all[i];
+	}
+
+	return i;
+}
+
+/**
+ * @brief Print the heaviest keys.
+ *
+ * @param[in] tk The tracker.
+ * @param[in] f Where to print.
+ * @param[in] max How many keys to print at most.
+ */
+void topk_print(struct topk *tk, FILE *f, size_t max)
+{
+	struct topk_entry entries[TOPK_K];
+	size_t n = topk_get(tk, entries, max < TOPK_K ? max : TOPK_K);
+	uint64_t total = atomic_load_explicit(&tk->total, memory_order_relaxed);
+
+	fprintf(f, "%s: total %" PRIu64 "\n", tk->name, total);
+	for (size_t i = 0; i < n; i++) {
+		fprintf(f, "  %-24s %12" PRIu64 " %5.1f%%\n", entries[i].key, entries[i].count,
+				total ? 100.0 * entries[i].count / total : 0.0);
+	}
+}
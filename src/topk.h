@@ -0,0 +1,60 @@
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/** @brief Rows of the count-min sketch; each one is an independent estimate. */
+#define TOPK_DEPTH 4
+
+/** @brief Counters per row of the count-min sketch, a power of two. */
+#define TOPK_WIDTH 16384
+
+/** @brief Number of heaviest keys kept. */
+#define TOPK_K 32
+
+/** @brief Longest key kept, @c NUL included; longer keys are truncated. */
+#define TOPK_KEY_LEN 100
+
+/** @brief Seconds after which every count is halved, so the ranking follows recent traffic. */
+#define TOPK_HALF_LIFE 10
+
+/** @brief Most counted by a batch before it is added to the tracker. */
+#define TOPK_BATCH_MAX 65536
+
+/** @brief Most milliseconds a batch keeps what it counted, checked as it counts more; topk_flush() empties it when done. */
+#define TOPK_BATCH_MS 1000
+
+/**
+ * @brief One of the heaviest keys.
+ */
+struct topk_entry {
+	char key[TOPK_KEY_LEN]; /**< The key */
+	uint64_t count; 		/**< Its estimated count, never below the real one */
+};
+
+/**
+ * @brief What one thread counted for one key and did not add to the tracker yet.
+ *
+ * Lets a connection count every read or write without touching the shared
+ * tracker each time. Zero it before use.
+ */
+struct topk_batch {
+	uint64_t pending; 	/**< Counted and not added yet */
+	uint64_t since_ms; 	/**< When it was last added */
+};
+
+struct topk;
+
+struct topk *topk_create(const char *name);
+void topk_destroy(struct topk *tk);
+void topk_add(struct topk *tk, const char *key, uint64_t n);
+void topk_add_batched(struct topk *tk, struct topk_batch *b, const char *key, uint64_t n);
+void topk_flush(struct topk *tk, struct topk_batch *b, const char *key);
+void topk_tick(struct topk *tk);
+uint64_t topk_estimate(struct topk *tk, const char *key);
+size_t topk_get(struct topk *tk, struct topk_entry *entries, size_t max);
+void topk_print(struct topk *tk, FILE *f, size_t max);
+
+#endif
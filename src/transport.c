@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include "transport.h"
+
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "fiber.h"
+
+/**
+ * @brief Get the file descriptor of a socket connection.
+ */
+static int socket_fd(void *conn)
+{
+	return (int)(intptr_t)conn;
+}
+
+static ssize_t socket_send(void *conn, const void *buf, size_t len, int flags)
+{
+	return send(socket_fd(conn), buf, len, MSG_NOSIGNAL | flags);
+}
+
+static ssize_t socket_sendfile(void *conn, int fd, off_t *off, size_t len)
+{
+	return sendfile(socket_fd(conn), fd, off, len);
+}
+
+static ssize_t socket_recv(void *conn, void *buf, size_t len)
+{
+	return recv(socket_fd(conn), buf, len, 0);
+}
+
+/**
+ * @brief Wait for the socket to be ready.
+ *
+ * Only the sockets of clients run as fibers are non-blocking, and there only the
+ * fiber waits.
+ */
+static int socket_wait(void *conn, short events, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = socket_fd(conn), .events = events };
+	int rv;
+	while ((rv = fiber_poll(&pfd, 1, timeout_ms)) == -1) {
+		if (errno != EINTR)
+			return -1;
+	}
+	if (rv == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void socket_shutdown(void *conn)
+{
+	shutdown(socket_fd(conn), SHUT_RDWR);
+}
+
+static void socket_close(void *conn)
+{
+	close(socket_fd(conn));
+}
+
+const struct transport_ops TRANSPORT_SOCKET = {
+	.name 		= "socket",
+	.send 		= socket_send,
+	.sendfile 	= socket_sendfile,
+	.recv 		= socket_recv,
+	.wait 		= socket_wait,
+	.shutdown 	= socket_shutdown,
+	.close 		= socket_close
+};
+
+/**
+ * @brief Make a socket a transport connection.
+ *
+ * @param[in] sockfd The socket.
+ *
+ * @return The connection, going through @c TRANSPORT_SOCKET.
+ */
+struct transport transport_socket(int sockfd)
+{
+	struct transport t = { .ops = &TRANSPORT_SOCKET, .conn = (void *)(intptr_t)sockfd };
+
+	return t;
+}
+
+/**
+ * @brief Get the socket of a connection.
+ *
+ * @param[in] t The connection.
+ *
+ * @return The socket, @c -1 if the connection does not go through one.
+ */
+int transport_get_socket(const struct transport *t)
+{
+	if (t->ops == &TRANSPORT_SOCKET) {
+		return socket_fd(t->conn);
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Write bytes to a connection.
+ *
+ * @param[in] t The connection.
+ * @param[in] buf The bytes.
+ * @param[in] len Number of bytes.
+ * @param[in] flags @c MSG_* flags, as for @c send(); @c MSG_NOSIGNAL is implied.
+ *
+ * @return The number of bytes written, @c -1 on error.
+ */
+ssize_t transport_send(const struct transport *t, const void *buf, size_t len, int flags)
+{
+	return t->ops->send(t->conn, buf, len, flags);
+}
+
+/**
+ * @brief Write bytes of a file to a connection.
+ *
+ * @param[in] t The connection.
+ * @param[in] fd The file.
+ * @param[in,out] off Where to start, moved past what was written.
+ * @param[in] len Most bytes to write.
+ *
+ * @return The number of bytes written, @c -1 on error.
+ */
+ssize_t transport_sendfile(const struct transport *t, int fd, off_t *off, size_t len)
+{
+	return t->ops->sendfile(t->conn, fd, off, len);
+}
+
+/**
+ * @brief Read bytes from a connection.
+ *
+ * @param[in] t The connection.
+ * @param[out] buf Where the bytes will be stored.
+ * @param[in] len The size of @p buf.
+ *
+ * @return The number of bytes read, @c 0 if the connection was closed, @c -1 on error.
+ */
+ssize_t transport_recv(const struct transport *t, void *buf, size_t len)
+{
+	return t->ops->recv(t->conn, buf, len);
+}
+
+/**
+ * @brief Block until a connection is ready.
+ *
+ * @param[in] t The connection.
+ * @param[in] events @c POLLIN or @c POLLOUT.
+ * @param[in] timeout_ms Most milliseconds to wait, @c -1 for no limit.
+ *
+ * @return @c 0 once ready, @c -1 on error, with @c errno set to @c ETIMEDOUT if the time ran out.
+ */
+int transport_wait(const struct transport *t, short events, int timeout_ms)
+{
+	return t->ops->wait(t->conn, events, timeout_ms);
+}
+
+/**
+ * @brief End a connection both ways; whoever reads it gets @c 0, whoever writes an error.
+ *
+ * @param[in] t The connection.
+ */
+void transport_shutdown(const struct transport *t)
+{
+	t->ops->shutdown(t->conn);
+}
+
+/**
+ * @brief Release a connection.
+ *
+ * @param[in] t The connection.
+ */
+void transport_close(const struct transport *t)
+{
+	t->ops->close(t->conn);
+}
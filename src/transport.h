@@ -0,0 +1,46 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+/**
+ * @brief What a transport does for a connection; every function gets the connection as @c conn.
+ *
+ * The functions behave as their socket namesakes: @c send and @c sendfile may be
+ * short or fail with @c EAGAIN, after which @c wait blocks until they may go on;
+ * it fails with @c ETIMEDOUT if @c timeout_ms, unless @c -1, runs out first.
+ */
+struct transport_ops {
+	const char *name; 														/**< Name of the transport */
+	ssize_t (*send)(void *conn, const void *buf, size_t len, int flags); 	/**< Write bytes, @c flags as for @c send() */
+	ssize_t (*sendfile)(void *conn, int fd, off_t *off, size_t len); 		/**< Write bytes of a file, from @p off on */
+	ssize_t (*recv)(void *conn, void *buf, size_t len); 					/**< Read bytes, @c 0 once the peer left */
+	int (*wait)(void *conn, short events, int timeout_ms); 					/**< Block until @c POLLIN or @c POLLOUT would not */
+	void (*shutdown)(void *conn); 											/**< End the connection both ways, waking whoever waits */
+	void (*close)(void *conn); 												/**< Release the connection */
+};
+
+/**
+ * @brief A connection and the transport it goes through.
+ */
+struct transport {
+	const struct transport_ops *ops; 	/**< The transport */
+	void *conn; 						/**< The connection */
+};
+
+/** @brief Transport over a socket, the connection being the file descriptor. */
+extern const struct transport_ops TRANSPORT_SOCKET;
+
+struct transport transport_socket(int sockfd);
+int transport_get_socket(const struct transport *t);
+ssize_t transport_send(const struct transport *t, const void *buf, size_t len, int flags);
+ssize_t transport_sendfile(const struct transport *t, int fd, off_t *off, size_t len);
+ssize_t transport_recv(const struct transport *t, void *buf, size_t len);
+int transport_wait(const struct transport *t, short events, int timeout_ms);
+void transport_shutdown(const struct transport *t);
+void transport_close(const struct transport *t);
+
+#endif
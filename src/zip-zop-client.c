@@ -3,36 +3,91 @@
 #include <string.h>
 #include <stdbool.h>
 
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
-#include <pthread.h>
 
 #include "errcodes.h"
 #include "message.h"
-#include "client.h"
-
-/** @brief The port where this application will be running */
-#define PORT "1234"
+#include "zipzop.h"
+#include "textscan.h"
 
 /** @brief Maximum length of a client message */
-#define MESSAGE_LEN 2000 
+#define MESSAGE_LEN ZIPZOP_MESSAGE_LEN
+
+/** @brief How many times a busy server is tried again before giving up. */
+#define BUSY_RETRIES 10
+
+/** @brief Bytes read from @c stdin at once in batch mode. */
+#define INGEST_BLOCK 65536
+
+/** @brief Most line ends looked for by a single scan in batch mode. */
+#define INGEST_LINES 1024
+
+/** @brief Whether the user asked for the shared-memory transport (@c -m). */
+bool USE_SHM = false;
+
+/** @brief Whether the user asked to get the room from the multicast group of the server (@c -g). */
+bool USE_MCAST = false;
+
+/** @brief Trace one in every @c TRACE_EVERY sent messages and show per-hop latency (@c -t), @c 0 for none. */
+unsigned TRACE_EVERY = 0;
+
+/** @brief Keywords of the messages the user wants (@c -f), NULL for all of them. */
+const char *FILTER = NULL;
+
+/**
+ * @brief Batch mode (@c -b): milliseconds sent messages may wait to be written together, @c -1 if not in batch mode.
+ *
+ * For feeds piped into the client rather than typed: @c stdin is read in large
+ * blocks, and the client leaves once it is over and everything was sent.
+ */
+int INGEST_FLUSH_MS = -1;
 
 /**
  * @brief Checks if the user enter the arguments in the correct manner.
  *
+ * Options are consumed from @p argv, so after a successful call the 
+ * positional arguments start at @c argv[optind].
+ *
  * @param[in] argc Number of arguments.
+ * @param[in] argv The arguments.
  *
  * @return @c true if the arguments are correct, @c false otherwise.
  */
-bool check_args(int argc)
+bool check_args(int argc, char **argv)
 {
-	if (argc == 3)
+	int opt;
+	while ((opt = getopt(argc, argv, "mgt:f:b:")) != -1) {
+		if (opt == 'm')
+			USE_SHM = true;
+		else if (opt == 'g')
+			USE_MCAST = true;
+		else if (opt == 't')
+			TRACE_EVERY = strtoul(optarg, NULL, 10);
+		else if (opt == 'f')
+			FILTER = optarg;
+		else if (opt == 'b' && optarg[0] != '-')
+			INGEST_FLUSH_MS = atoi(optarg);
+		else
+			return false;
+	}
+
+	if (argc - optind == 2)
 		return true;
 	return false;
 }
 
+/**
+ * @brief Get the zipzop_connect() flags the user asked for.
+ */
+int connect_flags(void)
+{
+	return (USE_SHM ? ZIPZOP_SHM : 0) | (USE_MCAST ? ZIPZOP_MCAST : 0);
+}
+
 /**
  * @brief Prints the correct usage of the program.
  *
@@ -40,7 +95,12 @@ bool check_args(int argc)
  */
 void print_usage(const char *name)
 {
-	printf("usage: %s <server addr> <username>\n", name);
+	printf("usage: %s [-m] [-g] [-t N] [-f words] [-b ms] <server addr | unix socket path> <username>\n", name);
+	printf("  -m    use shared memory (only with a unix socket path)\n");
+	printf("  -g    get the room from the multicast group of the server, if it has one (TCP only)\n");
+	printf("  -t N  trace one in every N sent messages and show per-hop latency of traced messages\n");
+	printf("  -f W  only get the messages with any of the blank separated words W\n");
+	printf("  -b ms batch mode for piped input: send every line as it is, commands included, writing at most every ms milliseconds, then leave\n");
 }
 
 /**
@@ -48,230 +108,557 @@ void print_usage(const char *name)
  *
  * @param[in] m The message.
  */
-void show_message(struct message *m)
+void show_message(const struct message_view *m)
 {
 	if (m) {
-		printf("[%s]: ", message_get_sender(m));
-		printf("%s\n", message_get_content(m));
+		printf("[%.*s]: ", (int)m->sender_len, m->sender);
+		printf("%.*s\n", (int)m->content_len, m->content);
 	}
 }
 
 /**
- * @brief Keeps listening to server messages.
+ * @brief Displays the per-hop latency of a traced message.
  *
- * This function will be executed by a thread that is responsable for 
- * keep checking if there is a new message from the server.
+ * Hops between the sender and the server, and between the server and this client,
+ * are only meaningful when both ends share the monotonic clock, that is, on the same host.
  *
- * If there is an new message, the thread will display the message.
+ * @param[in] t The trace stamps.
+ */
+void show_trace(const struct frame_trace *t)
+{
+	uint64_t now = frame_now();
+
+	printf("    trace:");
+	if (t->client_send)
+		printf(" sender->server %.1fus", ((int64_t)(t->server_recv - t->client_send)) / 1000.0);
+	printf(" server lock %.1fus", (t->server_enqueue - t->server_recv) / 1000.0);
+	printf(" fan-out %.1fus", (t->server_flush - t->server_enqueue) / 1000.0);
+	printf(" server->here %.1fus", ((int64_t)(now - t->server_flush)) / 1000.0);
+	if (t->client_send)
+		printf(" total %.1fus", ((int64_t)(now - t->client_send)) / 1000.0);
+	printf("\n");
+}
+
+/** @brief Set once the session is ready, so a failure can be told apart from a goodbye. */
+bool CONNECTED = false;
+
+/** @brief Set by @c /exit, so the session closing is not resumed. */
+bool LEAVING = false;
+
+/** @brief The current session, NULL while waiting to reconnect. */
+struct zipzop_session *SESSION = NULL;
+
+/** @brief Resume token of the session that dropped. */
+char RESUME_TOKEN[ZIPZOP_TOKEN_LEN + 1];
+
+/** @brief Last message the session that dropped got. */
+uint64_t RESUME_SEQ = 0;
+
+/** @brief When to give up reconnecting, @c 0 when not reconnecting. */
+time_t RESUME_DEADLINE = 0;
+
+/** @brief When to try a busy server again, @c 0 when it was not busy. */
+time_t RETRY_AT = 0;
+
+/** @brief Busy answers taken so far. */
+unsigned BUSY_ANSWERS = 0;
+
+/** @brief File being downloaded, @c -1 if none. */
+int DOWNLOAD_FD = -1;
+
+/** @brief Where the file being downloaded is saved. */
+char DOWNLOAD_PATH[64 + FRAME_MAX_PAYLOAD];
+
+/**
+ * @brief Called by the library once the handshake is done.
+ *
+ * @param[in] s The session.
+ * @param[in] arg Unused.
+ */
+void on_connect(struct zipzop_session *s, void *arg)
+{
+	(void)arg;
+	CONNECTED = true;
+	zipzop_set_trace(s, TRACE_EVERY);
+	if (INGEST_FLUSH_MS > 0)
+		zipzop_set_flush_interval(s, INGEST_FLUSH_MS);
+
+	if (RESUME_DEADLINE) {
+		RESUME_DEADLINE = 0;
+		fprintf(stderr, "reconnected\n");
+	}
+}
+
+/**
+ * @brief Called by the library for every message from the server.
  *
- * @param[in] client A pointer to the client.
+ * @param[in] s The session.
+ * @param[in] m The message.
+ * @param[in] arg Unused.
  *
  * @see show_message
  */
-void *listen_to_server_thread(void *client)
+void on_message(struct zipzop_session *s, const struct message_view *m, void *arg)
 {
-	struct client *c = (struct client *)client;
-	char msg[MESSAGE_LEN];
-
-	ssize_t numbytes;
-	while ((numbytes = recv(client_get_socket(c), msg, MESSAGE_LEN - 1, 0)) > 0) {
-		msg[numbytes] = '\0';
-		struct message *m = message_unpack(msg);
-		show_message(m);
-		message_destroy(m);
+	(void)arg;
+	show_message(m);
+
+	const struct frame_trace *t = zipzop_get_trace(s);
+	if (TRACE_EVERY && t) {
+		show_trace(t);
 	}
+}
 
-	perror("listen_to_server_thread -> recv():");
+/**
+ * @brief Called by the library when someone enters or leaves the room.
+ *
+ * @param[in] s The session.
+ * @param[in] kind What happened.
+ * @param[in] name The username.
+ * @param[in] arg Unused.
+ */
+void on_presence(struct zipzop_session *s, enum zipzop_presence kind, const char *name, void *arg)
+{
+	(void)s;
+	(void)arg;
+
+	if (kind == ZIPZOP_MEMBER)
+		printf("[server]: %s is in the room\n", name);
+	else if (kind == ZIPZOP_JOINED)
+		printf("[server]: %s entered the room\n", name);
+	else if (kind == ZIPZOP_LEFT)
+		printf("[server]: %s has exit the room\n", name);
+}
 
-	pthread_cancel(*client_get_thread(c));
-	close(client_get_socket(c));
-	client_destroy(c);
+/**
+ * @brief Called by the library as a file asked for with @c /get arrives.
+ *
+ * The file is saved in the current directory, under its own name, or prefixed
+ * with its id if that name is taken.
+ *
+ * @param[in] s The session.
+ * @param[in] ev What arrived.
+ * @param[in] ff The file frame.
+ * @param[in] arg Unused.
+ */
+void on_file(struct zipzop_session *s, enum zipzop_file_event ev, const struct frame_file *ff, void *arg)
+{
+	(void)s;
+	(void)arg;
+
+	if (ev == ZIPZOP_FILE_BEGIN) {
+		if (DOWNLOAD_FD != -1)
+			close(DOWNLOAD_FD);
+
+		const char *name = strrchr(ff->name, '/');
+		name = name ? name + 1 : ff->name;
+		if (name[0] == '\0' || name[0] == '.')
+			name = "file";
+
+		snprintf(DOWNLOAD_PATH, sizeof(DOWNLOAD_PATH), "%s", name);
+		DOWNLOAD_FD = open(DOWNLOAD_PATH, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (DOWNLOAD_FD == -1 && errno == EEXIST) {
+			snprintf(DOWNLOAD_PATH, sizeof(DOWNLOAD_PATH), "%u-%s", ff->id, name);
+			DOWNLOAD_FD = open(DOWNLOAD_PATH, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		}
+		if (DOWNLOAD_FD == -1)
+			perror(DOWNLOAD_PATH);
+		else
+			printf("[file]: receiving %s (%llu bytes)\n", DOWNLOAD_PATH, (unsigned long long)ff->size);
+		return;
+	}
+
+	if (DOWNLOAD_FD == -1)
+		return;
 
-	return NULL;
+	if (ev == ZIPZOP_FILE_DATA) {
+		if (write(DOWNLOAD_FD, ff->data, ff->len) != (ssize_t)ff->len) {
+			perror(DOWNLOAD_PATH);
+			close(DOWNLOAD_FD);
+			DOWNLOAD_FD = -1;
+		}
+		return;
+	}
+
+	close(DOWNLOAD_FD);
+	DOWNLOAD_FD = -1;
+	printf("[file]: saved %s\n", DOWNLOAD_PATH);
 }
 
 /**
- * @brief Keeps reading messages from @c stdin and send them to server.
- *
- * The message will be sent as a packet version of a struct message.
+ * @brief Called by the library when the connection is gone.
  *
- * @param[in] c The client that sent the message.
+ * A session that drops is resumed by communicate(), retrying for up to
+ * @c ZIPZOP_RESUME_WINDOW seconds. A server too busy to take the session on is
+ * tried again once the time it asked for passed, up to @c BUSY_RETRIES times.
  *
- * @see message_pack
+ * @param[in] s The session.
+ * @param[in] arg Unused.
  */
-void *speak_thread(void *client)
+void on_close(struct zipzop_session *s, void *arg)
 {
-	struct client *c = (struct client *)client;
-	char msg[MESSAGE_LEN];
+	(void)arg;
 
-	while (fgets(msg, MESSAGE_LEN, stdin)) {
-		char *nl = strchr(msg, '\n');
-		if (nl) {
-			*nl = '\0';
-		}
+	if (LEAVING)
+		exit(0);
 
-		char cmd[MESSAGE_LEN];
-		strcpy(cmd, msg);
-		char *tok = strtok(cmd, " \n\t");
+	SESSION = NULL;
 
-		if (tok) {
-			if (strcmp(tok, "/exit") == 0) {
-				exit(0);
-			}
+	if (zipzop_is_ended(s)) {
+		fprintf(stderr, "server shut down\n");
+		exit(0);
+	}
+
+	unsigned retry_after = zipzop_get_retry_after(s);
+	if (retry_after) {
+		CONNECTED = false;
+		if (++BUSY_ANSWERS > BUSY_RETRIES) {
+			fprintf(stderr, "server busy, giving up\n");
+			exit(E_CONNECT);
 		}
+		RETRY_AT = time(NULL) + retry_after;
+		fprintf(stderr, "server busy, retrying in %u s\n", retry_after);
+		return;
+	}
 
-		int rv = send(client_get_socket(c), msg, strlen(msg) + 1, 0);
-		if (rv <= 0) {
-			perror("send()");
+	if (CONNECTED) {
+		CONNECTED = false;
+		if (zipzop_get_token(s)[0] == '\0') {
+			fprintf(stderr, "connection closed\n");
+			exit(0);
 		}
+		strcpy(RESUME_TOKEN, zipzop_get_token(s));
+		RESUME_SEQ = zipzop_get_last_seq(s);
+		if (!RESUME_DEADLINE) {
+			RESUME_DEADLINE = time(NULL) + ZIPZOP_RESUME_WINDOW;
+			fprintf(stderr, "connection lost, reconnecting\n");
+		}
+		return;
 	}
 
-	return NULL;
+	if (!RESUME_DEADLINE) {
+		fprintf(stderr, "failed to connect\n");
+		exit(E_CONNECT);
+	}
 }
 
 /**
- * @brief Gets the internet address of the server.
+ * @brief Check if a line is a command: blanks, the command, then a blank or the end of the line.
  *
- * Given the server name, this function will try to find an internet address to this server.
+ * @param[in] line The line.
+ * @param[in] len The line length.
+ * @param[in] cmd The command.
  *
- * @param[in] server_name The server name.
- *
- * @return A pointer to a list of possibly valid server internet addresses.
+ * @return Where what follows the command starts if the line is the command, @c 0 otherwise.
  */
-struct addrinfo *get_server_addr(const char * server_name)
+size_t match_command(const char *line, size_t len, const char *cmd)
 {
-	struct addrinfo hints, *servinfo;
+	size_t i = 0;
+	while (i < len && (line[i] == ' ' || line[i] == '\t'))
+		i++;
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family 	= AF_UNSPEC;
-	hints.ai_socktype 	= SOCK_STREAM;
+	size_t cmd_len = strlen(cmd);
+	if (len - i < cmd_len || memcmp(line + i, cmd, cmd_len) != 0)
+		return 0;
 
-	int rv;
-	if ((rv = getaddrinfo(server_name, PORT, &hints, &servinfo)) != 0) {
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-		exit(E_GETADDRINFO);
-	}
+	i += cmd_len;
+	if (i < len && line[i] != ' ' && line[i] != '\t')
+		return 0;
 
-	return servinfo;
+	return i;
 }
 
 /**
- * @brief Attempts to create a socket to an internet address 
- * and connect to it in to a port.
+ * @brief Send one line typed by the user to the server.
  *
- * @param[in] addr The internet address.
+ * The @c /exit command ends the program instead, telling the server not to keep the session,
+ * and @c /send @c <path> uploads a file.
  *
- * @return The socket in case os success. @c -1 otherwise.
+ * @param[in] s The session.
+ * @param[in] msg The line, without the new line character; it need not be @c NUL terminated.
+ * @param[in] len The line length.
+ *
+ * @return @c 0 in case of success, @c -1 if the line could not be sent, see zipzop_send().
  */
-int create_and_connect(struct addrinfo *addr)
+int speak(struct zipzop_session *s, const char *msg, size_t len)
 {
-	int sockfd;
-
-	if ((sockfd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) == -1) {
-		return -1;
+	/* Commands start with a slash, other lines are not looked at any further */
+	size_t args = memchr(msg, '/', len) ? match_command(msg, len, "/exit") : 0;
+	if (args) {
+		LEAVING = true;
+		zipzop_bye(s);
+		exit(0);
 	}
 
-	if (connect(sockfd, addr->ai_addr, addr->ai_addrlen) == -1) {
-		return -1;
+	args = memchr(msg, '/', len) ? match_command(msg, len, "/send") : 0;
+	if (args) {
+		char path[MESSAGE_LEN];
+		while (args < len && (msg[args] == ' ' || msg[args] == '\t'))
+			args++;
+		snprintf(path, sizeof(path), "%.*s", (int)(len - args), msg + args);
+		if (zipzop_send_file(s, path) == -1)
+			perror(path);
+		return 0;
 	}
 
-	return sockfd;
+	return zipzop_send(s, msg, len);
 }
 
 /**
- * @brief Presents the client to the server.
+ * @brief Read what is available on @c stdin and send every complete line.
  *
- * This function sends everything that is needed to introduce the client to the server.
+ * @param[in] s The session.
  *
- * In this case only the client name is sent to the server.
- *
- * @param[in] c The client.
+ * @return @c false once @c stdin is over, @c true otherwise.
  */
-void server_introduction(struct client *c)
+bool read_lines(struct zipzop_session *s)
 {
-	int sockfd 			= client_get_socket(c);
-	const char *name 	= client_get_name(c);
-	int len 			= strlen(name) + 1;
+	static char buf[MESSAGE_LEN];
+	static size_t len = 0;
+
+	ssize_t n = read(STDIN_FILENO, buf + len, MESSAGE_LEN - 1 - len);
+	if (n == -1 && errno == EINTR)
+		return true;
 
-	int rv = send(sockfd, name, len, 0);
-	if (rv == -1) {
-		perror("send()");
+	if (n <= 0) {
+		if (len > 0 && speak(s, buf, len) == -1)
+			perror("zipzop_send()");
+		len = 0;
+		return false;
+	}
+	len += n;
+
+	char *start = buf;
+	char *nl;
+	while ((nl = memchr(start, '\n', buf + len - start))) {
+		if (speak(s, start, nl - start) == -1)
+			perror("zipzop_send()");
+		start = nl + 1;
 	}
+	len = buf + len - start;
+	memmove(buf, start, len);
+
+	/* A line longer than the buffer is sent in pieces */
+	if (len == MESSAGE_LEN - 1) {
+		if (speak(s, buf, len) == -1)
+			perror("zipzop_send()");
+		len = 0;
+	}
+
+	return true;
 }
 
+/** @brief Batch mode: bytes read from @c stdin and not sent yet. */
+char INGEST_BUF[INGEST_BLOCK];
+
+/** @brief Batch mode: number of bytes in @c INGEST_BUF. */
+size_t INGEST_LEN = 0;
+
+/** @brief Batch mode: set while the session takes no more, so @c stdin is not read. */
+bool INGEST_STALLED = false;
+
 /**
- * @brief Manages the connection with a user and a server.
+ * @brief Batch mode: send the lines read, as long as the session takes them.
  *
- * Given a username and a socket connected with the server, manages the connection, 
- * creating a thread to listen to incomming messages from the server, and another to 
- * read messages from the user and send them to the server.
+ * The line ends are found many at a time, by textscan_find_newlines(). Lines
+ * longer than a message are sent in pieces, and so is a full buffer without any
+ * line end. Lines are handed to the library as they lie in the buffer, commands
+ * included: piped data is sent as it is, and only the end of @c stdin ends it.
  *
- * @param[in] user_name The username.
- * @param[in] sockfd The socket connected to the server.
+ * @param[in] s The session.
+ * @param[in] eof Whether @c stdin is over, so the last line needs no line end.
+ *
+ * @return @c true if every complete line was sent, @c false if the session is full.
  */
-void communicate(const char *user_name, int sockfd)
+bool ingest_lines(struct zipzop_session *s, bool eof)
 {
-	struct client *c = client_create(user_name, sockfd);
+	uint32_t ends[INGEST_LINES];
+	size_t done = 0;
+	bool full = false;
+
+	while (!full && done < INGEST_LEN) {
+		const char *base = INGEST_BUF + done;
+		size_t avail = INGEST_LEN - done;
+		size_t n = textscan_find_newlines(base, avail, ends, INGEST_LINES);
+		if (n == 0) {
+			/* The end of the line is still to be read */
+			if (!eof && avail < INGEST_BLOCK)
+				break;
+			ends[n++] = avail;
+		}
 
-	if (c) {
-		server_introduction(c);
-		if (pthread_create(client_get_thread(c), NULL, speak_thread, c)) {
-			exit(E_PTHREAD_CREATE);
+		size_t off = 0;
+		for (size_t i = 0; i < n && !full; i++) {
+			while (off < ends[i]) {
+				size_t len = ends[i] - off < MESSAGE_LEN - 1 ? ends[i] - off : MESSAGE_LEN - 1;
+				if (zipzop_send(s, base + off, len) == -1) {
+					if (errno == EAGAIN) {
+						full = true;
+						break;
+					}
+					perror("zipzop_send()");
+				}
+				off += len;
+			}
+			if (!full)
+				off = ends[i] + 1;
 		}
-		listen_to_server_thread(c);
+		done += off < avail ? off : avail;
 	}
+
+	INGEST_LEN -= done;
+	memmove(INGEST_BUF, INGEST_BUF + done, INGEST_LEN);
+
+	return !full;
+}
+
+/**
+ * @brief Batch mode: read a block of @c stdin and send its lines.
+ *
+ * @param[in] s The session.
+ *
+ * @return @c false once @c stdin is over, @c true otherwise.
+ */
+bool ingest(struct zipzop_session *s)
+{
+	ssize_t n = read(STDIN_FILENO, INGEST_BUF + INGEST_LEN, INGEST_BLOCK - INGEST_LEN);
+	if (n == -1 && errno == EINTR)
+		return true;
+
+	if (n > 0)
+		INGEST_LEN += n;
+	INGEST_STALLED = !ingest_lines(s, n <= 0);
+
+	return n > 0;
 }
 
 /**
- * @brief This function is responsible to make the initial 
- * configuration, so that this program can run as a client.
+ * @brief Manages the connection with a user and a server.
+ *
+ * Waits on @c stdin and on the library at the same time: lines typed by the user
+ * are sent to the server, and messages from the server are displayed by on_message().
+ * While the connection is down, a new one resuming the session is attempted every second.
+ * After a busy answer, the same kind of connection is attempted again once, when the server said.
  *
- * @return A socket connected with the zip-zop-server.
- * The user should be able to call @c send() and @c recv() in this socket.
+ * In batch mode @c stdin is read by blocks instead, and not at all while the
+ * session takes no more; the client leaves once it is over and everything was written.
+ *
+ * @param[in] ctx The library context.
+ * @param[in] server The server address, or the path of its Unix domain socket.
+ * @param[in] name The username.
+ * @param[in] cb The library callbacks.
  */
-int configure_as_client(const char *server_name)
+void communicate(struct zipzop_ctx *ctx, const char *server, const char *name, const struct zipzop_callbacks *cb)
 {
-	struct addrinfo *servinfo = get_server_addr(server_name);
-	
-	int sockfd;
-	/* Iterate through all the list of server addresses, and try to connect to one of them */
-	for (struct addrinfo *p = servinfo; p != NULL; p = p->ai_next) {
-		if ((sockfd = create_and_connect(p)) != -1) {
+	struct pollfd pfd[2] = {
+		{ .fd = -1, 						.events = POLLIN },
+		{ .fd = zipzop_ctx_get_fd(ctx), 	.events = POLLIN }
+	};
+	bool stdin_open = true;
+
+	while (true) {
+		/* Nothing is read from the user before the server is ready for it */
+		pfd[0].fd = (CONNECTED && stdin_open && !INGEST_STALLED) ? STDIN_FILENO : -1;
+
+		/* A stalled session over shared memory tells nothing when it takes more again */
+		int timeout = INGEST_STALLED ? 10 : (RESUME_DEADLINE || RETRY_AT) ? 1000 : -1;
+		int flush = zipzop_ctx_get_timeout(ctx);
+		if (flush != -1 && (timeout == -1 || flush < timeout))
+			timeout = flush;
+
+		if (poll(pfd, 2, timeout) == -1 && errno != EINTR) {
+			perror("poll()");
 			break;
 		}
-	}
 
-	freeaddrinfo(servinfo);
+		if (pfd[0].revents && SESSION) {
+			stdin_open = INGEST_FLUSH_MS >= 0 ? ingest(SESSION) : read_lines(SESSION);
+		} else if (INGEST_STALLED && SESSION) {
+			INGEST_STALLED = !ingest_lines(SESSION, !stdin_open);
+		}
 
-	if (sockfd == -1) {
-		fprintf(stderr, "failed to connect\n");
-		exit(E_CONNECT);
-	}
+		/* Batch mode is over once everything read was written, the server closes the session then */
+		if (INGEST_FLUSH_MS >= 0 && !stdin_open && !INGEST_STALLED && SESSION && !LEAVING
+				&& zipzop_get_pending(SESSION) == 0) {
+			LEAVING = true;
+			zipzop_finish(SESSION);
+		}
 
-	return sockfd;
+		if (RETRY_AT && !SESSION) {
+			if (time(NULL) >= RETRY_AT) {
+				RETRY_AT = 0;
+				SESSION = RESUME_TOKEN[0]
+					? zipzop_resume(ctx, server, name, RESUME_TOKEN, RESUME_SEQ, connect_flags(), cb, NULL)
+					: zipzop_connect(ctx, server, name, connect_flags(), cb, NULL);
+				if (!SESSION) {
+					fprintf(stderr, "failed to connect\n");
+					exit(E_CONNECT);
+				}
+				if (FILTER)
+					zipzop_set_filter(SESSION, FILTER);
+			}
+		} else if (RESUME_DEADLINE && !SESSION) {
+			if (time(NULL) >= RESUME_DEADLINE) {
+				fprintf(stderr, "could not reconnect\n");
+				exit(E_CONNECT);
+			}
+			SESSION = zipzop_resume(ctx, server, name, RESUME_TOKEN, RESUME_SEQ,
+					connect_flags(), cb, NULL);
+			if (SESSION && FILTER)
+				zipzop_set_filter(SESSION, FILTER);
+		}
+
+		if (zipzop_poll(ctx, 0) == -1) {
+			perror("zipzop_poll()");
+			break;
+		}
+	}
 }
+
 /**
  * @brief The zip-zop-client.
  *
  * A TCP client that will connect with an instance of the zip-zop-server.
+ * It is a thin interactive front end to the libzipzop client library.
  *
  * @param[in] argc Number of arguments given by the user.
  * @param[in] argc An array of strings representing the arguments given by the user
  * 
- * @note Usage: ./zip-zop-client <server_addr> <username>
+ * @note Usage: ./zip-zop-client [-m] [-g] [-t N] [-f words] [-b ms] <server_addr | unix socket path> <username>
  */
 int main(int argc, char **argv)
 {
-	if (check_args(argc) == false) {
+	if (check_args(argc, argv) == false) {
 		print_usage(argv[0]);
 		return E_BAD_ARGS;
 	}
 
-	const char *server_name 	= argv[1];
-	const char *user_name 		= argv[2];
+	const char *server_name 	= argv[optind];
+	const char *user_name 		= argv[optind + 1];
+
+	struct zipzop_ctx *ctx = zipzop_ctx_create();
+	if (!ctx) {
+		perror("zipzop_ctx_create()");
+		return E_CONNECT;
+	}
+
+	if (USE_SHM && !strchr(server_name, '/')) {
+		fprintf(stderr, "shared memory needs a unix socket path, using TCP\n");
+		USE_SHM = false;
+	}
+
+	struct zipzop_callbacks cb = { on_connect, on_message, on_close, on_presence, on_file };
+	SESSION = zipzop_connect(ctx, server_name, user_name, connect_flags(), &cb, NULL);
+	if (!SESSION) {
+		fprintf(stderr, "failed to connect\n");
+		return E_CONNECT;
+	}
+	if (FILTER && zipzop_set_filter(SESSION, FILTER) == -1) {
+		perror("zipzop_set_filter()");
+	}
 
-	int sockfd = configure_as_client(server_name);
-	communicate(user_name, sockfd);
+	communicate(ctx, server_name, user_name, &cb);
+	zipzop_ctx_destroy(ctx);
 
 	return 0;
 }
@@ -0,0 +1,628 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "errcodes.h"
+#include "frame.h"
+#include "hist.h"
+#include "capture.h"
+#include "shmchan.h"
+#include "zipzop.h"
+
+/** @brief Handshake option carrying the token of a session to resume, dropped when replaying. */
+#define RESUME_OPT "resume="
+
+/** @brief Handshake option carrying the last sequence number a resuming client got, dropped when replaying. */
+#define SEQ_OPT "seq="
+
+/** @brief Longest handshake sent; the server reads it at once. */
+#define HANDSHAKE_LEN 512
+
+/** @brief Milliseconds the last deliveries get once every record was played. */
+#define DRAIN_MS 1000
+
+/** @brief Most report entries read from a baseline. */
+#define REPORT_KEYS 16
+
+/** @brief Playback speed (@c -x): @c 1 is the speed of the capture, @c 0 as fast as possible. */
+double SPEED = 1;
+
+/** @brief Host of the server under test (@c -s). */
+const char *HOST = "127.0.0.1";
+
+/** @brief Where the report is saved (@c -o), NULL for nowhere. */
+const char *REPORT = NULL;
+
+/** @brief Report of an earlier run to compare with (@c -b), NULL for none. */
+const char *BASELINE = NULL;
+
+/** @brief How much worse than the baseline, in percent, is a regression (@c -t). */
+double THRESHOLD = 10;
+
+/**
+ * @brief A connection of the capture, played against the server.
+ */
+struct conn {
+	int sockfd; 			/**< The socket, @c -1 once closed */
+	bool answered; 			/**< Whether the server refused shared memory, its answer to every replayed handshake */
+	bool ready; 			/**< Whether the server sent the session, so frames may go */
+	bool closing; 			/**< Whether the capture closed it while frames were still held back */
+	char *pending; 			/**< Frames captured before the server answered, sent once it does */
+	size_t pending_len; 	/**< Bytes of @c pending */
+	char in[FRAME_MAX_LEN]; /**< Bytes received and not parsed yet */
+	size_t in_len; 			/**< Bytes of @c in */
+};
+
+/**
+ * @brief What the replay did.
+ */
+struct replay_stats {
+	unsigned conns; 				/**< Connections opened */
+	unsigned refused; 				/**< Connections that could not be opened */
+	unsigned dropped; 				/**< Connections the server closed */
+	unsigned long long sent; 		/**< Frames sent */
+	unsigned long long sent_chat; 	/**< Chat messages sent */
+	unsigned long long sent_bytes; 	/**< Bytes sent */
+	unsigned long long recv; 		/**< Frames received */
+	unsigned long long recv_chat; 	/**< Chat messages received */
+	unsigned long long recv_bytes; 	/**< Bytes received */
+	uint64_t last_us; 				/**< When something was last played, sent or received */
+};
+
+/** @brief The connections, by capture id; the ids start at @c 1. */
+struct conn **CONNS = NULL;
+
+/** @brief Number of entries in @c CONNS. */
+size_t NCONNS = 0;
+
+/** @brief What the replay did. */
+struct replay_stats STATS;
+
+/** @brief Time from sending a chat message to getting it back from the server, on every connection. */
+struct hist *LATENCY;
+
+/**
+ * @brief Checks if the user enter the arguments in the correct manner.
+ *
+ * @param[in] argc Number of arguments.
+ * @param[in] argv The arguments.
+ *
+ * @return @c true if the arguments are correct, @c false otherwise.
+ */
+bool check_args(int argc, char **argv)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "x:s:o:b:t:")) != -1) {
+		if (opt == 'x')
+			SPEED = strtod(optarg, NULL);
+		else if (opt == 's')
+			HOST = optarg;
+		else if (opt == 'o')
+			REPORT = optarg;
+		else if (opt == 'b')
+			BASELINE = optarg;
+		else if (opt == 't')
+			THRESHOLD = strtod(optarg, NULL);
+		else
+			return false;
+	}
+
+	return SPEED >= 0 && argc - optind == 1;
+}
+
+/**
+ * @brief Prints the correct usage of the program.
+ *
+ * @param[in] name The name of this program.
+ */
+void print_usage(const char *name)
+{
+	printf("usage: %s [-x speed] [-s host] [-o report] [-b baseline] [-t percent] <capture>\n", name);
+	printf("  -x S  play S times faster than captured, 0 for as fast as possible (default 1)\n");
+	printf("  -s H  the server host (default 127.0.0.1)\n");
+	printf("  -o F  save the report in F\n");
+	printf("  -b F  compare with the report F of an earlier run\n");
+	printf("  -t P  a throughput or latency P percent worse than the baseline is a regression (default 10)\n");
+}
+
+/**
+ * @brief Read the @c CLOCK_MONOTONIC time in microseconds.
+ */
+uint64_t now_us(void)
+{
+	return frame_now() / 1000;
+}
+
+/**
+ * @brief Open a connection to the server.
+ *
+ * @return The socket, @c -1 on error.
+ */
+int connect_to_server(void)
+{
+	struct addrinfo hints, *servinfo;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family 	= AF_UNSPEC;
+	hints.ai_socktype 	= SOCK_STREAM;
+
+	int rv;
+	if ((rv = getaddrinfo(HOST, ZIPZOP_PORT, &hints, &servinfo)) != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		return -1;
+	}
+
+	int sockfd = -1;
+	for (struct addrinfo *p = servinfo; p != NULL; p = p->ai_next) {
+		sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		if (sockfd == -1)
+			continue;
+		if (connect(sockfd, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+		close(sockfd);
+		sockfd = -1;
+	}
+
+	freeaddrinfo(servinfo);
+
+	return sockfd;
+}
+
+/**
+ * @brief Write all of a buffer to a connection.
+ *
+ * @return @c 0 in case of success, @c -1 on error.
+ */
+int send_all(struct conn *c, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = send(c->sockfd, buf, len, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return -1;
+		STATS.last_us = now_us();
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Close a connection, if it is open.
+ */
+void close_conn(struct conn *c)
+{
+	if (c->sockfd != -1) {
+		close(c->sockfd);
+		c->sockfd = -1;
+	}
+	free(c->pending);
+	c->pending 		= NULL;
+	c->pending_len 	= 0;
+}
+
+/**
+ * @brief Send a captured frame.
+ *
+ * Chat messages are traced from now on, so the time they take to come back can be
+ * measured; the stamps they were captured with are meaningless here.
+ *
+ * @return @c 0 in case of success, @c -1 on error.
+ */
+int send_frame(struct conn *c, const char *frame, size_t len)
+{
+	struct frame f;
+	if (frame_parse(frame, len, &f) != (ssize_t)len)
+		return -1;
+
+	STATS.sent++;
+	if (f.type != FRAME_CHAT) {
+		STATS.sent_bytes += len;
+		return send_all(c, frame, len);
+	}
+
+	char out[FRAME_MAX_LEN];
+	struct frame_trace t;
+	memset(&t, 0, sizeof(t));
+	t.client_send = frame_now();
+	size_t hlen = frame_write_header(out, FRAME_CHAT, FRAME_F_TRACE, f.payload_len, 0, &t);
+	memcpy(out + hlen, f.payload, f.payload_len);
+
+	STATS.sent_chat++;
+	STATS.sent_bytes += hlen + f.payload_len;
+
+	return send_all(c, out, hlen + f.payload_len);
+}
+
+/**
+ * @brief Send the frames captured before the server answered the handshake.
+ *
+ * @return @c 0 in case of success, @c -1 on error.
+ */
+int send_pending(struct conn *c)
+{
+	struct frame f;
+	size_t off = 0;
+	ssize_t flen;
+	while (off < c->pending_len && (flen = frame_parse(c->pending + off, c->pending_len - off, &f)) > 0) {
+		if (send_frame(c, c->pending + off, flen) == -1)
+			return -1;
+		off += flen;
+	}
+	free(c->pending);
+	c->pending 		= NULL;
+	c->pending_len 	= 0;
+
+	return 0;
+}
+
+/**
+ * @brief Start a captured connection: connect, and send the captured handshake.
+ *
+ * The resume options are left out, the sessions they name do not exist on this
+ * server; so is the shared-memory one, the replay only speaks TCP.
+ */
+void play_open(uint32_t id, const char *handshake, size_t len)
+{
+	if (id >= NCONNS) {
+		size_t n = NCONNS ? NCONNS : 64;
+		while (n <= id)
+			n *= 2;
+		struct conn **conns = realloc(CONNS, n * sizeof(struct conn *));
+		if (!conns) {
+			exit(E_ALLOC);
+		}
+		memset(conns + NCONNS, 0, (n - NCONNS) * sizeof(struct conn *));
+		CONNS 	= conns;
+		NCONNS 	= n;
+	}
+
+	struct conn *c = CONNS[id] ? CONNS[id] : calloc(1, sizeof(struct conn));
+	if (!c) {
+		exit(E_ALLOC);
+	}
+	CONNS[id] = c;
+	c->answered = false;
+	c->ready 	= false;
+	c->closing 	= false;
+	c->in_len 	= 0;
+	c->sockfd 	= connect_to_server();
+	if (c->sockfd == -1) {
+		STATS.refused++;
+		return;
+	}
+	STATS.conns++;
+
+	char out[HANDSHAKE_LEN];
+	size_t out_len = 0;
+	const char *p = handshake, *end = handshake + len;
+	while (p < end) {
+		const char *nul = memchr(p, '\0', end - p);
+		size_t n = (nul ? nul : end) - p;
+		bool skip = p != handshake && (strncmp(p, RESUME_OPT, strlen(RESUME_OPT)) == 0
+				|| strncmp(p, SEQ_OPT, strlen(SEQ_OPT)) == 0
+				|| (n == strlen(SHMCHAN_HANDSHAKE_OPT) && memcmp(p, SHMCHAN_HANDSHAKE_OPT, n) == 0));
+		if (!skip && out_len + n + 1 <= sizeof(out)) {
+			memcpy(out + out_len, p, n);
+			out[out_len + n] = '\0';
+			out_len += n + 1;
+		}
+		p += n + 1;
+	}
+
+	if (send_all(c, out, out_len) == -1) {
+		close_conn(c);
+		STATS.dropped++;
+	}
+}
+
+/**
+ * @brief Send a captured frame, or keep it until the server answered the handshake.
+ */
+void play_frame(uint32_t id, const char *frame, size_t len)
+{
+	struct conn *c = id < NCONNS ? CONNS[id] : NULL;
+	if (!c || c->sockfd == -1 || c->closing)
+		return;
+
+	if (!c->ready) {
+		char *pending = realloc(c->pending, c->pending_len + len);
+		if (!pending) {
+			exit(E_ALLOC);
+		}
+		memcpy(pending + c->pending_len, frame, len);
+		c->pending 		= pending;
+		c->pending_len += len;
+		return;
+	}
+
+	if (send_frame(c, frame, len) == -1) {
+		close_conn(c);
+		STATS.dropped++;
+	}
+}
+
+/**
+ * @brief Read what the server sent on a connection.
+ *
+ * The handshake is answered with a single byte, then the session comes in the
+ * first frame. Traced chat messages are the ones the replay sent, back from the server.
+ */
+void read_conn(struct conn *c)
+{
+	if (!c->answered) {
+		char byte;
+		if (recv(c->sockfd, &byte, 1, 0) != 1 || byte != SHMCHAN_REFUSED) {
+			close_conn(c);
+			STATS.dropped++;
+			return;
+		}
+		c->answered = true;
+		return;
+	}
+
+	ssize_t n = recv(c->sockfd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+	if (n <= 0) {
+		close_conn(c);
+		STATS.dropped++;
+		return;
+	}
+	c->in_len += n;
+	STATS.recv_bytes += n;
+	STATS.last_us = now_us();
+
+	uint64_t now = frame_now();
+	struct frame f;
+	size_t off = 0;
+	ssize_t flen;
+	while ((flen = frame_parse(c->in + off, c->in_len - off, &f)) > 0) {
+		off += flen;
+		STATS.recv++;
+		if (f.type == FRAME_CHAT) {
+			STATS.recv_chat++;
+			if ((f.flags & FRAME_F_TRACE) && f.trace.client_send && f.trace.client_send <= now)
+				hist_record(LATENCY, now - f.trace.client_send);
+		}
+		if (!c->ready) {
+			c->ready = true;
+			if (send_pending(c) == -1) {
+				close_conn(c);
+				STATS.dropped++;
+				return;
+			}
+			if (c->closing) {
+				close_conn(c);
+				return;
+			}
+		}
+	}
+	if (flen == -1) {
+		fprintf(stderr, "the server sent a malformed frame\n");
+		close_conn(c);
+		STATS.dropped++;
+		return;
+	}
+
+	c->in_len -= off;
+	memmove(c->in, c->in + off, c->in_len);
+}
+
+/**
+ * @brief End a captured connection, once the frames held back for it were sent.
+ */
+void play_close(uint32_t id)
+{
+	struct conn *c = id < NCONNS ? CONNS[id] : NULL;
+	if (!c)
+		return;
+
+	if (c->ready || c->sockfd == -1)
+		close_conn(c);
+	else
+		c->closing = true;
+}
+
+/**
+ * @brief Read from every connection that has something, waiting up to @p timeout_ms.
+ */
+void poll_conns(int timeout_ms)
+{
+	static struct pollfd *pfd = NULL;
+	static struct conn **who = NULL;
+	static size_t cap = 0;
+
+	if (cap < NCONNS) {
+		pfd = realloc(pfd, NCONNS * sizeof(struct pollfd));
+		who = realloc(who, NCONNS * sizeof(struct conn *));
+		if (!pfd || !who) {
+			exit(E_ALLOC);
+		}
+		cap = NCONNS;
+	}
+
+	nfds_t n = 0;
+	for (size_t i = 0; i < NCONNS; i++) {
+		if (CONNS[i] && CONNS[i]->sockfd != -1) {
+			pfd[n].fd 		= CONNS[i]->sockfd;
+			pfd[n].events 	= POLLIN;
+			who[n++] 		= CONNS[i];
+		}
+	}
+
+	if (n == 0) {
+		if (timeout_ms > 0)
+			usleep(timeout_ms * 1000);
+		return;
+	}
+
+	if (poll(pfd, n, timeout_ms) <= 0)
+		return;
+
+	for (nfds_t i = 0; i < n; i++) {
+		if (pfd[i].revents)
+			read_conn(who[i]);
+	}
+}
+
+/**
+ * @brief Get a value saved in a report.
+ *
+ * @return The value, @c -1 if the report does not have it.
+ */
+double report_get(char keys[][32], const double *values, int n, const char *key)
+{
+	for (int i = 0; i < n; i++) {
+		if (strcmp(keys[i], key) == 0)
+			return values[i];
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Print the report, save it, and compare it with the baseline.
+ *
+ * @param[in] elapsed_us How long the replay took.
+ * @param[in] captured_us How long the capture took.
+ *
+ * @return @c true if it is a regression from the baseline, @c false otherwise.
+ */
+bool report(uint64_t elapsed_us, uint64_t captured_us)
+{
+	double secs = elapsed_us / 1e6;
+	const char *keys[] = { "sent_per_s", "delivered_per_s", "latency_p50_us", "latency_p90_us", "latency_p99_us" };
+	double values[] = {
+		STATS.sent / secs,
+		STATS.recv_chat / secs,
+		hist_percentile(LATENCY, 50) / 1e3,
+		hist_percentile(LATENCY, 90) / 1e3,
+		hist_percentile(LATENCY, 99) / 1e3
+	};
+	int nkeys = sizeof(keys) / sizeof(keys[0]);
+
+	printf("replay: %u connections (%u refused, %u dropped by the server), %.1f s for %.1f s of capture\n",
+			STATS.conns, STATS.refused, STATS.dropped, secs, captured_us / 1e6);
+	printf("  sent:      %llu frames, %llu chat messages, %llu bytes\n", STATS.sent, STATS.sent_chat, STATS.sent_bytes);
+	printf("  received:  %llu frames, %llu chat messages, %llu bytes\n", STATS.recv, STATS.recv_chat, STATS.recv_bytes);
+	hist_print(LATENCY, stdout);
+
+	if (REPORT) {
+		FILE *f = fopen(REPORT, "w");
+		if (!f) {
+			perror(REPORT);
+		} else {
+			for (int i = 0; i < nkeys; i++)
+				fprintf(f, "%s=%.3f\n", keys[i], values[i]);
+			fclose(f);
+		}
+	}
+
+	if (!BASELINE)
+		return false;
+
+	FILE *f = fopen(BASELINE, "r");
+	if (!f) {
+		perror(BASELINE);
+		return false;
+	}
+	char base_keys[REPORT_KEYS][32];
+	double base_values[REPORT_KEYS];
+	int nbase = 0;
+	while (nbase < REPORT_KEYS && fscanf(f, " %31[^=]=%lf", base_keys[nbase], &base_values[nbase]) == 2)
+		nbase++;
+	fclose(f);
+
+	bool regression = false;
+	printf("  against %s:\n", BASELINE);
+	for (int i = 0; i < nkeys; i++) {
+		double base = report_get(base_keys, base_values, nbase, keys[i]);
+		if (base <= 0)
+			continue;
+		double change = (values[i] - base) / base * 100;
+		/* Rates should not drop, latencies should not grow */
+		bool worse = i < 2 ? change < -THRESHOLD : change > THRESHOLD;
+		regression |= worse;
+		printf("    %-16s %12.1f -> %12.1f  %+7.1f%%%s\n", keys[i], base, values[i], change, worse ? "  REGRESSION" : "");
+	}
+
+	return regression;
+}
+
+/**
+ * @brief Plays a capture back against a server, and reports how it coped.
+ *
+ * Every captured connection is opened again and sends the same frames, at the
+ * captured pace or faster. Chat messages are traced when they are sent, so every
+ * copy the server sends back tells how long the fan-out took.
+ *
+ * @note Usage: ./zip-zop-replay [-x speed] [-s host] [-o report] [-b baseline] [-t percent] capture
+ */
+int main(int argc, char *argv[])
+{
+	if (!check_args(argc, argv)) {
+		print_usage(argv[0]);
+		exit(E_BAD_ARGS);
+	}
+
+	struct capture_reader *r = capture_reader_create(argv[optind]);
+	LATENCY = hist_create("latency");
+	if (!r || !LATENCY) {
+		fprintf(stderr, "%s: cannot read the capture\n", argv[optind]);
+		exit(E_BAD_ARGS);
+	}
+
+	struct capture_record rec;
+	uint64_t start = now_us(), captured = 0;
+	int rv;
+	while ((rv = capture_reader_next(r, &rec)) == 1) {
+		captured = rec.time_us;
+		uint64_t due = start + (SPEED > 0 ? (uint64_t)(rec.time_us / SPEED) : 0);
+
+		uint64_t now;
+		while ((now = now_us()) < due) {
+			poll_conns((due - now + 999) / 1000);
+		}
+		poll_conns(0);
+
+		if (rec.kind == CAPTURE_OPEN) {
+			play_open(rec.conn, rec.payload, rec.len);
+		} else if (rec.kind == CAPTURE_FRAME) {
+			play_frame(rec.conn, rec.payload, rec.len);
+		} else {
+			play_close(rec.conn);
+		}
+		STATS.last_us = now_us();
+	}
+	if (rv == -1)
+		fprintf(stderr, "%s: the capture is cut short\n", argv[optind]);
+
+	/* The last messages are still on their way back */
+	uint64_t deadline = now_us() + DRAIN_MS * 1000, now;
+	while ((now = now_us()) < deadline) {
+		poll_conns((deadline - now + 999) / 1000);
+	}
+	uint64_t elapsed = STATS.last_us > start ? STATS.last_us - start : 0;
+
+	for (size_t i = 0; i < NCONNS; i++) {
+		if (CONNS[i]) {
+			close_conn(CONNS[i]);
+			free(CONNS[i]);
+		}
+	}
+	free(CONNS);
+	capture_reader_destroy(r);
+
+	bool regression = report(elapsed ? elapsed : 1, captured);
+	hist_destroy(LATENCY);
+
+	return regression ? E_REGRESSION : E_SUCCESS;
+}
@@ -2,23 +2,68 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <inttypes.h>
 
+#include <endian.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
 
 #include "errcodes.h"
 #include "message.h"
 #include "client.h"
 #include "sllist.h"
+#include "shmchan.h"
+#include "frame.h"
+#include "hist.h"
+#include "lockstat.h"
+#include "history.h"
+#include "session.h"
+#include "presence.h"
+#include "mailbox.h"
+#include "search.h"
+#include "textscan.h"
+#include "attach.h"
+#include "topk.h"
+#include "pipeline.h"
+#include "filter.h"
+#include "bufpool.h"
+#include "fiber.h"
+#include "capture.h"
+#include "transport.h"
+#include "simnet.h"
+#include "admit.h"
+#include "affinity.h"
+#include "mcast.h"
+#include "sequencer.h"
 
 /** @brief The port where this application will be running. */
 #define PORT "1234"
 
-/** @brief The number of clients that will be kept in the queue if the server is not ready for accepting them. */
-#define BACKLOG 10
+/** @brief Path of the Unix domain socket co-located clients can connect to. */
+#define UNIX_SOCKET_PATH "/tmp/zip-zop.sock"
+
+/** @brief Number of listening sockets: the TCP one and the Unix domain one. */
+#define LISTENERS 2
+
+/**
+ * @brief The number of clients that will be kept in the queue if the server is not ready for accepting them.
+ *
+ * Refusing is cheap, so it is better for a client to be accepted and told the
+ * server is busy than to be left waiting in the queue.
+ */
+#define BACKLOG SOMAXCONN
+
+/** @brief Milliseconds a new connection has to send its handshake. */
+#define HANDSHAKE_TIMEOUT_MS 5000
 
 /** @brief Maximum length of a client name. */
 #define CLIENT_NAME_LEN 100
@@ -26,6 +71,102 @@
 /** @brief Maximum length of a client message. */
 #define MESSAGE_LEN 2000
 
+/** @brief Maximum length of the handshake: the client name and its options. */
+#define HANDSHAKE_LEN 512
+
+/** @brief Handshake option carrying the token of the session the client wants to resume. */
+#define RESUME_OPT "resume="
+
+/** @brief Handshake option carrying the last sequence number the resuming client got. */
+#define SEQ_OPT "seq="
+
+/** @brief Handshake option carrying the keywords of the client subscription filter. */
+#define FILTER_OPT "filter="
+
+/** @brief Seconds a dropped session stays resumable before the room is told the client left. */
+#define RESUME_GRACE 30
+
+/** @brief Number of messages kept in @c HISTORY for resuming clients. */
+#define HISTORY_LEN 4096
+
+/** @brief Most messages sent again for one @c FRAME_REPLAY request of a member of the multicast group. */
+#define REPLAY_SPAN_MAX 256
+
+/** @brief Milliseconds between two presence deltas. */
+#define PRESENCE_INTERVAL_MS 250
+
+/** @brief Directory where the mailboxes of offline users are kept. */
+#define MAILBOX_DIR "/tmp/zip-zop-mail"
+
+/** @brief Command clients use to send a direct message: @c /msg @c <user> @c <text>. */
+#define DIRECT_MESSAGE_CMD "/msg "
+
+/** @brief Maximum number of @c @@user mentions in a message that are spooled for offline users. */
+#define MENTIONS_MAX 8
+
+/** @brief Command to search the messages broadcast so far: @c /search @c <words>. */
+#define SEARCH_CMD "/search "
+
+/** @brief Maximum number of matches a search shows. */
+#define SEARCH_RESULTS 20
+
+/** @brief Directory where the files uploaded by the users are kept. */
+#define ATTACH_DIR "/tmp/zip-zop-files"
+
+/** @brief Smallest stack, in KiB, that may be asked for the client threads. */
+#define CLIENT_STACK_MIN_KIB 64
+
+/** @brief Idle receive buffers each of the @c RECV_POOLS keeps for reuse. */
+#define RECV_POOL_KEEP 64
+
+/** @brief Command to download a file someone uploaded: @c /get @c <id>. */
+#define GET_CMD "/get "
+
+/** @brief Command to only get the messages with one of the keywords: @c /filter @c <words>, alone to get everything. */
+#define FILTER_CMD "/filter"
+
+/** @brief Seconds @c /shutdown gives the clients to get what is queued for them, unless it is told otherwise. */
+#define DRAIN_TIMEOUT_S 10
+
+/** @brief Connections shut down at once when the server closes them, see drain_server(). */
+#define DRAIN_BATCH 64
+
+/** @brief Milliseconds between two looks at how the drain is going. */
+#define DRAIN_POLL_MS 10
+
+/**
+ * @brief The stages a traced frame goes through in the server.
+ */
+enum trace_stage {
+	TRACE_CLIENT_TO_SERVER, /**< From the sender stamp to the server reading the frame (same host only) */
+	TRACE_SERVER_LOCK, 		/**< From reading the frame to holding the client list lock */
+	TRACE_FANOUT, 			/**< From holding the lock to queuing each copy for a recipient */
+	TRACE_STAGES 			/**< Number of stages */
+};
+
+/** @brief Per-stage latency histograms, fed by traced frames and shown by @c /stats. */
+struct hist *TRACE_HIST[TRACE_STAGES];
+
+/**
+ * @brief Trace one in every @c TRACE_SAMPLE frames that the clients did not trace themselves.
+ *
+ * @c 0 turns server side sampling off. Changed with the @c /trace command.
+ */
+_Atomic unsigned TRACE_SAMPLE = 0;
+
+/** @brief Frames seen since the last server side sample. */
+_Atomic unsigned TRACE_TICK = 0;
+
+/**
+ * @brief Whether the server is shutting down, see drain_server().
+ *
+ * No connection is accepted anymore, and clients may only say goodbye.
+ */
+_Atomic bool DRAINING = false;
+
+/** @brief Readers handling frames they read before the server started draining, see intake_begin(). */
+_Atomic unsigned READERS_BUSY = 0;
+
 /**
  * @brief A singly linked list that will keep all the connected clients.
  *
@@ -38,294 +179,2477 @@ struct sllist *CLIENT_LIST = SLL_INIT();
 /**
  * @brief The @c CLIENT_LIST mutex.
  *
- * This is used to ensure mutual exclusion wen accessing the @c CLIENT_LIST, given 
- * the nature of the application where multiple threads might use the list.
+ * This is used to ensure mutual exclusion wen accessing the @c CLIENT_LIST, given 
+ * the nature of the application where multiple threads might use the list.
+ *
+ * It records its contention statistics, shown by @c /stats.
+ *
+ * @see CLIENT_LIST
+ */
+struct lockstat *CLIENT_LIST_MUTEX;
+
+/**
+ * @brief The last messages broadcast, replayed to clients that resume their session.
+ *
+ * @warning Protected by the @c CLIENT_LIST_MUTEX, so sequence numbers follow the fan-out order.
+ */
+struct history *HISTORY;
+
+/**
+ * @brief Sessions whose connection dropped and that may still be resumed.
+ *
+ * @warning Protected by the @c CLIENT_LIST_MUTEX.
+ *
+ * @see reap_sessions_thread
+ */
+struct sllist *PARKED_SESSIONS = SLL_INIT();
+
+/**
+ * @brief The joins and leaves not yet sent to the room.
+ *
+ * @warning Protected by the @c CLIENT_LIST_MUTEX.
+ *
+ * @see presence_thread
+ */
+struct presence *PRESENCE;
+
+/** @brief Mailboxes keeping the direct messages and mentions of offline users. */
+struct mailbox_store *MAILBOXES;
+
+/** @brief Inverted index of every message broadcast, for @c /search. */
+struct search_index *SEARCH;
+
+/** @brief Files uploaded by the users, for @c /get. */
+struct attach_store *ATTACHMENTS;
+
+/**
+ * @brief The subscription filters of the clients that only want some messages.
+ *
+ * @warning Protected by the @c CLIENT_LIST_MUTEX.
+ */
+struct filter_set *FILTERS;
+
+/**
+ * @brief Receive buffers shared by the clients, one pool per NUMA node, NULL if every client reads into its own.
+ *
+ * Set with the @c -b option. A client only holds a buffer while it has bytes to
+ * read, or a partial frame, and takes it from the pool of its node, see @c AFFINITY.
+ */
+struct bufpool *RECV_POOLS[AFFINITY_MAX_NODES];
+
+/**
+ * @brief Scheduler running the clients as fibers, NULL if every client has its own threads.
+ *
+ * Set with the @c -f option. The reader and the writer of every client are then
+ * fibers on a few worker threads, so a connection only costs two small stacks.
+ * Their sockets are non-blocking: where a thread would block, the fiber parks and
+ * the worker runs another one. Clients may not switch to shared memory then, as
+ * waiting for a channel would block the worker.
+ */
+struct fiber_sched *FIBERS = NULL;
+
+/**
+ * @brief Where what the clients send is recorded, NULL if it is not.
+ *
+ * Set with the @c -c option. Every connection is recorded with its handshake and
+ * the frames it sends, as they are read, so the load can be played back later by
+ * @c zip-zop-replay.
+ */
+struct capture *CAPTURE = NULL;
+
+/**
+ * @brief Simulated clients the server serves besides the real ones, NULL if none.
+ *
+ * Set with the @c -S option, see simnet_parse_params(). The clients connect as the
+ * server starts, through the in-process transport of simnet.c, and the server exits
+ * once every one of them is gone, after printing how it coped.
+ */
+struct simnet *SIMNET = NULL;
+
+/**
+ * @brief Which new connections the server takes on.
+ *
+ * The limits are set with the @c -L option, see admit_parse_limits(). A connection
+ * past them is answered with a @c FRAME_BUSY frame, telling the client when to come
+ * back, and closed, so those already in keep being served through a spike.
+ */
+struct admit *ADMISSION;
+
+/**
+ * @brief Which CPUs the server threads run on, and the NUMA node of every connection.
+ *
+ * Set with the @c -A option, see affinity_create(). A connection is served by
+ * threads of the node its packets arrive on, and its state is allocated by them.
+ */
+struct affinity *AFFINITY;
+
+/**
+ * @brief Multicast group the room is sent to once, NULL if every client gets its own copy.
+ *
+ * Set with the @c -M option, see mcast_create(). Clients on the LAN that ask for
+ * it, and want every message, get the room from the group instead of their
+ * connection; they ask for what they missed over their connection.
+ */
+struct mcast *MCAST = NULL;
+
+/** @brief What chat messages go through, from being read to being queued for the room. */
+struct pipeline *PIPELINE;
+
+/**
+ * @brief What gives the messages broadcast to the room their order.
+ *
+ * The threads reading the clients push what they broadcast without waiting for
+ * each other; the sequencer thread numbers the messages and is the only one to
+ * fan them out, in batches, so every client gets them in the same order.
+ *
+ * @see fan_out_batch
+ */
+struct sequencer *SEQUENCER;
+
+/** @brief Clients shown per ranking by @c /top. */
+#define TOP_SHOWN 10
+
+/**
+ * @brief What is accounted per client, to find who is causing a load spike.
+ */
+enum top_metric {
+	TOP_MESSAGES, 	/**< Messages broadcast by the client */
+	TOP_BYTES_IN, 	/**< Bytes received from the client */
+	TOP_FANOUT, 	/**< Bytes queued for the room because of the client messages */
+	TOP_BYTES_OUT, 	/**< Bytes written to the client */
+	TOP_METRICS 	/**< Number of metrics */
+};
+
+/** @brief Heaviest clients per metric, kept in bounded memory whatever the number of clients, shown by @c /top. */
+struct topk *TOP[TOP_METRICS];
+
+/**
+ * @brief Carry out mutual exclusion and insert the new client on the list.
+ *
+ * This function locks the @c CLIENT_LIST_MUTEX and inserts the client on the list, then unlocks the mutex.
+ * The join is recorded for the next presence delta.
+ *
+ * @param[in] c The client.
+ *
+ * @see CLIENT_LIST
+ * @see CLIENT_LIST_MUTEX
+ */
+void insert_client_concurrent(struct client *c)
+{
+	lockstat_lock(CLIENT_LIST_MUTEX);
+	sll_insert_last(&CLIENT_LIST, c);
+	presence_join(PRESENCE, client_get_name(c));
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+}
+
+/**
+ * @brief Carry out mutual exclusion and remove the new client on the list.
+ * 
+ * This function locks the @c CLIENT_LIST_MUTEX and inserts the client on the list, then unlocks the mutex.
+ *
+ * @param[in] c The client.
+ *
+ * @return The client just removed. NULL otherwise.
+ *
+ * @see CLIENT_LIST
+ * @see CLIENT_LIST_MUTEX
+ */
+struct client *remove_client_concurrent(struct client *c)
+{
+	lockstat_lock(CLIENT_LIST_MUTEX);
+	void *key = sll_remove_elm(&CLIENT_LIST, c);
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+
+	return (struct client *)key;
+}
+
+/**
+ * @brief Length of the header of a broadcast frame.
+ *
+ * @param[in] traced Whether the message is traced.
+ *
+ * @return The header length.
+ */
+size_t broadcast_header_len(bool traced)
+{
+	return frame_header_len(FRAME_F_SEQ | (traced ? FRAME_F_TRACE : 0));
+}
+
+/**
+ * @brief Sends a framed message to all clients.
+ *
+ * The message is appended to the @c HISTORY, with the sequence number the
+ * @c SEQUENCER gave it, and queued for the @c SEARCH index, then the header is written and the same frame
+ * is queued for everyone, in the chat lane, but the clients whose filter it does not
+ * pass. The @c FILTERS are matched once for all of them. Members of the @c MCAST
+ * group get no copy, the frame is sent to the group once instead. Traced frames get their enqueue stamp here,
+ * and a flush stamp when each client writer sends its copy; the time to queue every copy
+ * is recorded in @c TRACE_HIST.
+ *
+ * @warning The @c CLIENT_LIST_MUTEX must be held, and only the @c SEQUENCER broadcasts.
+ *
+ * @param[in,out] frame The frame: broadcast_header_len() bytes of room, then the packed message.
+ * @param[in] seq The sequence number.
+ * @param[in] len The packed message length.
+ * @param[in] trace The trace stamps taken so far, NULL if the message is not traced.
+ *
+ * @return The number of bytes queued, for all the clients.
+ */
+size_t broadcast_frame_locked(char *frame, uint64_t seq, int len, const struct frame_trace *trace)
+{
+	uint8_t flags = FRAME_F_SEQ | (trace ? FRAME_F_TRACE : 0);
+	size_t hlen = broadcast_header_len(trace != NULL);
+	const char *pack = frame + hlen;
+	size_t queued = 0;
+	size_t members = 0;
+
+	history_append(HISTORY, seq, pack, len);
+	search_submit(SEARCH, seq, pack, len);
+
+	struct frame_trace t;
+	if (trace) {
+		t = *trace;
+		t.server_enqueue = frame_now();
+		hist_record(TRACE_HIST[TRACE_SERVER_LOCK], t.server_enqueue - t.server_recv);
+	}
+	frame_write_header(frame, FRAME_CHAT, flags, len, seq, trace ? &t : NULL);
+
+	bool filtered = filter_set_count(FILTERS) > 0;
+	if (filtered)
+		filter_set_match(FILTERS, pack, strnlen(pack, len));
+
+	/* Iterate through all the CLIENT_LIST, and send the message to all the connected clients */
+	for (struct sllist *p = CLIENT_LIST; p; p = sll_get_next(&p)) {
+		struct client *current_client = (struct client *)sll_get_key(p);
+		/* Its connection was shut down, the resumed one gets the message */
+		if (client_is_superseded(current_client))
+			continue;
+		if (client_is_mcast(current_client)) {
+			members++;
+			continue;
+		}
+		if (filtered && client_get_filter(current_client) != -1
+				&& !filter_set_hit(FILTERS, client_get_filter(current_client)))
+			continue;
+		int rv = client_send(current_client, OUTQ_CHAT, OUTQ_ORDERED | (trace ? OUTQ_TRACED : 0), frame, hlen + len);
+		if (trace)
+			hist_record(TRACE_HIST[TRACE_FANOUT], frame_now() - t.server_enqueue);
+		if (rv == -1) {
+			perror("send()");
+		} else {
+			queued += hlen + len;
+		}
+	}
+
+	if (MCAST)
+		mcast_send(MCAST, frame, hlen + len, seq, members);
+
+	return queued;
+}
+
+/**
+ * @brief Sends a packed message from the server to all clients.
+ *
+ * The message is framed once, and pushed to the @c SEQUENCER, which queues it for everyone.
+ *
+ * @param[in] pack The packed message.
+ * @param[in] len The packed message length.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ *
+ * @see message_pack
+ */
+int broadcast_pack(const char *pack, int len)
+{
+	size_t hlen = broadcast_header_len(false);
+
+	char *frame = malloc(hlen + len);
+	if (!frame)
+		return -1;
+	memcpy(frame + hlen, pack, len);
+
+	struct sequencer_msg *m = sequencer_msg_create(frame, hlen, len);
+	if (!m) {
+		free(frame);
+		return -1;
+	}
+	sequencer_push(SEQUENCER, m);
+
+	return 0;
+}
+
+/**
+ * @brief Sends a message to a single client, outside of the @c HISTORY, in the chat lane.
+ *
+ * @param[in] c The client.
+ * @param[in] content The message content.
+ * @param[in] sender The sender name.
+ */
+void send_message_to(struct client *c, const char *content, const char *sender)
+{
+	size_t content_len 	= strlen(content);
+	size_t sender_len 	= strlen(sender);
+	size_t len 			= content_len + sender_len + 2;
+
+	if (len <= FRAME_MAX_PAYLOAD) {
+		/* Packed straight into the frame, as message_pack() would */
+		char frame[FRAME_MAX_LEN];
+		size_t hlen = frame_write_header(frame, FRAME_CHAT, 0, len, 0, NULL);
+		memcpy(frame + hlen, content, content_len + 1);
+		memcpy(frame + hlen + content_len + 1, sender, sender_len + 1);
+		if (client_send(c, OUTQ_CHAT, 0, frame, hlen + len) == -1) {
+			perror("send()");
+		}
+	}
+}
+
+/**
+ * @brief Checks if someone with that name is connected.
+ *
+ * @warning The @c CLIENT_LIST_MUTEX must be held.
+ *
+ * @param[in] name The username.
+ * @param[in] parked Whether a parked session counts, as it will get the @c HISTORY replayed.
+ *
+ * @return @c true if so, @c false otherwise.
+ */
+bool is_in_room(const char *name, bool parked)
+{
+	for (struct sllist *p = CLIENT_LIST; p; p = sll_get_next(&p)) {
+		struct client *c = (struct client *)sll_get_key(p);
+		if (!client_is_superseded(c) && strcmp(client_get_name(c), name) == 0)
+			return true;
+	}
+
+	for (struct sllist *p = PARKED_SESSIONS; parked && p; p = sll_get_next(&p)) {
+		if (strcmp(session_get_name((struct session *)sll_get_key(p)), name) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * @brief Spool a broadcast message for the offline users it mentions.
+ *
+ * A mention is a @c @@ followed by a username, up to the next space. Only the first
+ * @c MENTIONS_MAX are looked at, and users who never logged in have no mailbox.
+ *
+ * @warning The @c CLIENT_LIST_MUTEX must be held, the same hold the message is
+ * broadcast in, so a user logging in either gets the message live, or finds it in
+ * the mailbox.
+ *
+ * @param[in] msg The message content.
+ * @param[in] pack The packed message.
+ * @param[in] len The packed message length.
+ */
+void spool_mentions_locked(const char *msg, const char *pack, int len)
+{
+	char names[MENTIONS_MAX][CLIENT_NAME_LEN];
+	int n = 0;
+
+	for (const char *p = strchr(msg, '@'); p && n < MENTIONS_MAX; p = strchr(p, '@')) {
+		p++;
+		size_t nlen = strcspn(p, " \t\n,.:;!?@");
+		if (nlen == 0 || nlen >= CLIENT_NAME_LEN)
+			continue;
+
+		memcpy(names[n], p, nlen);
+		names[n][nlen] = '\0';
+
+		bool dup = false;
+		for (int i = 0; i < n; i++) {
+			dup = dup || strcmp(names[i], names[n]) == 0;
+		}
+		if (!dup)
+			n++;
+	}
+
+	if (n == 0)
+		return;
+
+	for (int i = 0; i < n; i++) {
+		if (!is_in_room(names[i], true) && mailbox_append(MAILBOXES, names[i], pack, len) == -1
+				&& errno != ENOENT) {
+			perror("mailbox_append()");
+		}
+	}
+}
+
+/**
+ * @brief Sends a message from the server to all clients.
+ *
+ * The message will be sent as a packet version of a struct message.
+ *
+ * @param[in] msg The message content.
+ *
+ * @see message_pack_text
+ */
+void broadcast_server_message(const char *msg)
+{
+	int len;
+	char *pack = message_pack_text(msg, strlen(msg), "server", &len);
+	if (pack) {
+		broadcast_pack(pack, len);
+		free(pack);
+	}
+}
+
+/**
+ * @brief Sends a notice from the server to all clients, ahead of everything queued for them.
+ *
+ * Unlike broadcast_server_message(), the notice goes in the control lane, so it
+ * does not wait behind chat or a replay. It has no sequence number, which would
+ * let it overtake sequenced messages, and it is not kept in the @c HISTORY.
+ *
+ * @param[in] msg The notice.
+ */
+void broadcast_server_notice(const char *msg)
+{
+	size_t msg_len = strlen(msg);
+	size_t len = msg_len + sizeof("server") + 1;
+	if (len > FRAME_MAX_PAYLOAD)
+		return;
+
+	char frame[FRAME_MAX_LEN];
+	size_t hlen = frame_write_header(frame, FRAME_CHAT, 0, len, 0, NULL);
+	memcpy(frame + hlen, msg, msg_len + 1);
+	memcpy(frame + hlen + msg_len + 1, "server", sizeof("server"));
+
+	lockstat_lock(CLIENT_LIST_MUTEX);
+	for (struct sllist *p = CLIENT_LIST; p; p = sll_get_next(&p)) {
+		struct client *c = (struct client *)sll_get_key(p);
+		if (!client_is_superseded(c) && client_send(c, OUTQ_CONTROL, 0, frame, hlen + len) == -1) {
+			perror("send()");
+		}
+	}
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+}
+
+/**
+ * @brief Send a direct message, or spool it if the recipient is offline.
+ *
+ * The sender gets a copy, or a notice telling what happened to the message.
+ *
+ * @param[in] c The sender.
+ * @param[in] cmd The command arguments: the recipient name, a space and the text.
+ */
+void send_direct_message(struct client *c, const char *cmd)
+{
+	char to[CLIENT_NAME_LEN];
+	size_t nlen = strcspn(cmd, " ");
+	if (nlen == 0 || nlen >= CLIENT_NAME_LEN || cmd[nlen] == '\0') {
+		send_message_to(c, "usage: /msg <user> <text>", "server");
+		return;
+	}
+	memcpy(to, cmd, nlen);
+	to[nlen] = '\0';
+
+	char content[MESSAGE_LEN + sizeof("(private) ")];
+	int clen = snprintf(content, sizeof(content), "(private) %s", cmd + nlen + 1);
+
+	int len;
+	char *pack = message_pack_text(content, clen, client_get_name(c), &len);
+	if (!pack)
+		return;
+
+	lockstat_lock(CLIENT_LIST_MUTEX);
+
+	char notice[MESSAGE_LEN] = "";
+	bool sent = true;
+	if (!is_in_room(to, false)) {
+		if (mailbox_append(MAILBOXES, to, pack, len) == 0) {
+			snprintf(notice, MESSAGE_LEN, "%s is offline, the message will be delivered when they log in", to);
+		} else {
+			sent = false;
+			if (errno == ENOENT)
+				snprintf(notice, MESSAGE_LEN, "%s is not a known user", to);
+			else if (errno == EDQUOT)
+				snprintf(notice, MESSAGE_LEN, "the mailbox of %s is full", to);
+			else
+				snprintf(notice, MESSAGE_LEN, "the message to %s could not be kept: %s", to, strerror(errno));
+		}
+	}
+
+	for (struct sllist *p = CLIENT_LIST; sent && p; p = sll_get_next(&p)) {
+		struct client *r = (struct client *)sll_get_key(p);
+		if (!client_is_superseded(r) && (r == c || strcmp(client_get_name(r), to) == 0))
+			send_message_to(r, content, client_get_name(c));
+	}
+
+	if (notice[0])
+		send_message_to(c, notice, "server");
+
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+
+	free(pack);
+}
+
+/**
+ * @brief Close an admitted connection, so it no longer counts against the limits.
+ *
+ * @param[in] tr The connection.
+ * @param[in] node The NUMA node it was placed on.
+ *
+ * @see ADMISSION
+ * @see AFFINITY
+ */
+void close_connection(const struct transport *tr, int node)
+{
+	transport_close(tr);
+	affinity_leave(AFFINITY, node);
+	admit_leave(ADMISSION);
+}
+
+/**
+ * @brief Tell a new connection the server is busy, and close it.
+ *
+ * A socket first gets the handshake answer its client waits for; the
+ * @c FRAME_BUSY frame then comes where the session frame would.
+ *
+ * @param[in] tr The connection, not admitted.
+ * @param[in] why Why it is refused.
+ *
+ * @see ADMISSION
+ */
+void refuse_connection(const struct transport *tr, enum admit_reason why)
+{
+	char frame[FRAME_HEADER_LEN + sizeof(uint32_t)];
+	size_t len = frame_write_busy(frame, admit_retry_after(ADMISSION, why));
+
+	int sockfd = transport_get_socket(tr);
+	if (sockfd != -1)
+		shmchan_refuse(sockfd);
+	transport_send(tr, frame, len, MSG_DONTWAIT);
+
+	if (sockfd != -1) {
+		/* Closing with the handshake unread would reset the connection, and the frame could be lost */
+		char handshake[HANDSHAKE_LEN];
+		shutdown(sockfd, SHUT_WR);
+		recv(sockfd, handshake, sizeof(handshake), MSG_DONTWAIT);
+	}
+	transport_close(tr);
+}
+
+/**
+ * @brief Take a client whose connection ended out of the room.
+ *
+ * Removes the client from the @c CLIENT_LIST, destroys it and closes the connection.
+ * The leave is recorded for the next presence delta, unless the client may come back:
+ * then its session is parked in @c PARKED_SESSIONS, and reap_sessions_thread() records
+ * the leave once the session expires.
+ * A client superseded by a resumed connection leaves silently.
+ *
+ * @param[in] c The client.
+ * @param[in] park Whether the session may be resumed.
+ *
+ * @see CLIENT_LIST
+ * @see PARKED_SESSIONS
+ */
+void leave_room(struct client *c, bool park)
+{
+	bool announce = true;
+
+	lockstat_lock(CLIENT_LIST_MUTEX);
+
+	sll_remove_elm(&CLIENT_LIST, c);
+	filter_set_remove(FILTERS, client_get_filter(c));
+	if (client_is_mcast(c))
+		mcast_forget(MCAST);
+	if (client_is_superseded(c)) {
+		announce = false;
+	} else if (park && client_get_token(c)) {
+		struct session *s = session_create(client_get_name(c), client_get_token(c), time(NULL) + RESUME_GRACE);
+		if (s) {
+			sll_insert_last(&PARKED_SESSIONS, s);
+			announce = false;
+		}
+	}
+
+	if (announce)
+		presence_leave(PRESENCE, client_get_name(c));
+
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+
+	struct transport tr = *client_get_transport(c);
+	int node = client_get_node(c);
+	client_destroy(c);
+	close_connection(&tr, node);
+}
+
+/**
+ * @brief Keeps expiring the parked sessions, the attachments, the mailboxes and the
+ * traffic counts, and writing out the @c CAPTURE.
+ *
+ * Once a session is no longer resumable, the leave is recorded for the next presence delta.
+ *
+ * @param[in] arg Unused.
+ *
+ * @see PARKED_SESSIONS
+ */
+void *reap_sessions_thread(void *arg)
+{
+	while (true) {
+		sleep(1);
+
+		struct sllist *expired = SLL_INIT();
+		time_t now = time(NULL);
+
+		lockstat_lock(CLIENT_LIST_MUTEX);
+		for (struct sllist *p = PARKED_SESSIONS; p; p = sll_get_next(&p)) {
+			struct session *s = (struct session *)sll_get_key(p);
+			if (session_get_expiry(s) <= now)
+				sll_insert_last(&expired, s);
+		}
+		for (struct sllist *p = expired; p; p = sll_get_next(&p)) {
+			struct session *s = (struct session *)sll_get_key(p);
+			sll_remove_elm(&PARKED_SESSIONS, s);
+			presence_leave(PRESENCE, session_get_name(s));
+		}
+		lockstat_unlock(CLIENT_LIST_MUTEX);
+
+		struct session *s;
+		while ((s = sll_remove_first(&expired))) {
+			session_destroy(s);
+		}
+
+		attach_expire(ATTACHMENTS, now);
+		mailbox_expire(MAILBOXES, now);
+		for (int i = 0; i < TOP_METRICS; i++) {
+			topk_tick(TOP[i]);
+		}
+		if (CAPTURE)
+			capture_flush(CAPTURE);
+	}
+
+	return arg;
+}
+
+/**
+ * @brief Append a frame to a growing buffer of frames.
+ *
+ * @param[in,out] buf The buffer, reallocated as needed.
+ * @param[in,out] len Bytes used in @p buf.
+ * @param[in,out] cap Bytes allocated for @p buf.
+ * @param[in] type The frame type.
+ * @param[in] payload The frame payload.
+ * @param[in] plen The payload length.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+int append_frame(char **buf, size_t *len, size_t *cap, uint8_t type, const char *payload, size_t plen)
+{
+	size_t flen = frame_header_len(0) + plen;
+
+	if (*len + flen > *cap) {
+		size_t newcap = *cap ? *cap : FRAME_MAX_LEN;
+		while (newcap < *len + flen)
+			newcap *= 2;
+
+		char *tmp = realloc(*buf, newcap);
+		if (!tmp)
+			return -1;
+		*buf = tmp;
+		*cap = newcap;
+	}
+
+	size_t hlen = frame_write_header(*buf + *len, type, 0, plen, 0, NULL);
+	memcpy(*buf + *len + hlen, payload, plen);
+	*len += flen;
+
+	return 0;
+}
+
+/**
+ * @brief Frames that are being put together, see append_frame().
+ */
+struct frame_buffer {
+	char *data; 	/**< The frames */
+	size_t len; 	/**< Bytes used */
+	size_t cap; 	/**< Bytes allocated */
+	size_t count; 	/**< Number of frames */
+};
+
+/**
+ * @brief Frame the list of everyone in the room, split in as many frames as needed.
+ *
+ * Parked sessions are still in the room, as far as the other clients know.
+ *
+ * @warning The @c CLIENT_LIST_MUTEX must be held.
+ *
+ * @param[out] buf The frames, to be freed by the caller.
+ *
+ * @return The length of the frames, @c 0 in case of error.
+ */
+size_t pack_member_list(char **buf)
+{
+	char chunk[FRAME_MAX_PAYLOAD];
+	size_t used = 0;
+	size_t len 	= 0;
+	size_t cap 	= 0;
+	*buf = NULL;
+
+	struct sllist *lists[] = { CLIENT_LIST, PARKED_SESSIONS };
+	for (int i = 0; i < 2; i++) {
+		for (struct sllist *p = lists[i]; p; p = sll_get_next(&p)) {
+			const char *name;
+			if (i == 0) {
+				struct client *c = (struct client *)sll_get_key(p);
+				/* Its successor is in the list too */
+				if (client_is_superseded(c))
+					continue;
+				name = client_get_name(c);
+			} else {
+				name = session_get_name((struct session *)sll_get_key(p));
+			}
+
+			size_t need = strlen(name) + 1;
+			if (used + need > FRAME_MAX_PAYLOAD) {
+				if (append_frame(buf, &len, &cap, FRAME_MEMBERS, chunk, used) == -1)
+					goto fail;
+				used = 0;
+			}
+			memcpy(chunk + used, name, need);
+			used += need;
+		}
+	}
+
+	/* Always at least one frame, even if empty, so the client knows the room is empty */
+	if (append_frame(buf, &len, &cap, FRAME_MEMBERS, chunk, used) == -1)
+		goto fail;
+
+	return len;
+
+fail:
+	free(*buf);
+	*buf = NULL;
+	return 0;
+}
+
+/**
+ * @brief Frame the pending presence changes, split in as many frames as needed.
+ *
+ * @warning The @c CLIENT_LIST_MUTEX must be held.
+ *
+ * @param[out] buf The frames, to be freed by the caller.
+ *
+ * @return The length of the frames, @c 0 in case of error.
+ */
+size_t pack_presence_delta(char **buf)
+{
+	char chunk[FRAME_MAX_PAYLOAD];
+	size_t len 	= 0;
+	size_t cap 	= 0;
+	size_t from = 0;
+	size_t used;
+	*buf = NULL;
+
+	while ((used = presence_pack(PRESENCE, &from, chunk, FRAME_MAX_PAYLOAD)) > 0) {
+		if (append_frame(buf, &len, &cap, FRAME_PRESENCE, chunk, used) == -1) {
+			free(*buf);
+			*buf = NULL;
+			return 0;
+		}
+	}
+
+	return len;
+}
+
+/**
+ * @brief Rebuild the automaton of the @c FILTERS, if the filters changed.
+ *
+ * Only the list of filters is taken and the new automaton put in place under the
+ * @c CLIENT_LIST_MUTEX; the build itself runs without it, so the broadcasts go on
+ * meanwhile. The presence_thread() calls it once every @c PRESENCE_INTERVAL_MS,
+ * so a burst of subscriptions costs a single rebuild.
+ */
+void rebuild_filters(void)
+{
+	lockstat_lock(CLIENT_LIST_MUTEX);
+	struct filter_automaton *a = filter_set_prepare(FILTERS);
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+	if (!a)
+		return;
+
+	filter_automaton_build(a);
+
+	lockstat_lock(CLIENT_LIST_MUTEX);
+	a = filter_set_swap(FILTERS, a);
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+
+	filter_automaton_destroy(a);
+}
+
+/**
+ * @brief Keeps sending the presence changes to the room.
+ *
+ * Every @c PRESENCE_INTERVAL_MS, the joins and leaves of the window are framed
+ * once and sent to every client that already has the member list. Clients that
+ * joined in the window get the member list instead, framed once for all of them.
+ * A storm of @c n joins then costs @c O(n) frames instead of @c O(n^2) messages.
+ * The automaton of the @c FILTERS is rebuilt on the same beat.
+ *
+ * @param[in] arg Unused.
+ *
+ * @see PRESENCE
+ */
+void *presence_thread(void *arg)
+{
+	while (true) {
+		usleep(PRESENCE_INTERVAL_MS * 1000);
+
+		char *delta 	= NULL;
+		char *members 	= NULL;
+		size_t delta_len 	= 0;
+		size_t members_len 	= 0;
+
+		/* The queues of the clients are closed, see drain_server() */
+		if (atomic_load(&DRAINING))
+			continue;
+
+		rebuild_filters();
+
+		lockstat_lock(CLIENT_LIST_MUTEX);
+
+		if (presence_is_pending(PRESENCE)) {
+			delta_len = pack_presence_delta(&delta);
+			presence_clear(PRESENCE);
+		}
+
+		for (struct sllist *p = CLIENT_LIST; p; p = sll_get_next(&p)) {
+			struct client *c = (struct client *)sll_get_key(p);
+			if (client_is_superseded(c))
+				continue;
+
+			ssize_t rv = 0;
+			if (client_is_synced(c)) {
+				if (delta_len)
+					rv = client_send(c, OUTQ_CONTROL, 0, delta, delta_len);
+			} else {
+				if (!members)
+					members_len = pack_member_list(&members);
+				if (members_len) {
+					rv = client_send(c, OUTQ_CONTROL, 0, members, members_len);
+					client_set_synced(c, true);
+				}
+			}
+			if (rv == -1) {
+				perror("send()");
+			}
+		}
+
+		lockstat_unlock(CLIENT_LIST_MUTEX);
+
+		free(delta);
+		free(members);
+
+		if (MCAST)
+			mcast_heartbeat(MCAST);
+	}
+
+	return arg;
+}
+
+/**
+ * @brief Count the clients whose writer is not over yet.
+ *
+ * @see client_drain
+ */
+size_t count_undrained_clients(void)
+{
+	size_t n = 0;
+
+	lockstat_lock(CLIENT_LIST_MUTEX);
+	for (struct sllist *p = CLIENT_LIST; p; p = sll_get_next(&p)) {
+		if (!client_is_drained((struct client *)sll_get_key(p)))
+			n++;
+	}
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+
+	return n;
+}
+
+/**
+ * @brief Shut the server down without losing what is queued for the clients.
+ *
+ * New connections are refused, and what the clients send from then on is dropped.
+ * Once the messages read before went through the @c PIPELINE and the @c SEQUENCER,
+ * every client gets a final @c FRAME_BYE after whatever is queued for it, and its
+ * writer stops once that is written: all the clients drain at once, for up to
+ * @p timeout_s seconds. Their connections are then shut down @c DRAIN_BATCH at a
+ * time, and their readers take them out of the room.
+ *
+ * @param[in] accept_threads The @c LISTENERS accept_clients_thread() threads.
+ * @param[in] timeout_s Most seconds the clients have to get what is queued for them.
+ */
+void drain_server(pthread_t *accept_threads, unsigned timeout_s)
+{
+	uint64_t deadline = frame_now() / 1000000 + timeout_s * 1000ULL;
+
+	atomic_store(&DRAINING, true);
+	for (int i = 0; i < LISTENERS; i++) {
+		pthread_cancel(accept_threads[i]);
+	}
+	broadcast_server_notice("Server shutting down.");
+
+	/* Every message read before is queued for the room before the goodbye */
+	while ((atomic_load(&READERS_BUSY) || pipeline_get_inflight() || sequencer_get_pending(SEQUENCER))
+			&& frame_now() / 1000000 < deadline) {
+		usleep(1000);
+	}
+
+	char bye[FRAME_HEADER_LEN];
+	size_t len = frame_write_header(bye, FRAME_BYE, 0, 0, 0, NULL);
+
+	lockstat_lock(CLIENT_LIST_MUTEX);
+	for (struct sllist *p = CLIENT_LIST; p; p = sll_get_next(&p)) {
+		struct client *c = (struct client *)sll_get_key(p);
+		/* The lanes are written in order once nothing comes anymore, so the bulk lane goes last */
+		if (!client_is_superseded(c) && client_send(c, OUTQ_BULK, 0, bye, len) == -1) {
+			perror("send()");
+		}
+		client_drain(c);
+	}
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+
+	size_t left;
+	while ((left = count_undrained_clients()) > 0 && frame_now() / 1000000 < deadline) {
+		usleep(DRAIN_POLL_MS * 1000);
+	}
+	if (left)
+		fprintf(stderr, "%zu clients did not get everything in time\n", left);
+
+	/* A reader whose connection is shut down takes its client out of the room */
+	size_t fewest = SIZE_MAX;
+	unsigned idle_ms = 0;
+	while (true) {
+		size_t in_room = 0;
+		size_t shut = 0;
+
+		/* The next batch, the clients of the ones before may not have left yet */
+		lockstat_lock(CLIENT_LIST_MUTEX);
+		for (struct sllist *p = CLIENT_LIST; p; p = sll_get_next(&p), in_room++) {
+			struct client *c = (struct client *)sll_get_key(p);
+			if (shut < DRAIN_BATCH && !client_is_shut_down(c)) {
+				client_shutdown(c);
+				shut++;
+			}
+		}
+		lockstat_unlock(CLIENT_LIST_MUTEX);
+
+		if (in_room == 0)
+			break;
+		if (in_room < fewest) {
+			fewest 	= in_room;
+			idle_ms = 0;
+		} else if ((idle_ms += DRAIN_POLL_MS) >= 1000) {
+			fprintf(stderr, "%zu clients did not leave\n", in_room);
+			break;
+		}
+		usleep(DRAIN_POLL_MS * 1000);
+	}
+}
+
+/**
+ * @brief Stop the server: drain the clients, remove the Unix socket and close the @c CAPTURE.
+ *
+ * The @c /shutdown command and the signals may race to stop the server; only the
+ * first call does it, the others wait for it to be over.
+ *
+ * @param[in] accept_threads The @c LISTENERS accept_clients_thread() threads.
+ * @param[in] timeout_s Most seconds the clients have to get what is queued for them.
+ */
+void stop_server(pthread_t *accept_threads, unsigned timeout_s)
+{
+	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	static bool stopped = false;
+
+	pthread_mutex_lock(&mutex);
+	if (!stopped) {
+		drain_server(accept_threads, timeout_s);
+		unlink(UNIX_SOCKET_PATH);
+		if (CAPTURE)
+			capture_end(CAPTURE);
+		stopped = true;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Where the matches of a search go.
+ */
+struct search_reply {
+	FILE *out; 				/**< The operator terminal, NULL to frame them for a client */
+	struct frame_buffer fb; /**< The matches framed for the client */
+};
+
+/**
+ * @brief Show one search match.
+ *
+ * This is a search_fn, @p arg is a struct search_reply.
+ */
+void show_search_match(uint64_t seq, time_t when, const char *pack, uint32_t len, void *arg)
+{
+	struct search_reply *r = (struct search_reply *)arg;
+	(void)seq;
+
+	struct tm tm;
+	char stamp[32];
+	localtime_r(&when, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+	struct message_view m;
+	if (message_view_decode(&m, pack, len) == -1)
+		return;
+
+	char line[MESSAGE_LEN];
+	int llen = snprintf(line, MESSAGE_LEN, "[%s] %s: %s", stamp, m.sender, m.content);
+	if (llen >= MESSAGE_LEN)
+		llen = MESSAGE_LEN - 1;
+
+	if (r->out) {
+		fprintf(r->out, "%s\n", line);
+		return;
+	}
+
+	int plen;
+	char *mpack = message_pack_text(line, llen, "search", &plen);
+	if (mpack && append_frame(&r->fb.data, &r->fb.len, &r->fb.cap, FRAME_CHAT, mpack, plen) == 0)
+		r->fb.count++;
+	free(mpack);
+}
+
+/**
+ * @brief Run a search and show the most recent matches.
+ *
+ * The query runs in the caller thread, away from the fan-out.
+ *
+ * @param[in] c The client that asked, NULL for the operator.
+ * @param[in] query The words to look for.
+ */
+void run_search(struct client *c, const char *query)
+{
+	struct search_reply r = { c ? NULL : stdout, { NULL, 0, 0, 0 } };
+
+	uint64_t start 	= frame_now();
+	size_t total 	= search_query(SEARCH, query, SEARCH_RESULTS, show_search_match, &r);
+	uint64_t took 	= frame_now() - start;
+
+	char summary[MESSAGE_LEN];
+	snprintf(summary, MESSAGE_LEN, "%zu messages match \"%s\", showing the newest %zu (%.1fus)",
+			total, query, total < SEARCH_RESULTS ? total : SEARCH_RESULTS, took / 1000.0);
+
+	if (!c) {
+		printf("%s\n", summary);
+		fflush(stdout);
+		return;
+	}
+
+	lockstat_lock(CLIENT_LIST_MUTEX);
+	send_message_to(c, summary, "search");
+	if (r.fb.len && client_send(c, OUTQ_CHAT, 0, r.fb.data, r.fb.len) == -1) {
+		perror("send()");
+	}
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+
+	free(r.fb.data);
+}
+
+/**
+ * @brief Send a notice to a single client.
+ *
+ * @param[in] c The client.
+ * @param[in] notice The notice.
+ */
+void notify_client(struct client *c, const char *notice)
+{
+	lockstat_lock(CLIENT_LIST_MUTEX);
+	send_message_to(c, notice, "server");
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+}
+
+/**
+ * @brief Store the file frames of an upload as they arrive.
+ *
+ * Every chunk is written to the attachment file right away, so the server never
+ * holds more than one chunk of a file. A client uploads one file at a time; once
+ * all of it arrived the room is told how to download it.
+ *
+ * @param[in] c The client.
+ * @param[in] f The frame, of one of the @c FRAME_FILE_* types.
+ */
+void receive_file_frame(struct client *c, const struct frame *f)
+{
+	struct frame_file ff;
+	if (frame_parse_file(f, &ff) == -1)
+		return;
+
+	char notice[MESSAGE_LEN];
+	int upload = client_get_upload(c);
+
+	if (f->type == FRAME_FILE_BEGIN) {
+		if (upload)
+			attach_abort(ATTACHMENTS, upload);
+		upload = attach_begin(ATTACHMENTS, ff.name, ff.size);
+		if (upload == -1) {
+			snprintf(notice, MESSAGE_LEN, "could not store %s: %s", ff.name, strerror(errno));
+			notify_client(c, notice);
+			upload = 0;
+		}
+		client_set_upload(c, upload);
+		return;
+	}
+
+	if (!upload)
+		return;
+
+	if (f->type == FRAME_FILE_DATA) {
+		if (attach_write(ATTACHMENTS, upload, ff.data, ff.len) == -1) {
+			snprintf(notice, MESSAGE_LEN, "could not store the file: %s", strerror(errno));
+			notify_client(c, notice);
+			attach_abort(ATTACHMENTS, upload);
+			client_set_upload(c, 0);
+		}
+		return;
+	}
+
+	client_set_upload(c, 0);
+
+	uint64_t size;
+	char name[ATTACH_NAME_LEN];
+	if (attach_finish(ATTACHMENTS, upload, &size, name) == -1) {
+		notify_client(c, "the file was not stored: some of it is missing");
+		return;
+	}
+
+	snprintf(notice, MESSAGE_LEN, "%s shared %s (%" PRIu64 " bytes), type %s%d to download it",
+			client_get_name(c), name, size, GET_CMD, upload);
+	broadcast_server_message(notice);
+}
+
+/**
+ * @brief Send an attachment to a client.
+ *
+ * The file is queued in the bulk lane, and streamed from the page cache by the
+ * client writer, a @c FRAME_FILE_CHUNK at a time; chat and control frames for the
+ * same client go out between them.
+ *
+ * @param[in] c The client.
+ * @param[in] arg The command argument: the attachment id.
+ */
+void send_file(struct client *c, const char *arg)
+{
+	uint64_t size;
+	char name[ATTACH_NAME_LEN];
+	int id = atoi(arg);
+
+	int fd = attach_open(ATTACHMENTS, id, &size, name);
+	if (fd == -1) {
+		notify_client(c, "there is no such file");
+		return;
+	}
+
+	char frame[FRAME_MAX_LEN];
+	size_t nlen = strlen(name) + 1;
+	uint64_t be = htobe64(size);
+	size_t hlen = frame_write_file_header(frame, FRAME_FILE_BEGIN, id, sizeof(be) + nlen);
+	memcpy(frame + hlen, &be, sizeof(be));
+	memcpy(frame + hlen + sizeof(be), name, nlen);
+
+	if (client_send(c, OUTQ_BULK, 0, frame, hlen + sizeof(be) + nlen) == -1) {
+		perror("send_file()");
+		close(fd);
+		return;
+	}
+
+	if (client_send_file(c, fd, id, size) == -1) {
+		perror("send_file()");
+		return;
+	}
+
+	hlen = frame_write_file_header(frame, FRAME_FILE_END, id, 0);
+	if (client_send(c, OUTQ_BULK, 0, frame, hlen) == -1) {
+		perror("send_file()");
+	}
+}
+
+/**
+ * @brief Replace the subscription filter of a client.
+ *
+ * @param[in] c The client.
+ * @param[in] expr The keywords, separated by blanks; none to get every message.
+ * @param[in] confirm Whether to tell the client what it gets from now on.
+ *
+ * A client getting the room from the @c MCAST group gets it over its connection again.
+ */
+void subscribe(struct client *c, const char *expr, bool confirm)
+{
+	lockstat_lock(CLIENT_LIST_MUTEX);
+	filter_set_remove(FILTERS, client_get_filter(c));
+	int id = filter_set_add(FILTERS, expr);
+	client_set_filter(c, id);
+	/* The group carries every message, a filtered client is back to its connection */
+	if (id != -1 && client_is_mcast(c)) {
+		char frame[FRAME_HEADER_LEN + FRAME_SEQ_LEN];
+		client_set_mcast(c, false);
+		client_set_mcast_left(c, history_last_seq(HISTORY));
+		if (client_send(c, OUTQ_CHAT, OUTQ_ORDERED, frame,
+					mcast_write_leave(MCAST, frame, history_last_seq(HISTORY))) == -1)
+			perror("send()");
+	}
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+
+	if (id == -1 && errno != EINVAL)
+		perror("filter_set_add()");
+
+	if (confirm) {
+		char notice[MESSAGE_LEN];
+		while (*expr == ' ')
+			expr++;
+		if (id == -1)
+			snprintf(notice, MESSAGE_LEN, "you get every message");
+		else
+			snprintf(notice, MESSAGE_LEN, "you only get the messages with any of: %s", expr);
+		notify_client(c, notice);
+	}
+}
+
+/**
+ * @brief Validate stage: drops what is not a chat message, and cleans up the rest.
+ *
+ * Chat content must be @c NUL terminated, and short enough to be relayed with the
+ * sender name. It is cleaned up in place, and messages left empty are dropped.
+ */
+void stage_validate(struct pipeline_msg *msgs, size_t n, void *arg)
+{
+	(void)arg;
+
+	for (size_t i = 0; i < n; i++) {
+		struct pipeline_msg *m = &msgs[i];
+		if (m->verdict != PIPELINE_PASS)
+			continue;
+
+		if (m->content_len == 0 || m->content_len > MESSAGE_LEN || m->content[m->content_len - 1] != '\0') {
+			m->verdict = PIPELINE_DROP;
+			continue;
+		}
+
+		m->content_len = textscan_sanitize(m->content, m->content_len - 1);
+		m->content[m->content_len] = '\0';
+		if (m->content_len == 0)
+			m->verdict = PIPELINE_DROP;
+	}
+}
+
+/**
+ * @brief Route stage: carries out the commands.
+ *
+ * Chat messages starting with @c DIRECT_MESSAGE_CMD are direct messages, those
+ * starting with @c SEARCH_CMD are searches, those starting with @c GET_CMD are
+ * downloads, and @c FILTER_CMD sets the client subscription filter; everything else
+ * goes on to be broadcast.
+ */
+void stage_route(struct pipeline_msg *msgs, size_t n, void *arg)
+{
+	(void)arg;
+
+	for (size_t i = 0; i < n; i++) {
+		struct pipeline_msg *m = &msgs[i];
+		struct client *c = (struct client *)m->origin;
+		if (m->verdict != PIPELINE_PASS)
+			continue;
+
+		if (strncmp(m->content, DIRECT_MESSAGE_CMD, strlen(DIRECT_MESSAGE_CMD)) == 0) {
+			send_direct_message(c, m->content + strlen(DIRECT_MESSAGE_CMD));
+			m->verdict = PIPELINE_DONE;
+		} else if (strncmp(m->content, SEARCH_CMD, strlen(SEARCH_CMD)) == 0) {
+			run_search(c, m->content + strlen(SEARCH_CMD));
+			m->verdict = PIPELINE_DONE;
+		} else if (strncmp(m->content, GET_CMD, strlen(GET_CMD)) == 0) {
+			send_file(c, m->content + strlen(GET_CMD));
+			m->verdict = PIPELINE_DONE;
+		} else if (strncmp(m->content, FILTER_CMD, strlen(FILTER_CMD)) == 0
+				&& (m->content[strlen(FILTER_CMD)] == ' ' || m->content[strlen(FILTER_CMD)] == '\0')) {
+			subscribe(c, m->content + strlen(FILTER_CMD), true);
+			m->verdict = PIPELINE_DONE;
+		}
+	}
+}
+
+/**
+ * @brief Encode stage: packs every message straight into its broadcast frame.
+ *
+ * The header is left to be written once the sequence number is known.
+ */
+void stage_encode(struct pipeline_msg *msgs, size_t n, void *arg)
+{
+	(void)arg;
+
+	for (size_t i = 0; i < n; i++) {
+		struct pipeline_msg *m = &msgs[i];
+		if (m->verdict != PIPELINE_PASS)
+			continue;
+
+		size_t sender_len 	= strlen(m->sender);
+		size_t len 			= m->content_len + sender_len + 2;
+		size_t hlen 		= broadcast_header_len(m->traced);
+
+		/* Packed as message_pack() would */
+		m->out = malloc(hlen + len);
+		if (!m->out) {
+			m->verdict = PIPELINE_DROP;
+			continue;
+		}
+		memcpy(m->out + hlen, m->content, m->content_len + 1);
+		memcpy(m->out + hlen + m->content_len + 1, m->sender, sender_len + 1);
+		m->out_hlen = hlen;
+		m->out_len 	= hlen + len;
+	}
+}
+
+/**
+ * @brief Broadcasts a batch of sequenced messages under a single hold of the @c CLIENT_LIST_MUTEX.
+ *
+ * This is the sequencer_fn of the @c SEQUENCER, so it runs on its thread, in
+ * sequence order, whoever sent the messages.
+ *
+ * Offline users a message from a client mentions find it in their mailbox. The
+ * messages, and the bytes they queued for the room, are accounted to the sender in @c TOP.
+ */
+void fan_out_batch(struct sequencer_msg **msgs, size_t n, void *arg)
+{
+	size_t queued[SEQUENCER_BATCH];
+	(void)arg;
+
+	lockstat_lock(CLIENT_LIST_MUTEX);
+	for (size_t i = 0; i < n; i++) {
+		struct sequencer_msg *m = msgs[i];
+		queued[i] = broadcast_frame_locked(m->frame, m->seq, m->len, m->traced ? &m->trace : NULL);
+		if (m->from_client)
+			spool_mentions_locked(m->frame + m->hlen, m->frame + m->hlen, m->len);
+	}
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+
+	if (MCAST)
+		mcast_flush(MCAST);
+
+	for (size_t i = 0; i < n; i++) {
+		struct sequencer_msg *m = msgs[i];
+		if (!m->from_client)
+			continue;
+
+		/* Packed as content, then sender */
+		const char *content = m->frame + m->hlen;
+		const char *sender 	= content + strlen(content) + 1;
+		topk_add(TOP[TOP_MESSAGES], sender, 1);
+		topk_add(TOP[TOP_FANOUT], sender, queued[i]);
+	}
+}
+
+/**
+ * @brief Enqueue stage: pushes every message to the @c SEQUENCER, which broadcasts it.
+ *
+ * The frames are handed over, so the batch can be done with before they are sent.
+ */
+void stage_enqueue(struct pipeline_msg *msgs, size_t n, void *arg)
+{
+	(void)arg;
+
+	for (size_t i = 0; i < n; i++) {
+		struct pipeline_msg *m = &msgs[i];
+		if (m->verdict != PIPELINE_PASS)
+			continue;
+
+		struct sequencer_msg *sm = sequencer_msg_create(m->out, m->out_hlen, m->out_len - m->out_hlen);
+		if (!sm) {
+			m->verdict = PIPELINE_DROP;
+			continue;
+		}
+		sm->from_client = true;
+		sm->traced 		= m->traced;
+		sm->trace 		= m->trace;
+		m->out 			= NULL;
+		sequencer_push(SEQUENCER, sm);
+	}
+}
+
+/** @brief The stages of the server, plugins are added around them. */
+const struct pipeline_stage_def SERVER_STAGES[] = {
+	{ "validate", 	PIPELINE_VALIDATE, 	0, stage_validate, 	NULL },
+	{ "route", 		PIPELINE_ROUTE, 	0, stage_route, 	NULL },
+	{ "encode", 	PIPELINE_ENCODE, 	0, stage_encode, 	NULL },
+	{ "enqueue", 	PIPELINE_ENQUEUE, 	0, stage_enqueue, 	NULL },
+	{ NULL, 		0, 					0, NULL, 			NULL }
+};
+
+/**
+ * @brief Send one message kept in the @c HISTORY to a resuming client, if it passes its filter.
+ *
+ * This is a history_fn, @p arg is the client.
+ */
+void replay_to_client(uint64_t seq, const char *pack, int len, void *arg)
+{
+	struct client *c = (struct client *)arg;
+	char frame[FRAME_MAX_LEN];
+	size_t hlen = frame_header_len(FRAME_F_SEQ);
+
+	if (client_get_filter(c) != -1) {
+		filter_set_match(FILTERS, pack, strnlen(pack, len));
+		if (!filter_set_hit(FILTERS, client_get_filter(c)))
+			return;
+	}
+
+	frame_write_header(frame, FRAME_CHAT, FRAME_F_SEQ, len, seq, NULL);
+	memcpy(frame + hlen, pack, len);
+	if (client_send(c, OUTQ_BULK, OUTQ_ORDERED, frame, hlen + len) == -1) {
+		perror("send()");
+	}
+}
+
+/**
+ * @brief Move a member of the @c MCAST group back to its connection.
+ *
+ * The client is told the group is over after @p after, then what the @c HISTORY has
+ * past it is sent again. What it missed of the group up to @p after may still be
+ * asked for, see replay_missed().
+ *
+ * @param[in] c The client.
+ * @param[in] after The last message it gets from the group.
+ *
+ * @warning The @c CLIENT_LIST_MUTEX must be held.
+ */
+void leave_mcast_locked(struct client *c, uint64_t after)
+{
+	char frame[FRAME_HEADER_LEN + FRAME_SEQ_LEN];
+
+	client_set_mcast(c, false);
+	client_set_mcast_left(c, after);
+	if (client_send(c, OUTQ_CHAT, OUTQ_ORDERED, frame, mcast_write_leave(MCAST, frame, after)) == -1)
+		perror("send()");
+	history_replay(HISTORY, after, replay_to_client, c);
+}
+
+/**
+ * @brief Send a client the messages of the @c MCAST group it missed, over its connection.
+ *
+ * What the @c HISTORY still has of the range goes in the bulk lane, followed by a
+ * @c FRAME_REPLAY frame carrying the range asked for and the last message of it
+ * answered, so the client stops waiting for what is lost. At most @c REPLAY_SPAN_MAX
+ * messages are sent for one request: the client asks again for the rest. A member
+ * missing messages the @c HISTORY no longer has, or more than the @c CLIENT_REPLAY_PER_S
+ * it may get a second, is moved back to its connection, see leave_mcast_locked().
+ *
+ * A client that left the group may still ask for what it missed up to the last
+ * message sent to the group while it was in; it gets what it may, the rest is lost.
+ * Clients that never were in the group are not answered, they miss nothing.
+ *
+ * @param[in] c The client.
+ * @param[in] f The @c FRAME_REPLAY frame it sent.
+ */
+void replay_missed(struct client *c, const struct frame *f)
+{
+	uint64_t first, last;
+	if (frame_parse_replay(f, &first, &last) == -1 || first == 0)
+		return;
+
+	char frame[FRAME_HEADER_LEN + FRAME_SEQ_LEN + 2 * sizeof(uint64_t)];
+	size_t sent = 0;
+
+	lockstat_lock(CLIENT_LIST_MUTEX);
+	bool member = client_is_mcast(c);
+	if (!member && !client_get_mcast_left(c)) {
+		lockstat_unlock(CLIENT_LIST_MUTEX);
+		return;
+	}
+
+	uint64_t oldest = history_first_seq(HISTORY);
+	uint64_t newest = member ? history_last_seq(HISTORY) : client_get_mcast_left(c);
+
+	if (member && first < oldest) {
+		leave_mcast_locked(c, first - 1);
+		lockstat_unlock(CLIENT_LIST_MUTEX);
+		return;
+	}
+
+	/* What came after the client left the group comes over its connection, it is not lost */
+	uint64_t end 	= member || last < newest ? last : newest;
+	uint64_t from 	= first < oldest ? oldest : first;
+	uint64_t to 	= last > newest ? newest : last;
+	if (from <= to) {
+		uint64_t want = to - from < REPLAY_SPAN_MAX ? to - from + 1 : REPLAY_SPAN_MAX;
+		uint64_t span = client_take_replays(c, want);
+		if (member && span < want) {
+			leave_mcast_locked(c, first - 1);
+			lockstat_unlock(CLIENT_LIST_MUTEX);
+			return;
+		}
+		if (span)
+			sent = history_replay_range(HISTORY, from - 1, from + span - 1, replay_to_client, c);
+		if (member && from + span - 1 < to)
+			end = from + span - 1;
+	}
+
+	size_t hlen = frame_write_header(frame, FRAME_REPLAY, FRAME_F_SEQ, f->payload_len, end, NULL);
+	memcpy(frame + hlen, f->payload, f->payload_len);
+	if (client_send(c, OUTQ_BULK, OUTQ_ORDERED, frame, hlen + f->payload_len) == -1) {
+		perror("send()");
+	}
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+
+	if (MCAST)
+		mcast_count_replay(MCAST, sent);
+}
+
+/**
+ * @brief Move a member of the @c MCAST group that cannot receive it back to its connection.
+ *
+ * Whatever went to the group after the last message the client got is sent again
+ * first, under the @c CLIENT_LIST_MUTEX, so nothing is missed in between.
+ *
+ * @param[in] c The client.
+ * @param[in] f The @c FRAME_MCAST frame it sent, carrying the last message it got.
+ */
+void decline_mcast(struct client *c, const struct frame *f)
+{
+	lockstat_lock(CLIENT_LIST_MUTEX);
+	if (client_is_mcast(c)) {
+		uint64_t after = (f->flags & FRAME_F_SEQ) ? f->seq : 0;
+		client_set_mcast(c, false);
+		client_set_mcast_left(c, after);
+		mcast_forget(MCAST);
+		history_replay(HISTORY, after, replay_to_client, c);
+	}
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+}
+
+/**
+ * @brief Start handling the frames a reader read, unless the server is draining.
+ *
+ * The drain waits for the readers counted in @c READERS_BUSY, so a message read
+ * before it started is queued for the room before the clients are told goodbye.
+ *
+ * @return @c true if the reader is counted, and must leave @c READERS_BUSY once
+ * its batch was run, @c false if the frames are dropped anyway.
+ */
+bool intake_begin(void)
+{
+	atomic_fetch_add(&READERS_BUSY, 1);
+	if (!atomic_load(&DRAINING))
+		return true;
+
+	atomic_fetch_sub(&READERS_BUSY, 1);
+	return false;
+}
+
+/**
+ * @brief Handle one frame received from a client.
+ *
+ * This is the decode stage: chat messages are added to the batch, to go through the
+ * @c PIPELINE; file frames are uploads, handled right away. Once the server is
+ * @c DRAINING, everything but a goodbye is dropped.
+ *
+ * Frames the client traced are stamped with the time the server read them.
+ * When @c TRACE_SAMPLE is set, one in every @c TRACE_SAMPLE untraced frames is
+ * traced by the server itself.
+ *
+ * @param[in] c The client.
+ * @param[in] f The frame.
+ * @param[in,out] batch The batch being filled, NULL if none yet; it is run when full.
+ * @param[in] src The batch submitter of the client.
+ *
+ * @return @c false if the client said goodbye, @c true otherwise.
+ */
+bool handle_client_frame(struct client *c, const struct frame *f, struct pipeline_batch **batch,
+		struct pipeline_source *src)
+{
+	if (f->type == FRAME_BYE)
+		return false;
+
+	/* What is sent once the server is shutting down would only reach clients that are gone */
+	if (atomic_load(&DRAINING))
+		return true;
+
+	if (f->type == FRAME_REPLAY) {
+		replay_missed(c, f);
+		return true;
+	}
+
+	if (f->type == FRAME_MCAST) {
+		decline_mcast(c, f);
+		return true;
+	}
+
+	if (f->type == FRAME_FILE_BEGIN || f->type == FRAME_FILE_DATA || f->type == FRAME_FILE_END) {
+		receive_file_frame(c, f);
+		return true;
+	}
+
+	if (f->type != FRAME_CHAT)
+		return true;
+
+	struct pipeline_msg *m = NULL;
+	if (*batch)
+		m = pipeline_batch_add(*batch, f->payload, f->payload_len);
+	if (!m) {
+		if (*batch)
+			pipeline_run(PIPELINE, *batch);
+		*batch = pipeline_batch_create(src, c, client_get_name(c));
+		if (!*batch || !(m = pipeline_batch_add(*batch, f->payload, f->payload_len)))
+			return true;
+	}
+
+	if (f->flags & FRAME_F_TRACE) {
+		m->trace 	= f->trace;
+		m->traced 	= true;
+	} else {
+		unsigned sample = atomic_load_explicit(&TRACE_SAMPLE, memory_order_relaxed);
+		if (sample && atomic_fetch_add_explicit(&TRACE_TICK, 1, memory_order_relaxed) % sample == 0) {
+			memset(&m->trace, 0, sizeof(m->trace));
+			m->traced = true;
+		}
+	}
+
+	if (m->traced) {
+		m->trace.server_recv = frame_now();
+		if (m->trace.client_send && m->trace.client_send < m->trace.server_recv)
+			hist_record(TRACE_HIST[TRACE_CLIENT_TO_SERVER], m->trace.server_recv - m->trace.client_send);
+	}
+
+	return true;
+}
+
+/**
+ * @brief Keeps listening to client messages.
+ *
+ * This function will be executed by a thread that is responsable for 
+ * keep checking if there is a new message from the client.
+ *
+ * A single read may bring several frames, or only part of one, so the bytes are 
+ * kept in a buffer until a whole frame is there. Every frame is given to 
+ * handle_client_frame(), and the chat messages of a read go through the @c PIPELINE
+ * as one batch. A client that sends something that is not a frame is dropped.
+ *
+ * With @c RECV_POOLS the buffer is taken from the pool of its node once the client has something
+ * to read, and given back as soon as no partial frame is left in it.
+ *
+ * Unless the client said goodbye, its session is kept for a while after the
+ * connection ends, so it can be resumed (see leave_room()).
+ *
+ * @param[in] client A pointer to the client.
+ *
+ * @see handle_client_frame
+ */
+void *listen_to_client_thread(void *client)
+{
+	struct client *c = (struct client *)client;
+	char local_buf[FRAME_MAX_LEN];
+	struct bufpool *pool = RECV_POOLS[client_get_node(c)];
+	char *buf = pool ? NULL : local_buf;
+	size_t used = 0;
+	bool bye = false;
+	struct topk_batch bytes_in = { 0 };
+
+	struct pipeline_source *src = pipeline_source_create();
+	if (!src) {
+		leave_room(c, true);
+		return NULL;
+	}
+	
+	ssize_t numbytes;
+	while (!bye) {
+		if (!buf) {
+			/* An idle client holds no buffer */
+			if (client_wait(c) == -1 || !(buf = bufpool_get(pool)))
+				break;
+		}
+		if ((numbytes = client_recv(c, buf + used, FRAME_MAX_LEN - used)) <= 0)
+			break;
+		used += numbytes;
+		topk_add_batched(TOP[TOP_BYTES_IN], &bytes_in, client_get_name(c), numbytes);
+
+		struct frame f;
+		struct pipeline_batch *batch = NULL;
+		size_t off = 0;
+		ssize_t flen;
+		bool intake = intake_begin();
+		while ((flen = frame_parse(buf + off, used - off, &f)) > 0) {
+			if (CAPTURE)
+				capture_frame(CAPTURE, client_get_capture(c), buf + off, flen);
+			off += flen;
+			if (!handle_client_frame(c, &f, &batch, src)) {
+				bye = true;
+				break;
+			}
+		}
+		if (batch)
+			pipeline_run(PIPELINE, batch);
+		if (intake)
+			atomic_fetch_sub(&READERS_BUSY, 1);
+
+		if (flen == -1) {
+			fprintf(stderr, "%s sent a malformed frame\n", client_get_name(c));
+			break;
+		}
+
+		used -= off;
+		memmove(buf, buf + off, used);
+
+		if (pool && used == 0) {
+			bufpool_put(pool, buf);
+			buf = NULL;
+		}
+	}
+
+	if (pool && buf)
+		bufpool_put(pool, buf);
+	topk_flush(TOP[TOP_BYTES_IN], &bytes_in, client_get_name(c));
+
+	if (!bye)
+		perror("listen_to_client_thread -> recv():");
+
+	/* A file the connection did not finish uploading is of no use */
+	if (client_get_upload(c))
+		attach_abort(ATTACHMENTS, client_get_upload(c));
+
+	/* Batches still on a worker use the client */
+	pipeline_source_destroy(src);
+
+	if (CAPTURE)
+		capture_close(CAPTURE, client_get_capture(c));
+
+	leave_room(c, !bye);
+
+	return NULL;
+}
+
+/**
+ * @brief Print the server statistics on @c stdout.
+ *
+ * This is what the @c /stats command shows.
+ */
+void print_stats(void)
+{
+	printf("trace sampling: %s", TRACE_SAMPLE ? "1 in " : "off");
+	if (TRACE_SAMPLE)
+		printf("%u", TRACE_SAMPLE);
+	printf("\n");
+	printf("text scanning: %s\n", textscan_impl_name(textscan_get_impl()));
+
+	for (int i = 0; i < TRACE_STAGES; i++) {
+		hist_print(TRACE_HIST[i], stdout);
+	}
+
+	lockstat_print_all(stdout);
+	search_print(SEARCH, stdout);
+	attach_print(ATTACHMENTS, stdout);
+	pipeline_print(PIPELINE, stdout);
+	sequencer_print(SEQUENCER, stdout);
+	lockstat_lock(CLIENT_LIST_MUTEX);
+	filter_set_print(FILTERS, stdout);
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+	if (FIBERS)
+		fiber_sched_print(FIBERS, stdout);
+	if (CAPTURE)
+		capture_print(CAPTURE, stdout);
+	admit_print(ADMISSION, stdout);
+	affinity_print(AFFINITY, stdout);
+	if (MCAST)
+		mcast_print(MCAST, stdout);
+	if (SIMNET)
+		simnet_print(SIMNET, stdout);
+	fflush(stdout);
+}
+
+/**
+ * @brief A client and how far behind it is, for print_top().
+ */
+struct top_receiver {
+	char name[CLIENT_NAME_LEN]; /**< The username */
+	size_t queued; 				/**< Bytes queued for it */
+};
+
+/**
+ * @brief Print the heaviest senders and the slowest receivers on @c stdout.
+ *
+ * This is what the @c /top command shows. The rankings come from @c TOP, so
+ * they follow recent traffic; the receivers are ranked by what is queued for them
+ * right now.
+ */
+void print_top(void)
+{
+	struct top_receiver slow[TOP_SHOWN];
+	size_t n = 0;
+
+	lockstat_lock(CLIENT_LIST_MUTEX);
+	for (struct sllist *p = CLIENT_LIST; p; p = sll_get_next(&p)) {
+		struct client *c = (struct client *)sll_get_key(p);
+		size_t queued = client_get_queued(c);
+		if (queued == 0 || (n == TOP_SHOWN && queued <= slow[n - 1].queued))
+			continue;
+
+		/* Insertion into the few kept, largest first */
+		size_t i = n < TOP_SHOWN ? n++ : n - 1;
+		for ( ; i > 0 && slow[i - 1].queued < queued; i--) {
+			slow[i] = slow[i - 1];
+		}
+		strncpy(slow[i].name, client_get_name(c), CLIENT_NAME_LEN - 1);
+		slow[i].name[CLIENT_NAME_LEN - 1] = '\0';
+		slow[i].queued = queued;
+	}
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+
+	printf("counts are halved every %d seconds\n", TOPK_HALF_LIFE);
+	for (int i = 0; i < TOP_METRICS; i++) {
+		topk_print(TOP[i], stdout, TOP_SHOWN);
+	}
+
+	printf("slowest receivers (bytes queued, bytes written):\n");
+	for (size_t i = 0; i < n; i++) {
+		printf("  %-24s %12zu %12" PRIu64 "\n", slow[i].name, slow[i].queued,
+				topk_estimate(TOP[TOP_BYTES_OUT], slow[i].name));
+	}
+	fflush(stdout);
+}
+
+/**
+ * @brief Print what the connections cost, on average, by component, on @c stdout.
+ *
+ * This is what the @c /memory command shows, to plan how many users fit in a given
+ * amount of memory.
+ */
+void print_memory(void)
+{
+	struct client_footprint fp;
+	size_t n = 0;
+
+	memset(&fp, 0, sizeof(fp));
+
+	lockstat_lock(CLIENT_LIST_MUTEX);
+	for (struct sllist *p = CLIENT_LIST; p; p = sll_get_next(&p)) {
+		struct client *c = (struct client *)sll_get_key(p);
+		client_add_footprint(c, &fp);
+		fp.other += sll_node_size() + pipeline_source_size();
+		if (client_get_filter(c) != -1)
+			fp.other += filter_size();
+		n++;
+	}
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+
+	/* Without a pool the buffer is on the reader stack, already counted there */
+	for (int i = 0; i < AFFINITY_MAX_NODES && RECV_POOLS[i]; i++)
+		fp.recv += bufpool_get_in_use(RECV_POOLS[i]) * bufpool_get_size(RECV_POOLS[i]);
+
+	printf("memory: %zu connections, %zu KiB %s stacks, receive buffers %s\n", n,
+			client_get_stack_size() / 1024, FIBERS ? "fiber" : "thread",
+			RECV_POOLS[0] ? "pooled" : "on the reader stacks");
+	if (n) {
+		size_t total = fp.client + fp.stacks + fp.recv + fp.outq + fp.shm + fp.other;
+		printf("  per connection, on average:\n");
+		printf("    client         %12zu\n", fp.client / n);
+		printf("    thread stacks  %12zu (reserved for the reader and the writer)\n", fp.stacks / n);
+		printf("    receive buffer %12zu\n", fp.recv / n);
+		printf("    outbound queue %12zu\n", fp.outq / n);
+		printf("    shared memory  %12zu\n", fp.shm / n);
+		printf("    other          %12zu (list node, pipeline state, filter)\n", fp.other / n);
+		printf("    total          %12zu, about %zu connections per GiB\n", total / n,
+				(size_t)((1ULL << 30) / (total / n ? total / n : 1)));
+	}
+	printf("  plus up to %d bytes of socket send buffer per connection, in the kernel\n", CLIENT_SNDBUF);
+	for (int i = 0; i < AFFINITY_MAX_NODES && RECV_POOLS[i]; i++)
+		bufpool_print(RECV_POOLS[i], stdout);
+	fflush(stdout);
+}
+
+/**
+ * @brief Keeps listening commands from stdin.
+ *
+ * This function will be executed by a thread responsible for listen to user commands:
+ *  - @c /stats prints the server statistics;
+ *  - @c /trace @c N traces one in every @c N frames, @c /trace alone turns it off;
+ *  - @c /search @c <words> shows the most recent messages containing all the words;
+ *  - @c /top shows the heaviest senders and the slowest receivers;
+ *  - @c /memory shows what the connections cost;
+ *  - @c /shutdown @c [seconds] lets the clients get what is queued for them, for up to
+ *    @c DRAIN_TIMEOUT_S seconds unless told otherwise, and stops the server.
+ *
+ * @param arg An array with the @c LISTENERS accept_clients_thread() threads, so it can cancel 
+ * them when the server administrator executes the @c /shutdown command.
+ *
+ * @see stop_server
+ *
+ * @see accept_clients_thread
+ */
+void *listen_to_commands_thread(void *arg)
+{
+	/* accept_clients_thread() threads */
+	pthread_t *accept_threads = (pthread_t *)arg;
+
+	char cmd[MESSAGE_LEN];
+
+	while (fgets(cmd, MESSAGE_LEN, stdin)) {
+		char *tok = strtok(cmd, " \n\t");
+
+		if (tok) {
+			if (strcmp(tok, "/stats") == 0) {
+				print_stats();
+			} else if (strcmp(tok, "/trace") == 0) {
+				char *rate = strtok(NULL, " \n\t");
+				TRACE_SAMPLE = rate ? strtoul(rate, NULL, 10) : 0;
+			} else if (strcmp(tok, "/top") == 0) {
+				print_top();
+			} else if (strcmp(tok, "/memory") == 0) {
+				print_memory();
+			} else if (strcmp(tok, "/search") == 0) {
+				char *query = strtok(NULL, "\n");
+				if (query)
+					run_search(NULL, query);
+			} else if (strcmp(tok, "/shutdown") == 0) {
+				char *timeout = strtok(NULL, " \n\t");
+				stop_server(accept_threads, timeout ? strtoul(timeout, NULL, 10) : DRAIN_TIMEOUT_S);
+				break;
+			}
+		}
+		
+	}
+
+	return arg;
+}
+
+/**
+ * @brief Waits for @c SIGINT or @c SIGTERM, and stops the server like @c /shutdown does.
+ *
+ * Every other thread blocks both signals, see main(). Once the server is stopping,
+ * another one ends it right away.
+ *
+ * @param arg The @c LISTENERS accept_clients_thread() threads.
  *
- * @see CLIENT_LIST
+ * @see stop_server
  */
-pthread_mutex_t CLIENT_LIST_MUTEX;
+void *wait_signals_thread(void *arg)
+{
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+
+	int sig;
+	if (sigwait(&set, &sig) != 0)
+		return arg;
+
+	fprintf(stderr, "%s, shutting down\n", strsignal(sig));
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+	stop_server((pthread_t *)arg, DRAIN_TIMEOUT_S);
+	exit(E_SUCCESS);
+
+	return arg;
+}
 
 /**
- * @brief Carry out mutual exclusion and insert the new client on the list.
+ * @brief Checks if the client asked for an option during the handshake.
  *
- * This function locks the @c CLIENT_LIST_MUTEX and inserts the client on the list, then unlocks the mutex.
+ * The handshake is the client name followed by zero or more options, all of them @c NUL terminated.
  *
- * @param[in] c The client.
+ * @param[in] handshake The bytes received from the client, followed by a @c NUL.
+ * @param[in] len The number of bytes received.
+ * @param[in] opt The option.
  *
- * @see CLIENT_LIST
- * @see CLIENT_LIST_MUTEX
+ * @return @c true if the option is present, @c false otherwise.
  */
-void insert_client_concurrent(struct client *c)
+bool handshake_has_option(const char *handshake, ssize_t len, const char *opt)
 {
-	pthread_mutex_lock(&CLIENT_LIST_MUTEX);
-	sll_insert_last(&CLIENT_LIST, c);
-	pthread_mutex_unlock(&CLIENT_LIST_MUTEX);
+	const char *end = handshake + len;
+	const char *p 	= memchr(handshake, '\0', len);
+
+	while (p && ++p < end) {
+		if (strcmp(p, opt) == 0)
+			return true;
+		p = memchr(p, '\0', end - p);
+	}
+
+	return false;
 }
 
 /**
- * @brief Carry out mutual exclusion and remove the new client on the list.
- * 
- * This function locks the @c CLIENT_LIST_MUTEX and inserts the client on the list, then unlocks the mutex.
+ * @brief Get the value of a @c key=value option sent during the handshake.
  *
- * @param[in] c The client.
+ * @param[in] handshake The bytes received from the client, followed by a @c NUL.
+ * @param[in] len The number of bytes received.
+ * @param[in] key The option name, including the @c '='.
  *
- * @return The client just removed. NULL otherwise.
+ * @return The value, pointing into @p handshake, or NULL if the option is not present.
  *
- * @see CLIENT_LIST
- * @see CLIENT_LIST_MUTEX
+ * @see handshake_has_option
  */
-struct client *remove_client_concurrent(struct client *c)
+const char *handshake_get_option(const char *handshake, ssize_t len, const char *key)
 {
-	pthread_mutex_lock(&CLIENT_LIST_MUTEX);
-	void *key = sll_remove_elm(&CLIENT_LIST, c);
-	pthread_mutex_unlock(&CLIENT_LIST_MUTEX);
+	const char *end = handshake + len;
+	const char *p 	= memchr(handshake, '\0', len);
+	size_t keylen 	= strlen(key);
+
+	while (p && ++p < end) {
+		if (strncmp(p, key, keylen) == 0)
+			return p + keylen;
+		p = memchr(p, '\0', end - p);
+	}
 
-	return (struct client *)key;
+	return NULL;
 }
 
 /**
- * @brief Sends a message from one client to all clients.
+ * @brief Copy a handshake without one of its @c key=value options.
  *
- * The message will be sent as a packet version of a struct message.
+ * @param[in] handshake The bytes received from the client, followed by a @c NUL.
+ * @param[in] len The number of bytes received.
+ * @param[in] key The option name, including the @c '='.
+ * @param[out] out Where the copy is written; must hold @p len bytes.
  *
- * @param[in] c The client that sent the message.
- * @param[in] msg The message content.
+ * @return The length of the copy.
  *
- * @see message_pack
+ * @see handshake_get_option
  */
-void broadcast_client_message(struct client *c, const char *msg)
+ssize_t handshake_strip_option(const char *handshake, ssize_t len, const char *key, char *out)
 {
-	/* The serialized message will be stored here */
-	char *pack = "";
+	const char *end = handshake + len;
+	size_t keylen 	= strlen(key);
+	ssize_t n 		= 0;
+
+	for (const char *p = handshake; p < end; ) {
+		const char *next = memchr(p, '\0', end - p);
+		next = next ? next + 1 : end;
+		/* The name comes first, whatever it looks like */
+		if (p == handshake || strncmp(p, key, keylen) != 0) {
+			memcpy(out + n, p, next - p);
+			n += next - p;
+		}
+		p = next;
+	}
 
-	struct message *m = message_create(msg, client_get_name(c));
-	if (m) {
-		int len;
-		pack = message_pack(m, &len);
-		if (pack) {
-			pthread_mutex_lock(&CLIENT_LIST_MUTEX);
+	return n;
+}
 
-			/* Iterate through all the CLIENT_LIST, and send the message to all the connected clients */
-			for (struct sllist *p = CLIENT_LIST; p; p = sll_get_next(&p)) {
-				struct client *current_client = (struct client *)sll_get_key(p);
-				int rv = send(client_get_socket(current_client), pack, len, 0);
-				if (rv == -1) {
-					perror("send()");
-				}
-			}
+/**
+ * @brief Checks if a socket is a Unix domain socket.
+ *
+ * @param[in] sockfd The socket.
+ *
+ * @return @c true if the socket family is @c AF_UNIX, @c false otherwise.
+ */
+bool is_unix_socket(int sockfd)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
 
-			pthread_mutex_unlock(&CLIENT_LIST_MUTEX);
+	if (getsockname(sockfd, (struct sockaddr *)&addr, &addrlen) == -1)
+		return false;
 
-			free(pack);
-		}
-		message_destroy(m);
-	}
+	return addr.ss_family == AF_UNIX;
 }
 
 /**
- * @brief Sends a message from the server to all clients.
- *
- * The message will be sent as a packet version of a struct message.
+ * @brief Answer the client handshake.
  *
- * @param[in] msg The message content.
+ * Clients connected through the Unix domain socket that asked for it are switched
+ * to the shared-memory transport, and the channel is handed to them over their socket.
+ * Everyone else, or anyone for whom the channel could not be set up, is told to keep
+ * using the socket. The client sends no message before getting this answer.
  *
- * @see message_pack
+ * @param[in] c The client.
+ * @param[in] want_shm Whether the client asked for shared memory.
  */
-void broadcast_server_message(const char *msg)
+void answer_handshake(struct client *c, bool want_shm)
 {
-	/* The serialized message will be stored here */
-	char *pack = "";
-
-	struct message *m = message_create(msg, "server");
-	if (m) {
-		int len;
-		pack = message_pack(m, &len);
-		if (pack) {
-			pthread_mutex_lock(&CLIENT_LIST_MUTEX);
-
-			/* Iterate through all the CLIENT_LIST, and send the message to all the connected clients */
-			for (struct sllist *p = CLIENT_LIST; p; p = sll_get_next(&p)) {
-				struct client *current_client = (struct client *)sll_get_key(p);
-				int rv = send(client_get_socket(current_client), pack, len, 0);
-				if (rv == -1) {
-					perror("send()");
-				}
-			}
+	int sockfd = client_get_socket(c);
+
+	/* Only a socket has anyone expecting an answer */
+	if (sockfd == -1)
+		return;
+
+	if (want_shm && is_unix_socket(sockfd)) {
+		struct shmchan *shm = shmchan_create();
+		if (!shm) {
+			perror("shmchan_create()");
+		} else if (shmchan_send_fds(shm, sockfd) == -1) {
+			perror("shmchan_send_fds()");
+			shmchan_destroy(shm);
+		} else {
+			client_set_shm(c, shm);
+			return;
+		}
+	}
 
-			pthread_mutex_unlock(&CLIENT_LIST_MUTEX);
+	if (shmchan_refuse(sockfd) == -1) {
+		perror("shmchan_refuse()");
+	}
+}
 
-			free(pack);
-		}
-		message_destroy(m);
+/**
+ * @brief Send the client its session: the resume token and whether it was resumed.
+ *
+ * @param[in] c The client.
+ * @param[in] resumed Whether an earlier session was resumed.
+ */
+void send_session_frame(struct client *c, bool resumed)
+{
+	char frame[FRAME_HEADER_LEN + SESSION_TOKEN_LEN + 3];
+	size_t hlen = frame_header_len(0);
+	size_t len 	= 0;
+
+	strcpy(frame + hlen, client_get_token(c));
+	len += strlen(client_get_token(c)) + 1;
+	strcpy(frame + hlen + len, resumed ? "1" : "0");
+	len += 2;
+
+	frame_write_header(frame, FRAME_SESSION, 0, len, 0, NULL);
+	if (client_send(c, OUTQ_CONTROL, 0, frame, hlen + len) == -1) {
+		perror("send()");
 	}
 }
 
 /**
- * @brief Kill a client.
+ * @brief Look for the session a client wants to resume and take it over.
  *
- * Removes a client from the @c CLIENT_LIST, destroys it and closes the connection.
+ * The session is either parked, or still held by a connection the server has not
+ * noticed is dead yet. That connection is shut down and marked as superseded, so it
+ * leaves without telling the room.
  *
- * @param[in] c The client.
+ * @param[in] token The resume token the client sent.
+ * @param[out] name Where the session username is copied; must hold @c CLIENT_NAME_LEN bytes.
  *
- * @see CLIENT_LIST
+ * @return @c true if the session was found, @c false otherwise.
  */
-void kill_client(struct client *c)
+bool take_over_session(const char *token, char *name)
 {
-	if (c) {
-		void *key = remove_client_concurrent(c);
+	bool found = false;
+
+	lockstat_lock(CLIENT_LIST_MUTEX);
+
+	for (struct sllist *p = CLIENT_LIST; p && !found; p = sll_get_next(&p)) {
+		struct client *old = (struct client *)sll_get_key(p);
+		const char *t = client_get_token(old);
+		if (t && !client_is_superseded(old) && strcmp(t, token) == 0) {
+			snprintf(name, CLIENT_NAME_LEN, "%s", client_get_name(old));
+			client_set_superseded(old, true);
+			client_shutdown(old);
+			found = true;
+		}
+	}
 
-		if (key) {
-			close(client_get_socket(c));
-			client_destroy(c);
+	for (struct sllist *p = PARKED_SESSIONS; p && !found; p = sll_get_next(&p)) {
+		struct session *s = (struct session *)sll_get_key(p);
+		if (strcmp(session_get_token(s), token) == 0) {
+			snprintf(name, CLIENT_NAME_LEN, "%s", session_get_name(s));
+			sll_remove_elm(&PARKED_SESSIONS, s);
+			session_destroy(s);
+			found = true;
 		}
 	}
 
+	lockstat_unlock(CLIENT_LIST_MUTEX);
+
+	return found;
 }
 
 /**
- * @brief Kill all connected clients.
+ * @brief Replay what a resuming client missed and put it back in the @c CLIENT_LIST.
  *
- * Removes all clients from the @c CLIENT_LIST, destroy them and closes the connection.
+ * Both happen under the @c CLIENT_LIST_MUTEX, so no message is lost or sent twice
+ * between the replay and the live fan-out. If the client was gone for so long that
+ * the @c HISTORY no longer has everything it missed, it is told so. It gets the
+ * member list again along with the next presence delta.
  *
- * @see CLIENT_LIST
+ * @param[in] c The client.
+ * @param[in] last_seq The last sequence number the client got.
  */
-void kill_all_clients(void)
+void rejoin_room(struct client *c, uint64_t last_seq)
 {
-	pthread_mutex_lock(&CLIENT_LIST_MUTEX);
-
-	struct client *c;
-	while ((c = sll_remove_first(&CLIENT_LIST))) {
-		pthread_cancel(*client_get_thread(c));
-		close(client_get_socket(c));
-		client_destroy(c);
+	lockstat_lock(CLIENT_LIST_MUTEX);
+
+	uint64_t first = history_first_seq(HISTORY);
+	if (last_seq + 1 < first) {
+		char notice[MESSAGE_LEN];
+		snprintf(notice, MESSAGE_LEN, "%llu messages were lost while you were away",
+				(unsigned long long)(first - last_seq - 1));
+		send_message_to(c, notice, "server");
 	}
 
-	pthread_mutex_unlock(&CLIENT_LIST_MUTEX);
+	history_replay(HISTORY, last_seq, replay_to_client, c);
+	sll_insert_last(&CLIENT_LIST, c);
+
+	lockstat_unlock(CLIENT_LIST_MUTEX);
 }
 
 /**
- * @brief Keeps listening to client messages.
- *
- * This function will be executed by a thread that is responsable for 
- * keep checking if there is a new message from the client.
- *
- * If there is an new message, the thread will execute the broadcast_client_message().
+ * @brief Move a client that asked for it to the @c MCAST group.
  *
- * @param[in] client A pointer to the client.
+ * Only clients connected over TCP, and wanting every message, join. The switch
+ * happens under the @c CLIENT_LIST_MUTEX, so every message goes either over the
+ * connection, up to the sequence number the client is told, or to the group.
  *
- * @see broadcast_client_message
+ * @param[in] c The client, in the @c CLIENT_LIST.
  */
-void *listen_to_client_thread(void *client)
+void join_mcast(struct client *c)
 {
-	struct client *c = (struct client *)client;
-	char msg[MESSAGE_LEN];
-	
-	ssize_t numbytes;
-	while ((numbytes = recv(client_get_socket(c), msg, MESSAGE_LEN - 1, 0)) > 0) {
-		msg[numbytes] = '\0';
-		broadcast_client_message(c, msg);
-	}
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	int sockfd = client_get_socket(c);
 
-	perror("listen_to_client_thread -> recv():");
-	sprintf(msg, "%s has exit the room", client_get_name(c));
+	if (sockfd == -1 || client_get_shm(c) || getsockname(sockfd, (struct sockaddr *)&addr, &addrlen) == -1
+			|| addr.ss_family != AF_INET)
+		return;
 
-	kill_client(c);
+	char frame[FRAME_HEADER_LEN + FRAME_SEQ_LEN + sizeof(uint32_t) + sizeof(uint16_t)];
 
-	broadcast_server_message(msg);
-
-	return NULL;
+	lockstat_lock(CLIENT_LIST_MUTEX);
+	if (client_get_filter(c) == -1 && !client_is_mcast(c)) {
+		client_set_mcast(c, true);
+		if (client_send(c, OUTQ_CHAT, OUTQ_ORDERED, frame, mcast_write_join(MCAST, frame, history_last_seq(HISTORY))) == -1)
+			perror("send()");
+	}
+	lockstat_unlock(CLIENT_LIST_MUTEX);
 }
 
 /**
- * @brief Keeps listening commands from stdin.
- *
- * This function will be executed by a thread responsible for listen to user commands.
- *
- * @param arg An adress to the accept_clients_thread() thread, so it can cancel the 
- * thread when the server administrator executes the @c /shutdown command.
+ * @brief Frame one message taken out of a mailbox.
  *
- * @see accept_clients_thread
+ * This is a mailbox_fn, @p arg is a struct frame_buffer.
  */
-void *listen_to_commands_thread(void *arg)
+void frame_mailbox_message(const char *pack, uint32_t len, time_t when, void *arg)
 {
-	/* accept_clients_thread() thread */
-	pthread_t accept_thread = *(pthread_t *)arg;
+	struct frame_buffer *fb = (struct frame_buffer *)arg;
+	(void)when;
 
-	char cmd[MESSAGE_LEN];
+	if (len <= FRAME_MAX_PAYLOAD && append_frame(&fb->data, &fb->len, &fb->cap, FRAME_CHAT, pack, len) == 0)
+		fb->count++;
+}
 
-	while (fgets(cmd, MESSAGE_LEN, stdin)) {
-		char *tok = strtok(cmd, " \n\t");
+/**
+ * @brief Deliver what was spooled for a client while it was offline.
+ *
+ * The mailbox is read outside of the @c CLIENT_LIST_MUTEX; the messages are then
+ * sent in a single burst, preceded by a notice. The client must already be in the
+ * @c CLIENT_LIST, so nothing new gets spooled for it meanwhile.
+ *
+ * @param[in] c The client.
+ */
+void deliver_mailbox(struct client *c)
+{
+	if (mailbox_open(MAILBOXES, client_get_name(c)) == -1) {
+		perror("mailbox_open()");
+		return;
+	}
 
-		if (tok) {
-			if (strcmp(tok, "/shutdown") == 0) {
-				char goodbye_message[] = "Server shutting down in 10 seconds.";
-				broadcast_server_message(goodbye_message);
+	struct frame_buffer fb = { NULL, 0, 0, 0 };
+	if (mailbox_fetch(MAILBOXES, client_get_name(c), frame_mailbox_message, &fb) == -1) {
+		perror("mailbox_fetch()");
+	}
 
-				unsigned time = 10;
-				while ((time = sleep(time)) != 0) {
-					/* Empty body */
-				}
+	if (fb.count) {
+		char notice[MESSAGE_LEN];
+		snprintf(notice, MESSAGE_LEN, "%zu messages arrived while you were away", fb.count);
 
-				kill_all_clients();
-				pthread_cancel(accept_thread);
-				break;
-			}
+		lockstat_lock(CLIENT_LIST_MUTEX);
+		send_message_to(c, notice, "server");
+		if (client_send(c, OUTQ_BULK, 0, fb.data, fb.len) == -1) {
+			perror("send()");
 		}
-		
+		lockstat_unlock(CLIENT_LIST_MUTEX);
 	}
 
-	return arg;
+	free(fb.data);
 }
 
 /**
  * @brief Create a new client and add it in the @c CLIENT_LIST.
  *
- * Also broadcast everyone that the new client has entered the room.
+ * The room is told the new client entered by the next presence delta, and the
+ * client gets the member list at the same time.
  *
- * @param[in] sockfd The socket created in accept_clients_thread(),  and that 
+ * A client that sends the token of a session still resumable gets back its name, and
+ * the messages it missed instead of the room being told it entered. It gets a new
+ * token either way, and the token is left out of the @c CAPTURE.
+ *
+ * Either way, the client then gets the direct messages and mentions spooled in its mailbox.
+ *
+ * The connection is first placed on a NUMA node; unless the clients are fibers,
+ * the calling thread moves there, so the client is allocated on that node and its
+ * threads run there, see @c AFFINITY.
+ *
+ * @param[in] tr The connection accepted in accept_clients_thread(),  and that 
  * is used to communicate with the client that will be created.
  *
  * @see accept_clients_thread
  * @see CLIENT_LIST
  */
-void create_new_client(int sockfd)
+void create_new_client(const struct transport *tr)
 {
 	/* 
 	 * The first thing the client will do is to send its name 
 	 * to the server, so we will recieve it in this function 
 	 */
 
-	/* Where the client name will be stored */
+	int node = affinity_place(AFFINITY, transport_get_socket(tr), !FIBERS);
+
+	/* Where the client name and its options will be stored */
+	char handshake[HANDSHAKE_LEN];
+	/* recv() the client name and store it in the handshake buffer, unless it takes too long */
+	ssize_t numbytes = -1;
+	if (transport_wait(tr, POLLIN, HANDSHAKE_TIMEOUT_MS) == 0)
+		numbytes = transport_recv(tr, handshake, HANDSHAKE_LEN - 1);
+	if (numbytes <= 0) {
+		close_connection(tr, node);
+		return;
+	}
+	handshake[numbytes] = '\0';
+
+	/* Accepted just before the server started shutting down */
+	if (atomic_load(&DRAINING)) {
+		close_connection(tr, node);
+		return;
+	}
+
 	char client_name[CLIENT_NAME_LEN];
-	/* recv() the client name and store it in the client_name buffer */
-	ssize_t numbytes = recv(sockfd, client_name, CLIENT_NAME_LEN - 1, 0);
-	client_name[numbytes] = '\0';
+	size_t name_len = strnlen(handshake, CLIENT_NAME_LEN - 1);
+	memcpy(client_name, handshake, name_len);
+	/* Names are printed by every client, they get the same cleanup as messages */
+	client_name[textscan_sanitize(client_name, name_len)] = '\0';
+
+	/* A client coming back after its connection dropped */
+	const char *token 	= handshake_get_option(handshake, numbytes, RESUME_OPT);
+	const char *seq 	= handshake_get_option(handshake, numbytes, SEQ_OPT);
+	bool resumed 		= token && take_over_session(token, client_name);
+
+	int sockfd = transport_get_socket(tr);
+	struct client *c = sockfd != -1 ? client_create(client_name, sockfd) : client_create_transport(client_name, tr);
+	if (!c) {
+		close_connection(tr, node);
+	} else {
+		client_set_node(c, node);
+		if (CAPTURE) {
+			/* A capture is shared for debugging, it must not let anyone take the session over */
+			char captured[HANDSHAKE_LEN];
+			client_set_capture(c, capture_open(CAPTURE, captured,
+						handshake_strip_option(handshake, numbytes, RESUME_OPT, captured)));
+		}
+
+		client_set_meter(c, TOP[TOP_BYTES_OUT]);
+
+		/* A bot may say at once which messages it wants, before any replay */
+		const char *filter = handshake_get_option(handshake, numbytes, FILTER_OPT);
+		if (filter)
+			subscribe(c, filter, false);
+
+		/* Co-located clients may ask to talk through shared memory instead of the socket */
+		answer_handshake(c, !FIBERS && handshake_has_option(handshake, numbytes, SHMCHAN_HANDSHAKE_OPT));
+
+		/* A resumed session gets a new token too, so a token is only ever good once */
+		char new_token[SESSION_TOKEN_LEN + 1];
+		if (session_new_token(new_token) == 0) {
+			client_set_token(c, new_token);
+			send_session_frame(c, resumed);
+		}
+
+		if (resumed) {
+			rejoin_room(c, seq ? strtoull(seq, NULL, 10) : 0);
+		} else {
+			/* Carry out mutual exclusion and insert the new client on the list */
+			insert_client_concurrent(c);
+		}
+
+		/* Clients on the LAN may get the room from the multicast group */
+		if (MCAST && handshake_has_option(handshake, numbytes, MCAST_HANDSHAKE_OPT))
+			join_mcast(c);
 
-	struct client *c = client_create(client_name, sockfd);
-	if (c) {
-		/* Carry out mutual exclusion and insert the new client on the list */
-		insert_client_concurrent(c);
+		deliver_mailbox(c);
 
 		/* 
 		 * Create a a new thread for that client, this thread 
 		 * will execute the listen_to_client_thread() function 
 		 */
-		if (pthread_create(client_get_thread(c), NULL, listen_to_client_thread, c)) {
-			exit(E_PTHREAD_CREATE);
+		bool listening = FIBERS ? fiber_spawn(FIBERS, listen_to_client_thread, c, true) != NULL
+				: pthread_create(client_get_thread(c), client_get_thread_attr(), listen_to_client_thread, c) == 0;
+		if (!listening) {
+			/* Out of threads: this client is let go, the others are still served */
+			fprintf(stderr, "no thread to listen to %s, dropping it\n", client_name);
+			leave_room(c, true);
+		}
+	}
+}
+
+/**
+ * @brief Reads the handshake of an admitted connection and creates its client.
+ *
+ * Handshakes run apart from the accept loop, so a slow one does not hold the
+ * others up; how many run at once is bounded by @c ADMISSION.
+ *
+ * @param[in] arg The connection, allocated by accept_clients_thread() and freed here.
+ */
+void *handshake_thread(void *arg)
+{
+	struct transport tr = *(struct transport *)arg;
+	free(arg);
+
+	create_new_client(&tr);
+	admit_handshake_done(ADMISSION);
+
+	return NULL;
+}
+
+/**
+ * @brief Start the handshake of an admitted connection, see handshake_thread().
+ *
+ * @param[in] tr The connection.
+ *
+ * @return @c 0 in case of success, @c -1 if no thread, or fiber, could be had.
+ */
+int start_handshake(const struct transport *tr)
+{
+	struct transport *arg = malloc(sizeof(struct transport));
+	if (!arg)
+		return -1;
+	*arg = *tr;
+
+	if (FIBERS) {
+		if (fiber_spawn(FIBERS, handshake_thread, arg, true))
+			return 0;
+	} else {
+		pthread_t thread;
+		if (pthread_create(&thread, client_get_thread_attr(), handshake_thread, arg) == 0) {
+			pthread_detach(thread);
+			return 0;
 		}
+	}
 
-		char welcome_message[MESSAGE_LEN];
+	free(arg);
+
+	return -1;
+}
 
-		snprintf(welcome_message, MESSAGE_LEN, "%s entered the room", client_get_name(c));
-		broadcast_server_message(welcome_message);
+/**
+ * @brief Admit a new connection, or refuse it and close it.
+ *
+ * @param[in] tr The connection.
+ *
+ * @return @c true if it was admitted, @c false otherwise.
+ *
+ * @see ADMISSION
+ */
+bool admit_connection(const struct transport *tr)
+{
+	enum admit_reason why = admit_enter(ADMISSION);
+	if (why != ADMIT_OK) {
+		refuse_connection(tr, why);
+		return false;
 	}
+
+	return true;
 }
 
 /**
  * @brief Keeps on accepting new clients connections.
  *
  * Keeps listening for incoming connections, wen a new one
- * arrives accepts it and instantiates a new client.
+ * arrives accepts it and, if @c ADMISSION takes it on, starts its handshake;
+ * otherwise the client is told the server is busy.
  *
  * @param[in] sock Adress to the socket used to listen to new connections.
  */
@@ -333,13 +2657,15 @@ void *accept_clients_thread(void *sock)
 {
 	int sockfd = *(int *)sock;
 
-	pthread_mutex_init(&CLIENT_LIST_MUTEX, NULL);
+	if (affinity_pin(AFFINITY, AFFINITY_ACCEPT) == -1)
+		perror("accept_clients_thread -> affinity_pin()");
 
 	struct sockaddr_storage client_addr;
-	socklen_t addrlen = sizeof(client_addr);
+	socklen_t addrlen;
 	int client_sockfd;
 
 	while (true) {
+		addrlen = sizeof(client_addr);
 		/* Listen and accept incoming connections, client_socket is the new connection socket */
 		client_sockfd = accept(sockfd, (struct sockaddr *)&client_addr, &addrlen);
 		if (client_sockfd == -1) {  /* If the connection failed */
@@ -347,12 +2673,42 @@ void *accept_clients_thread(void *sock)
 			continue;
 		}
 
-		create_new_client(client_sockfd);
+		struct transport tr = transport_socket(client_sockfd);
+		if (admit_connection(&tr) && start_handshake(&tr) == -1) {
+			admit_refuse(ADMISSION, ADMIT_NO_THREAD);
+			refuse_connection(&tr, ADMIT_NO_THREAD);
+		}
 	}
 
 	return NULL;
 }
 
+/**
+ * @brief Connects the simulated clients, and ends the server once they are all gone.
+ *
+ * @param[in] arg Unused.
+ *
+ * @see SIMNET
+ */
+void *simulate_clients_thread(void *arg)
+{
+	for (unsigned i = 0; i < simnet_get_clients(SIMNET); i++) {
+		struct transport tr = simnet_connect(SIMNET, i);
+		if (admit_connection(&tr)) {
+			create_new_client(&tr);
+			admit_handshake_done(ADMISSION);
+		}
+	}
+
+	simnet_wait(SIMNET);
+	print_stats();
+
+	unlink(UNIX_SOCKET_PATH);
+	exit(E_SUCCESS);
+
+	return arg;
+}
+
 /**
  * @brief Find a set of possible internet addresses of localhost.
  *
@@ -443,22 +2799,261 @@ int configure_as_server(void)
 	return sockfd;
 }
 
+/**
+ * @brief This function is responsible to make the Unix domain socket
+ * that co-located clients use to reach the server.
+ *
+ * A stale socket file left by a previous instance is removed first.
+ *
+ * @return A socket in passive mode, bound to @c UNIX_SOCKET_PATH.
+ */
+int configure_as_unix_server(void)
+{
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, UNIX_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+
+	int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sockfd == -1) {
+		perror("socket()");
+		exit(E_BIND);
+	}
+
+	unlink(UNIX_SOCKET_PATH);
+	if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("bind");
+		exit(E_BIND);
+	}
+
+	if (listen(sockfd, BACKLOG) == -1) {
+		perror("listen");
+		exit(E_LISTEN);
+	}
+
+	return sockfd;
+}
+
+/**
+ * @brief Prints the correct usage of the program.
+ *
+ * @param[in] name The name of this program.
+ */
+void print_usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-b] [-s KiB, at least %d] [-f threads] [-c file] [-S key=value,...] [-L key=value,...] "
+			"[-A role=cpus,...] [-M group:port[@iface][,drop=N]] [plugin.so...]\n", name, CLIENT_STACK_MIN_KIB);
+}
+
 /**
  * @brief The zip-zop-server. 
  *
  * A TCP server that will accept connections from zip-zop-clients, 
  * hear its messages and broadcast them to all connected clients. Working as a chatroom.
+ *
+ * Clients on the same host may also connect through the Unix domain socket at
+ * @c UNIX_SOCKET_PATH, and from there switch to a shared-memory channel.
+ *
+ * Options:
+ *  - @c -s @c KiB sets the stack size of the two threads, or fibers, of every client;
+ *  - @c -b makes the clients share receive buffers, see @c RECV_POOLS;
+ *  - @c -f @c N runs the clients as fibers on @c N threads, see @c FIBERS;
+ *  - @c -c @c file records what the clients send, see @c CAPTURE;
+ *  - @c -S @c key=value,... serves simulated clients too, then exits, see @c SIMNET;
+ *  - @c -L @c key=value,... changes the limits past which new connections are refused, see @c ADMISSION;
+ *  - @c -A @c role=cpus,... pins the threads of each role to CPUs, see @c AFFINITY;
+ *  - @c -M @c group:port[\@iface][,drop=N] sends the room to a multicast group, dropping
+ *    one datagram in @c N on purpose if asked, see @c MCAST.
+ *
+ * Every other argument is a plugin adding stages to the @c PIPELINE, see pipeline_load_plugin().
+ *
+ * @note Usage: ./zip-zop-server [-b] [-s KiB] [-f threads] [-c file] [-S key=value,...] [-L key=value,...] [-A role=cpus,...] [-M group:port[\@iface][,drop=N]] [plugin.so...]
  */
-int main(void)
+int main(int argc, char *argv[])
 {
-	int sockfd = configure_as_server();
+	/* Blocked in every thread, the signals stopping the server go to wait_signals_thread() */
+	sigset_t stop_signals;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+	int opt;
+	unsigned long stack_kib;
+	int fiber_workers = 0;
+	bool pool_buffers = false;
+	bool mcast_seen = false;
+	bool simulate = false;
+	struct simnet_params sim;
+	simnet_default_params(&sim);
+	struct admit_limits limits;
+	admit_default_limits(&limits);
+	while ((opt = getopt(argc, argv, "bs:f:c:S:L:A:M:")) != -1) {
+		if (opt == 'b') {
+			pool_buffers = true;
+		} else if (opt == 's' && (stack_kib = strtoul(optarg, NULL, 10)) >= CLIENT_STACK_MIN_KIB
+				&& client_set_stack_size(stack_kib * 1024) == 0) {
+			/* Empty body */
+		} else if (opt == 'f' && (fiber_workers = atoi(optarg)) > 0) {
+			/* Empty body */
+		} else if (opt == 'c') {
+			CAPTURE = capture_create(optarg);
+			if (!CAPTURE) {
+				perror(optarg);
+				exit(E_BAD_ARGS);
+			}
+		} else if (opt == 'S' && simnet_parse_params(optarg, &sim) == 0) {
+			simulate = true;
+		} else if (opt == 'L' && admit_parse_limits(optarg, &limits) == 0) {
+			/* Empty body */
+		} else if (opt == 'A' && !AFFINITY && (AFFINITY = affinity_create(optarg))) {
+			/* Empty body */
+		} else if (opt == 'M' && !mcast_seen) {
+			/* A single group; a second -M is a usage error */
+			mcast_seen = true;
+			MCAST = mcast_create(optarg);
+			if (!MCAST && errno != EINVAL) {
+				/* A well formed group whose socket could not be set up */
+				perror(optarg);
+				exit(E_MCAST);
+			}
+			if (!MCAST) {
+				print_usage(argv[0]);
+				exit(E_BAD_ARGS);
+			}
+		} else {
+			print_usage(argv[0]);
+			exit(E_BAD_ARGS);
+		}
+	}
+
+	if (!AFFINITY && !(AFFINITY = affinity_create(NULL))) {
+		exit(E_ALLOC);
+	}
+	for (int i = 0; pool_buffers && i < affinity_get_nodes(AFFINITY); i++) {
+		RECV_POOLS[i] = bufpool_create(FRAME_MAX_LEN, RECV_POOL_KEEP);
+		if (!RECV_POOLS[i]) {
+			exit(E_ALLOC);
+		}
+	}
+
+	/* Threads start on the CPUs of the thread creating them: the fiber workers serve the connections */
+	if (affinity_pin(AFFINITY, AFFINITY_IO) == -1) {
+		perror("affinity_pin()");
+	}
+	if (fiber_workers) {
+		/* The fibers get the stack asked with -s, or their own small default */
+		FIBERS = fiber_sched_create(fiber_workers, client_get_thread_attr() ? client_get_stack_size() : 0);
+		if (!FIBERS) {
+			exit(E_PTHREAD_CREATE);
+		}
+		client_set_fibers(FIBERS);
+	}
+	/* Every other thread main creates works for the whole room */
+	if (affinity_pin(AFFINITY, AFFINITY_WORKER) == -1) {
+		perror("affinity_pin()");
+	}
+
+	int sockfds[LISTENERS];
+	sockfds[0] = configure_as_server();
+	sockfds[1] = configure_as_unix_server();
+
+	CLIENT_LIST_MUTEX = lockstat_create("CLIENT_LIST");
+	ADMISSION = admit_create(&limits);
+	if (!CLIENT_LIST_MUTEX || !ADMISSION) {
+		exit(E_ALLOC);
+	}
 
-	pthread_t accept_thread;
-	if (pthread_create(&accept_thread, NULL, accept_clients_thread, &sockfd)) {
+	HISTORY 	= history_create(HISTORY_LEN);
+	PRESENCE 	= presence_create();
+	MAILBOXES 	= mailbox_store_create(MAILBOX_DIR);
+	SEARCH 		= search_create();
+	ATTACHMENTS = attach_store_create(ATTACH_DIR);
+	FILTERS 	= filter_set_create();
+	if (!HISTORY || !PRESENCE || !MAILBOXES || !SEARCH || !ATTACHMENTS || !FILTERS) {
+		exit(E_ALLOC);
+	}
+
+	TRACE_HIST[TRACE_CLIENT_TO_SERVER] 	= hist_create("client->server");
+	TRACE_HIST[TRACE_SERVER_LOCK] 		= hist_create("server recv->lock");
+	TRACE_HIST[TRACE_FANOUT] 			= hist_create("server lock->queue");
+	for (int i = 0; i < TRACE_STAGES; i++) {
+		if (!TRACE_HIST[i]) {
+			exit(E_ALLOC);
+		}
+	}
+
+	TOP[TOP_MESSAGES] 	= topk_create("top senders (messages)");
+	TOP[TOP_BYTES_IN] 	= topk_create("top senders (bytes received)");
+	TOP[TOP_FANOUT] 	= topk_create("top senders (fan-out bytes caused)");
+	TOP[TOP_BYTES_OUT] 	= topk_create("top receivers (bytes written)");
+	for (int i = 0; i < TOP_METRICS; i++) {
+		if (!TOP[i]) {
+			exit(E_ALLOC);
+		}
+	}
+
+	SEQUENCER = sequencer_create(history_last_seq(HISTORY) + 1, fan_out_batch, NULL);
+	if (!SEQUENCER) {
+		exit(E_PTHREAD_CREATE);
+	}
+
+	PIPELINE = pipeline_create();
+	if (!PIPELINE) {
+		exit(E_ALLOC);
+	}
+	for (const struct pipeline_stage_def *def = SERVER_STAGES; def->name; def++) {
+		if (pipeline_add_stage(PIPELINE, def) == -1) {
+			exit(E_ALLOC);
+		}
+	}
+	/* Every other argument is a plugin adding its stages */
+	for (int i = optind; i < argc; i++) {
+		if (pipeline_load_plugin(PIPELINE, argv[i]) == -1) {
+			print_usage(argv[0]);
+			exit(E_BAD_ARGS);
+		}
+	}
+	if (pipeline_start(PIPELINE) == -1) {
 		exit(E_PTHREAD_CREATE);
 	}
 
-	listen_to_commands_thread(&accept_thread);
+	pthread_t accept_threads[LISTENERS];
+	for (int i = 0; i < LISTENERS; i++) {
+		if (pthread_create(&accept_threads[i], NULL, accept_clients_thread, &sockfds[i])) {
+			exit(E_PTHREAD_CREATE);
+		}
+	}
+
+	pthread_t reap_thread, presence_tid;
+	if (pthread_create(&reap_thread, NULL, reap_sessions_thread, NULL)
+			|| pthread_create(&presence_tid, NULL, presence_thread, NULL)) {
+		exit(E_PTHREAD_CREATE);
+	}
+
+	/* Created last, the simulated clock starts once the server is ready */
+	if (simulate) {
+		pthread_t sim_thread;
+		if (!(SIMNET = simnet_create(&sim))) {
+			exit(E_ALLOC);
+		}
+		if (pthread_create(&sim_thread, NULL, simulate_clients_thread, NULL)) {
+			exit(E_PTHREAD_CREATE);
+		}
+	}
+
+	pthread_t signal_tid;
+	if (pthread_create(&signal_tid, NULL, wait_signals_thread, accept_threads)) {
+		exit(E_PTHREAD_CREATE);
+	}
+
+	listen_to_commands_thread(accept_threads);
+
+	pthread_cancel(reap_thread);
+	pthread_cancel(presence_tid);
+	if (CAPTURE)
+		capture_end(CAPTURE);
 
 	return 0;
 }
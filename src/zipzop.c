@@ -0,0 +1,1689 @@
+#define _GNU_SOURCE
+#include "zipzop.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include "shmchan.h"
+#include "mcast.h"
+
+/** @brief Maximum number of events handled by each epoll_wait() in zipzop_poll(). */
+#define ZIPZOP_MAX_EVENTS 256
+
+/**
+ * @brief What a descriptor registered in the epoll instance belongs to.
+ */
+enum zipzop_watch_kind {
+	ZIPZOP_WATCH_SOCKET, 	/**< The session socket */
+	ZIPZOP_WATCH_SHM, 		/**< The eventfd of the session shared-memory channel */
+	ZIPZOP_WATCH_MCAST 		/**< The socket receiving the multicast group */
+};
+
+/**
+ * @brief Pointer stored in the epoll event data.
+ */
+struct zipzop_watch {
+	struct zipzop_session *s; 		/**< The session */
+	enum zipzop_watch_kind kind; 	/**< Which of its descriptors */
+};
+
+/**
+ * @brief A message from the multicast group that came before some it follows.
+ */
+struct zipzop_held {
+	uint64_t seq; 	/**< Its sequence number */
+	char *frame; 	/**< A copy of the frame, NULL if the slot is free */
+	size_t len; 	/**< The frame length */
+};
+
+/**
+ * @brief A connection to a zip-zop-server.
+ */
+struct zipzop_session {
+	struct zipzop_ctx *ctx; 			/**< The context driving this session */
+	char *name; 						/**< The username */
+	int sockfd; 						/**< Socket connected to the server */
+	struct shmchan *shm; 				/**< Shared-memory channel, NULL if not in use */
+	int flags; 							/**< Flags given to zipzop_connect() */
+	enum zipzop_state state; 			/**< Current state */
+	struct zipzop_callbacks cb; 		/**< User callbacks */
+	void *arg; 							/**< Argument given to the callbacks */
+	char inbuf[ZIPZOP_INBUF_LEN]; 		/**< Received bytes not yet parsed into frames */
+	size_t in_len; 						/**< Bytes used in @c inbuf */
+	char *outbuf; 						/**< Frames waiting to be written, or waiting for room in the ring */
+	size_t out_len; 					/**< Bytes used in @c outbuf */
+	size_t out_cap; 					/**< Bytes allocated for @c outbuf */
+	bool in_ring; 						/**< Whether the last frame_reserve() was in the ring rather than @c outbuf */
+	bool dirty; 						/**< Whether the session is in the context dirty list */
+	uint64_t dirty_since; 				/**< When it was put in the dirty list, in @c CLOCK_MONOTONIC milliseconds */
+	unsigned flush_ms; 					/**< Most milliseconds batched output waits to be written, @c 0 for none */
+	bool want_write; 					/**< Whether @c EPOLLOUT is armed on the socket */
+	unsigned trace_every; 				/**< Trace one in this many sent frames, @c 0 for none */
+	unsigned trace_tick; 				/**< Frames sent since the last traced one */
+	const struct frame_trace *trace; 	/**< Trace of the frame being delivered, NULL if untraced */
+	char token[ZIPZOP_TOKEN_LEN + 1]; 	/**< Resume token given by the server, empty until it arrives */
+	bool resumed; 						/**< Whether the server resumed an earlier session */
+	unsigned retry_after; 				/**< Seconds the server asked to wait before connecting again, @c 0 unless it was busy */
+	bool ended; 						/**< Whether the server said goodbye, so the session cannot be resumed */
+	uint64_t last_seq; 					/**< Sequence number of the last message delivered */
+	bool in_members; 					/**< Whether the last frame delivered was part of a member list */
+	int upload_fd; 						/**< File being uploaded, @c -1 if none */
+	uint32_t upload_id; 				/**< Transfer id of the upload */
+	uint64_t upload_left; 				/**< Bytes of the upload not queued yet */
+	struct zipzop_watch sock_watch; 	/**< epoll data for the socket */
+	struct zipzop_watch shm_watch; 		/**< epoll data for the channel eventfd */
+	int mcast_fd; 						/**< Socket receiving the multicast group, @c -1 if not a member */
+	uint64_t mcast_asked; 				/**< Messages up to this one are held, or asked for again, since joining the group */
+	uint64_t ask_first; 				/**< First message of the range to ask for again, @c 0 for none */
+	uint64_t ask_last; 					/**< Last message of the range to ask for again */
+	bool asking; 						/**< Whether a range asked for again is not answered yet */
+	struct zipzop_held *held; 			/**< @c ZIPZOP_MCAST_HOLD slots of messages out of order, by sequence number */
+	size_t held_count; 					/**< Messages in @c held */
+	struct zipzop_watch mcast_watch; 	/**< epoll data for the group socket */
+	struct zipzop_session *prev; 		/**< Previous session in the context */
+	struct zipzop_session *next; 		/**< Next session in the context */
+	struct zipzop_session *next_dirty; 	/**< Next session with output to flush */
+	struct zipzop_session *next_dead; 	/**< Next closed session waiting to be freed */
+};
+
+/**
+ * @brief Drives any number of sessions from a single thread.
+ */
+struct zipzop_ctx {
+	int epfd; 						/**< The epoll instance all the session descriptors are registered in */
+	struct zipzop_session *all; 	/**< All sessions that were not freed yet */
+	struct zipzop_session *dirty; 	/**< Sessions with output batched since the last flush */
+	struct zipzop_session *dead; 	/**< Closed sessions to be freed at the end of zipzop_poll() */
+};
+
+/**
+ * @brief Create a context.
+ *
+ * @return A pointer to the context in case of success, NULL otherwise.
+ * The context must be freed, using zipzop_ctx_destroy().
+ */
+struct zipzop_ctx *zipzop_ctx_create(void)
+{
+	struct zipzop_ctx *ctx = malloc(sizeof(struct zipzop_ctx));
+	if (ctx) {
+		ctx->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (ctx->epfd == -1) {
+			free(ctx);
+			return NULL;
+		}
+		ctx->all 	= NULL;
+		ctx->dirty 	= NULL;
+		ctx->dead 	= NULL;
+	}
+
+	return ctx;
+}
+
+/**
+ * @brief Free the closed sessions.
+ */
+static void free_dead_sessions(struct zipzop_ctx *ctx)
+{
+	struct zipzop_session *s;
+	while ((s = ctx->dead)) {
+		ctx->dead = s->next_dead;
+
+		if (s->prev)
+			s->prev->next = s->next;
+		else
+			ctx->all = s->next;
+		if (s->next)
+			s->next->prev = s->prev;
+
+		free(s->name);
+		free(s->outbuf);
+		free(s);
+	}
+}
+
+/**
+ * @brief Destroy a context, closing all its sessions.
+ *
+ * @param[in] ctx The context.
+ */
+void zipzop_ctx_destroy(struct zipzop_ctx *ctx)
+{
+	if (ctx) {
+		for (struct zipzop_session *s = ctx->all; s; s = s->next) {
+			zipzop_close(s);
+		}
+		free_dead_sessions(ctx);
+		close(ctx->epfd);
+		free(ctx);
+	}
+}
+
+/**
+ * @brief Get a descriptor that becomes readable when zipzop_poll() has work to do.
+ *
+ * Lets the caller wait on the context together with its own descriptors.
+ *
+ * @warning Output batched by zipzop_send() does not make this descriptor readable,
+ * call zipzop_poll() after sending.
+ *
+ * @param[in] ctx The context.
+ *
+ * @return The descriptor.
+ */
+int zipzop_ctx_get_fd(struct zipzop_ctx *ctx)
+{
+	return ctx->epfd;
+}
+
+/**
+ * @brief Get how long the caller may wait on the context descriptor before calling zipzop_poll().
+ *
+ * Output a flush interval holds back is only written by a call to zipzop_poll()
+ * once the interval is over, see zipzop_set_flush_interval().
+ *
+ * @param[in] ctx The context.
+ *
+ * @return The number of milliseconds, @c -1 for no limit.
+ */
+int zipzop_ctx_get_timeout(struct zipzop_ctx *ctx)
+{
+	uint64_t now = frame_now() / 1000000;
+	int wait = -1;
+
+	for (struct zipzop_session *s = ctx->dirty; s; s = s->next_dirty) {
+		uint64_t due = s->dirty_since + s->flush_ms;
+		int left = due > now ? (int)(due - now) : 0;
+		if (wait == -1 || left < wait)
+			wait = left;
+	}
+
+	return wait;
+}
+
+/**
+ * @brief Change the events the session socket is watched for.
+ */
+static void watch_socket(struct zipzop_session *s, bool want_write)
+{
+	struct epoll_event ev;
+
+	ev.events 	= EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+	ev.data.ptr = &s->sock_watch;
+	if (epoll_ctl(s->ctx->epfd, EPOLL_CTL_MOD, s->sockfd, &ev) == -1) {
+		perror("epoll_ctl()");
+	}
+	s->want_write = want_write;
+}
+
+/**
+ * @brief Stop receiving the multicast group, and forget the messages held.
+ */
+static void leave_group(struct zipzop_session *s)
+{
+	if (s->mcast_fd != -1) {
+		epoll_ctl(s->ctx->epfd, EPOLL_CTL_DEL, s->mcast_fd, NULL);
+		close(s->mcast_fd);
+		s->mcast_fd = -1;
+	}
+
+	if (s->held) {
+		for (size_t i = 0; i < ZIPZOP_MCAST_HOLD; i++) {
+			free(s->held[i].frame);
+		}
+		free(s->held);
+		s->held = NULL;
+	}
+	s->held_count = 0;
+}
+
+/**
+ * @brief Tear a session down and tell the user.
+ *
+ * The memory is only released at the end of zipzop_poll(), so events already
+ * fetched for this session can still be looked at safely.
+ */
+static void session_fail(struct zipzop_session *s)
+{
+	if (s->state == ZIPZOP_CLOSED)
+		return;
+
+	s->state = ZIPZOP_CLOSED;
+
+	epoll_ctl(s->ctx->epfd, EPOLL_CTL_DEL, s->sockfd, NULL);
+	if (s->shm) {
+		epoll_ctl(s->ctx->epfd, EPOLL_CTL_DEL, shmchan_get_event_fd(s->shm), NULL);
+		shmchan_destroy(s->shm);
+		s->shm = NULL;
+	}
+	leave_group(s);
+	close(s->sockfd);
+	if (s->upload_fd != -1) {
+		close(s->upload_fd);
+		s->upload_fd = -1;
+	}
+
+	s->next_dead 	= s->ctx->dead;
+	s->ctx->dead 	= s;
+
+	if (s->cb.on_close)
+		s->cb.on_close(s, s->arg);
+}
+
+/**
+ * @brief Make sure the output buffer can take @p len more bytes.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+static int outbuf_reserve(struct zipzop_session *s, size_t len)
+{
+	if (s->out_len + len > ZIPZOP_OUTBUF_MAX) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (s->out_len + len > s->out_cap) {
+		size_t cap = s->out_cap ? s->out_cap : ZIPZOP_BATCH_BYTES;
+		while (cap < s->out_len + len)
+			cap *= 2;
+
+		char *tmp = realloc(s->outbuf, cap);
+		if (!tmp)
+			return -1;
+		s->outbuf 	= tmp;
+		s->out_cap 	= cap;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Move as many frames of the output buffer to the ring as it takes.
+ *
+ * If the ring is full, the server writes the channel eventfd once it made room,
+ * and drain_shm() calls this again.
+ *
+ * @return @c 0 in case of success, @c -1 if the session was closed.
+ */
+static int ring_flush(struct zipzop_session *s)
+{
+	size_t off = 0;
+
+	while (off < s->out_len) {
+		struct frame f;
+		ssize_t flen = frame_parse(s->outbuf + off, s->out_len - off, &f);
+		char *rec = flen > 0 ? shmchan_try_reserve(s->shm, flen) : NULL;
+		if (!rec && flen > 0 && errno == EAGAIN)
+			break;
+		if (!rec) {
+			session_fail(s);
+			return -1;
+		}
+		memcpy(rec, s->outbuf + off, flen);
+		if (shmchan_commit(s->shm, flen) == -1) {
+			session_fail(s);
+			return -1;
+		}
+		off += flen;
+	}
+
+	s->out_len -= off;
+	memmove(s->outbuf, s->outbuf + off, s->out_len);
+
+	/* The socket is always writable, so an upload only goes on while the ring has room */
+	bool want_write = s->out_len == 0 && s->upload_fd != -1;
+	if (want_write != s->want_write)
+		watch_socket(s, want_write);
+
+	return 0;
+}
+
+/**
+ * @brief Write as much of the output buffer as the socket, or the ring, takes.
+ *
+ * @return @c 0 in case of success, @c -1 if the session was closed.
+ */
+static int session_flush(struct zipzop_session *s)
+{
+	size_t off = 0;
+
+	if (s->shm)
+		return ring_flush(s);
+
+	while (off < s->out_len) {
+		ssize_t n = send(s->sockfd, s->outbuf + off, s->out_len - off, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			session_fail(s);
+			return -1;
+		}
+		off += n;
+	}
+
+	s->out_len -= off;
+	memmove(s->outbuf, s->outbuf + off, s->out_len);
+
+	/* An upload goes on as long as the socket is writable, see pump_upload() */
+	bool want_write = s->out_len > 0 || s->upload_fd != -1;
+	if (want_write != s->want_write && s->state != ZIPZOP_CONNECTING)
+		watch_socket(s, want_write);
+
+	return 0;
+}
+
+/**
+ * @brief Make room for a frame of @p len bytes, in the ring or in the output buffer.
+ *
+ * A frame only goes straight into the ring if none waits before it; when the
+ * ring is full, it waits in the output buffer like it would for the socket.
+ *
+ * @return Where to write the frame, NULL if there is no room now.
+ */
+static char *frame_reserve(struct zipzop_session *s, size_t len)
+{
+	if (s->shm && s->out_len == 0) {
+		char *rec = shmchan_try_reserve(s->shm, len);
+		if (rec || errno != EAGAIN) {
+			s->in_ring = rec != NULL;
+			return rec;
+		}
+	}
+
+	s->in_ring = false;
+	if (outbuf_reserve(s, len) == -1)
+		return NULL;
+
+	return s->outbuf + s->out_len;
+}
+
+/**
+ * @brief Queue the frame written where frame_reserve() said.
+ *
+ * The frame may be shorter than the room reserved for it.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+static int frame_commit(struct zipzop_session *s, size_t len)
+{
+	if (s->in_ring)
+		return shmchan_commit(s->shm, len);
+
+	s->out_len += len;
+
+	return 0;
+}
+
+/**
+ * @brief Queue the next chunks of the upload.
+ *
+ * Called whenever the socket is writable, and queues about @c ZIPZOP_BATCH_BYTES
+ * each time, so messages sent meanwhile only wait behind a few chunks. On shared
+ * memory the socket is always writable, so this runs on every zipzop_poll()
+ * until the upload is over, or until the ring fills up; see ring_flush().
+ */
+static void pump_upload(struct zipzop_session *s)
+{
+	size_t queued = 0;
+
+	while (s->upload_fd != -1 && queued < ZIPZOP_BATCH_BYTES && (s->shm ? s->out_len == 0 : s->out_len < ZIPZOP_BATCH_BYTES)) {
+		size_t len = s->upload_left < FRAME_FILE_CHUNK ? s->upload_left : FRAME_FILE_CHUNK;
+		size_t flen = frame_header_len(0) + FRAME_FILE_ID_LEN + len;
+		char *buf = frame_reserve(s, flen);
+		if (!buf)
+			break;
+
+		ssize_t n = len ? read(s->upload_fd, buf + flen - len, len) : 0;
+		if (n > 0) {
+			frame_write_file_header(buf, FRAME_FILE_DATA, s->upload_id, n);
+			s->upload_left -= n;
+		} else {
+			/* Over, or the file got shorter: the server drops what it got then */
+			n = 0;
+			frame_write_file_header(buf, FRAME_FILE_END, s->upload_id, 0);
+			close(s->upload_fd);
+			s->upload_fd = -1;
+		}
+		/* A short read makes a shorter frame than reserved */
+		if (frame_commit(s, flen - len + n) == -1) {
+			session_fail(s);
+			return;
+		}
+		queued += flen - len + n;
+	}
+}
+
+/**
+ * @brief Hand the presence records of a frame to the user.
+ *
+ * A member list may span several consecutive frames; the first of them resets the list.
+ */
+static void deliver_presence(struct zipzop_session *s, const struct frame *f, bool new_list)
+{
+	if (new_list && s->cb.on_presence)
+		s->cb.on_presence(s, ZIPZOP_MEMBERS_RESET, NULL, s->arg);
+
+	const char *p 	= f->payload;
+	const char *end = f->payload + f->payload_len;
+	const char *nul;
+
+	while (p < end && s->state == ZIPZOP_READY && (nul = memchr(p, '\0', end - p))) {
+		enum zipzop_presence kind = ZIPZOP_MEMBER;
+		const char *name = p;
+		if (f->type == FRAME_PRESENCE) {
+			kind = (*p == '+') ? ZIPZOP_JOINED : ZIPZOP_LEFT;
+			name++;
+		}
+		if (name <= nul && s->cb.on_presence)
+			s->cb.on_presence(s, kind, name, s->arg);
+		p = nul + 1;
+	}
+}
+
+/**
+ * @brief Hand the message of a chat frame to the user, unless it was already delivered.
+ */
+static void deliver_chat(struct zipzop_session *s, const struct frame *f)
+{
+	if (f->flags & FRAME_F_SEQ) {
+		if (f->seq <= s->last_seq)
+			return;
+		s->last_seq = f->seq;
+	}
+
+	struct message_view m;
+	if (message_view_decode(&m, f->payload, f->payload_len) == -1)
+		return;
+
+	s->trace = (f->flags & FRAME_F_TRACE) ? &f->trace : NULL;
+	if (s->cb.on_message)
+		s->cb.on_message(s, &m, s->arg);
+	s->trace = NULL;
+}
+
+/**
+ * @brief Queue a frame for the server on the connection, and write it out.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise.
+ */
+static int send_control(struct zipzop_session *s, const char *frame, size_t len)
+{
+	if (outbuf_reserve(s, len) == -1)
+		return -1;
+
+	memcpy(s->outbuf + s->out_len, frame, len);
+	s->out_len += len;
+
+	return session_flush(s);
+}
+
+/**
+ * @brief Ask the server for the range of messages noted by ask_missed().
+ *
+ * One range is asked for at a time, so the answers cannot overtake each other:
+ * the next one is sent once the server answered the last one.
+ *
+ * @return @c 0 in case of success, @c -1 if it must be tried again later.
+ */
+static int send_asks(struct zipzop_session *s)
+{
+	char frame[FRAME_HEADER_LEN + 2 * sizeof(uint64_t)];
+
+	if (!s->ask_first || s->asking)
+		return 0;
+	if (send_control(s, frame, frame_write_replay(frame, s->ask_first, s->ask_last)) == -1)
+		return -1;
+	s->ask_first 	= 0;
+	s->asking 		= true;
+
+	return 0;
+}
+
+/**
+ * @brief Note the messages of the group missed up to @p upto, but those held or asked for already.
+ *
+ * They are asked for by send_asks(), in as few ranges as possible: a burst of
+ * datagrams lost, or too far ahead to be held, makes a single request.
+ */
+static void ask_missed(struct zipzop_session *s, uint64_t upto)
+{
+	uint64_t first = (s->mcast_asked > s->last_seq ? s->mcast_asked : s->last_seq) + 1;
+	if (upto < first)
+		return;
+
+	/* A range that cannot be sent yet takes in what lies between, duplicates are dropped anyway */
+	if (s->ask_first && first != s->ask_last + 1)
+		send_asks(s);
+	if (!s->ask_first)
+		s->ask_first = first;
+	s->ask_last 	= upto;
+	s->mcast_asked 	= upto;
+}
+
+/**
+ * @brief Keep a copy of a message of the group until the ones before it arrive.
+ *
+ * @return @c 0 in case of success, @c -1 if it is too far ahead or out of memory.
+ */
+static int hold_frame(struct zipzop_session *s, uint64_t seq, const char *frame, size_t len)
+{
+	if (!s->held || seq - s->last_seq > ZIPZOP_MCAST_HOLD)
+		return -1;
+
+	/* Within the window, a slot is only taken by this very message, or by one delivered already */
+	struct zipzop_held *h = &s->held[seq % ZIPZOP_MCAST_HOLD];
+	if (h->frame) {
+		if (h->seq == seq)
+			return 0;
+		free(h->frame);
+		s->held_count--;
+	}
+
+	h->frame = malloc(len);
+	if (!h->frame)
+		return -1;
+	memcpy(h->frame, frame, len);
+	h->seq = seq;
+	h->len = len;
+	s->held_count++;
+
+	return 0;
+}
+
+/**
+ * @brief Deliver the messages held that are next in order.
+ *
+ * Messages up to @p upto that are neither held nor delivered are lost for good, and skipped.
+ */
+static void release_held(struct zipzop_session *s, uint64_t upto)
+{
+	while (s->held_count && s->state == ZIPZOP_READY) {
+		uint64_t next = s->last_seq + 1;
+		struct zipzop_held *h = &s->held[next % ZIPZOP_MCAST_HOLD];
+
+		if (h->frame && h->seq == next) {
+			/* Out of the slot first, the user may close the session meanwhile */
+			char *frame = h->frame;
+			size_t len 	= h->len;
+			h->frame 	= NULL;
+			s->held_count--;
+
+			struct frame f;
+			if (frame_parse(frame, len, &f) > 0)
+				deliver_chat(s, &f);
+			free(frame);
+			s->last_seq = next;
+		} else if (next <= upto) {
+			s->last_seq = next;
+		} else {
+			break;
+		}
+	}
+
+	if (s->last_seq < upto)
+		s->last_seq = upto;
+}
+
+/**
+ * @brief Tell the server the group cannot be received, so it sends the room over the connection again.
+ */
+static void decline_group(struct zipzop_session *s)
+{
+	char frame[FRAME_HEADER_LEN + FRAME_SEQ_LEN];
+
+	send_control(s, frame, frame_write_header(frame, FRAME_MCAST, FRAME_F_SEQ, 0, s->last_seq, NULL));
+}
+
+/**
+ * @brief Join the multicast group a @c FRAME_MCAST frame names, or leave it.
+ *
+ * Messages up to the sequence number of the frame came over the connection, those
+ * after it go to the group, or the other way round when leaving. What the group
+ * did not deliver by then is asked for again before leaving.
+ */
+static void switch_group(struct zipzop_session *s, const struct frame *f)
+{
+	uint32_t group;
+	uint16_t port;
+
+	if (frame_parse_mcast(f, &group, &port) == -1 || !(f->flags & FRAME_F_SEQ)) {
+		decline_group(s);
+		return;
+	}
+
+	if (!group) {
+		ask_missed(s, f->seq);
+		send_asks(s);
+		leave_group(s);
+		return;
+	}
+
+	if (s->mcast_fd != -1)
+		return;
+
+	s->held 	= calloc(ZIPZOP_MCAST_HOLD, sizeof(struct zipzop_held));
+	s->mcast_fd = s->held ? mcast_open_receiver(group, port, s->sockfd) : -1;
+
+	struct epoll_event ev;
+	ev.events 	= EPOLLIN;
+	ev.data.ptr = &s->mcast_watch;
+	if (s->mcast_fd == -1 || epoll_ctl(s->ctx->epfd, EPOLL_CTL_ADD, s->mcast_fd, &ev) == -1) {
+		leave_group(s);
+		decline_group(s);
+		return;
+	}
+	s->mcast_asked 	= f->seq;
+	s->ask_first 	= 0;
+	s->asking 		= false;
+}
+
+/**
+ * @brief Parse the whole frames at the start of a buffer and hand them to the user.
+ *
+ * The payload of a chat frame from the server is a packed message: content and 
+ * sender, both @c NUL terminated. Sequenced messages already delivered, which a
+ * resumed session may get again, are dropped. Session frames are kept for
+ * zipzop_resume(), presence and member list frames go to @c on_presence, file
+ * frames to @c on_file, frames of other types are skipped. A malformed frame
+ * closes the session, and so does a goodbye from the server, see zipzop_is_ended().
+ *
+ * Messages held from the multicast group go first when a message of the connection
+ * follows them, or when the server says a replay is over; the part of a range it
+ * did not send yet is asked for again.
+ *
+ * @return The number of bytes consumed.
+ *
+ * @see message_view_decode
+ */
+static size_t deliver_frames(struct zipzop_session *s, const char *buf, size_t len)
+{
+	size_t off = 0;
+
+	while (s->state == ZIPZOP_READY) {
+		struct frame f;
+		ssize_t flen = frame_parse(buf + off, len - off, &f);
+		if (flen == 0)
+			break;
+		if (flen == -1) {
+			session_fail(s);
+			break;
+		}
+		off += flen;
+
+		bool new_list = f.type == FRAME_MEMBERS && !s->in_members;
+		s->in_members = f.type == FRAME_MEMBERS;
+
+		if (f.type == FRAME_PRESENCE || f.type == FRAME_MEMBERS) {
+			deliver_presence(s, &f, new_list);
+			continue;
+		}
+
+		if (f.type == FRAME_FILE_BEGIN || f.type == FRAME_FILE_DATA || f.type == FRAME_FILE_END) {
+			struct frame_file ff;
+			if (frame_parse_file(&f, &ff) == 0 && s->cb.on_file) {
+				enum zipzop_file_event ev = f.type == FRAME_FILE_BEGIN ? ZIPZOP_FILE_BEGIN
+						: f.type == FRAME_FILE_DATA ? ZIPZOP_FILE_DATA : ZIPZOP_FILE_END;
+				s->cb.on_file(s, ev, &ff, s->arg);
+			}
+			continue;
+		}
+
+		if (f.type == FRAME_BYE) {
+			/* Everything the server had for the session came before */
+			s->ended = true;
+			session_fail(s);
+			break;
+		}
+
+		if (f.type == FRAME_BUSY) {
+			uint32_t retry_after;
+			s->retry_after = frame_parse_busy(&f, &retry_after) == 0 && retry_after ? retry_after : 1;
+			session_fail(s);
+			break;
+		}
+
+		if (f.type == FRAME_SESSION) {
+			const char *resumed = memchr(f.payload, '\0', f.payload_len);
+			if (resumed && resumed - f.payload <= ZIPZOP_TOKEN_LEN) {
+				memcpy(s->token, f.payload, resumed - f.payload + 1);
+				s->resumed = resumed + 1 < f.payload + f.payload_len && resumed[1] == '1';
+			}
+			continue;
+		}
+
+		if (f.type == FRAME_MCAST) {
+			switch_group(s, &f);
+			continue;
+		}
+
+		if (f.type == FRAME_REPLAY) {
+			uint64_t first, last;
+			if (!(f.flags & FRAME_F_SEQ))
+				continue;
+			s->asking = false;
+			release_held(s, f.seq);
+			/* Only part of the range was sent, the rest is asked for first */
+			if (frame_parse_replay(&f, &first, &last) == 0 && f.seq >= first && f.seq < last) {
+				if (!s->ask_first)
+					s->ask_last = last;
+				s->ask_first = f.seq + 1;
+			}
+			send_asks(s);
+			continue;
+		}
+
+		if (f.type != FRAME_CHAT)
+			continue;
+
+		if (s->held_count && (f.flags & FRAME_F_SEQ) && f.seq > s->last_seq + 1)
+			release_held(s, f.seq - 1);
+		deliver_chat(s, &f);
+		if (s->held_count)
+			release_held(s, 0);
+	}
+
+	return off;
+}
+
+/**
+ * @brief Deliver every record waiting on the shared-memory channel.
+ */
+static void drain_shm(struct zipzop_session *s)
+{
+	shmchan_disarm(s->shm);
+
+	do {
+		const void *rec;
+		size_t len;
+		while (s->state == ZIPZOP_READY && (rec = shmchan_peek(s->shm, &len))) {
+			deliver_frames(s, rec, len);
+			shmchan_release(s->shm);
+		}
+		if (s->state == ZIPZOP_READY && shmchan_is_broken(s->shm)) {
+			session_fail(s);
+			return;
+		}
+	} while (s->state == ZIPZOP_READY && !shmchan_arm(s->shm));
+
+	/* The eventfd also tells the server made room for frames waiting */
+	if (s->state == ZIPZOP_READY && s->out_len)
+		session_flush(s);
+}
+
+/**
+ * @brief Read everything available on the socket and deliver the complete frames.
+ */
+static void read_socket(struct zipzop_session *s)
+{
+	while (s->state == ZIPZOP_READY) {
+		if (s->in_len == ZIPZOP_INBUF_LEN) {
+			/* A frame that does not fit the buffer can only be garbage */
+			session_fail(s);
+			return;
+		}
+
+		ssize_t n = recv(s->sockfd, s->inbuf + s->in_len, ZIPZOP_INBUF_LEN - s->in_len, 0);
+		if (n == 0) {
+			session_fail(s);
+			return;
+		}
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				session_fail(s);
+			return;
+		}
+
+		s->in_len += n;
+		size_t used = deliver_frames(s, s->inbuf, s->in_len);
+		s->in_len -= used;
+		memmove(s->inbuf, s->inbuf + used, s->in_len);
+	}
+}
+
+/**
+ * @brief Deliver a message of the group in order, holding it if some before it are missing.
+ */
+static void group_message(struct zipzop_session *s, const struct frame *f, const char *frame, size_t len)
+{
+	if (f->seq <= s->last_seq)
+		return;
+
+	if (f->seq == s->last_seq + 1) {
+		deliver_chat(s, f);
+		release_held(s, 0);
+		return;
+	}
+
+	/* The missing ones come over the connection; if this one cannot wait for them, it comes too */
+	if (hold_frame(s, f->seq, frame, len) == -1) {
+		ask_missed(s, f->seq);
+	} else {
+		ask_missed(s, f->seq - 1);
+		s->mcast_asked = f->seq;
+	}
+}
+
+/**
+ * @brief Read every datagram of the group and deliver its messages.
+ *
+ * A heartbeat carries the last message sent to the group, for those missing the end of a burst.
+ * What is missing is asked for once they are all read.
+ */
+static void read_group(struct zipzop_session *s)
+{
+	char buf[FRAME_MAX_LEN];
+
+	while (s->state == ZIPZOP_READY && s->mcast_fd != -1) {
+		ssize_t n = recv(s->mcast_fd, buf, sizeof(buf), 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		/* A datagram holds whole frames, anything else in it is dropped */
+		size_t off = 0;
+		while (s->state == ZIPZOP_READY && s->mcast_fd != -1) {
+			struct frame f;
+			ssize_t flen = frame_parse(buf + off, n - off, &f);
+			if (flen <= 0)
+				break;
+
+			if (f.type == FRAME_CHAT && (f.flags & FRAME_F_SEQ))
+				group_message(s, &f, buf + off, flen);
+			else if (f.type == FRAME_MCAST && (f.flags & FRAME_F_SEQ))
+				ask_missed(s, f.seq);
+			off += flen;
+		}
+	}
+
+	if (s->state == ZIPZOP_READY)
+		send_asks(s);
+}
+
+/**
+ * @brief Read the handshake answer and move to the ready state.
+ */
+static void finish_handshake(struct zipzop_session *s)
+{
+	struct shmchan *shm = shmchan_recv_fds(s->sockfd);
+	if (!shm) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return;
+		if (errno != ENOTSUP) {
+			session_fail(s);
+			return;
+		}
+	}
+
+	s->state = ZIPZOP_READY;
+
+	if (shm) {
+		struct epoll_event ev;
+		ev.events 	= EPOLLIN;
+		ev.data.ptr = &s->shm_watch;
+		if (epoll_ctl(s->ctx->epfd, EPOLL_CTL_ADD, shmchan_get_event_fd(shm), &ev) == -1) {
+			perror("epoll_ctl()");
+			shmchan_destroy(shm);
+			session_fail(s);
+			return;
+		}
+		s->shm = shm;
+		shmchan_arm(shm);
+	}
+
+	if (s->cb.on_connect)
+		s->cb.on_connect(s, s->arg);
+}
+
+/**
+ * @brief Handle the events reported on the session socket.
+ */
+static void handle_socket(struct zipzop_session *s, uint32_t events)
+{
+	if (s->state == ZIPZOP_CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(s->sockfd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+			session_fail(s);
+			return;
+		}
+		/* The handshake is already in the output buffer */
+		s->state = ZIPZOP_HANDSHAKE;
+		watch_socket(s, true);
+		session_flush(s);
+		return;
+	}
+
+	if (s->state == ZIPZOP_HANDSHAKE && (events & EPOLLIN)) {
+		finish_handshake(s);
+		if (s->shm && s->state == ZIPZOP_READY)
+			drain_shm(s);
+	}
+
+	if (s->state == ZIPZOP_READY && (events & EPOLLIN)) {
+		if (s->shm) {
+			/* Nothing is expected on the socket once the rings are in use, so this is the server leaving */
+			char byte;
+			if (recv(s->sockfd, &byte, 1, MSG_DONTWAIT) != -1 || (errno != EAGAIN && errno != EWOULDBLOCK))
+				session_fail(s);
+		} else {
+			read_socket(s);
+		}
+	}
+
+	if (s->state != ZIPZOP_CLOSED && (events & EPOLLOUT)) {
+		session_flush(s);
+		if (s->state == ZIPZOP_READY && s->upload_fd != -1) {
+			pump_upload(s);
+			session_flush(s);
+		}
+	}
+
+	if (s->state != ZIPZOP_CLOSED && (events & (EPOLLHUP | EPOLLERR)))
+		session_fail(s);
+}
+
+/**
+ * @brief Write the batched output of every dirty session, but that of sessions with a flush interval not over yet.
+ *
+ * @return Milliseconds until the first of those intervals is over, @c -1 if there are none.
+ */
+static int flush_dirty_sessions(struct zipzop_ctx *ctx)
+{
+	struct zipzop_session *s, *keep = NULL;
+	uint64_t now = 0;
+	int wait = -1;
+
+	while ((s = ctx->dirty)) {
+		ctx->dirty = s->next_dirty;
+
+		if (s->flush_ms && s->state == ZIPZOP_READY) {
+			if (!now)
+				now = frame_now() / 1000000;
+			uint64_t due = s->dirty_since + s->flush_ms;
+			if (due > now) {
+				s->next_dirty 	= keep;
+				keep 			= s;
+				if (wait == -1 || due - now < (uint64_t)wait)
+					wait = due - now;
+				continue;
+			}
+		}
+
+		s->dirty = false;
+		if (s->state == ZIPZOP_READY)
+			session_flush(s);
+	}
+	ctx->dirty = keep;
+
+	return wait;
+}
+
+/**
+ * @brief Drive all the sessions of a context.
+ *
+ * Flushes batched output, waits up to @p timeout_ms for I/O and then runs the
+ * callbacks for whatever happened.
+ *
+ * @param[in] ctx The context.
+ * @param[in] timeout_ms How long to wait, as in @c epoll_wait(): @c 0 returns at once, @c -1 waits forever.
+ *
+ * @return The number of descriptors that had events, @c -1 on error.
+ */
+int zipzop_poll(struct zipzop_ctx *ctx, int timeout_ms)
+{
+	struct epoll_event events[ZIPZOP_MAX_EVENTS];
+
+	/* Output held back by a flush interval must not wait for more than the interval */
+	int wait = flush_dirty_sessions(ctx);
+	if (wait != -1 && (timeout_ms == -1 || wait < timeout_ms))
+		timeout_ms = wait;
+
+	int n = epoll_wait(ctx->epfd, events, ZIPZOP_MAX_EVENTS, timeout_ms);
+	if (n == -1) {
+		if (errno == EINTR)
+			return 0;
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++) {
+		struct zipzop_watch *w = events[i].data.ptr;
+		if (w->s->state == ZIPZOP_CLOSED)
+			continue;
+
+		if (w->kind == ZIPZOP_WATCH_SOCKET)
+			handle_socket(w->s, events[i].events);
+		else if (w->kind == ZIPZOP_WATCH_MCAST)
+			read_group(w->s);
+		else
+			drain_shm(w->s);
+	}
+
+	flush_dirty_sessions(ctx);
+	free_dead_sessions(ctx);
+
+	return n;
+}
+
+/**
+ * @brief Start a non-blocking connection to a server.
+ *
+ * A server name containing a @c '/' is taken as the path of the server Unix domain socket.
+ *
+ * @return The socket in case of success, @c -1 otherwise.
+ */
+static int start_connect(const char *server)
+{
+	if (strchr(server, '/')) {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, server, sizeof(addr.sun_path) - 1);
+
+		int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (sockfd == -1)
+			return -1;
+		if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS) {
+			close(sockfd);
+			return -1;
+		}
+		return sockfd;
+	}
+
+	struct addrinfo hints, *servinfo;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family 	= AF_UNSPEC;
+	hints.ai_socktype 	= SOCK_STREAM;
+
+	int rv;
+	if ((rv = getaddrinfo(server, ZIPZOP_PORT, &hints, &servinfo)) != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		return -1;
+	}
+
+	int sockfd = -1;
+	/* Iterate through all the list of server addresses, and use the first one that does not fail right away */
+	for (struct addrinfo *p = servinfo; p != NULL; p = p->ai_next) {
+		sockfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+		if (sockfd == -1)
+			continue;
+		if (connect(sockfd, p->ai_addr, p->ai_addrlen) == 0 || errno == EINPROGRESS)
+			break;
+		close(sockfd);
+		sockfd = -1;
+	}
+
+	freeaddrinfo(servinfo);
+
+	return sockfd;
+}
+
+/**
+ * @brief Open a session, asking the server to resume an earlier one if @p token is not NULL.
+ *
+ * @see zipzop_connect
+ * @see zipzop_resume
+ */
+static struct zipzop_session *session_open(struct zipzop_ctx *ctx, const char *server, const char *name,
+		const char *token, uint64_t last_seq, int flags, const struct zipzop_callbacks *cb, void *arg)
+{
+	/* The handshake options, all of them NUL terminated */
+	char opts[sizeof(SHMCHAN_HANDSHAKE_OPT) + sizeof(MCAST_HANDSHAKE_OPT) + ZIPZOP_TOKEN_LEN + 64];
+	size_t opts_len = 0;
+	if (flags & ZIPZOP_SHM) {
+		memcpy(opts, SHMCHAN_HANDSHAKE_OPT, sizeof(SHMCHAN_HANDSHAKE_OPT));
+		opts_len += sizeof(SHMCHAN_HANDSHAKE_OPT);
+	}
+	if (flags & ZIPZOP_MCAST) {
+		memcpy(opts + opts_len, MCAST_HANDSHAKE_OPT, sizeof(MCAST_HANDSHAKE_OPT));
+		opts_len += sizeof(MCAST_HANDSHAKE_OPT);
+	}
+	if (token) {
+		if (strlen(token) > ZIPZOP_TOKEN_LEN) {
+			errno = EINVAL;
+			return NULL;
+		}
+		opts_len += sprintf(opts + opts_len, "resume=%s", token) + 1;
+		opts_len += sprintf(opts + opts_len, "seq=%llu", (unsigned long long)last_seq) + 1;
+	}
+
+	struct zipzop_session *s = calloc(1, sizeof(struct zipzop_session));
+	if (!s)
+		return NULL;
+
+	s->ctx 	 = ctx;
+	s->flags = flags;
+	s->arg 	 = arg;
+	s->name  = strdup(name);
+	if (cb)
+		s->cb = *cb;
+	s->sock_watch.s 	= s;
+	s->sock_watch.kind 	= ZIPZOP_WATCH_SOCKET;
+	s->shm_watch.s 		= s;
+	s->shm_watch.kind 	= ZIPZOP_WATCH_SHM;
+	s->mcast_watch.s 	= s;
+	s->mcast_watch.kind = ZIPZOP_WATCH_MCAST;
+	s->mcast_fd 		= -1;
+	s->last_seq 		= last_seq;
+	s->upload_fd 		= -1;
+
+	/* The handshake: the name followed by the options */
+	size_t name_len = strlen(name) + 1;
+	if (!s->name || outbuf_reserve(s, name_len + opts_len) == -1) {
+		free(s->name);
+		free(s->outbuf);
+		free(s);
+		return NULL;
+	}
+	memcpy(s->outbuf, name, name_len);
+	memcpy(s->outbuf + name_len, opts, opts_len);
+	s->out_len = name_len + opts_len;
+
+	s->sockfd = start_connect(server);
+
+	struct epoll_event ev;
+	ev.events 	= EPOLLOUT;
+	ev.data.ptr = &s->sock_watch;
+	if (s->sockfd == -1 || epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, s->sockfd, &ev) == -1) {
+		if (s->sockfd != -1)
+			close(s->sockfd);
+		free(s->name);
+		free(s->outbuf);
+		free(s);
+		return NULL;
+	}
+	s->state = ZIPZOP_CONNECTING;
+
+	s->next = ctx->all;
+	if (ctx->all)
+		ctx->all->prev = s;
+	ctx->all = s;
+
+	return s;
+}
+
+/**
+ * @brief Open a session with a server.
+ *
+ * The connection and the handshake happen asynchronously while zipzop_poll() is
+ * called; @c on_connect tells when the session is ready, and @c on_close when it
+ * failed or ended.
+ *
+ * @param[in] ctx The context that will drive the session.
+ * @param[in] server The server address, or the path of its Unix domain socket.
+ * @param[in] name The username.
+ * @param[in] flags @c ZIPZOP_SHM, @c ZIPZOP_MCAST, both or @c 0.
+ * @param[in] cb The callbacks; copied into the session.
+ * @param[in] arg The argument given to the callbacks.
+ *
+ * @return A pointer to the session in case of success, NULL otherwise.
+ */
+struct zipzop_session *zipzop_connect(struct zipzop_ctx *ctx, const char *server, const char *name,
+		int flags, const struct zipzop_callbacks *cb, void *arg)
+{
+	return session_open(ctx, server, name, NULL, 0, flags, cb, arg);
+}
+
+/**
+ * @brief Open a session that takes over one whose connection dropped.
+ *
+ * The server keeps a dropped session for @c ZIPZOP_RESUME_WINDOW seconds; within that
+ * window it hands the new session the messages that came after @p last_seq, and the
+ * room is not told the user left. After it, or with an unknown token, the server
+ * starts a fresh session, as zipzop_is_resumed() tells once connected.
+ *
+ * @param[in] ctx The context that will drive the session.
+ * @param[in] server The server address, or the path of its Unix domain socket.
+ * @param[in] name The username.
+ * @param[in] token The token of the dropped session, see zipzop_get_token().
+ * @param[in] last_seq The last message the dropped session got, see zipzop_get_last_seq().
+ * @param[in] flags @c ZIPZOP_SHM, @c ZIPZOP_MCAST, both or @c 0.
+ * @param[in] cb The callbacks; copied into the session.
+ * @param[in] arg The argument given to the callbacks.
+ *
+ * @return A pointer to the session in case of success, NULL otherwise.
+ *
+ * @see zipzop_connect
+ */
+struct zipzop_session *zipzop_resume(struct zipzop_ctx *ctx, const char *server, const char *name,
+		const char *token, uint64_t last_seq, int flags, const struct zipzop_callbacks *cb, void *arg)
+{
+	return session_open(ctx, server, name, token, last_seq, flags, cb, arg);
+}
+
+/**
+ * @brief Write a chat frame carrying @p msg at @p buf.
+ *
+ * @return The frame length.
+ */
+static size_t write_chat_frame(char *buf, uint8_t flags, const char *msg, size_t len)
+{
+	struct frame_trace t;
+	memset(&t, 0, sizeof(t));
+	if (flags & FRAME_F_TRACE)
+		t.client_send = frame_now();
+
+	size_t hlen = frame_header_len(flags);
+	frame_write_header(buf, FRAME_CHAT, flags, len + 1, 0, &t);
+	memcpy(buf + hlen, msg, len);
+	buf[hlen + len] = '\0';
+
+	return hlen + len + 1;
+}
+
+/**
+ * @brief Send a message.
+ *
+ * Messages are batched: they are written by the next zipzop_poll() or zipzop_flush(),
+ * or right away once @c ZIPZOP_BATCH_BYTES are pending. On shared memory each
+ * message goes straight into the ring, unless the ring is full: it then waits
+ * with the ones behind it until the server made room, without blocking.
+ *
+ * @param[in] s The session.
+ * @param[in] msg The message content; it does not need to be @c NUL terminated.
+ * @param[in] len The content length.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise, with @c errno set to
+ * @c ENOTCONN if the session is not ready, @c EMSGSIZE if the message is longer
+ * than @c ZIPZOP_MESSAGE_LEN or @c EAGAIN if too much output is pending.
+ *
+ * @see zipzop_set_trace
+ */
+int zipzop_send(struct zipzop_session *s, const char *msg, size_t len)
+{
+	if (s->state != ZIPZOP_READY) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	if (len + 1 > ZIPZOP_MESSAGE_LEN) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	uint8_t flags = 0;
+	if (s->trace_every && ++s->trace_tick >= s->trace_every) {
+		s->trace_tick = 0;
+		flags |= FRAME_F_TRACE;
+	}
+	size_t flen = frame_header_len(flags) + len + 1;
+
+	char *buf = frame_reserve(s, flen);
+	if (!buf)
+		return -1;
+	if (frame_commit(s, write_chat_frame(buf, flags, msg, len)) == -1)
+		return -1;
+
+	/* Frames waiting for the ring go once the server makes room, see drain_shm() */
+	if (s->shm)
+		return 0;
+
+	if (s->out_len >= ZIPZOP_BATCH_BYTES)
+		return session_flush(s);
+
+	if (!s->dirty) {
+		s->dirty 			= true;
+		s->dirty_since 		= s->flush_ms ? frame_now() / 1000000 : 0;
+		s->next_dirty 		= s->ctx->dirty;
+		s->ctx->dirty 		= s;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Only get the messages containing one of some keywords.
+ *
+ * Right after zipzop_connect() or zipzop_resume() the filter goes with the
+ * handshake, so not even the replayed messages are sent unfiltered; once the
+ * session is ready it is sent as a @c /filter command.
+ *
+ * @param[in] s The session.
+ * @param[in] expr The keywords, separated by blanks, case ignored; NULL or none to get every message.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise, with @c errno set to
+ * @c EMSGSIZE if @p expr is longer than @c ZIPZOP_FILTER_LEN, or @c ENOTCONN
+ * during the handshake.
+ */
+int zipzop_set_filter(struct zipzop_session *s, const char *expr)
+{
+	char cmd[ZIPZOP_FILTER_LEN + 16];
+	size_t len = expr ? strlen(expr) : 0;
+
+	if (len > ZIPZOP_FILTER_LEN) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if (s->state == ZIPZOP_CONNECTING) {
+		/* The handshake is all there is in the output buffer, one more option goes after it */
+		if (len == 0)
+			return 0;
+		int n = snprintf(cmd, sizeof(cmd), "filter=%s", expr) + 1;
+		if (outbuf_reserve(s, n) == -1)
+			return -1;
+		memcpy(s->outbuf + s->out_len, cmd, n);
+		s->out_len += n;
+		return 0;
+	}
+
+	int n = snprintf(cmd, sizeof(cmd), "/filter%s%s", len ? " " : "", len ? expr : "");
+
+	return zipzop_send(s, cmd, n);
+}
+
+/**
+ * @brief Upload a file, for the rest of the room to download.
+ *
+ * The file is read and sent a chunk at a time while zipzop_poll() is called, with
+ * the messages sent meanwhile going out between the chunks. Once the server has
+ * all of it, the room is told how to get it. If the session closes first, the
+ * upload is lost.
+ *
+ * @param[in] s The session.
+ * @param[in] path The file.
+ *
+ * @return @c 0 in case of success, @c -1 otherwise, with @c errno set to
+ * @c ENOTCONN if the session is not ready or @c EBUSY if an upload is going on.
+ */
+int zipzop_send_file(struct zipzop_session *s, const char *path)
+{
+	if (s->state != ZIPZOP_READY) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	if (s->upload_fd != -1) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return -1;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	const char *name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	size_t nlen = strnlen(name, FRAME_MAX_PAYLOAD / 2) + 1;
+	uint64_t size = htobe64(st.st_size);
+
+	size_t flen = frame_header_len(0) + FRAME_FILE_ID_LEN + sizeof(size) + nlen;
+	char *buf = frame_reserve(s, flen);
+	if (!buf) {
+		close(fd);
+		return -1;
+	}
+	size_t hlen = frame_write_file_header(buf, FRAME_FILE_BEGIN, ++s->upload_id, sizeof(size) + nlen);
+	memcpy(buf + hlen, &size, sizeof(size));
+	memcpy(buf + hlen + sizeof(size), name, nlen - 1);
+	buf[flen - 1] = '\0';
+	if (frame_commit(s, flen) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	s->upload_fd 	= fd;
+	s->upload_left 	= st.st_size;
+
+	return session_flush(s);
+}
+
+/**
+ * @brief Write the batched messages of a session now.
+ *
+ * @param[in] s The session.
+ *
+ * @return @c 0 in case of success, @c -1 if the session was closed.
+ */
+int zipzop_flush(struct zipzop_session *s)
+{
+	if (s->state != ZIPZOP_READY) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	return session_flush(s);
+}
+
+/**
+ * @brief Queue a goodbye for the server, if the session can still send one.
+ */
+static void send_bye(struct zipzop_session *s)
+{
+	if (s->state == ZIPZOP_READY) {
+		char *buf = frame_reserve(s, frame_header_len(0));
+		if (buf && frame_commit(s, frame_write_header(buf, FRAME_BYE, 0, 0, 0, NULL)) == 0)
+			session_flush(s);
+	}
+}
+
+/**
+ * @brief Tell the server the user is leaving for good, then close the session.
+ *
+ * Unlike a dropped connection, the session cannot be resumed afterwards, and the
+ * room is told right away that the user left.
+ *
+ * @param[in] s The session.
+ *
+ * @see zipzop_close
+ */
+void zipzop_bye(struct zipzop_session *s)
+{
+	send_bye(s);
+	zipzop_close(s);
+}
+
+/**
+ * @brief Tell the server the user is leaving for good, and let the server close the session.
+ *
+ * Unlike zipzop_bye(), nothing sent before is lost: closing a connection with
+ * messages left unread may make the system discard what the server did not read
+ * yet. Messages keep coming until the server closes the session, calling @c on_close.
+ *
+ * @param[in] s The session.
+ */
+void zipzop_finish(struct zipzop_session *s)
+{
+	send_bye(s);
+}
+
+/**
+ * @brief Close a session.
+ *
+ * @c on_close is called, and the session is freed by the next zipzop_poll().
+ *
+ * @param[in] s The session.
+ */
+void zipzop_close(struct zipzop_session *s)
+{
+	if (s)
+		session_fail(s);
+}
+
+/**
+ * @brief Get the session state.
+ *
+ * @param[in] s The session.
+ *
+ * @return The state.
+ */
+enum zipzop_state zipzop_get_state(struct zipzop_session *s)
+{
+	return s->state;
+}
+
+/**
+ * @brief Get the session username.
+ *
+ * @param[in] s The session.
+ *
+ * @return The username.
+ */
+const char *zipzop_get_name(struct zipzop_session *s)
+{
+	return s->name;
+}
+
+/**
+ * @brief Trace one in every @p every messages sent on the session.
+ *
+ * Traced frames carry the send time, and collect the server stamps on their way
+ * to the recipients. Tracing is off by default.
+ *
+ * @param[in] s The session.
+ * @param[in] every The sampling period, @c 1 to trace everything, @c 0 to turn tracing off.
+ *
+ * @see zipzop_get_trace
+ */
+void zipzop_set_trace(struct zipzop_session *s, unsigned every)
+{
+	s->trace_every 	= every;
+	s->trace_tick 	= 0;
+}
+
+/**
+ * @brief Let batched messages wait before being written, so more of them go in each write.
+ *
+ * Messages are batched by zipzop_send() until zipzop_poll() writes them; with an
+ * interval, zipzop_poll() only writes them once the first has waited that long.
+ * Either way, @c ZIPZOP_BATCH_BYTES of them are written at once.
+ *
+ * @param[in] s The session.
+ * @param[in] ms The interval in milliseconds, @c 0 to write at every zipzop_poll().
+ */
+void zipzop_set_flush_interval(struct zipzop_session *s, unsigned ms)
+{
+	s->flush_ms = ms;
+}
+
+/**
+ * @brief Get the number of bytes batched and not written yet.
+ *
+ * zipzop_send() fails with @c EAGAIN once they reach @c ZIPZOP_OUTBUF_MAX.
+ *
+ * @param[in] s The session.
+ *
+ * @return The number of bytes; over shared memory, those waiting for room in the ring.
+ */
+size_t zipzop_get_pending(struct zipzop_session *s)
+{
+	return s->out_len;
+}
+
+/**
+ * @brief Get the trace stamps of the message being delivered.
+ *
+ * Only meaningful inside the @c on_message callback.
+ *
+ * @param[in] s The session.
+ *
+ * @return The stamps, NULL if the message was not traced.
+ */
+const struct frame_trace *zipzop_get_trace(struct zipzop_session *s)
+{
+	return s->trace;
+}
+
+/**
+ * @brief Get the argument given to zipzop_connect().
+ *
+ * @param[in] s The session.
+ *
+ * @return The argument.
+ */
+void *zipzop_get_arg(struct zipzop_session *s)
+{
+	return s->arg;
+}
+
+/**
+ * @brief Get the token that lets zipzop_resume() take this session over.
+ *
+ * @param[in] s The session.
+ *
+ * @return The token, empty until the server sent it.
+ */
+const char *zipzop_get_token(struct zipzop_session *s)
+{
+	return s->token;
+}
+
+/**
+ * @brief Get the sequence number of the last message delivered.
+ *
+ * @param[in] s The session.
+ *
+ * @return The sequence number, @c 0 if none was delivered.
+ */
+uint64_t zipzop_get_last_seq(struct zipzop_session *s)
+{
+	return s->last_seq;
+}
+
+/**
+ * @brief Check if the server resumed the session asked for by zipzop_resume().
+ *
+ * @param[in] s The session.
+ *
+ * @return @c true if it did, @c false otherwise.
+ */
+bool zipzop_is_resumed(struct zipzop_session *s)
+{
+	return s->resumed;
+}
+
+/**
+ * @brief Get how long the server asked to wait before connecting again.
+ *
+ * A busy server refuses new sessions with this instead of serving them; the
+ * session is closed right after.
+ *
+ * @param[in] s The session.
+ *
+ * @return The number of seconds, @c 0 if the server was not busy.
+ */
+unsigned zipzop_get_retry_after(struct zipzop_session *s)
+{
+	return s->retry_after;
+}
+
+/**
+ * @brief Check if the server ended the session, because it is shutting down.
+ *
+ * The server says goodbye once everything it had for the session was sent, and
+ * the session is closed right after; there is nothing left to resume.
+ *
+ * @param[in] s The session.
+ *
+ * @return @c true if it did, @c false otherwise.
+ */
+bool zipzop_is_ended(struct zipzop_session *s)
+{
+	return s->ended;
+}
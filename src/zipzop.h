@@ -0,0 +1,124 @@
+#ifndef ZIPZOP_H
+#define ZIPZOP_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "message.h"
+#include "frame.h"
+
+/** @brief The port the zip-zop-server listens on. */
+#define ZIPZOP_PORT "1234"
+
+/** @brief Pending outbound bytes after which zipzop_send() flushes without waiting for zipzop_poll(). */
+#define ZIPZOP_BATCH_BYTES 16384
+
+/** @brief Maximum number of outbound bytes a session keeps queued before zipzop_send() refuses more. */
+#define ZIPZOP_OUTBUF_MAX (1 << 20)
+
+/** @brief Size of the per-session receive buffer; must hold at least @c FRAME_MAX_LEN bytes. */
+#define ZIPZOP_INBUF_LEN 8192
+
+/** @brief Flag for zipzop_connect(): talk through shared memory (Unix socket paths only). */
+#define ZIPZOP_SHM 0x1
+
+/** @brief Flag for zipzop_connect(): get the room from the multicast group of the server, if it has one (TCP only). */
+#define ZIPZOP_MCAST 0x2
+
+/** @brief Most messages from the multicast group held while the ones before them are asked for again. */
+#define ZIPZOP_MCAST_HOLD 1024
+
+/** @brief Length of a resume token, without the terminating @c NUL. */
+#define ZIPZOP_TOKEN_LEN 32
+
+/** @brief Longest message zipzop_send() accepts, terminating @c NUL included; the server drops longer ones. */
+#define ZIPZOP_MESSAGE_LEN 2000
+
+/** @brief Longest filter expression zipzop_set_filter() accepts. */
+#define ZIPZOP_FILTER_LEN 200
+
+/** @brief Seconds the server keeps a dropped session resumable. */
+#define ZIPZOP_RESUME_WINDOW 30
+
+/**
+ * @brief The states a session goes through.
+ */
+enum zipzop_state {
+	ZIPZOP_CONNECTING, 	/**< Waiting for the non-blocking connect() to finish */
+	ZIPZOP_HANDSHAKE, 	/**< Handshake sent, waiting for the server answer */
+	ZIPZOP_READY, 		/**< Messages can be sent and received */
+	ZIPZOP_CLOSED 		/**< The connection is gone; the session is freed by the next zipzop_poll() */
+};
+
+/**
+ * @brief What a presence callback reports.
+ */
+enum zipzop_presence {
+	ZIPZOP_MEMBERS_RESET, 	/**< A new member list starts; the name is NULL */
+	ZIPZOP_MEMBER, 			/**< The user is part of the member list */
+	ZIPZOP_JOINED, 			/**< The user entered the room */
+	ZIPZOP_LEFT 			/**< The user left the room */
+};
+
+/**
+ * @brief What a file callback reports.
+ */
+enum zipzop_file_event {
+	ZIPZOP_FILE_BEGIN, 	/**< A file starts arriving; its id, name and size are given */
+	ZIPZOP_FILE_DATA, 	/**< The next bytes of the file */
+	ZIPZOP_FILE_END 	/**< The whole file arrived */
+};
+
+struct zipzop_ctx;
+struct zipzop_session;
+
+/**
+ * @brief Functions called by zipzop_poll() when something happens to a session.
+ *
+ * Any of them may be NULL.
+ */
+struct zipzop_callbacks {
+	/** @brief The handshake finished and the session is ready. */
+	void (*on_connect)(struct zipzop_session *s, void *arg);
+	/** @brief A message arrived; the view points into the receive buffer, promote it to keep it. */
+	void (*on_message)(struct zipzop_session *s, const struct message_view *m, void *arg);
+	/** @brief The session was closed; it must not be used after this returns. */
+	void (*on_close)(struct zipzop_session *s, void *arg);
+	/** @brief Someone entered or left the room, or the member list arrived. */
+	void (*on_presence)(struct zipzop_session *s, enum zipzop_presence kind, const char *name, void *arg);
+	/** @brief Part of a file asked for with @c /get arrived; the data points into the receive buffer. */
+	void (*on_file)(struct zipzop_session *s, enum zipzop_file_event ev, const struct frame_file *ff, void *arg);
+};
+
+struct zipzop_ctx *zipzop_ctx_create(void);
+void zipzop_ctx_destroy(struct zipzop_ctx *ctx);
+int zipzop_ctx_get_fd(struct zipzop_ctx *ctx);
+int zipzop_ctx_get_timeout(struct zipzop_ctx *ctx);
+int zipzop_poll(struct zipzop_ctx *ctx, int timeout_ms);
+struct zipzop_session *zipzop_connect(struct zipzop_ctx *ctx, const char *server, const char *name,
+		int flags, const struct zipzop_callbacks *cb, void *arg);
+struct zipzop_session *zipzop_resume(struct zipzop_ctx *ctx, const char *server, const char *name,
+		const char *token, uint64_t last_seq, int flags, const struct zipzop_callbacks *cb, void *arg);
+int zipzop_send(struct zipzop_session *s, const char *msg, size_t len);
+int zipzop_send_file(struct zipzop_session *s, const char *path);
+int zipzop_set_filter(struct zipzop_session *s, const char *expr);
+int zipzop_flush(struct zipzop_session *s);
+void zipzop_bye(struct zipzop_session *s);
+void zipzop_finish(struct zipzop_session *s);
+void zipzop_close(struct zipzop_session *s);
+enum zipzop_state zipzop_get_state(struct zipzop_session *s);
+const char *zipzop_get_name(struct zipzop_session *s);
+void *zipzop_get_arg(struct zipzop_session *s);
+void zipzop_set_trace(struct zipzop_session *s, unsigned every);
+void zipzop_set_flush_interval(struct zipzop_session *s, unsigned ms);
+size_t zipzop_get_pending(struct zipzop_session *s);
+const struct frame_trace *zipzop_get_trace(struct zipzop_session *s);
+const char *zipzop_get_token(struct zipzop_session *s);
+uint64_t zipzop_get_last_seq(struct zipzop_session *s);
+bool zipzop_is_resumed(struct zipzop_session *s);
+unsigned zipzop_get_retry_after(struct zipzop_session *s);
+bool zipzop_is_ended(struct zipzop_session *s);
+
+#endif